@@ -0,0 +1,60 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+#define BUFFER_POOL_MIN_SHIFT 6  // smallest size class, 64 bytes
+#define BUFFER_POOL_MAX_SHIFT 20 // largest size class, 1MB
+#define BUFFER_POOL_CLASSES (BUFFER_POOL_MAX_SHIFT - BUFFER_POOL_MIN_SHIFT + 1)
+
+#define BUFFER_POOL_CACHE_BYTES (256 * 1024)       // per class and thread
+#define BUFFER_POOL_GLOBAL_BYTES (4 * 1024 * 1024) // per class
+
+struct buffer_pool_stats {
+    unsigned long hits;   // leases served by a cached buffer
+    unsigned long misses; // leases that had to call malloc
+};
+
+/**
+ * Leases a buffer of at least `size` bytes from the buffer pool. Sizes are
+ * rounded up to a power of two. Buffers are taken from the calling thread's
+ * cache first, then refilled in batches from the global pool, and only
+ * allocated if both are empty. Sizes above `1 << BUFFER_POOL_MAX_SHIFT` are
+ * not pooled.
+ *
+ * @param size minimum size of the buffer in bytes
+ * @returns the buffer, `NULL` if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+void *buffer_pool_alloc(size_t size);
+
+/**
+ * Adds an owner to a buffer leased with `buffer_pool_alloc`, so that it can be
+ * shared without a copy. Each owner drops its reference with
+ * `buffer_pool_free`, and the last one returns the buffer. Shared buffers must
+ * not be written to.
+ *
+ * @param buffer buffer to share, may be `NULL`
+ * @returns `buffer`
+ */
+void *buffer_pool_ref(void *buffer);
+
+/**
+ * Drops a reference to a buffer leased with `buffer_pool_alloc`, returning it
+ * to the calling thread's cache once no owner is left. Once the cache holds
+ * `BUFFER_POOL_CACHE_BYTES` of a size class, half of it moves to the global
+ * pool, and buffers beyond `BUFFER_POOL_GLOBAL_BYTES` are freed. A thread's
+ * cache moves to the global pool when the thread exits.
+ *
+ * @param buffer buffer to return, may be `NULL`
+ */
+void buffer_pool_free(void *buffer);
+
+/**
+ * Gets the hit and miss counters of the buffer pool, summed over all threads.
+ *
+ * @param stats output param for the counters
+ */
+void buffer_pool_stats(struct buffer_pool_stats *stats);
+
+#endif
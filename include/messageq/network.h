@@ -2,19 +2,103 @@
 #define NETWORK_H
 
 #include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
 
+#include "worker_pool.h"
+
 #define LISTEN_BACKLOG 128
-#define MAX_PAYLOAD_LENGTH (1 << 20) // 1MB
-#define DMQP_HEADER_SIZE 12          // bytes
+#define MAX_PAYLOAD_LENGTH (1 << 20)    // 1MB
+#define DMQP_HEADER_SIZE 12             // bytes, without a correlation ID
+#define DMQP_CORRELATION_ID_SIZE 4      // bytes, after the header if flagged
+#define DMQP_HEADER_MAX_SIZE (DMQP_HEADER_SIZE + DMQP_CORRELATION_ID_SIZE)
+#define DMQP_COMPACT_HEADER_MAX_SIZE 22 // bytes, flags and 5 varints
+#define SOCKET_TIMEOUT_SEC 30
+#define DMQP_KEEPALIVE_IDLE_SEC 60     // idle time before the first probe
+#define DMQP_KEEPALIVE_INTERVAL_SEC 10 // between unanswered probes
+#define DMQP_KEEPALIVE_PROBES 6        // unanswered probes before closing
+#define DMQP_UNIX_PATH_MAX 108 // bytes, with the terminating null byte
+
+#define EVENT_LOOP_MAX_THREADS 16 // one event loop per core, up to this many
+#define EVENT_LOOP_MAX_EVENTS 64  // events handled per `epoll_wait`
+
+#define EVENT_LOOP_READ_BUFFER_SIZE (64 * 1024) // bytes per `read`
+#define SEND_MAX_IOV 64                         // replies per `sendmsg`
+
+// `send_dmqp_message` flag, the payload is leased from the buffer pool
+#define DMQP_SEND_LEASED 0x10000000
+
+#define DMQP_BATCH_LENGTH_SIZE 4 // bytes, prefixes each message in a batch
+#define DMQP_BATCH_STATUS_SIZE 2 // bytes, per message in a batch response
+
+#define DMQP_FETCH_REQUEST_SIZE 8      // bytes, max messages and max bytes
+#define DMQP_FETCH_ENTRY_HEADER_SIZE 8 // bytes, sequence ID and length
+#define DMQP_FETCH_MAX_MESSAGES 4096   // messages per fetch response
+
+#define DMQP_READ_REQUEST_SIZE 16 // bytes, offset, max messages and max bytes
+#define DMQP_READ_OFFSET_SIZE 8   // bytes, offset of the first message read
+#define DMQP_READ_NEXT UINT64_MAX // offset, go on from the connection's cursor
+
+#define DMQP_POP_WAIT_SIZE 4                            // bytes, pop timeout
+#define DMQP_POP_MAX_WAIT_MS (SOCKET_TIMEOUT_SEC * 1000) // longest pop timeout
+
+#define DMQP_SUBSCRIBE_SIZE 4 // bytes, credits granted to a subscription
 
-enum dmqp_method { DMQP_PUSH, DMQP_POP, DMQP_PEEK_SEQUENCE_ID, DMQP_RESPONSE };
+#define DMQP_CREDIT_SIZE 4  // bytes, byte credits a `DMQP_CREDIT` waits for
+#define DMQP_CREDITS_SIZE 8 // bytes, message and byte credits of a producer
+
+#define DMQP_SHM_RING_SIZE (4 * 1024 * 1024) // bytes per direction, power of 2
+#define DMQP_SHM_MAX_CHANNELS 64             // shared memory clients per server
+
+#define DMQP_CHUNK 0x4000                  // method flag, chunk of a message
+#define DMQP_CHUNK_LAST 0x2000             // method flag, its last chunk
+#define DMQP_CHUNK_SIZE (256 * 1024)       // bytes per chunk sent
+#define DMQP_CHUNKED_MAX_LENGTH (16 << 20) // 16MB, largest chunked message
+#define DMQP_CHUNK_MAX_STREAMS 4           // reassembled at once per connection
+
+#define DMQP_CORRELATED 0x1000 // method flag, a correlation ID follows
+
+#define DMQP_COMPRESSED 0x8000       // method flag, the payload is compressed
+#define DMQP_COMPRESS_SIZE 8         // bytes, threshold and flags
+#define DMQP_COMPRESS_THRESHOLD 1024 // bytes, default smallest payload
+#define DMQP_COMPRESS_ADAPTIVE 0x1   // skip payloads after incompressible ones
+#define DMQP_COMPRESS_MIN_SAVING 10  // percent, adaptive mode
+#define DMQP_COMPRESS_BACKOFF 64     // payloads sent raw, adaptive mode
+
+#define DMQP_VERSION 2           // highest protocol version spoken
+#define DMQP_HELLO_SIZE 8        // bytes, version and feature bits
+#define DMQP_CLIENT_MAX_FD 65536 // client sockets above use fixed headers
+
+#define DMQP_FEATURE_BATCH 0x1           // `DMQP_PUSH_BATCH` and `DMQP_FETCH`
+#define DMQP_FEATURE_COMPRESSION 0x2     // `DMQP_COMPRESS`
+#define DMQP_FEATURE_CORRELATION_IDS 0x4 // replies matched by correlation ID
+#define DMQP_FEATURE_COMPACT_HEADER 0x8  // varint headers, from version 2
+#define DMQP_FEATURES                                                          \
+    (DMQP_FEATURE_BATCH | DMQP_FEATURE_COMPRESSION |                           \
+     DMQP_FEATURE_CORRELATION_IDS | DMQP_FEATURE_COMPACT_HEADER)
+
+enum dmqp_method {
+    DMQP_PUSH,
+    DMQP_POP,
+    DMQP_PEEK_SEQUENCE_ID,
+    DMQP_RESPONSE,
+    DMQP_PUSH_BATCH,
+    DMQP_FETCH,
+    DMQP_SUBSCRIBE,
+    DMQP_CREDIT,
+    DMQP_SHM_ATTACH,
+    DMQP_COMPRESS,
+    DMQP_HELLO,
+    DMQP_HEARTBEAT,
+    DMQP_READ
+};
 
 struct dmqp_header {
-    uint32_t sequence_id; // unique sequence number of queue entry
-    uint32_t length;      // payload length
-    uint16_t method;      // maps to `enum dmqp_method`
-    int16_t status_code;  // unix errno
+    uint32_t sequence_id;    // unique sequence number of queue entry
+    uint32_t length;         // payload length
+    uint16_t method;         // maps to `enum dmqp_method`
+    int16_t status_code;     // unix errno
+    uint32_t correlation_id; // set by the client, echoed in the response
 };
 
 struct dmqp_message {
@@ -22,10 +106,95 @@ struct dmqp_message {
     void *payload;
 };
 
+// a chunked message being reassembled
+struct dmqp_chunk_stream {
+    struct dmqp_header header; // of the message, length received so far
+    char *payload;             // `NULL` if the stream is unused
+    uint32_t capacity;         // bytes of `payload`
+};
+
+// chunked messages being reassembled from one connection, zeroed before use
+struct dmqp_chunks {
+    struct dmqp_chunk_stream streams[DMQP_CHUNK_MAX_STREAMS];
+};
+
+// protocol version and features of a connection, agreed by `DMQP_HELLO`
+struct dmqp_hello {
+    uint32_t version;
+    uint32_t features; // `DMQP_FEATURE_*` bits
+};
+
+// compression settings of one direction of a connection
+struct dmqp_compression {
+    uint32_t threshold; // smallest payload compressed, 0 if disabled
+    uint32_t flags;     // `DMQP_COMPRESS_ADAPTIVE`
+    unsigned int skip;  // payloads left to send raw, adaptive mode
+};
+
+// one message of a `DMQP_PUSH_BATCH` or `DMQP_FETCH` response payload
+struct dmqp_batch_entry {
+    void *data;
+    uint32_t length;
+    uint32_t sequence_id; // only carried by `DMQP_FETCH` responses
+};
+
+// credits a partition grants a producer connection. Pushing a message takes a
+// message credit and as many byte credits as the message is long
+struct dmqp_credits {
+    uint32_t messages;
+    uint32_t bytes;
+};
+
+// TCP keepalive of client and server connections, so that idle connections
+// stay open as long as the peer answers and a dead peer is detected within
+// `idle_sec + interval_sec * probes` seconds. `idle_sec` 0 disables it
+struct dmqp_keepalive {
+    int idle_sec;
+    int interval_sec;
+    int probes;
+};
+
+// socket I/O backend of the DMQP server, selected before `dmqp_server_init`
+enum dmqp_io_backend { DMQP_IO_BACKEND_EPOLL, DMQP_IO_BACKEND_IO_URING };
+
 extern pthread_mutex_t server_lock;
 extern pthread_cond_t server_running_cond;
 extern int server_running;
 extern unsigned short server_port;
+extern enum dmqp_io_backend server_io_backend;
+
+// keepalive of the connections created from now on, `DMQP_KEEPALIVE_*` by
+// default
+extern struct dmqp_keepalive dmqp_keepalive;
+
+// path of an `AF_UNIX` stream socket the server also listens on, so that
+// clients on the same host skip the TCP/IP stack. empty disables it
+extern char server_unix_path[DMQP_UNIX_PATH_MAX];
+
+// number of acceptor threads of the epoll backend, each accepting on its own
+// `SO_REUSEPORT` listener so that the kernel spreads new connections across
+// them. 0 runs one per event loop. the io_uring backend always has one listener
+// per io_uring
+extern unsigned int server_acceptors;
+
+// pins the i-th acceptor, event loop and io_uring thread to the i-th CPU the
+// process may run on, so that a connection is accepted and served on one core
+extern int server_pin_cpus;
+
+// with `server_pin_cpus`, attaches a BPF program to the server's listeners
+// that steers each new connection to the listener of the thread pinned to the
+// CPU its packets arrived on, so the connection is accepted and served where
+// its socket state already is. connections arriving on CPUs no thread is
+// pinned to, or all of them if the program cannot be attached, fall back to
+// the kernel's hashing
+extern int server_reuseport_steering;
+
+// payloads of at least this many bytes are sent with `MSG_ZEROCOPY`, 0 disables
+// zerocopy sends. `send_dmqp_message` then returns once the kernel has released
+// the payload, which on TCP is when the peer acknowledges it. Server
+// connections only send payloads flagged `DMQP_SEND_LEASED` this way, and keep
+// a reference to the lease until the kernel releases it instead of waiting
+extern size_t send_zerocopy_threshold;
 
 // TODO: TLS
 
@@ -40,51 +209,568 @@ extern unsigned short server_port;
  */
 int dmqp_client_init(const char *host, unsigned short port);
 
+/**
+ * Initializes a DMQP client connection to a DMQP server over its `AF_UNIX`
+ * socket.
+ *
+ * @param path path of the server's socket
+ * @returns the socket of the DMQP client, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EIO` unexpected error
+ */
+int dmqp_client_init_unix(const char *path);
+
+/**
+ * Initializes a DMQP client connection to a partition from the address it
+ * advertises, `{host}:{port}` optionally followed by `,{socket_path}`. Anything
+ * from a `;` on is ignored. Connects over the `AF_UNIX` socket if `host` is an
+ * address of this machine, and over TCP otherwise or if that fails.
+ *
+ * @param address advertised address of the partition
+ * @returns the socket of the DMQP client, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args or malformed address
+ * @throws `EIO` unexpected error
+ */
+int dmqp_client_connect(const char *address);
+
 /**
  * Initializes a DMQP server and registers the current process as a partition in
  * ZooKeeper. Signals are handled to gracefully exit.
  *
+ * Client sockets are non-blocking and multiplexed with edge-triggered epoll
+ * across a fixed set of event loop threads, one per online core. Complete
+ * messages are handed to a fixed-size worker pool (one worker per online core)
+ * that invokes the handlers. Replies to one connection never interleave, but
+ * may be sent in a different order than the requests, so clients can pipeline
+ * requests and match responses by `correlation_id`.
+ *
+ * New connections are accepted by `server_acceptors` threads, each on its own
+ * listener bound to `port` with `SO_REUSEPORT`, and handed to the event loops
+ * in turn.
+ *
+ * If `server_io_backend` is `DMQP_IO_BACKEND_IO_URING`, each event loop thread
+ * instead owns an io_uring with its own `SO_REUSEPORT` listener, using
+ * multishot accepts, multishot receives into provided buffers and linked
+ * sends. Falls back to epoll if io_uring is unavailable.
+ *
+ * If `server_unix_path` is set, the server also accepts clients on an
+ * `AF_UNIX` stream socket at that path, removed when the server stops.
+ *
  * @param port the port to bind the server to
  * @param zookeeper_host the host of the ZooKeeper server
  * @returns 0 on success, -1 on error with global `errno` set. does not return
  * until the server is interrupted or terminated
  * @throws `EINVAL` invalid args
+ * @throws `EADDRINUSE` another server listens on `server_unix_path`
  * @throws `EIO` unexpected error
  */
 int dmqp_server_init(unsigned short port);
 
 /**
- * Reads a DMQP message from a file descriptor. Converts header fields to host
- * byte order.
+ * Gets per-worker statistics of the running DMQP server's worker pool: queue
+ * depth, executed tasks and steals.
+ *
+ * @param stats output array of at least `n` entries
+ * @param n capacity of `stats`
+ * @returns number of workers, 0 if the server is not running
+ */
+unsigned int dmqp_server_worker_stats(struct worker_stats *stats,
+                                      unsigned int n);
+
+/**
+ * Reads a DMQP message from a file descriptor, with a compact header if
+ * `dmqp_client_hello` agreed on it. Converts header fields to host byte order
+ * and decompresses compressed payloads. The payload is leased from
+ * the buffer pool and must be released with `buffer_pool_free`.
+ *
+ * If the socket has a receive timeout (`SO_RCVTIMEO`) and no message starts
+ * before it expires, the connection is merely idle: `ETIMEDOUT` is thrown and
+ * the socket may still be read from. Any other error leaves the connection in
+ * an unknown state, and it should be closed.
  *
  * @param fd file descriptor to read from
  * @param buf DMQP message buffer to write to
  * @returns 0 on success, -1 if error with global `errno` set
  * @throws `EINVAL` invalid args
+ * @throws `ETIMEDOUT` receive timeout expired before a message started
+ * @throws `ECONNRESET` peer closed the connection
  * @throws `EMSGSIZE` message payload too large
+ * @throws `EBADMSG` malformed header or compressed payload
+ * @throws `ENOMEM` out of memory
  * @throws `EIO` unexpected error
  */
 int read_dmqp_message(int fd, struct dmqp_message *buf);
 
 /**
  * Sends a DMQP message to a file descriptor. Converts header fields to network
- * byte order (big endian).
+ * byte order (big endian). Payloads above `MAX_PAYLOAD_LENGTH` are sent as
+ * chunks of `DMQP_CHUNK_SIZE` bytes with `send_dmqp_chunk`.
  *
  * @param fd file descriptor to write to
  * @param buffer DMQP message buffer to send
+ * @param flags same flags param as send syscall, or'ed with `DMQP_SEND_LEASED`
+ * if the payload is leased from the buffer pool
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EMSGSIZE` message payload above `DMQP_CHUNKED_MAX_LENGTH`
+ * @throws `EIO` unexpected error
+ */
+int send_dmqp_message(int fd, const struct dmqp_message *buffer, int flags);
+
+/**
+ * Sends one chunk of a message. A chunked message is a run of frames carrying
+ * its header, with `DMQP_CHUNK` set in the method and the chunk's length, the
+ * last of which also has `DMQP_CHUNK_LAST` set. Its chunks are told apart from
+ * those of other messages by correlation ID, and other messages may be sent
+ * between them, so a large message does not hold back the requests behind it.
+ * Servers reassemble chunked requests received over sockets before handling
+ * them, up to `DMQP_CHUNK_MAX_STREAMS` at a time per connection.
+ *
+ * @param fd file descriptor to write to
+ * @param buffer header of the message and payload of the chunk
+ * @param last whether this is the message's last chunk
  * @param flags same flags param as send syscall
  * @returns 0 on success, -1 if error with global `errno` set
  * @throws `EINVAL` invalid args
+ * @throws `EMSGSIZE` chunk payload too large
+ * @throws `EIO` unexpected error
+ */
+int send_dmqp_chunk(int fd, const struct dmqp_message *buffer, int last,
+                    int flags);
+
+/**
+ * Adds a received frame to the chunked messages of a connection. Frames that
+ * are not chunks are left as is.
+ *
+ * @param chunks chunked messages being reassembled from the connection
+ * @param message received frame, whose payload is leased from the buffer pool.
+ * a chunk's payload is released, and the last one's message is replaced with
+ * the reassembled message
+ * @returns 1 if `message` is a complete message, 0 if the chunk was taken, -1
+ * if error with global `errno` set, releasing the payload and the message's
+ * chunks
+ * @throws `EINVAL` invalid args
+ * @throws `EBUSY` `DMQP_CHUNK_MAX_STREAMS` chunked messages already in flight
+ * @throws `EPROTO` chunk of another method than the message's first
+ * @throws `EMSGSIZE` message above `DMQP_CHUNKED_MAX_LENGTH`
+ * @throws `ENOMEM` out of memory
+ */
+int dmqp_chunks_add(struct dmqp_chunks *chunks, struct dmqp_message *message);
+
+/**
+ * Frees the chunked messages of a connection that were not completed.
+ *
+ * @param chunks chunked messages being reassembled from the connection
+ */
+void dmqp_chunks_reset(struct dmqp_chunks *chunks);
+
+/**
+ * Reads the next complete DMQP message from a file descriptor, reassembling
+ * chunked messages. Messages are returned in the order they complete, so a
+ * reply sent between the chunks of another is returned first.
+ *
+ * @param fd file descriptor to read from
+ * @param chunks chunked messages being reassembled from `fd`, kept across calls
+ * @param buf DMQP message buffer to write to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws same as `read_dmqp_message` and `dmqp_chunks_add`
+ */
+int read_dmqp_chunked_message(int fd, struct dmqp_chunks *chunks,
+                              struct dmqp_message *buf);
+
+/**
+ * Packs messages into the payload of a `DMQP_PUSH_BATCH` message. Each message
+ * is prefixed with its length (4 bytes, network byte order). Sets the payload
+ * and `length` of `buf`; the payload is leased from the buffer pool and must be
+ * released with `buffer_pool_free`.
+ *
+ * @param entries messages to pack
+ * @param n number of messages
+ * @param buf DMQP message buffer to write to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EMSGSIZE` packed messages too large
+ * @throws `ENOMEM` out of memory
+ */
+int dmqp_batch_pack(const struct dmqp_batch_entry *entries, unsigned int n,
+                    struct dmqp_message *buf);
+
+/**
+ * Unpacks the messages of a `DMQP_PUSH_BATCH` payload. Unpacked entries point
+ * into the payload.
+ *
+ * @param message batch message to unpack
+ * @param entries output array of at least `n` entries, may be `NULL` if `n` is
+ * 0 to only count the messages
+ * @param n capacity of `entries`
+ * @returns number of messages in the batch, which may exceed `n`. -1 if error
+ * with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EBADMSG` malformed batch
+ */
+int dmqp_batch_unpack(const struct dmqp_message *message,
+                      struct dmqp_batch_entry *entries, unsigned int n);
+
+/**
+ * Packs messages into the payload of a `DMQP_FETCH` response. Each message is
+ * prefixed with its sequence ID and length (4 bytes each, network byte order).
+ * Sets the payload and `length` of `buf`; the payload is leased from the
+ * buffer pool and must be released with `buffer_pool_free`.
+ *
+ * @param entries messages to pack
+ * @param n number of messages
+ * @param buf DMQP message buffer to write to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EMSGSIZE` packed messages too large
+ * @throws `ENOMEM` out of memory
+ */
+int dmqp_fetch_pack(const struct dmqp_batch_entry *entries, unsigned int n,
+                    struct dmqp_message *buf);
+
+/**
+ * Unpacks the messages of a `DMQP_FETCH` response payload. Unpacked entries
+ * point into the payload.
+ *
+ * @param message fetch response to unpack
+ * @param entries output array of at least `n` entries, may be `NULL` if `n` is
+ * 0 to only count the messages
+ * @param n capacity of `entries`
+ * @returns number of messages in the response, which may exceed `n`. -1 if
+ * error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EBADMSG` malformed response
+ */
+int dmqp_fetch_unpack(const struct dmqp_message *message,
+                      struct dmqp_batch_entry *entries, unsigned int n);
+
+/**
+ * Packs messages read from a log into the payload of a `DMQP_READ` response:
+ * the offset of the first message (8 bytes, network byte order), then the
+ * messages as packed by `dmqp_fetch_pack`. Sets the payload and `length` of
+ * `buf`; the payload is leased from the buffer pool and must be released with
+ * `buffer_pool_free`.
+ *
+ * @param entries messages to pack, at consecutive offsets
+ * @param n number of messages
+ * @param offset offset of the first message
+ * @param buf DMQP message buffer to write to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EMSGSIZE` packed messages too large
+ * @throws `ENOMEM` out of memory
+ */
+int dmqp_read_pack(const struct dmqp_batch_entry *entries, unsigned int n,
+                   uint64_t offset, struct dmqp_message *buf);
+
+/**
+ * Unpacks the messages of a `DMQP_READ` response payload. Unpacked entries
+ * point into the payload.
+ *
+ * @param message read response to unpack
+ * @param offset output param for the offset of the first message
+ * @param entries output array of at least `n` entries, may be `NULL` if `n` is
+ * 0 to only count the messages
+ * @param n capacity of `entries`
+ * @returns number of messages in the response, which may exceed `n`. -1 if
+ * error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EBADMSG` malformed response
+ */
+int dmqp_read_unpack(const struct dmqp_message *message, uint64_t *offset,
+                     struct dmqp_batch_entry *entries, unsigned int n);
+
+/**
+ * Writes credits in the format carried by responses to producers (message and
+ * byte credits, 4 bytes each, network byte order).
+ *
+ * @param credits credits to write
+ * @param buf output buffer of at least `DMQP_CREDITS_SIZE` bytes
+ */
+void dmqp_credits_pack(const struct dmqp_credits *credits, void *buf);
+
+/**
+ * Reads the credits at the end of the payload of a `DMQP_PUSH`,
+ * `DMQP_PUSH_BATCH` or `DMQP_CREDIT` response.
+ *
+ * @param message response to read
+ * @param credits output param for the credits
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EBADMSG` response carries no credits
+ */
+int dmqp_credits_unpack(const struct dmqp_message *message,
+                        struct dmqp_credits *credits);
+
+/**
+ * Takes the credits needed to push a message of `length` bytes, so that a
+ * producer never sends more than the partition granted it.
+ *
+ * @param credits credits of the producer connection
+ * @param length length of the message to push
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOBUFS` not enough credits, wait for more with `DMQP_CREDIT`
+ */
+int dmqp_credits_take(struct dmqp_credits *credits, uint32_t length);
+
+/**
+ * Negotiates the protocol version and features of a client connection with
+ * `DMQP_HELLO`. The server answers with the highest version both speak and the
+ * features both support. If they agree on `DMQP_FEATURE_COMPACT_HEADER`, every
+ * later message on the connection, both ways, has a compact header instead of
+ * the fixed `DMQP_HEADER_SIZE` bytes, which `send_dmqp_message` and
+ * `read_dmqp_message` then use for `client`. Requests may carry a correlation
+ * ID once they agree on `DMQP_FEATURE_CORRELATION_IDS`. Servers that predate
+ * the handshake answer `ENOSYS` and keep fixed headers. Must be the
+ * connection's first request, with nothing else in flight, and such a
+ * connection must be closed with `dmqp_client_close`.
+ *
+ * @param client socket of the DMQP client
+ * @param version highest version the client speaks, at most `DMQP_VERSION`
+ * @param features `DMQP_FEATURE_*` bits the client supports
+ * @param buf output param for the agreed version and features
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOSYS` server predates the handshake
+ * @throws `EPROTO` malformed response
+ * @throws `ENOMEM` out of memory
+ * @throws `EIO` unexpected error
+ */
+int dmqp_client_hello(int client, uint32_t version, uint32_t features,
+                      struct dmqp_hello *buf);
+
+/**
+ * Closes a client connection and forgets what `dmqp_client_hello` agreed on
+ * for its socket.
+ *
+ * @param client socket of the DMQP client
+ */
+void dmqp_client_close(int client);
+
+/**
+ * Checks that a client connection is alive with `DMQP_HEARTBEAT`, which servers
+ * answer right away without involving the partition. Meant for idle
+ * connections, e.g. after `read_dmqp_message` threw `ETIMEDOUT`, or to keep
+ * middleboxes from dropping them. Must not have other requests in flight.
+ *
+ * @param client socket of the DMQP client
+ * @returns 0 if the server answered, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOSYS` server predates heartbeats, but the connection is alive
+ * @throws `ETIMEDOUT` no answer before the socket's receive timeout
+ * @throws `ECONNRESET` server closed the connection
+ * @throws `EIO` unexpected error
+ */
+int dmqp_client_heartbeat(int client);
+
+/**
+ * Turns on compression for a client connection. Sends `DMQP_COMPRESS`, after
+ * which the server compresses the response payloads of at least `threshold`
+ * bytes, and sets `buf` up so that `dmqp_compress` does the same for the
+ * client's requests. Servers always accept compressed requests; a successful
+ * handshake tells the client that the server understands them. The connection
+ * must have no request in flight.
+ *
+ * @param client socket of the DMQP client
+ * @param threshold smallest payload to compress, in bytes
+ * @param flags `DMQP_COMPRESS_ADAPTIVE` to stop compressing for a while after
+ * a payload that shrank by less than `DMQP_COMPRESS_MIN_SAVING` percent
+ * @param buf output param for the client's compression settings
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOSYS` server does not support compression
+ * @throws `EOPNOTSUPP` connection cannot be compressed, e.g. shared memory
+ * @throws `ENOMEM` out of memory
+ * @throws `EIO` unexpected error
+ */
+int dmqp_client_compress(int client, uint32_t threshold, uint32_t flags,
+                         struct dmqp_compression *buf);
+
+/**
+ * Compresses the payload of a `DMQP_PUSH`, `DMQP_PUSH_BATCH` or
+ * `DMQP_RESPONSE` message with raw deflate, so that a batch is compressed as a
+ * whole. The compressed payload is prefixed with the payload's length (4 bytes,
+ * network byte order) and `DMQP_COMPRESSED` is set in the method. Payloads
+ * below the threshold, above `MAX_PAYLOAD_LENGTH`, of other methods, or that
+ * would not shrink are left raw, as are those skipped in adaptive mode.
+ *
+ * @param compression compression settings, may be shared by threads
+ * @param message message to compress
+ * @param buf output param for the message to send: the compressed message,
+ * whose payload is leased from the buffer pool and must be released with
+ * `buffer_pool_free`, or a copy of `message`
+ * @returns 1 if compressed, 0 if left raw, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOMEM` out of memory
+ */
+int dmqp_compress(struct dmqp_compression *compression,
+                  const struct dmqp_message *message, struct dmqp_message *buf);
+
+/**
+ * Decompresses the payload of a message compressed by `dmqp_compress` in
+ * place, and clears `DMQP_COMPRESSED` from its method. Other messages are left
+ * as is. `read_dmqp_message` and servers decompress messages they receive.
+ *
+ * @param message message to decompress, whose payload is leased from the
+ * buffer pool. it is released and replaced on success
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EBADMSG` malformed compressed payload
+ * @throws `ENOMEM` out of memory
+ */
+int dmqp_decompress(struct dmqp_message *message);
+
+// client end of a shared memory channel to a server on the same machine
+struct dmqp_shm_client;
+
+/**
+ * Attaches a shared memory channel to a client connected over the server's
+ * `AF_UNIX` socket. The server maps a pair of single-producer single-consumer
+ * rings into both processes and passes them over the socket; requests then go
+ * through the rings instead of the socket, and their payloads are handed to
+ * the handlers in place. The consumer of a ring spins before it sleeps, so a
+ * wakeup is only sent to an idle peer. The socket must stay open for the
+ * channel's lifetime and have no request in flight, and is not used for
+ * anything else. One thread at a time may send and one may read.
+ *
+ * @param client socket from `dmqp_client_init_unix`
+ * @returns the channel, `NULL` if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EOPNOTSUPP` not an `AF_UNIX` connection, or one with compact
+ * headers
+ * @throws `EBUSY` server has `DMQP_SHM_MAX_CHANNELS` channels
+ * @throws `ENOMEM` out of memory
+ * @throws `EPROTO` malformed response
+ * @throws `EIO` unexpected error
+ */
+struct dmqp_shm_client *dmqp_shm_attach(int client);
+
+/**
+ * Sends a DMQP message through a shared memory channel. The message is copied
+ * into the ring, so the caller may reuse it once this returns. Waits for room
+ * if the ring is full.
+ *
+ * @param shm channel to send on
+ * @param buffer DMQP message to send
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
  * @throws `EMSGSIZE` message payload too large
+ * @throws `ETIMEDOUT` ring still full after `SOCKET_TIMEOUT_SEC`
+ */
+int dmqp_shm_send(struct dmqp_shm_client *shm,
+                  const struct dmqp_message *buffer);
+
+/**
+ * Reads a DMQP message from a shared memory channel. The payload is leased from
+ * the buffer pool and must be released with `buffer_pool_free`.
+ *
+ * @param shm channel to read from
+ * @param buf DMQP message buffer to write to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ETIMEDOUT` no message within `SOCKET_TIMEOUT_SEC`
+ * @throws `ENOMEM` out of memory
+ * @throws `EIO` server disconnected or sent a malformed message
+ */
+int dmqp_shm_read(struct dmqp_shm_client *shm, struct dmqp_message *buf);
+
+/**
+ * Unmaps a shared memory channel. The server drops its end once the client's
+ * socket is closed.
+ *
+ * @param shm channel to free, may be `NULL`
+ */
+void dmqp_shm_detach(struct dmqp_shm_client *shm);
+
+/**
+ * Takes a reference to the payload of the message the calling thread is
+ * handling, so that the handler can keep it after returning without a copy.
+ * Payloads read from a socket are leased from the buffer pool, while those of
+ * a shared memory channel live in its ring and must be copied.
+ *
+ * @param message message being handled
+ * @returns the payload, to be released with `buffer_pool_free`, `NULL` if
+ * error with global `errno` set
+ * @throws `EINVAL` calling thread is not handling `message`, or its payload
+ * is not leased
+ */
+void *dmqp_payload_hold(const struct dmqp_message *message);
+
+// reply to a request, detached from the handler so that it can be sent later
+struct dmqp_reply;
+
+/**
+ * Defers the reply to the message the calling thread is handling, so that the
+ * handler can return and the reply can be sent later from any thread. Keeps
+ * the connection from being freed until the reply is sent or cancelled. Once
+ * the server stops, outstanding replies lose their connection and sending or
+ * cancelling them only frees them.
+ *
+ * @param client socket the message being handled was received on
+ * @returns the deferred reply, `NULL` if error with global `errno` set
+ * @throws `EINVAL` calling thread is not handling a message from `client`
+ * @throws `ENOMEM` out of memory
+ */
+struct dmqp_reply *dmqp_reply_defer(int client);
+
+/**
+ * Sends a deferred reply and frees it, even on error.
+ *
+ * @param reply deferred reply to send
+ * @param buffer DMQP message to send
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EMSGSIZE` message payload too large
+ * @throws `EPIPE` server stopped
+ * @throws `ENOMEM` out of memory
  * @throws `EIO` unexpected error
  */
-int send_dmqp_message(int fd, const struct dmqp_message *buffer, int flags);
+int dmqp_reply_send(struct dmqp_reply *reply,
+                    const struct dmqp_message *buffer);
+
+/**
+ * Sends a message on the connection of a deferred reply without freeing it, so
+ * that a handler can stream many messages in reply to one request. The reply
+ * must still be sent or cancelled once the stream ends.
+ *
+ * @param reply deferred reply to send on
+ * @param buffer DMQP message to send
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EMSGSIZE` message payload too large
+ * @throws `EPIPE` server stopped
+ * @throws `ENOMEM` out of memory
+ * @throws `EIO` unexpected error
+ */
+int dmqp_reply_push(struct dmqp_reply *reply,
+                    const struct dmqp_message *buffer);
+
+/**
+ * Frees a deferred reply without sending it.
+ *
+ * @param reply deferred reply to cancel, may be `NULL`
+ */
+void dmqp_reply_cancel(struct dmqp_reply *reply);
+
+/**
+ * Returns 1 if the connection of a deferred reply is still open, 0 if the
+ * client disconnected or the server stopped.
+ *
+ * @param reply deferred reply to check
+ */
+int dmqp_reply_is_open(const struct dmqp_reply *reply);
 
 // ----------------------------------------------------------------------------
 // The following functions must be implemented separately by each DMQP server.
+// Handlers run concurrently, so responses may be sent out of order. Every
+// response must carry the `correlation_id` of the request it answers.
 
 /**
- * Handles a DMQP message with method `DMQP_PUSH`.
+ * Handles a DMQP message with method `DMQP_PUSH`. A leader pushes a message
+ * only if the connection has credits for it and refuses it with `ENOBUFS`
+ * otherwise. Its responses carry the connection's credits as payload, packed
+ * by `dmqp_credits_pack`.
  *
  * @param message message received by server
  * @param client socket to reply on
@@ -92,7 +778,73 @@ int send_dmqp_message(int fd, const struct dmqp_message *buffer, int flags);
 void handle_dmqp_push(const struct dmqp_message *message, int client);
 
 /**
- * Handles a DMQP message with method `DMQP_POP`.
+ * Handles a DMQP message with method `DMQP_PUSH_BATCH`. The batch's messages
+ * take the sequence IDs from the header's `sequence_id` onwards and are pushed
+ * atomically. The response carries one status (2 bytes, network byte order) per
+ * message, in batch order, followed on a leader by the connection's credits.
+ * A batch is refused with `ENOBUFS` unless it fits in the credits.
+ *
+ * @param message message received by server
+ * @param client socket to reply on
+ */
+void handle_dmqp_push_batch(const struct dmqp_message *message, int client);
+
+/**
+ * Handles a DMQP message with method `DMQP_FETCH`. The request payload holds
+ * the maximum number of messages and the maximum total payload bytes to pop (4
+ * bytes each, network byte order). Pops a run of messages from the head of the
+ * queue and replies with them in one frame, packed by `dmqp_fetch_pack`.
+ *
+ * @param message message received by server
+ * @param client socket to reply on
+ */
+void handle_dmqp_fetch(const struct dmqp_message *message, int client);
+
+/**
+ * Handles a DMQP message with method `DMQP_READ`, on a partition that keeps
+ * its entries in a log. The request payload holds an offset (8 bytes) and the
+ * maximum number of messages and the maximum total payload bytes to read (4
+ * bytes each), all in network byte order. Reads a run of messages from the
+ * offset, or from where the connection's last read ended if it is
+ * `DMQP_READ_NEXT`, without removing them, so other connections and later
+ * reads may read them again. Replies with them in one frame, packed by
+ * `dmqp_read_pack`, or with `ERANGE` if the offset was reclaimed or not
+ * appended yet.
+ *
+ * @param message message received by server
+ * @param client socket to reply on
+ */
+void handle_dmqp_read(const struct dmqp_message *message, int client);
+
+/**
+ * Handles a DMQP message with method `DMQP_SUBSCRIBE`. The payload holds a
+ * number of credits (4 bytes, network byte order). The first request with a
+ * correlation ID on a connection subscribes it: entries are then pushed to it
+ * as they arrive, as responses carrying that correlation ID, one credit each.
+ * Later requests with the same correlation ID grant more credits, or end the
+ * subscription if they grant none, which is answered with `ECANCELED`.
+ *
+ * @param message message received by server
+ * @param client socket to stream entries to
+ */
+void handle_dmqp_subscribe(const struct dmqp_message *message, int client);
+
+/**
+ * Handles a DMQP message with method `DMQP_CREDIT`, sent by producers that ran
+ * out of credits. The payload may hold a number of byte credits (4 bytes,
+ * network byte order); the request waits until the connection has a message
+ * credit and that many byte credits, then replies with its credits.
+ *
+ * @param message message received by server
+ * @param client socket to reply on
+ */
+void handle_dmqp_credit(const struct dmqp_message *message, int client);
+
+/**
+ * Handles a DMQP message with method `DMQP_POP`. The payload may hold a
+ * timeout in milliseconds (4 bytes, network byte order, capped at
+ * `DMQP_POP_MAX_WAIT_MS`); if the queue is empty, the request then waits for a
+ * push until the timeout instead of failing right away.
  *
  * @param message message received by server
  * @param client socket to reply on
@@ -0,0 +1,94 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <pthread.h>
+
+#define WORKER_POOL_MAX_WORKERS 64
+#define WORKER_QUEUE_CAPACITY 1024 // tasks per worker
+
+struct worker_task {
+    void (*fn)(void *arg);
+    void *arg;
+};
+
+struct worker_stats {
+    unsigned int depth;     // tasks queued on the worker
+    unsigned long executed; // tasks run by the worker
+    unsigned long steals;   // tasks the worker took from other workers
+};
+
+struct worker_pool;
+
+struct worker {
+    pthread_t tid;
+    unsigned int index;
+    struct worker_pool *pool;
+
+    pthread_mutex_t lock; // protects the deque
+    struct worker_task tasks[WORKER_QUEUE_CAPACITY];
+    unsigned int head;
+    unsigned int size;
+
+    unsigned long executed;
+    unsigned long steals;
+};
+
+struct worker_pool {
+    struct worker *workers;
+    unsigned int num_workers;
+    unsigned int next_worker; // round-robin submission cursor
+    unsigned int pending;     // tasks queued across all workers
+    unsigned int idle;        // workers waiting for tasks
+    int running;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+/**
+ * Initializes a fixed-size worker pool. Each worker owns a bounded deque of
+ * tasks. Workers run their own tasks oldest first, and steal the newest task of
+ * another worker once their own deque is empty.
+ *
+ * @param pool the pool to init
+ * @param num_workers number of worker threads, 0 for one per online core
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args or more than `WORKER_POOL_MAX_WORKERS` workers
+ * @throws `ENOMEM` out of memory
+ * @throws `EIO` unexpected error
+ */
+int worker_pool_init(struct worker_pool *pool, unsigned int num_workers);
+
+/**
+ * Destroys a worker pool. Blocks until every queued task has run and all
+ * workers have exited.
+ *
+ * @param pool the pool to destroy
+ */
+void worker_pool_destroy(struct worker_pool *pool);
+
+/**
+ * Queues a task on the pool, distributing tasks between workers using
+ * Round-Robin. Never creates threads; fails instead once every deque is full.
+ *
+ * @param pool the pool to submit to
+ * @param fn function to run on a worker thread
+ * @param arg argument passed to `fn`
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EAGAIN` every worker's deque is full
+ */
+int worker_pool_submit(struct worker_pool *pool, void (*fn)(void *arg),
+                       void *arg);
+
+/**
+ * Gets a snapshot of per-worker statistics.
+ *
+ * @param pool the pool to inspect
+ * @param stats output array of at least `n` entries
+ * @param n capacity of `stats`
+ * @returns number of workers in the pool, entries beyond `n` are not written
+ */
+unsigned int worker_pool_stats(struct worker_pool *pool,
+                               struct worker_stats *stats, unsigned int n);
+
+#endif
@@ -0,0 +1,177 @@
+// Measures how fast the DMQP server takes a reconnect storm, as when every
+// client of a restarted partition reconnects at once, with one acceptor thread
+// and with one `SO_REUSEPORT` acceptor per event loop, pinned or not, and
+// steered to the acceptor of the CPU the connection arrived on. Each
+// client thread opens its connections back to back and times each one from
+// `connect` to the response of its first request. The server runs in a child
+// process.
+//
+// Usage: bench_accept [clients]
+
+#include "messageq/buffer_pool.h"
+#include "messageq/network.h"
+#include "messageq/util.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT 8110
+#define BENCH_THREADS 8
+#define BENCH_CLIENTS 2048 // connections per storm, across all threads
+#define BENCH_ROUNDS 3
+
+void handle_dmqp_peek_sequence_id(const struct dmqp_message *message,
+                                  int client) {
+    struct dmqp_header header = {
+        .method = DMQP_RESPONSE,
+        .correlation_id = message->header.correlation_id};
+    struct dmqp_message response = {.header = header, .payload = NULL};
+    send_dmqp_message(client, &response, 0);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+struct storm_thread {
+    pthread_t tid;
+    unsigned short port;
+    int count;         // connections to open
+    int *clients;      // opened connections, -1 if failed
+    double *latencies; // seconds per connection
+};
+
+static void *storm_thread(void *arg) {
+    struct storm_thread *thread = arg;
+    struct dmqp_header header = {.method = DMQP_PEEK_SEQUENCE_ID};
+    struct dmqp_message request = {.header = header, .payload = NULL};
+
+    for (int i = 0; i < thread->count; i++) {
+        double start = now();
+        int client = dmqp_client_init("127.0.0.1", thread->port);
+        struct dmqp_message response;
+        if (client >= 0 && send_dmqp_message(client, &request, 0) >= 0 &&
+            read_dmqp_message(client, &response) >= 0) {
+            buffer_pool_free(response.payload);
+        } else if (client >= 0) {
+            close(client);
+            client = -1;
+        }
+
+        thread->clients[i] = client;
+        thread->latencies[i] = now() - start;
+    }
+
+    return NULL;
+}
+
+/**
+ * Opens `clients` connections to a server from `BENCH_THREADS` threads at
+ * once, keeping them open until all are done.
+ *
+ * @param name label of the server's configuration
+ * @param port port of the server
+ * @param clients connections to open
+ */
+static void bench_storm(const char *name, unsigned short port, int clients) {
+    struct storm_thread threads[BENCH_THREADS];
+    int *fds = malloc(clients * sizeof(int));
+    double *latencies = malloc(clients * sizeof(double));
+
+    double start = now();
+    int offset = 0;
+    for (int i = 0; i < BENCH_THREADS; i++) {
+        threads[i].port = port;
+        threads[i].count = clients / BENCH_THREADS +
+                           (i < clients % BENCH_THREADS ? 1 : 0);
+        threads[i].clients = fds + offset;
+        threads[i].latencies = latencies + offset;
+        offset += threads[i].count;
+        pthread_create(&threads[i].tid, NULL, storm_thread, &threads[i]);
+    }
+    for (int i = 0; i < BENCH_THREADS; i++) {
+        pthread_join(threads[i].tid, NULL);
+    }
+    double elapsed = now() - start;
+
+    int failed = 0;
+    for (int i = 0; i < clients; i++) {
+        if (fds[i] < 0) {
+            failed++;
+        } else {
+            close(fds[i]);
+        }
+    }
+
+    qsort(latencies, clients, sizeof(double), compare_doubles);
+    printf("%-17s %8d %12.0f %10.1f %10.1f %10.1f %7d\n", name, clients,
+           clients / elapsed, latencies[clients / 2] * 1e6,
+           latencies[clients * 99 / 100] * 1e6, latencies[clients - 1] * 1e6,
+           failed);
+
+    free(latencies);
+    free(fds);
+}
+
+int main(int argc, char **argv) {
+    int clients = argc > 1 ? atoi(argv[1]) : BENCH_CLIENTS;
+    if (clients < BENCH_THREADS) {
+        fprintf(stderr, "Usage: %s [clients]\n", argv[0]);
+        return 1;
+    }
+
+    // every connection of a storm stays open until the storm ends
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    struct {
+        const char *name;
+        unsigned int acceptors;
+        int pin_cpus;
+        int steering;
+    } configs[] = {{"1 acceptor", 1, 0, 0},
+                   {"per loop", 0, 0, 0},
+                   {"per loop pinned", 0, 1, 0},
+                   {"per loop steered", 0, 1, 1}};
+
+    printf("%ld online cores\n", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-17s %8s %12s %10s %10s %10s %7s\n", "acceptors", "clients",
+           "conn/s", "p50 us", "p99 us", "max us", "failed");
+    for (int i = 0; i < arrlen(configs); i++) {
+        unsigned short port = BENCH_PORT + i;
+        fflush(stdout);
+        pid_t server = fork();
+        if (server == 0) {
+            server_acceptors = configs[i].acceptors;
+            server_pin_cpus = configs[i].pin_cpus;
+            server_reuseport_steering = configs[i].steering;
+            return dmqp_server_init(port) < 0;
+        }
+        sleep(1); // wait 1s for server to initialize
+
+        for (int round = 0; round < BENCH_ROUNDS; round++) {
+            bench_storm(configs[i].name, port, clients);
+        }
+
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+// Measures how the DMQP server scales with the number of persistent client
+// connections, and the throughput of small pipelined requests on a single
+// connection. The server runs in a child process so that each side gets its
+// own file descriptor limit.
+//
+// Usage: bench_network [epoll|io_uring]
+
+#include "messageq/network.h"
+#include "messageq/util.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT 8090
+#define BENCH_ROUNDS 20
+#define BENCH_PIPELINED_SEC 2
+#define BENCH_SMALL_PAYLOAD 64 // bytes
+
+void handle_dmqp_peek_sequence_id(const struct dmqp_message *message,
+                                  int client) {
+    struct dmqp_header header = {
+        .method = DMQP_RESPONSE,
+        .correlation_id = message->header.correlation_id};
+    struct dmqp_message response = {.header = header, .payload = NULL};
+    send_dmqp_message(client, &response, 0);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns the number of threads of a process.
+ *
+ * @param pid process to inspect
+ * @returns thread count, -1 if unknown
+ */
+static int thread_count(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof path, "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return -1;
+    }
+
+    int threads = -1;
+    char line[256];
+    while (fgets(line, sizeof line, f)) {
+        if (sscanf(line, "Threads: %d", &threads) == 1) {
+            break;
+        }
+    }
+
+    fclose(f);
+    return threads;
+}
+
+/**
+ * Raises the soft file descriptor limit to the hard limit.
+ *
+ * @returns the new soft limit
+ */
+static long raise_fd_limit() {
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    return (long)rl.rlim_cur;
+}
+
+static int bench(pid_t server, int num_clients) {
+    int *clients = malloc(num_clients * sizeof(int));
+    int connected = 0;
+    for (; connected < num_clients; connected++) {
+        clients[connected] = dmqp_client_init("127.0.0.1", BENCH_PORT);
+        if (clients[connected] < 0) {
+            break;
+        }
+    }
+
+    struct dmqp_header header = {.method = DMQP_PEEK_SEQUENCE_ID};
+    struct dmqp_message request = {.header = header, .payload = NULL};
+
+    double start = now();
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        for (int i = 0; i < connected; i++) {
+            send_dmqp_message(clients[i], &request, 0);
+        }
+
+        for (int i = 0; i < connected; i++) {
+            struct dmqp_message response;
+            read_dmqp_message(clients[i], &response);
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%8d %8d %16.0f %14.1f\n", connected, thread_count(server),
+           connected * BENCH_ROUNDS / elapsed, elapsed / BENCH_ROUNDS * 1e6);
+
+    for (int i = 0; i < connected; i++) {
+        close(clients[i]);
+    }
+
+    free(clients);
+    return connected == num_clients ? 0 : -1;
+}
+
+/**
+ * Keeps `depth` small requests in flight on one connection.
+ *
+ * @param depth number of requests sent before their responses are read
+ * @returns 0 on success, -1 if the client could not connect
+ */
+static int bench_pipelined(int depth) {
+    int client = dmqp_client_init("127.0.0.1", BENCH_PORT);
+    if (client < 0) {
+        return -1;
+    }
+
+    char payload[BENCH_SMALL_PAYLOAD] = {0};
+    struct dmqp_header header = {.method = DMQP_PEEK_SEQUENCE_ID,
+                                 .length = sizeof payload};
+    struct dmqp_message request = {.header = header, .payload = payload};
+
+    long sent = 0;
+    double start = now();
+    double elapsed = 0;
+    while (elapsed < BENCH_PIPELINED_SEC) {
+        for (int i = 0; i < depth; i++) {
+            request.header.correlation_id = sent + i;
+            send_dmqp_message(client, &request, 0);
+        }
+
+        for (int i = 0; i < depth; i++) {
+            struct dmqp_message response;
+            read_dmqp_message(client, &response);
+        }
+
+        sent += depth;
+        elapsed = now() - start;
+    }
+
+    printf("%8d %16.0f\n", depth, sent / elapsed);
+
+    close(client);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "io_uring") == 0) {
+        server_io_backend = DMQP_IO_BACKEND_IO_URING;
+    }
+
+    long fd_limit = raise_fd_limit();
+
+    pid_t server = fork();
+    if (server == 0) {
+        return dmqp_server_init(BENCH_PORT) < 0;
+    }
+    sleep(1); // wait 1s for server to initialize
+
+    int client_counts[] = {10, 100, 1000, 10000};
+
+    printf("%8s %8s %16s %14s\n", "clients", "threads", "requests/s",
+           "usec/round");
+    for (int i = 0; i < arrlen(client_counts); i++) {
+        if (client_counts[i] > fd_limit - 16) {
+            fprintf(stderr, "skipping %d clients: fd limit is %ld\n",
+                    client_counts[i], fd_limit);
+            continue;
+        }
+
+        if (bench(server, client_counts[i]) < 0) {
+            fprintf(stderr, "could not connect all clients: %s\n",
+                    strerror(errno));
+        }
+    }
+
+    int depths[] = {1, 16, 64};
+
+    printf("\n%8s %16s\n", "depth", "requests/s");
+    for (int i = 0; i < arrlen(depths); i++) {
+        if (bench_pipelined(depths[i]) < 0) {
+            fprintf(stderr, "could not connect client: %s\n",
+                    strerror(errno));
+        }
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,231 @@
+// Compares the latency and throughput of DMQP requests over loopback TCP, over
+// the server's `AF_UNIX` socket and over a shared memory channel. Latency is
+// measured one request at a time, throughput with requests pipelined on a
+// single connection, along with the time a pipelined request takes to enqueue.
+// The server runs in a child process and echoes every payload back.
+//
+// Usage: bench_unix [epoll|io_uring]
+
+#include "messageq/buffer_pool.h"
+#include "messageq/network.h"
+#include "messageq/util.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT 8093
+#define BENCH_UNIX_PATH "/tmp/messageq-bench_unix.sock"
+#define BENCH_LATENCY_REQUESTS 20000
+#define BENCH_PIPELINED_SEC 2
+#define BENCH_PIPELINED_DEPTH 64
+
+void handle_dmqp_peek_sequence_id(const struct dmqp_message *message,
+                                  int client) {
+    struct dmqp_header header = {
+        .length = message->header.length,
+        .method = DMQP_RESPONSE,
+        .correlation_id = message->header.correlation_id};
+    struct dmqp_message response = {.header = header,
+                                    .payload = message->payload};
+    send_dmqp_message(client, &response, 0);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+enum transport { TRANSPORT_TCP, TRANSPORT_UNIX, TRANSPORT_SHM };
+
+static const char *transport_names[] = {"tcp", "unix", "shm"};
+
+struct bench_client {
+    int fd;
+    struct dmqp_shm_client *shm; // `NULL` unless over shared memory
+};
+
+static int client_connect(enum transport transport,
+                          struct bench_client *client) {
+    client->shm = NULL;
+    client->fd = transport == TRANSPORT_TCP
+                     ? dmqp_client_init("127.0.0.1", BENCH_PORT)
+                     : dmqp_client_init_unix(BENCH_UNIX_PATH);
+    if (client->fd < 0) {
+        return -1;
+    }
+
+    if (transport == TRANSPORT_SHM) {
+        client->shm = dmqp_shm_attach(client->fd);
+        if (!client->shm) {
+            close(client->fd);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void client_close(struct bench_client *client) {
+    dmqp_shm_detach(client->shm);
+    close(client->fd);
+}
+
+static int client_send(struct bench_client *client,
+                       const struct dmqp_message *request) {
+    return client->shm ? dmqp_shm_send(client->shm, request)
+                       : send_dmqp_message(client->fd, request, 0);
+}
+
+static int client_read(struct bench_client *client,
+                       struct dmqp_message *response) {
+    return client->shm ? dmqp_shm_read(client->shm, response)
+                       : read_dmqp_message(client->fd, response);
+}
+
+/**
+ * Sends requests one at a time, waiting for each response.
+ *
+ * @param transport how to connect to the server
+ * @param payload_length bytes per request
+ * @returns 0 on success, -1 if the client could not connect
+ */
+static int bench_latency(enum transport transport, size_t payload_length) {
+    struct bench_client client;
+    if (client_connect(transport, &client) < 0) {
+        return -1;
+    }
+
+    char *payload = calloc(1, payload_length);
+    double *latencies = malloc(BENCH_LATENCY_REQUESTS * sizeof(double));
+    struct dmqp_header header = {.method = DMQP_PEEK_SEQUENCE_ID,
+                                 .length = payload_length};
+    struct dmqp_message request = {.header = header, .payload = payload};
+
+    for (int i = 0; i < BENCH_LATENCY_REQUESTS; i++) {
+        double start = now();
+        client_send(&client, &request);
+
+        struct dmqp_message response;
+        if (client_read(&client, &response) >= 0) {
+            buffer_pool_free(response.payload);
+        }
+        latencies[i] = now() - start;
+    }
+
+    qsort(latencies, BENCH_LATENCY_REQUESTS, sizeof(double), compare_doubles);
+    double total = 0;
+    for (int i = 0; i < BENCH_LATENCY_REQUESTS; i++) {
+        total += latencies[i];
+    }
+
+    printf("%8s %10zu %12s %14.1f %14.1f\n", transport_names[transport],
+           payload_length, "latency", total / BENCH_LATENCY_REQUESTS * 1e6,
+           latencies[BENCH_LATENCY_REQUESTS * 99 / 100] * 1e6);
+
+    free(latencies);
+    free(payload);
+    client_close(&client);
+    return 0;
+}
+
+/**
+ * Keeps `BENCH_PIPELINED_DEPTH` requests in flight on one connection.
+ *
+ * @param transport how to connect to the server
+ * @param payload_length bytes per request
+ * @returns 0 on success, -1 if the client could not connect
+ */
+static int bench_pipelined(enum transport transport, size_t payload_length) {
+    struct bench_client client;
+    if (client_connect(transport, &client) < 0) {
+        return -1;
+    }
+
+    char *payload = calloc(1, payload_length);
+    struct dmqp_header header = {.method = DMQP_PEEK_SEQUENCE_ID,
+                                 .length = payload_length};
+    struct dmqp_message request = {.header = header, .payload = payload};
+
+    long sent = 0;
+    double enqueue = 0; // time spent sending requests
+    double start = now();
+    double elapsed = 0;
+    while (elapsed < BENCH_PIPELINED_SEC) {
+        double enqueue_start = now();
+        for (int i = 0; i < BENCH_PIPELINED_DEPTH; i++) {
+            request.header.correlation_id = sent + i;
+            client_send(&client, &request);
+        }
+        enqueue += now() - enqueue_start;
+
+        for (int i = 0; i < BENCH_PIPELINED_DEPTH; i++) {
+            struct dmqp_message response;
+            if (client_read(&client, &response) >= 0) {
+                buffer_pool_free(response.payload);
+            }
+        }
+
+        sent += BENCH_PIPELINED_DEPTH;
+        elapsed = now() - start;
+    }
+
+    printf("%8s %10zu %12s %14.0f %14.1f\n", transport_names[transport],
+           payload_length, "pipelined", sent / elapsed,
+           sent * payload_length / elapsed / (1 << 20));
+    printf("%8s %10zu %12s %14.1f %14s\n", transport_names[transport],
+           payload_length, "enqueue", enqueue / sent * 1e9, "-");
+
+    free(payload);
+    client_close(&client);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "io_uring") == 0) {
+        server_io_backend = DMQP_IO_BACKEND_IO_URING;
+    }
+
+    pid_t server = fork();
+    if (server == 0) {
+        strcpy(server_unix_path, BENCH_UNIX_PATH);
+        return dmqp_server_init(BENCH_PORT) < 0;
+    }
+    sleep(1); // wait 1s for server to initialize
+
+    size_t payload_lengths[] = {64, 16 * 1024};
+
+    printf("%8s %10s %12s %14s %14s\n", "socket", "payload", "mode",
+           "avg us | req/s", "p99 us | MB/s");
+    printf("%8s %10s %12s %14s %14s\n", "", "", "", "| enqueue ns", "");
+    for (int i = 0; i < arrlen(payload_lengths); i++) {
+        for (int t = 0; t < arrlen(transport_names); t++) {
+            if (bench_latency(t, payload_lengths[i]) < 0) {
+                fprintf(stderr, "could not connect: %s\n", strerror(errno));
+            }
+        }
+    }
+    for (int i = 0; i < arrlen(payload_lengths); i++) {
+        for (int t = 0; t < arrlen(transport_names); t++) {
+            if (bench_pipelined(t, payload_lengths[i]) < 0) {
+                fprintf(stderr, "could not connect: %s\n", strerror(errno));
+            }
+        }
+    }
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return 0;
+}
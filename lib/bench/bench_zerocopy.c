@@ -0,0 +1,116 @@
+// Compares the CPU time the sender spends per GB of large DMQP payloads with
+// and without `MSG_ZEROCOPY`. By default the messages go to a DMQP server in a
+// child process over loopback, where the kernel copies zerocopy payloads
+// anyway, so run it against a partition on another host to see the savings.
+//
+// Usage: bench_zerocopy [host port]
+
+#include "messageq/network.h"
+#include "messageq/util.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_PORT 8091
+#define BENCH_BYTES (1L << 30) // sent per payload size and mode
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Returns the user and system CPU time of the calling process in seconds.
+ */
+static double cpu_time() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static int bench(const char *host, unsigned short port, size_t payload_length,
+                 int zerocopy) {
+    int client = dmqp_client_init(host, port);
+    if (client < 0) {
+        return -1;
+    }
+
+    char *payload = malloc(payload_length);
+    if (!payload) {
+        close(client);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(payload, 'x', payload_length);
+
+    struct dmqp_header header = {.method = DMQP_PUSH,
+                                 .length = payload_length};
+    struct dmqp_message request = {.header = header, .payload = payload};
+    send_zerocopy_threshold = zerocopy ? payload_length : 0;
+
+    long messages = BENCH_BYTES / payload_length;
+    double start = now();
+    double start_cpu = cpu_time();
+    int ret = 0;
+    for (long i = 0; i < messages; i++) {
+        if (send_dmqp_message(client, &request, 0) < 0) {
+            ret = -1;
+            break;
+        }
+    }
+    double elapsed = now() - start;
+    double cpu = cpu_time() - start_cpu;
+
+    double gb = (double)messages * payload_length / (1 << 30);
+    printf("%10zu %10s %12.2f %14.3f\n", payload_length,
+           zerocopy ? "zerocopy" : "copy", gb / elapsed, cpu / gb);
+
+    send_zerocopy_threshold = 0;
+    free(payload);
+    close(client);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    unsigned short port = BENCH_PORT;
+    pid_t server = -1;
+
+    if (argc == 3) {
+        host = argv[1];
+        port = atoi(argv[2]);
+    } else {
+        server = fork();
+        if (server == 0) {
+            return dmqp_server_init(BENCH_PORT) < 0;
+        }
+        sleep(1); // wait 1s for server to initialize
+    }
+
+    size_t payload_lengths[] = {64 * 1024, 256 * 1024, MAX_PAYLOAD_LENGTH};
+
+    printf("%10s %10s %12s %14s\n", "payload", "mode", "GB/s", "cpu sec/GB");
+    for (int i = 0; i < arrlen(payload_lengths); i++) {
+        for (int zerocopy = 0; zerocopy < 2; zerocopy++) {
+            if (bench(host, port, payload_lengths[i], zerocopy) < 0) {
+                fprintf(stderr, "could not send to %s:%d: %s\n", host, port,
+                        strerror(errno));
+            }
+        }
+    }
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,303 @@
+#include "messageq/buffer_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define OVERSIZE_CLASS BUFFER_POOL_CLASSES // not pooled, freed right away
+
+// Precedes every leased buffer. Keeps buffers aligned like `malloc` does.
+union buffer_header {
+    struct {
+        union buffer_header *next; // next free buffer of the same class
+        unsigned int size_class;
+        unsigned int refs; // owners of a leased buffer
+    };
+    max_align_t align;
+};
+
+struct buffer_cache {
+    union buffer_header *buffers[BUFFER_POOL_CLASSES];
+    unsigned int count[BUFFER_POOL_CLASSES];
+
+    // only written by the owning thread, read by `buffer_pool_stats`
+    unsigned long hits;
+    unsigned long misses;
+
+    int registered; // flushed to the global pool on thread exit
+    struct buffer_cache *prev;
+    struct buffer_cache *next;
+};
+
+struct buffer_list {
+    pthread_mutex_t lock;
+    union buffer_header *buffers;
+    unsigned int count;
+};
+
+static __thread struct buffer_cache cache;
+static struct buffer_list global[BUFFER_POOL_CLASSES];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+// caches of running threads, and the counters of exited ones
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct buffer_cache *caches;
+static unsigned long exited_hits;
+static unsigned long exited_misses;
+
+/**
+ * Returns the number of buffers of a size class a thread cache may hold.
+ */
+static unsigned int cache_capacity(unsigned int size_class) {
+    unsigned int capacity =
+        BUFFER_POOL_CACHE_BYTES >> (size_class + BUFFER_POOL_MIN_SHIFT);
+    return capacity < 2 ? 2 : capacity;
+}
+
+/**
+ * Returns the number of buffers of a size class the global pool may hold.
+ */
+static unsigned int global_capacity(unsigned int size_class) {
+    unsigned int capacity =
+        BUFFER_POOL_GLOBAL_BYTES >> (size_class + BUFFER_POOL_MIN_SHIFT);
+    return capacity < 8 ? 8 : capacity;
+}
+
+/**
+ * Returns the smallest size class that fits `size` bytes.
+ */
+static unsigned int size_class_of(size_t size) {
+    unsigned int size_class = 0;
+    while (size_class < OVERSIZE_CLASS &&
+           ((size_t)1 << (size_class + BUFFER_POOL_MIN_SHIFT)) < size) {
+        size_class++;
+    }
+
+    return size_class;
+}
+
+/**
+ * Moves up to `n` buffers of a size class from the calling thread's cache to
+ * the global pool, freeing those that do not fit.
+ */
+static void cache_flush(unsigned int size_class, unsigned int n) {
+    struct buffer_list *list = &global[size_class];
+    unsigned int capacity = global_capacity(size_class);
+    union buffer_header *overflow = NULL;
+
+    pthread_mutex_lock(&list->lock);
+    for (; n && cache.buffers[size_class]; n--) {
+        union buffer_header *buffer = cache.buffers[size_class];
+        cache.buffers[size_class] = buffer->next;
+        cache.count[size_class]--;
+
+        if (list->count < capacity) {
+            buffer->next = list->buffers;
+            list->buffers = buffer;
+            list->count++;
+        } else {
+            buffer->next = overflow;
+            overflow = buffer;
+        }
+    }
+    pthread_mutex_unlock(&list->lock);
+
+    while (overflow) {
+        union buffer_header *next = overflow->next;
+        free(overflow);
+        overflow = next;
+    }
+}
+
+/**
+ * Moves the calling thread's whole cache to the global pool when the thread
+ * exits.
+ */
+static void cache_destroy(void *arg) {
+    (void)arg;
+    for (unsigned int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        cache_flush(i, cache.count[i]);
+    }
+
+    pthread_mutex_lock(&caches_lock);
+    if (cache.prev) {
+        cache.prev->next = cache.next;
+    } else {
+        caches = cache.next;
+    }
+    if (cache.next) {
+        cache.next->prev = cache.prev;
+    }
+    exited_hits += cache.hits;
+    exited_misses += cache.misses;
+    cache.hits = 0;
+    cache.misses = 0;
+    pthread_mutex_unlock(&caches_lock);
+
+    cache.registered = 0;
+}
+
+static void buffer_pool_init() {
+    for (unsigned int i = 0; i < BUFFER_POOL_CLASSES; i++) {
+        pthread_mutex_init(&global[i].lock, NULL);
+    }
+    pthread_key_create(&cache_key, cache_destroy);
+}
+
+/**
+ * Registers the calling thread's cache on first use, so that it is counted by
+ * `buffer_pool_stats` and flushed when the thread exits.
+ */
+static void cache_register() {
+    if (cache.registered) {
+        return;
+    }
+
+    pthread_once(&init_once, buffer_pool_init);
+    pthread_setspecific(cache_key, &cache);
+
+    pthread_mutex_lock(&caches_lock);
+    cache.prev = NULL;
+    cache.next = caches;
+    if (caches) {
+        caches->prev = &cache;
+    }
+    caches = &cache;
+    pthread_mutex_unlock(&caches_lock);
+
+    cache.registered = 1;
+}
+
+/**
+ * Bumps a counter of the calling thread's cache. Only the owning thread
+ * writes it, so a plain store is enough for concurrent readers.
+ */
+static void cache_count(unsigned long *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Refills the calling thread's cache with up to half its capacity of a size
+ * class from the global pool.
+ *
+ * @returns 1 if any buffer was moved, 0 if the global pool is empty
+ */
+static int cache_refill(unsigned int size_class) {
+    struct buffer_list *list = &global[size_class];
+    unsigned int n = cache_capacity(size_class) / 2;
+
+    pthread_mutex_lock(&list->lock);
+    int refilled = list->buffers != NULL;
+    for (; n && list->buffers; n--) {
+        union buffer_header *buffer = list->buffers;
+        list->buffers = buffer->next;
+        list->count--;
+
+        buffer->next = cache.buffers[size_class];
+        cache.buffers[size_class] = buffer;
+        cache.count[size_class]++;
+    }
+    pthread_mutex_unlock(&list->lock);
+
+    return refilled;
+}
+
+void *buffer_pool_alloc(size_t size) {
+    cache_register();
+
+    unsigned int size_class = size_class_of(size);
+    if (size_class == OVERSIZE_CLASS) {
+        union buffer_header *buffer = NULL;
+        if (size <= SIZE_MAX - sizeof *buffer) {
+            buffer = malloc(sizeof *buffer + size);
+        }
+        if (!buffer) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        cache_count(&cache.misses);
+        buffer->size_class = OVERSIZE_CLASS;
+        buffer->refs = 1;
+        return buffer + 1;
+    }
+
+    if (cache.buffers[size_class] || cache_refill(size_class)) {
+        union buffer_header *buffer = cache.buffers[size_class];
+        cache.buffers[size_class] = buffer->next;
+        cache.count[size_class]--;
+
+        cache_count(&cache.hits);
+        buffer->refs = 1;
+        return buffer + 1;
+    }
+
+    union buffer_header *buffer = malloc(
+        sizeof *buffer + ((size_t)1 << (size_class + BUFFER_POOL_MIN_SHIFT)));
+    if (!buffer) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    cache_count(&cache.misses);
+    buffer->size_class = size_class;
+    buffer->refs = 1;
+    return buffer + 1;
+}
+
+void *buffer_pool_ref(void *buffer) {
+    if (!buffer) {
+        return NULL;
+    }
+
+    union buffer_header *header = (union buffer_header *)buffer - 1;
+    __atomic_add_fetch(&header->refs, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+void buffer_pool_free(void *buffer) {
+    if (!buffer) {
+        return;
+    }
+
+    // a sole owner cannot race with another reference, so it skips the atomic
+    // decrement
+    union buffer_header *header = (union buffer_header *)buffer - 1;
+    if (__atomic_load_n(&header->refs, __ATOMIC_ACQUIRE) != 1 &&
+        __atomic_sub_fetch(&header->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    unsigned int size_class = header->size_class;
+    if (size_class == OVERSIZE_CLASS) {
+        free(header);
+        return;
+    }
+
+    cache_register();
+    header->next = cache.buffers[size_class];
+    cache.buffers[size_class] = header;
+    cache.count[size_class]++;
+
+    unsigned int capacity = cache_capacity(size_class);
+    if (cache.count[size_class] > capacity) {
+        cache_flush(size_class, capacity / 2);
+    }
+}
+
+void buffer_pool_stats(struct buffer_pool_stats *stats) {
+    if (!stats) {
+        return;
+    }
+
+    pthread_mutex_lock(&caches_lock);
+    stats->hits = exited_hits;
+    stats->misses = exited_misses;
+    for (struct buffer_cache *curr = caches; curr; curr = curr->next) {
+        stats->hits += __atomic_load_n(&curr->hits, __ATOMIC_RELAXED);
+        stats->misses += __atomic_load_n(&curr->misses, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&caches_lock);
+}
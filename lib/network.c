@@ -1,18 +1,63 @@
 #include "messageq/network.h"
+#include "messageq/buffer_pool.h"
+#include "network_internal.h"
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <linux/errqueue.h>
+#include <linux/filter.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#define COMPACT_SEQUENCE_ID 0x1 // compact header flags, field is not 0
+#define COMPACT_STATUS_CODE 0x2
+#define COMPACT_CORRELATION_ID 0x4
+#define COMPACT_VARINT_MAX_SIZE 5 // bytes, of a 32-bit varint
+
+// client sockets that agreed on compact headers with `dmqp_client_hello`
+static unsigned char compact_clients[DMQP_CLIENT_MAX_FD];
+
+int is_compact_client(int fd) {
+    return fd < DMQP_CLIENT_MAX_FD &&
+           __atomic_load_n(&compact_clients[fd], __ATOMIC_RELAXED);
+}
+
+static void set_compact_client(int fd, int compact) {
+    if (fd < DMQP_CLIENT_MAX_FD) {
+        __atomic_store_n(&compact_clients[fd], compact, __ATOMIC_RELAXED);
+    }
+}
+
+enum zerocopy_state { ZEROCOPY_UNKNOWN, ZEROCOPY_ENABLED, ZEROCOPY_UNSUPPORTED };
+
+// whether client sockets have `SO_ZEROCOPY` enabled, tried on their first large
+// send
+static unsigned char zerocopy_clients[DMQP_CLIENT_MAX_FD];
+
+static void set_zerocopy_client(int fd, enum zerocopy_state state) {
+    if (fd < DMQP_CLIENT_MAX_FD) {
+        __atomic_store_n(&zerocopy_clients[fd], state, __ATOMIC_RELAXED);
+    }
+}
+
 int dmqp_client_init(const char *host, unsigned short port) {
     if (!host) {
         errno = EINVAL;
@@ -37,6 +82,13 @@ int dmqp_client_init(const char *host, unsigned short port) {
         goto cleanup;
     }
 
+    // requests are written whole, so Nagle would only delay pipelined ones
+    int nodelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+    socket_keepalive_init(client);
+
+    set_compact_client(client, 0);
+    set_zerocopy_client(client, ZEROCOPY_UNKNOWN);
     return client;
 
 cleanup:
@@ -45,250 +97,284 @@ cleanup:
     return -1;
 }
 
-pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t server_running_cond = PTHREAD_COND_INITIALIZER;
-int server_running = 0;
-unsigned short server_port = 0;
-static struct sigaction sa;
-static struct sigaction sa_ignore;
+int dmqp_client_init_unix(const char *path) {
+    if (!path || !path[0] || strlen(path) >= DMQP_UNIX_PATH_MAX) {
+        errno = EINVAL;
+        return -1;
+    }
 
-/**
- * Simple signal handler that sets `server_running` to zero to terminate server
- * threads.
- *
- * @param sig signal received by process
- */
-static void signal_handler(int sig) {
-    (void)sig; // unused
-    pthread_mutex_lock(&server_lock);
-    server_running = 0;
-    pthread_mutex_unlock(&server_lock);
-    pthread_cond_broadcast(&server_running_cond);
-}
+    int client = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (client < 0) {
+        errno = EIO;
+        return -1;
+    }
 
-/**
- * Initializes signal handling. Gracefully terminates server when `SIGINT` or
- * `SIGTERM` is received. Ignores when `SIGPIPE` is received.
- */
-static void signal_init() {
-    sa.sa_handler = signal_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
 
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+    if (connect(client, (struct sockaddr *)&address, sizeof address) < 0) {
+        close(client);
+        errno = EIO;
+        return -1;
+    }
 
-    sa_ignore.sa_handler = SIG_IGN;
-    sigemptyset(&sa_ignore.sa_mask);
-    sa_ignore.sa_flags = 0;
-    sigaction(SIGPIPE, &sa_ignore, NULL);
+    set_compact_client(client, 0);
+    set_zerocopy_client(client, ZEROCOPY_UNKNOWN);
+    return client;
 }
 
 /**
- * Listens on a connection.
+ * Returns 1 if `host` is an IPv4 address of this machine, 0 otherwise.
  *
- * @param arg pointer to client socket. must be freed once copied
+ * @param host IPv4 address to check
  */
-static void *connection_handler(void *arg) {
-    int client = *(int *)arg;
-    free(arg);
+static int is_local_host(const char *host) {
+    struct in_addr address;
+    if (inet_pton(AF_INET, host, &address) <= 0) {
+        return 0;
+    }
 
-    for (;;) {
-        pthread_mutex_lock(&server_lock);
-        int running = server_running;
-        pthread_mutex_unlock(&server_lock);
+    if (ntohl(address.s_addr) >> 24 == 127) { // loopback
+        return 1;
+    }
 
-        if (!running) {
-            break;
-        }
+    struct ifaddrs *ifaddrs;
+    if (getifaddrs(&ifaddrs) < 0) {
+        return 0;
+    }
 
-        struct dmqp_message buf;
-        // TODO: this means that any 30s timeout will clean resources. must only
-        // close thread if tcp keepalive expires or connection closed
-        if (read_dmqp_message(client, &buf) < 0) {
-            break;
+    int local = 0;
+    for (struct ifaddrs *curr = ifaddrs; curr && !local;
+         curr = curr->ifa_next) {
+        if (curr->ifa_addr && curr->ifa_addr->sa_family == AF_INET) {
+            struct sockaddr_in *interface =
+                (struct sockaddr_in *)curr->ifa_addr;
+            local = interface->sin_addr.s_addr == address.s_addr;
         }
+    }
 
-        switch (buf.header.method) {
-        case DMQP_PUSH:
-            handle_dmqp_push(&buf, client);
-            break;
-        case DMQP_POP:
-            handle_dmqp_pop(&buf, client);
-            break;
-        case DMQP_PEEK_SEQUENCE_ID:
-            handle_dmqp_peek_sequence_id(&buf, client);
-            break;
-        case DMQP_RESPONSE:
-            handle_dmqp_response(&buf, client);
-            break;
-        default:;
-            struct dmqp_header header = {0};
-            header.method = DMQP_RESPONSE;
-            header.status_code = ENOSYS;
-            struct dmqp_message response = {.header = header};
+    freeifaddrs(ifaddrs);
+    return local;
+}
 
-            send_dmqp_message(client, &response, 0);
-            break;
-        }
+int dmqp_client_connect(const char *address) {
+    if (!address) {
+        errno = EINVAL;
+        return -1;
+    }
 
-        if (buf.payload) {
-            free(buf.payload);
-        }
+    char host[INET_ADDRSTRLEN];
+    const char *colon = strchr(address, ':');
+    if (!colon || colon - address >= (long)sizeof host) {
+        errno = EINVAL;
+        return -1;
     }
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
 
-    close(client);
-    return NULL;
-}
+    char *end;
+    unsigned long port = strtoul(colon + 1, &end, 10);
+    if (end == colon + 1 || port > UINT16_MAX ||
+        (*end && *end != ',' && *end != ';')) {
+        errno = EINVAL;
+        return -1;
+    }
 
-/**
- * Creates a detached thread to handle accepted TCP clients.
- *
- * @param socket client socket
- */
-static void connection_thread_init(int socket) {
-    int *args = malloc(sizeof(int));
-    *args = socket;
+    // a socket path only names the partition on the host that advertised it
+    if (*end == ',' && is_local_host(host)) {
+        char path[DMQP_UNIX_PATH_MAX];
+        size_t path_len = strcspn(end + 1, ";");
+        if (path_len < sizeof path) {
+            memcpy(path, end + 1, path_len);
+            path[path_len] = '\0';
+
+            int client = dmqp_client_init_unix(path);
+            if (client >= 0) {
+                return client;
+            }
+        }
+    }
 
-    pthread_t tid;
-    pthread_attr_t attr;
-    pthread_attr_init(&attr);
-    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-    pthread_create(&tid, &attr, connection_handler, args);
-    pthread_attr_destroy(&attr);
+    return dmqp_client_init(host, port);
 }
 
-int dmqp_server_init(unsigned short port) {
-    int ret = 0;
-    signal_init();
-
-    int server = socket(AF_INET, SOCK_STREAM, 0);
-    if (server < 0) {
-        errno = EIO;
-        return -1;
+void socket_keepalive_init(int socket) {
+    int enabled = dmqp_keepalive.idle_sec > 0;
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof enabled);
+    if (!enabled) {
+        return;
     }
 
-    int opt = 1;
-    if (setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) < 0) {
-        errno = EIO;
-        ret = -1;
-        goto cleanup;
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &dmqp_keepalive.idle_sec,
+               sizeof dmqp_keepalive.idle_sec);
+    if (dmqp_keepalive.interval_sec > 0) {
+        setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL,
+                   &dmqp_keepalive.interval_sec,
+                   sizeof dmqp_keepalive.interval_sec);
     }
-
-    if (setsockopt(server, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt) < 0) {
-        errno = EIO;
-        ret = -1;
-        goto cleanup;
+    if (dmqp_keepalive.probes > 0) {
+        setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &dmqp_keepalive.probes,
+                   sizeof dmqp_keepalive.probes);
     }
+}
 
-    struct sockaddr_in address = {0};
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-    socklen_t address_len = sizeof address;
+int accept_exhausted(int error) {
+    return error == EMFILE || error == ENFILE || error == ENOBUFS ||
+           error == ENOMEM;
+}
 
-    if (bind(server, (struct sockaddr *)&address, address_len) < 0) {
-        errno = EIO;
-        ret = -1;
-        goto cleanup;
+int dmqp_client_hello(int client, uint32_t version, uint32_t features,
+                      struct dmqp_hello *buf) {
+    if (client < 0 || !version || !buf) {
+        errno = EINVAL;
+        return -1;
     }
 
-    if (listen(server, LISTEN_BACKLOG) < 0) {
-        errno = EIO;
-        ret = -1;
-        goto cleanup;
+    // sockets past the table cannot remember the header format
+    if (client >= DMQP_CLIENT_MAX_FD) {
+        features &= ~DMQP_FEATURE_COMPACT_HEADER;
     }
 
-    if (getsockname(server, (struct sockaddr *)&address, &address_len) < 0) {
-        errno = EIO;
-        ret = -1;
-        goto cleanup;
+    uint32_t wire[2] = {htonl(version), htonl(features)};
+    struct dmqp_header header = {.length = DMQP_HELLO_SIZE,
+                                 .method = DMQP_HELLO};
+    struct dmqp_message message = {.header = header, .payload = wire};
+    if (send_dmqp_message(client, &message, 0) < 0 ||
+        read_dmqp_message(client, &message) < 0) {
+        return -1;
     }
 
-    pthread_mutex_lock(&server_lock);
-    server_running = 1;
-    server_port = ntohs(address.sin_port);
-    pthread_mutex_unlock(&server_lock);
-    pthread_cond_broadcast(&server_running_cond);
+    if (message.header.status_code) {
+        buffer_pool_free(message.payload);
+        errno = message.header.status_code;
+        return -1;
+    }
 
-    printf("DMQP Server listening on port %d\n", server_port);
+    if (message.header.length != DMQP_HELLO_SIZE) {
+        buffer_pool_free(message.payload);
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(wire, message.payload, DMQP_HELLO_SIZE);
+    buffer_pool_free(message.payload);
 
-    for (;;) {
-        pthread_mutex_lock(&server_lock);
-        int running = server_running;
-        pthread_mutex_unlock(&server_lock);
+    buf->version = ntohl(wire[0]);
+    buf->features = ntohl(wire[1]);
+    set_compact_client(client,
+                       (buf->features & DMQP_FEATURE_COMPACT_HEADER) != 0);
+    return 0;
+}
 
-        if (!running) {
-            break;
-        }
+int dmqp_client_heartbeat(int client) {
+    if (client < 0) {
+        errno = EINVAL;
+        return -1;
+    }
 
-        struct sockaddr_in client_address;
-        socklen_t client_address_len = sizeof client_address;
+    struct dmqp_header header = {.method = DMQP_HEARTBEAT};
+    struct dmqp_message message = {.header = header, .payload = NULL};
+    if (send_dmqp_message(client, &message, 0) < 0 ||
+        read_dmqp_message(client, &message) < 0) {
+        return -1;
+    }
+    buffer_pool_free(message.payload);
 
-        fd_set readfds;
-        FD_ZERO(&readfds);
-        FD_SET(server, &readfds);
-        struct timeval tv = {.tv_sec = 1, .tv_usec = 0};
-        int ready = select(server + 1, &readfds, NULL, NULL, &tv);
-        if (ready < 0) {
-            if (errno == EINTR) {
-                errno = 0;
-                continue;
-            }
+    if (message.header.status_code) {
+        errno = message.header.status_code;
+        return -1;
+    }
 
-            break;
-        }
+    return 0;
+}
 
-        if (!ready || !FD_ISSET(server, &readfds)) {
-            continue;
-        }
+void dmqp_client_close(int client) {
+    if (client < 0) {
+        return;
+    }
 
-        int client = accept(server, (struct sockaddr *)&client_address,
-                            &client_address_len);
-        if (client < 0) {
-            if (errno == EINTR) {
-                errno = 0;
-                continue;
-            }
+    set_compact_client(client, 0);
+    set_zerocopy_client(client, ZEROCOPY_UNKNOWN);
+    close(client);
+}
 
-            break;
-        }
+pthread_mutex_t server_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t server_running_cond = PTHREAD_COND_INITIALIZER;
+int server_running = 0;
+unsigned short server_port = 0;
+enum dmqp_io_backend server_io_backend = DMQP_IO_BACKEND_EPOLL;
+struct dmqp_keepalive dmqp_keepalive = {
+    .idle_sec = DMQP_KEEPALIVE_IDLE_SEC,
+    .interval_sec = DMQP_KEEPALIVE_INTERVAL_SEC,
+    .probes = DMQP_KEEPALIVE_PROBES};
+unsigned int server_acceptors = 0;
+int server_pin_cpus = 0;
+int server_reuseport_steering = 0;
+char server_unix_path[DMQP_UNIX_PATH_MAX] = {0};
+size_t send_zerocopy_threshold = 0;
+static struct sigaction sa;
+static struct sigaction sa_ignore;
 
-        // 30s timeout on reads/writes
-        tv.tv_sec = 30;
-        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (void *)&tv, sizeof tv);
+/**
+ * Simple signal handler that sets `server_running` to zero to terminate server
+ * threads.
+ *
+ * @param sig signal received by process
+ */
+static void signal_handler(int sig) {
+    (void)sig; // unused
+    pthread_mutex_lock(&server_lock);
+    server_running = 0;
+    pthread_mutex_unlock(&server_lock);
+    pthread_cond_broadcast(&server_running_cond);
+}
 
-        // tcp keepalive
-        int keepalive = 1;
-        setsockopt(client, SOL_SOCKET, SO_KEEPALIVE, &keepalive,
-                   sizeof keepalive);
+/**
+ * Initializes signal handling. Gracefully terminates server when `SIGINT` or
+ * `SIGTERM` is received. Ignores when `SIGPIPE` is received.
+ */
+static void signal_init() {
+    sa.sa_handler = signal_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
 
-        connection_thread_init(client);
-    }
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
 
-cleanup:
-    close(server);
-    return ret;
+    sa_ignore.sa_handler = SIG_IGN;
+    sigemptyset(&sa_ignore.sa_mask);
+    sa_ignore.sa_flags = 0;
+    sigaction(SIGPIPE, &sa_ignore, NULL);
 }
 
 /**
  * Reads all bytes into a buffer from a file descriptor. Operation will return
- * once all `count` bytes are sent.
+ * once all `count` bytes are read.
  *
  * @param fd file descriptor to read from
  * @param buf buffer to write to
  * @param count number of bytes to read
  * @returns 0 on success, -1 on error with global `errno` set
+ * @throws `EAGAIN` receive timeout expired before any byte arrived
+ * @throws `ECONNRESET` peer closed the connection before any byte arrived
+ * @throws `EIO` failed after some bytes were read
  */
 static int read_all(int fd, void *buf, size_t count) {
-    unsigned int total = 0;
+    size_t total = 0;
 
     while (total < count) {
-        int n = read(fd, (char *)buf + total, count - total);
+        ssize_t n = read(fd, (char *)buf + total, count - total);
 
-        if (n < 0) {
-            if (errno == EINTR) {
-                continue;
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (total) {
+                errno = EIO;
+            } else if (n == 0) {
+                errno = ECONNRESET;
+            } else if (errno == EWOULDBLOCK) {
+                errno = EAGAIN;
             }
             return -1;
         }
@@ -300,21 +386,28 @@ static int read_all(int fd, void *buf, size_t count) {
 }
 
 /**
- * Reads a DMQP header from a file descriptor. Converts header fields to host
- * byte order.
- *
- * @param fd file descriptor to read from
- * @param buf DMQP header buffer to write to
- * @returns 0 on success, -1 if error with global `errno` set
- * @throws `EIO` unexpected error
+ * Maps the error of reading a header that has not started yet: a receive
+ * timeout is an idle connection, which may still be used.
  */
-static int read_dmqp_header(int fd, struct dmqp_header *buf) {
-    char header_wire_buf[DMQP_HEADER_SIZE];
-    if (read_all(fd, header_wire_buf, DMQP_HEADER_SIZE) < 0) {
-        errno = EIO;
-        return -1;
+static int idle_read_error(int _errno) {
+    if (_errno == EAGAIN) {
+        return ETIMEDOUT;
     }
+    if (_errno == ECONNRESET) {
+        return ECONNRESET;
+    }
+
+    return EIO;
+}
+
+size_t dmqp_header_size(const char *header_wire_buf) {
+    uint16_t method;
+    memcpy(&method, header_wire_buf + 8, 2);
+    return ntohs(method) & DMQP_CORRELATED ? DMQP_HEADER_MAX_SIZE
+                                           : DMQP_HEADER_SIZE;
+}
 
+void decode_dmqp_header(const char *header_wire_buf, struct dmqp_header *buf) {
     memcpy(&buf->sequence_id, header_wire_buf, 4);
     memcpy(&buf->length, header_wire_buf + 4, 4);
     memcpy(&buf->method, header_wire_buf + 8, 2);
@@ -324,130 +417,2733 @@ static int read_dmqp_header(int fd, struct dmqp_header *buf) {
     buf->length = ntohl(buf->length);
     buf->method = ntohs(buf->method);
     buf->status_code = ntohs(buf->status_code);
-    return 0;
+    buf->correlation_id = 0;
+
+    if (buf->method & DMQP_CORRELATED) {
+        memcpy(&buf->correlation_id, header_wire_buf + DMQP_HEADER_SIZE, 4);
+        buf->correlation_id = ntohl(buf->correlation_id);
+        buf->method &= ~DMQP_CORRELATED;
+    }
 }
 
-int read_dmqp_message(int fd, struct dmqp_message *buf) {
-    if (fd < 0 || !buf) {
-        errno = EINVAL;
+/**
+ * Reads a DMQP header from a file descriptor. Converts header fields to host
+ * byte order.
+ *
+ * @param fd file descriptor to read from
+ * @param buf DMQP header buffer to write to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ETIMEDOUT` receive timeout expired before the header started
+ * @throws `ECONNRESET` peer closed the connection
+ * @throws `EIO` unexpected error
+ */
+static int read_dmqp_header(int fd, struct dmqp_header *buf) {
+    char header_wire_buf[DMQP_HEADER_MAX_SIZE];
+    if (read_all(fd, header_wire_buf, DMQP_HEADER_SIZE) < 0) {
+        errno = idle_read_error(errno);
         return -1;
     }
 
-    if (read_dmqp_header(fd, &buf->header) < 0) {
+    size_t size = dmqp_header_size(header_wire_buf);
+    if (size > DMQP_HEADER_SIZE &&
+        read_all(fd, header_wire_buf + DMQP_HEADER_SIZE,
+                 size - DMQP_HEADER_SIZE) < 0) {
         errno = EIO;
         return -1;
     }
 
-    if (buf->header.length > MAX_PAYLOAD_LENGTH) {
-        errno = EMSGSIZE;
-        return -1;
-    }
+    decode_dmqp_header(header_wire_buf, buf);
+    return 0;
+}
+
+/**
+ * Reads a compact DMQP header from a socket. The header is peeked at first, so
+ * that no byte of the payload is consumed.
+ *
+ * @param fd socket to read from
+ * @param buf DMQP header buffer to write to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ETIMEDOUT` receive timeout expired before the header started
+ * @throws `ECONNRESET` peer closed the connection
+ * @throws `EBADMSG` malformed header
+ * @throws `EIO` unexpected error
+ */
+static int read_compact_dmqp_header(int fd, struct dmqp_header *buf) {
+    char header_wire_buf[DMQP_COMPACT_HEADER_MAX_SIZE];
+    size_t header_read = 0;
+
+    for (;;) {
+        ssize_t n = recv(fd, header_wire_buf + header_read,
+                         sizeof header_wire_buf - header_read, MSG_PEEK);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            int _errno = n == 0 ? ECONNRESET : errno;
+            if (_errno == EWOULDBLOCK) {
+                _errno = EAGAIN;
+            }
+            errno = header_read ? EIO : idle_read_error(_errno);
+            return -1;
+        }
+
+        int size = decode_compact_dmqp_header(header_wire_buf,
+                                              header_read + n, buf);
+        if (size < 0) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        // a header split across segments: what arrived is all header
+        size_t consume = size ? size - header_read : (size_t)n;
+        if (read_all(fd, header_wire_buf + header_read, consume) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        header_read += consume;
+
+        if (size) {
+            return 0;
+        }
+    }
+}
+
+int read_dmqp_message(int fd, struct dmqp_message *buf) {
+    if (fd < 0 || !buf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int ret = is_compact_client(fd) ? read_compact_dmqp_header(fd, &buf->header)
+                                    : read_dmqp_header(fd, &buf->header);
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (buf->header.length > MAX_PAYLOAD_LENGTH) {
+        errno = EMSGSIZE;
+        return -1;
+    }
 
     if (buf->header.length == 0) {
         buf->payload = NULL;
         return 0;
     }
 
-    buf->payload = malloc(buf->header.length);
+    buf->payload = buffer_pool_alloc(buf->header.length);
+    if (!buf->payload) {
+        errno = ENOMEM;
+        return -1;
+    }
+
     if (read_all(fd, buf->payload, buf->header.length) < 0) {
-        free(buf->payload);
+        buffer_pool_free(buf->payload);
         errno = EIO;
         return -1;
     }
 
+    if (dmqp_decompress(buf) < 0) {
+        int _errno = errno;
+        buffer_pool_free(buf->payload);
+        errno = _errno;
+        return -1;
+    }
+
     return 0;
 }
 
 /**
- * Sends all bytes from a buffer to a socket. Operation will return once all
- * `length` bytes are sent.
+ * Per-connection state of the epoll backend. A message may arrive across any
+ * number of edge-triggered wakeups, so it is read incrementally. Complete
+ * messages are handed to the worker pool, and each task holds a reference so
+ * that the socket outlives the event loop closing it.
+ */
+struct dmqp_connection {
+    int fd;
+    unsigned int refs; // event loop, in-flight tasks and deferred replies
+    int closed;        // no longer read by the event loop
+    int zerocopy;      // `SO_ZEROCOPY` enabled when accepted
+    pthread_mutex_t send_lock; // protects `flushing`, the send queue and the
+                               // zerocopy leases
+    int flushing; // a worker is writing, others queue their replies for it
+    struct connection_send *sendq_head;
+    struct connection_send *sendq_tail;
+    // payloads sent with `MSG_ZEROCOPY` that the kernel has not released yet,
+    // released by the event loop as it reads the completion notifications
+    struct zerocopy_lease *zerocopy_leases;
+    uint32_t zerocopy_next; // id of the next zerocopy `sendmsg`, writer only
+    struct dmqp_reader reader;
+    struct dmqp_session session;
+    // messages the worker pool had no room for, submitted in order before the
+    // connection is read again. only touched by the event loop thread
+    struct connection_task *stalled_head;
+    struct connection_task *stalled_tail;
+    struct dmqp_connection *stalled_next;
+    struct dmqp_connection *prev;
+    struct dmqp_connection *next;
+};
+
+// reply queued while another worker is writing to the connection
+struct connection_send {
+    struct connection_send *next;
+    size_t length;
+    char data[]; // header and payload in wire format
+};
+
+// payload lease referenced until the kernel releases it
+struct zerocopy_lease {
+    struct zerocopy_lease *next;
+    void *lease;
+    uint32_t first;        // id of the first zerocopy `sendmsg` sending it
+    unsigned int calls;    // zerocopy `sendmsg` calls, `UINT_MAX` while sending
+    unsigned int released; // calls whose completion notification arrived
+};
+
+struct connection_task {
+    struct dmqp_connection *conn;
+    struct dmqp_message message;
+    struct connection_task *next; // in the connection's stalled tasks
+};
+
+struct dmqp_reply {
+    // connection of either backend or a shared memory channel, all `NULL`
+    // once the server stopped
+    struct dmqp_connection *conn;
+    struct uring_connection *uring_conn;
+    struct shm_channel *shm_channel;
+    struct dmqp_reply *prev;
+    struct dmqp_reply *next;
+};
+
+// deferred replies not yet sent or cancelled, released when the server stops
+static pthread_mutex_t replies_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replies_idle = PTHREAD_COND_INITIALIZER;
+static struct dmqp_reply *replies;
+static unsigned int replies_in_use; // taken off the list, being sent
+
+struct worker_pool server_workers;
+
+// connection whose message is being handled on this thread
+static __thread struct dmqp_connection *current_connection;
+
+// leased payload of the message being handled on this thread, if any
+static __thread void *current_payload;
+
+/**
+ * Blocks until a non-blocking socket is writable again. Server sockets are
+ * non-blocking, but handlers reply synchronously.
+ *
+ * @param socket socket to wait on
+ * @returns 0 when writable, -1 on error with global `errno` set
+ * @throws `ETIMEDOUT` socket not writable within `SOCKET_TIMEOUT_SEC`
+ */
+static int wait_writable(int socket) {
+    struct pollfd pfd = {.fd = socket, .events = POLLOUT};
+
+    for (;;) {
+        int ready = poll(&pfd, 1, SOCKET_TIMEOUT_SEC * 1000);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            return -1;
+        }
+        if (!ready) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        return 0;
+    }
+}
+
+/**
+ * Gathers buffers into as few `sendmsg` calls as possible. Operation will
+ * return once all bytes are sent.
  *
  * @param socket socket to send to
- * @param buffer buffer to send
- * @param length number of bytes to read
+ * @param iov buffers to send, modified as bytes are sent
+ * @param iovcnt number of buffers, at most `SEND_MAX_IOV`
  * @param flags same flags param as that of `send` syscall
  * @returns 0 on success, -1 on error with global `errno` set
  */
-static int send_all(int socket, const void *buffer, size_t length, int flags) {
-    unsigned int total = 0;
+static int sendv_all(int socket, struct iovec *iov, int iovcnt, int flags) {
+    while (iovcnt > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        ssize_t n = sendmsg(socket, &msg, flags);
+        if (n <= 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                wait_writable(socket) >= 0) {
+                continue;
+            }
+            return -1;
+        }
+
+        // skip fully sent buffers and resume within a partially sent one
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the next zerocopy completion notification from a socket's error queue
+ * without blocking.
+ *
+ * @param socket socket the buffers were sent on
+ * @param first output param for the id of the first zerocopy `sendmsg` whose
+ * buffers the kernel released
+ * @param last output param for the id of the last one, inclusive
+ * @returns 1 if a notification was read, 0 if none is queued, -1 on error with
+ * global `errno` set
+ */
+static int zerocopy_recv(int socket, uint32_t *first, uint32_t *last) {
+    for (;;) {
+        char control[128];
+        struct msghdr msg = {.msg_control = control,
+                             .msg_controllen = sizeof control};
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP &&
+                   cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 &&
+                   cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            struct sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof err);
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            // notifications cover the inclusive range of send ids
+            // [ee_info, ee_data]
+            *first = err.ee_info;
+            *last = err.ee_data;
+            return 1;
+        }
+    }
+}
+
+/**
+ * Waits until the kernel releases the buffers of `pending` `MSG_ZEROCOPY`
+ * sends, reading the completion notifications from the socket's error queue.
+ *
+ * @param socket socket the buffers were sent on
+ * @param pending number of zerocopy `sendmsg` calls to wait for
+ * @returns 0 on success, -1 on error with global `errno` set
+ * @throws `ETIMEDOUT` buffers not released within `SOCKET_TIMEOUT_SEC`
+ */
+static int wait_zerocopy(int socket, unsigned int pending) {
+    while (pending) {
+        uint32_t first;
+        uint32_t last;
+        int ret = zerocopy_recv(socket, &first, &last);
+        if (ret < 0) {
+            return -1;
+        }
+        if (ret) {
+            unsigned int completed = last - first + 1;
+            pending = completed < pending ? pending - completed : 0;
+            continue;
+        }
+
+        // the error queue is reported as `POLLERR`
+        struct pollfd pfd = {.fd = socket, .events = 0};
+        int ready = poll(&pfd, 1, SOCKET_TIMEOUT_SEC * 1000);
+        if (ready < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (!ready) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (pfd.revents & (POLLHUP | POLLNVAL)) {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+
+    return 0;
+}
 
-    while (total < length) {
-        int n = send(socket, (char *)buffer + total, length - total, flags);
+/**
+ * Same as `sendv_all`, but the kernel sends from the buffers in place with
+ * `MSG_ZEROCOPY` instead of copying them, so they must stay untouched until
+ * the completion notifications of the `sendmsg` calls made arrive. The socket
+ * must have `SO_ZEROCOPY` enabled.
+ *
+ * @param socket socket to send to
+ * @param iov buffers to send, modified as bytes are sent
+ * @param iovcnt number of buffers, at most `SEND_MAX_IOV`
+ * @param flags same flags param as that of `send` syscall
+ * @param calls output param for the number of zerocopy `sendmsg` calls made,
+ * each of which gets a completion notification, even on error
+ * @returns 0 on success, -1 on error with global `errno` set
+ */
+static int sendv_zerocopy(int socket, struct iovec *iov, int iovcnt, int flags,
+                          unsigned int *calls) {
+    *calls = 0;
+    while (iovcnt > 0) {
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+        ssize_t n = sendmsg(socket, &msg, flags | MSG_ZEROCOPY);
         if (n <= 0) {
             if (errno == EINTR) {
                 continue;
             }
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+                wait_writable(socket) >= 0) {
+                continue;
+            }
+            if (errno == ENOBUFS) { // out of pinned memory, copy the rest
+                return sendv_all(socket, iov, iovcnt, flags);
+            }
             return -1;
         }
+        (*calls)++;
 
-        total += n;
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
     }
 
     return 0;
 }
 
 /**
- * Sends a DMQP header to a socket. Converts header fields to network byte
- * order (big endian).
+ * Enables `SO_ZEROCOPY` on a client socket the first time it sends a large
+ * payload, remembering the result for the next sends.
  *
- * @param socket socket to write to
- * @param buf DMQP header buffer to send
- * @param flags same flags param as `send` syscall
- * @returns 0 on success, -1 if error with global `errno` set
- * @throws `EIO` unexpected error
+ * @param socket socket to send to
+ * @returns whether the socket supports zerocopy sends
+ */
+static int zerocopy_client_init(int socket) {
+    unsigned char state = ZEROCOPY_UNKNOWN;
+    if (socket < DMQP_CLIENT_MAX_FD) {
+        state = __atomic_load_n(&zerocopy_clients[socket], __ATOMIC_RELAXED);
+    }
+    if (state != ZEROCOPY_UNKNOWN) {
+        return state == ZEROCOPY_ENABLED;
+    }
+
+    int zerocopy = 1;
+    state = setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &zerocopy,
+                       sizeof zerocopy) < 0
+                ? ZEROCOPY_UNSUPPORTED
+                : ZEROCOPY_ENABLED;
+    set_zerocopy_client(socket, state);
+    return state == ZEROCOPY_ENABLED;
+}
+
+/**
+ * Same as `sendv_all`, but the kernel sends from the buffers in place with
+ * `MSG_ZEROCOPY` instead of copying them. Returns once the kernel has released
+ * the buffers, so the caller may free them. Falls back to copying if the
+ * socket does not support zerocopy.
+ *
+ * @param socket socket to send to
+ * @param iov buffers to send, modified as bytes are sent
+ * @param iovcnt number of buffers, at most `SEND_MAX_IOV`
+ * @param flags same flags param as that of `send` syscall
+ * @returns 0 on success, -1 on error with global `errno` set
+ */
+static int sendv_all_zerocopy(int socket, struct iovec *iov, int iovcnt,
+                              int flags) {
+    if (!zerocopy_client_init(socket)) {
+        return sendv_all(socket, iov, iovcnt, flags);
+    }
+
+    unsigned int pending;
+    int ret = sendv_zerocopy(socket, iov, iovcnt, flags, &pending);
+
+    int _errno = errno;
+    if (wait_zerocopy(socket, pending) < 0) {
+        return -1;
+    }
+    errno = _errno;
+    return ret;
+}
+
+/**
+ * Fills the buffers of a DMQP message's frame, its encoded header followed by
+ * its payload.
+ *
+ * @param buffer DMQP message to send
+ * @param compact whether to encode a compact header
+ * @param header_wire_buf buffer of `DMQP_COMPACT_HEADER_MAX_SIZE` bytes for the
+ * header
+ * @param iov output array of 2 buffers
+ * @returns number of buffers filled
+ */
+static int frame_iov(const struct dmqp_message *buffer, int compact,
+                     char *header_wire_buf, struct iovec *iov) {
+    iov[0].iov_base = header_wire_buf;
+    iov[0].iov_len =
+        encode_dmqp_frame_header(&buffer->header, compact, header_wire_buf);
+    iov[1].iov_base = buffer->payload;
+    iov[1].iov_len = buffer->header.length;
+    return buffer->header.length ? 2 : 1;
+}
+
+/**
+ * Sends a DMQP message's header and payload with a single `sendmsg`.
+ *
+ * @param socket socket to send to
+ * @param buffer DMQP message to send
+ * @param flags same flags param as that of `send` syscall
+ * @param compact whether to send a compact header
+ * @returns 0 on success, -1 on error with global `errno` set
  */
-static int send_dmqp_header(int socket, const struct dmqp_header *buffer,
-                            int flags) {
+static int send_frame(int socket, const struct dmqp_message *buffer, int flags,
+                      int compact) {
+    char header_wire_buf[DMQP_COMPACT_HEADER_MAX_SIZE];
+    struct iovec iov[2];
+    int iovcnt = frame_iov(buffer, compact, header_wire_buf, iov);
+    return sendv_all(socket, iov, iovcnt, flags);
+}
+
+size_t encode_dmqp_header(const struct dmqp_header *buffer,
+                          char *header_wire_buf) {
+    uint16_t method = buffer->method & ~DMQP_CORRELATED;
+    if (buffer->correlation_id) {
+        method |= DMQP_CORRELATED;
+    }
+
     uint32_t network_byte_ordered_sequence_id = htonl(buffer->sequence_id);
     uint32_t network_byte_ordered_length = htonl(buffer->length);
-    uint16_t network_byte_ordered_method = htons(buffer->method);
+    uint16_t network_byte_ordered_method = htons(method);
     int16_t network_byte_ordered_status_code = htons(buffer->status_code);
 
-    char header_wire_buf[DMQP_HEADER_SIZE];
     memcpy(header_wire_buf, &network_byte_ordered_sequence_id, 4);
     memcpy(header_wire_buf + 4, &network_byte_ordered_length, 4);
     memcpy(header_wire_buf + 8, &network_byte_ordered_method, 2);
     memcpy(header_wire_buf + 10, &network_byte_ordered_status_code, 2);
+    if (!buffer->correlation_id) {
+        return DMQP_HEADER_SIZE;
+    }
 
-    if (send_all(socket, header_wire_buf, DMQP_HEADER_SIZE, flags) < 0) {
-        errno = EIO;
-        return -1;
+    uint32_t network_byte_ordered_correlation_id =
+        htonl(buffer->correlation_id);
+    memcpy(header_wire_buf + DMQP_HEADER_SIZE,
+           &network_byte_ordered_correlation_id, 4);
+    return DMQP_HEADER_MAX_SIZE;
+}
+
+/**
+ * Writes a varint, 7 bits per byte with the least significant first.
+ *
+ * @returns number of bytes written
+ */
+static size_t put_varint(uint32_t value, char *buf) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (char)(value | 0x80);
+        value >>= 7;
     }
+    buf[n++] = (char)value;
+    return n;
+}
 
-    return 0;
+/**
+ * Reads a varint written by `put_varint`.
+ *
+ * @returns number of bytes read, 0 if `length` bytes do not hold all of it, -1
+ * if longer than 32 bits
+ */
+static int get_varint(const char *buf, size_t length, uint32_t *value) {
+    *value = 0;
+    for (size_t i = 0; i < COMPACT_VARINT_MAX_SIZE; i++) {
+        if (i == length) {
+            return 0;
+        }
+
+        unsigned char byte = buf[i];
+        if (i == COMPACT_VARINT_MAX_SIZE - 1 && byte > 0x0f) {
+            return -1;
+        }
+
+        *value |= (uint32_t)(byte & 0x7f) << (7 * i);
+        if (!(byte & 0x80)) {
+            return i + 1;
+        }
+    }
+
+    return -1;
 }
 
-int send_dmqp_message(int fd, const struct dmqp_message *buffer, int flags) {
-    if (fd < 0 || !buffer ||
-        (buffer->header.length > 0 && buffer->payload == NULL)) {
-        errno = EINVAL;
-        return -1;
+size_t encode_compact_dmqp_header(const struct dmqp_header *buffer,
+                                  char *header_wire_buf) {
+    unsigned char flags = 0;
+    if (buffer->sequence_id) {
+        flags |= COMPACT_SEQUENCE_ID;
+    }
+    if (buffer->status_code) {
+        flags |= COMPACT_STATUS_CODE;
+    }
+    if (buffer->correlation_id) {
+        flags |= COMPACT_CORRELATION_ID;
     }
 
-    if (buffer->header.length > MAX_PAYLOAD_LENGTH) {
-        errno = EMSGSIZE;
-        return -1;
+    size_t n = 0;
+    header_wire_buf[n++] = flags;
+    n += put_varint(buffer->length, header_wire_buf + n);
+    n += put_varint(buffer->method, header_wire_buf + n);
+    if (flags & COMPACT_SEQUENCE_ID) {
+        n += put_varint(buffer->sequence_id, header_wire_buf + n);
+    }
+    if (flags & COMPACT_STATUS_CODE) {
+        // zigzag, so that small negative codes stay short
+        int32_t status_code = buffer->status_code;
+        n += put_varint(((uint32_t)status_code << 1) ^ (status_code >> 31),
+                        header_wire_buf + n);
+    }
+    if (flags & COMPACT_CORRELATION_ID) {
+        n += put_varint(buffer->correlation_id, header_wire_buf + n);
     }
 
-    if (send_dmqp_header(fd, &buffer->header, flags) < 0) {
-        errno = EIO;
-        return -1;
+    return n;
+}
+
+size_t encode_dmqp_frame_header(const struct dmqp_header *buffer, int compact,
+                                char *header_wire_buf) {
+    if (compact) {
+        return encode_compact_dmqp_header(buffer, header_wire_buf);
     }
 
-    if (buffer->header.length == 0) {
+    return encode_dmqp_header(buffer, header_wire_buf);
+}
+
+int decode_compact_dmqp_header(const char *header_wire_buf, size_t length,
+                               struct dmqp_header *buf) {
+    if (length == 0) {
         return 0;
     }
 
-    if (send_all(fd, buffer->payload, buffer->header.length, flags) < 0) {
-        errno = EIO;
+    unsigned char flags = header_wire_buf[0];
+    if (flags & ~(COMPACT_SEQUENCE_ID | COMPACT_STATUS_CODE |
+                  COMPACT_CORRELATION_ID)) {
         return -1;
     }
 
-    return 0;
+    uint32_t fields[5] = {0};
+    int present[5] = {1, 1, flags & COMPACT_SEQUENCE_ID,
+                      flags & COMPACT_STATUS_CODE,
+                      flags & COMPACT_CORRELATION_ID};
+    size_t n = 1;
+    for (int i = 0; i < 5; i++) {
+        if (!present[i]) {
+            continue;
+        }
+
+        int ret = get_varint(header_wire_buf + n, length - n, &fields[i]);
+        if (ret <= 0) {
+            return ret;
+        }
+        n += ret;
+    }
+
+    uint32_t status_code = (fields[3] >> 1) ^ -(fields[3] & 1);
+    if (fields[1] > UINT16_MAX || (int32_t)status_code < INT16_MIN ||
+        (int32_t)status_code > INT16_MAX) {
+        return -1;
+    }
+
+    buf->length = fields[0];
+    buf->method = fields[1];
+    buf->sequence_id = fields[2];
+    buf->status_code = (int32_t)status_code;
+    buf->correlation_id = fields[4];
+    return n;
 }
 
-__attribute__((weak)) void handle_dmqp_push(const struct dmqp_message *message,
-                                            int client) {
+/**
+ * Sends the replies other workers queued while the calling worker was writing
+ * to a connection, gathering up to `SEND_MAX_IOV` of them per `sendmsg`. Gives
+ * up the writer role once the queue is empty.
+ *
+ * @param conn connection the calling worker is writing to
+ * @param flags same flags param as that of `send` syscall
+ * @returns 0 on success, -1 if error with global `errno` set
+ */
+static int connection_flush(struct dmqp_connection *conn, int flags) {
+    int ret = 0;
+
+    pthread_mutex_lock(&conn->send_lock);
+    while (conn->sendq_head) {
+        struct connection_send *sends = conn->sendq_head;
+        conn->sendq_head = NULL;
+        conn->sendq_tail = NULL;
+        pthread_mutex_unlock(&conn->send_lock);
+
+        while (sends) {
+            struct iovec iov[SEND_MAX_IOV];
+            int iovcnt = 0;
+            struct connection_send *send = sends;
+            for (; send && iovcnt < SEND_MAX_IOV; send = send->next) {
+                iov[iovcnt].iov_base = send->data;
+                iov[iovcnt].iov_len = send->length;
+                iovcnt++;
+            }
+
+            if (!ret && sendv_all(conn->fd, iov, iovcnt, flags) < 0) {
+                ret = -1;
+            }
+
+            while (sends != send) {
+                struct connection_send *next = sends->next;
+                buffer_pool_free(sends);
+                sends = next;
+            }
+        }
+
+        pthread_mutex_lock(&conn->send_lock);
+    }
+    conn->flushing = 0;
+    pthread_mutex_unlock(&conn->send_lock);
+
+    return ret;
+}
+
+/**
+ * Releases the zerocopy leases of a connection whose sends all completed. The
+ * caller holds `send_lock`.
+ *
+ * @param conn connection whose leases to release
+ */
+static void zerocopy_sweep(struct dmqp_connection *conn) {
+    struct zerocopy_lease **link = &conn->zerocopy_leases;
+    while (*link) {
+        struct zerocopy_lease *lease = *link;
+        if (lease->released < lease->calls) {
+            link = &lease->next;
+            continue;
+        }
+
+        *link = lease->next;
+        buffer_pool_free(lease->lease);
+        buffer_pool_free(lease);
+    }
+}
+
+/**
+ * Reads the zerocopy completion notifications queued on a connection and
+ * releases the leases the kernel no longer sends from. Called by the event
+ * loop when the socket reports `EPOLLERR`.
+ *
+ * @param conn connection to reap
+ */
+static void connection_reap_zerocopy(struct dmqp_connection *conn) {
+    uint32_t first;
+    uint32_t last;
+    while (zerocopy_recv(conn->fd, &first, &last) > 0) {
+        pthread_mutex_lock(&conn->send_lock);
+        for (struct zerocopy_lease *lease = conn->zerocopy_leases; lease;
+             lease = lease->next) {
+            // ids relative to the lease's first send. few sends are in flight
+            // at once, so the distances fit in 32 bits across wrap-around
+            int64_t lo = (int32_t)(first - lease->first);
+            int64_t hi = (int32_t)(last - lease->first);
+            int64_t end = (int64_t)lease->calls - 1;
+            lo = lo < 0 ? 0 : lo;
+            hi = hi > end ? end : hi;
+            if (lo <= hi) {
+                lease->released += hi - lo + 1;
+            }
+        }
+        zerocopy_sweep(conn);
+        pthread_mutex_unlock(&conn->send_lock);
+    }
+}
+
+/**
+ * Sends a DMQP message whose payload is a buffer pool lease with
+ * `MSG_ZEROCOPY`. Returns without waiting for the kernel to release the
+ * payload: the connection keeps a reference to the lease until the event loop
+ * reads the completion notifications of its sends. The calling worker must be
+ * the connection's writer.
+ *
+ * @param conn connection to send to, with `SO_ZEROCOPY` enabled
+ * @param buffer DMQP message to send, whose payload is leased
+ * @param flags same flags param as that of `send` syscall
+ * @param compact whether to send a compact header
+ * @returns 0 on success, -1 on error with global `errno` set
+ */
+static int connection_send_zerocopy(struct dmqp_connection *conn,
+                                    const struct dmqp_message *buffer,
+                                    int flags, int compact) {
+    struct zerocopy_lease *lease = buffer_pool_alloc(sizeof *lease);
+    if (!lease) {
+        return send_frame(conn->fd, buffer, flags, compact);
+    }
+    lease->lease = buffer_pool_ref(buffer->payload);
+    lease->first = conn->zerocopy_next;
+    lease->calls = UINT_MAX;
+    lease->released = 0;
+
+    // listed before sending, so that the event loop counts notifications that
+    // arrive before the send returns
+    pthread_mutex_lock(&conn->send_lock);
+    lease->next = conn->zerocopy_leases;
+    conn->zerocopy_leases = lease;
+    pthread_mutex_unlock(&conn->send_lock);
+
+    char header_wire_buf[DMQP_COMPACT_HEADER_MAX_SIZE];
+    struct iovec iov[2];
+    int iovcnt = frame_iov(buffer, compact, header_wire_buf, iov);
+    unsigned int calls;
+    int ret = sendv_zerocopy(conn->fd, iov, iovcnt, flags, &calls);
+    int _errno = errno;
+
+    conn->zerocopy_next += calls;
+    pthread_mutex_lock(&conn->send_lock);
+    lease->calls = calls;
+    zerocopy_sweep(conn);
+    pthread_mutex_unlock(&conn->send_lock);
+
+    errno = _errno;
+    return ret;
+}
+
+/**
+ * Writes a reply to a server connection as is. Replies from different workers
+ * never interleave: while one worker writes, the others queue a copy of their
+ * reply and return, and the writing worker sends the queued replies together.
+ *
+ * @param conn connection to send to
+ * @param buffer DMQP message to send
+ * @param flags same flags param as that of `send` syscall, or'ed with
+ * `DMQP_SEND_LEASED` if the payload is leased from the buffer pool
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ * @throws `EIO` unexpected error
+ */
+static int connection_write(struct dmqp_connection *conn,
+                            const struct dmqp_message *buffer, int flags) {
+    int compact = __atomic_load_n(&conn->session.compact, __ATOMIC_ACQUIRE);
+    int zerocopy = (flags & DMQP_SEND_LEASED) && conn->zerocopy &&
+                   send_zerocopy_threshold &&
+                   buffer->header.length >= send_zerocopy_threshold;
+    flags &= ~DMQP_SEND_LEASED;
+
+    pthread_mutex_lock(&conn->send_lock);
+    if (conn->flushing) {
+        struct connection_send *send =
+            buffer_pool_alloc(sizeof(struct connection_send) +
+                              DMQP_COMPACT_HEADER_MAX_SIZE +
+                              buffer->header.length);
+        if (!send) {
+            pthread_mutex_unlock(&conn->send_lock);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        size_t header_size =
+            encode_dmqp_frame_header(&buffer->header, compact, send->data);
+        send->next = NULL;
+        send->length = header_size + buffer->header.length;
+        if (buffer->header.length) {
+            memcpy(send->data + header_size, buffer->payload,
+                   buffer->header.length);
+        }
+
+        if (conn->sendq_tail) {
+            conn->sendq_tail->next = send;
+        } else {
+            conn->sendq_head = send;
+        }
+        conn->sendq_tail = send;
+        pthread_mutex_unlock(&conn->send_lock);
+        return 0;
+    }
+    conn->flushing = 1;
+    pthread_mutex_unlock(&conn->send_lock);
+
+    // uncontended replies are sent straight from the caller's buffers
+    int ret = zerocopy ? connection_send_zerocopy(conn, buffer, flags, compact)
+                       : send_frame(conn->fd, buffer, flags, compact);
+    if (connection_flush(conn, flags) < 0) {
+        ret = -1;
+    }
+
+    if (ret < 0) {
+        errno = EIO;
+    }
+    return ret;
+}
+
+/**
+ * Sends a reply to a server connection, compressed if the client asked for it
+ * with `DMQP_COMPRESS` and with the header format agreed by `DMQP_HELLO`. See
+ * `connection_write`.
+ *
+ * @param conn connection to send to
+ * @param buffer DMQP message to send
+ * @param flags same flags param as that of `send` syscall, or'ed with
+ * `DMQP_SEND_LEASED` if the payload is leased from the buffer pool
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ * @throws `EIO` unexpected error
+ */
+static int connection_send(struct dmqp_connection *conn,
+                           const struct dmqp_message *buffer, int flags) {
+    struct dmqp_message compressed;
+    int ret = dmqp_compress(&conn->session.compression, buffer, &compressed);
+    if (ret < 0) {
+        return -1;
+    }
+
+    if (compressed.payload != buffer->payload) {
+        flags |= DMQP_SEND_LEASED;
+    }
+    ret = connection_write(conn, &compressed, flags);
+    if (compressed.payload != buffer->payload) {
+        int _errno = errno;
+        buffer_pool_free(compressed.payload);
+        errno = _errno;
+    }
+    return ret;
+}
+
+// destination of the chunks of a message sent with `send_dmqp_message`
+struct fd_send {
+    int fd;
+    int flags;
+};
+
+/**
+ * Sends one chunk of a message with `send_dmqp_message`.
+ *
+ * @param chunk chunk's frame
+ * @param arg the `struct fd_send` to send to
+ * @returns 0 on success, -1 if error with global `errno` set
+ */
+static int fd_send_chunk(const struct dmqp_message *chunk, void *arg) {
+    struct fd_send *dst = (struct fd_send *)arg;
+    return send_dmqp_message(dst->fd, chunk, dst->flags);
+}
+
+int send_dmqp_message(int fd, const struct dmqp_message *buffer, int flags) {
+    if (fd < 0 || !buffer ||
+        (buffer->header.length > 0 && buffer->payload == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (buffer->header.length > MAX_PAYLOAD_LENGTH) {
+        // chunks point into the payload, so they are no leases themselves
+        struct fd_send dst = {.fd = fd, .flags = flags & ~DMQP_SEND_LEASED};
+        return send_chunked_dmqp_message(buffer, fd_send_chunk, &dst);
+    }
+
+    int queued = shm_send_dmqp_message(fd, buffer);
+    if (!queued) {
+        queued = io_uring_send_dmqp_message(fd, buffer);
+    }
+    if (queued) {
+        return queued < 0 ? -1 : 0;
+    }
+
+    struct dmqp_connection *conn = current_connection;
+    if (conn && conn->fd == fd) {
+        return connection_send(conn, buffer, flags);
+    }
+
+    flags &= ~DMQP_SEND_LEASED;
+    char header_wire_buf[DMQP_COMPACT_HEADER_MAX_SIZE];
+    struct iovec iov[2];
+    int iovcnt =
+        frame_iov(buffer, is_compact_client(fd), header_wire_buf, iov);
+    int ret = send_zerocopy_threshold &&
+                      buffer->header.length >= send_zerocopy_threshold
+                  ? sendv_all_zerocopy(fd, iov, iovcnt, flags)
+                  : sendv_all(fd, iov, iovcnt, flags);
+    if (ret < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Packs messages into a batch payload. Each message is prefixed with its
+ * sequence ID if `with_ids` is set, then with its length.
+ *
+ * @param entries messages to pack
+ * @param n number of messages
+ * @param with_ids whether to prefix each message with its sequence ID
+ * @param reserved bytes left at the start of the payload for the caller
+ * @param buf DMQP message buffer to write to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `EMSGSIZE` packed messages too large
+ * @throws `ENOMEM` out of memory
+ */
+static int batch_pack(const struct dmqp_batch_entry *entries, unsigned int n,
+                      int with_ids, size_t reserved,
+                      struct dmqp_message *buf) {
+    if (!entries || !n || !buf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t prefix_size =
+        with_ids ? DMQP_FETCH_ENTRY_HEADER_SIZE : DMQP_BATCH_LENGTH_SIZE;
+    size_t length = reserved;
+    for (unsigned int i = 0; i < n; i++) {
+        if (!entries[i].data && entries[i].length) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        length += prefix_size + (size_t)entries[i].length;
+        if (length > MAX_PAYLOAD_LENGTH) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+
+    char *payload = buffer_pool_alloc(length);
+    if (!payload) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    char *curr = payload + reserved;
+    for (unsigned int i = 0; i < n; i++) {
+        if (with_ids) {
+            uint32_t sequence_id = htonl(entries[i].sequence_id);
+            memcpy(curr, &sequence_id, 4);
+            curr += 4;
+        }
+
+        uint32_t entry_length = htonl(entries[i].length);
+        memcpy(curr, &entry_length, DMQP_BATCH_LENGTH_SIZE);
+        curr += DMQP_BATCH_LENGTH_SIZE;
+
+        if (entries[i].length) {
+            memcpy(curr, entries[i].data, entries[i].length);
+            curr += entries[i].length;
+        }
+    }
+
+    buf->header.length = length;
+    buf->payload = payload;
+    return 0;
+}
+
+/**
+ * Unpacks the messages of a batch payload packed by `batch_pack`.
+ *
+ * @param message batch message to unpack
+ * @param with_ids whether each message is prefixed with its sequence ID
+ * @param entries output array of at least `n` entries
+ * @param n capacity of `entries`
+ * @returns number of messages in the batch, -1 if error with global `errno`
+ * set
+ * @throws `EINVAL` invalid args
+ * @throws `EBADMSG` malformed batch
+ */
+static int batch_unpack(const struct dmqp_message *message, int with_ids,
+                        struct dmqp_batch_entry *entries, unsigned int n) {
+    if (!message || (!entries && n) ||
+        (!message->payload && message->header.length)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t prefix_size =
+        with_ids ? DMQP_FETCH_ENTRY_HEADER_SIZE : DMQP_BATCH_LENGTH_SIZE;
+    char *payload = message->payload;
+    size_t length = message->header.length;
+    size_t offset = 0;
+    int count = 0;
+    while (offset < length) {
+        if (length - offset < prefix_size) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        uint32_t sequence_id = 0;
+        if (with_ids) {
+            memcpy(&sequence_id, payload + offset, 4);
+            sequence_id = ntohl(sequence_id);
+            offset += 4;
+        }
+
+        uint32_t entry_length;
+        memcpy(&entry_length, payload + offset, DMQP_BATCH_LENGTH_SIZE);
+        entry_length = ntohl(entry_length);
+        offset += DMQP_BATCH_LENGTH_SIZE;
+
+        if (length - offset < entry_length) {
+            errno = EBADMSG;
+            return -1;
+        }
+
+        if ((unsigned int)count < n) {
+            entries[count].data = payload + offset;
+            entries[count].length = entry_length;
+            entries[count].sequence_id = sequence_id;
+        }
+        offset += entry_length;
+        count++;
+    }
+
+    return count;
+}
+
+int dmqp_batch_pack(const struct dmqp_batch_entry *entries, unsigned int n,
+                    struct dmqp_message *buf) {
+    return batch_pack(entries, n, 0, 0, buf);
+}
+
+int dmqp_batch_unpack(const struct dmqp_message *message,
+                      struct dmqp_batch_entry *entries, unsigned int n) {
+    return batch_unpack(message, 0, entries, n);
+}
+
+int dmqp_fetch_pack(const struct dmqp_batch_entry *entries, unsigned int n,
+                    struct dmqp_message *buf) {
+    return batch_pack(entries, n, 1, 0, buf);
+}
+
+int dmqp_fetch_unpack(const struct dmqp_message *message,
+                      struct dmqp_batch_entry *entries, unsigned int n) {
+    return batch_unpack(message, 1, entries, n);
+}
+
+int dmqp_read_pack(const struct dmqp_batch_entry *entries, unsigned int n,
+                   uint64_t offset, struct dmqp_message *buf) {
+    if (batch_pack(entries, n, 1, DMQP_READ_OFFSET_SIZE, buf) < 0) {
+        return -1;
+    }
+
+    uint64_t first = htobe64(offset);
+    memcpy(buf->payload, &first, DMQP_READ_OFFSET_SIZE);
+    return 0;
+}
+
+int dmqp_read_unpack(const struct dmqp_message *message, uint64_t *offset,
+                     struct dmqp_batch_entry *entries, unsigned int n) {
+    if (!message || !offset || !message->payload) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (message->header.length < DMQP_READ_OFFSET_SIZE) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    uint64_t first;
+    memcpy(&first, message->payload, DMQP_READ_OFFSET_SIZE);
+
+    // the messages follow the offset, packed like a fetch response
+    struct dmqp_message packed = *message;
+    packed.header.length -= DMQP_READ_OFFSET_SIZE;
+    packed.payload = (char *)message->payload + DMQP_READ_OFFSET_SIZE;
+    int count = batch_unpack(&packed, 1, entries, n);
+    if (count >= 0) {
+        *offset = be64toh(first);
+    }
+    return count;
+}
+
+void dmqp_credits_pack(const struct dmqp_credits *credits, void *buf) {
+    uint32_t messages = htonl(credits->messages);
+    uint32_t bytes = htonl(credits->bytes);
+    memcpy(buf, &messages, 4);
+    memcpy((char *)buf + 4, &bytes, 4);
+}
+
+int dmqp_credits_unpack(const struct dmqp_message *message,
+                        struct dmqp_credits *credits) {
+    if (!message || !credits ||
+        (!message->payload && message->header.length)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (message->header.length < DMQP_CREDITS_SIZE) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    // credits come last, after the statuses of a batch response
+    char *curr =
+        (char *)message->payload + message->header.length - DMQP_CREDITS_SIZE;
+    memcpy(&credits->messages, curr, 4);
+    memcpy(&credits->bytes, curr + 4, 4);
+    credits->messages = ntohl(credits->messages);
+    credits->bytes = ntohl(credits->bytes);
+    return 0;
+}
+
+int dmqp_credits_take(struct dmqp_credits *credits, uint32_t length) {
+    if (!credits) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!credits->messages || credits->bytes < length) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    credits->messages--;
+    credits->bytes -= length;
+    return 0;
+}
+
+/**
+ * Gets the session of the connection whose message the calling thread is
+ * handling, if `client` is that connection.
+ *
+ * @param client socket the message was received on
+ * @returns the session, `NULL` if `client` is a shared memory channel
+ */
+static struct dmqp_session *current_session(int client) {
+    struct dmqp_connection *conn = current_connection;
+    if (conn && conn->fd == client) {
+        return &conn->session;
+    }
+
+    return io_uring_connection_session(client);
+}
+
+/**
+ * Handles a message with method `DMQP_COMPRESS`: turns on compression of the
+ * replies to the connection it was received on. Replies `EOPNOTSUPP` on shared
+ * memory channels, whose payloads never leave the host.
+ *
+ * @param message message received by server
+ * @param client socket the message was received on
+ */
+static void compression_handshake(const struct dmqp_message *message,
+                                  int client) {
+    struct dmqp_header header = {0};
+    header.method = DMQP_RESPONSE;
+    header.correlation_id = message->header.correlation_id;
+    struct dmqp_message response = {.header = header};
+
+    struct dmqp_session *session = current_session(client);
+    struct dmqp_compression *compression =
+        session ? &session->compression : NULL;
+
+    uint32_t wire[2] = {0};
+    if (message->header.length == DMQP_COMPRESS_SIZE) {
+        memcpy(wire, message->payload, DMQP_COMPRESS_SIZE);
+    }
+    uint32_t threshold = ntohl(wire[0]);
+
+    if (!compression) {
+        response.header.status_code = EOPNOTSUPP;
+    } else if (!threshold) {
+        response.header.status_code = EINVAL;
+    } else {
+        __atomic_store_n(&compression->flags, ntohl(wire[1]),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&compression->skip, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&compression->threshold, threshold,
+                         __ATOMIC_RELEASE);
+    }
+
+    send_dmqp_message(client, &response, 0);
+}
+
+/**
+ * Agrees on the protocol version and features of a `DMQP_HELLO` request: the
+ * highest version both sides speak and the features both support.
+ *
+ * @param message message received by server
+ * @param buf output param for the agreed version and features
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` malformed request
+ */
+static int hello_negotiate(const struct dmqp_message *message,
+                           struct dmqp_hello *buf) {
+    uint32_t wire[2];
+    if (message->header.length != DMQP_HELLO_SIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(wire, message->payload, DMQP_HELLO_SIZE);
+
+    uint32_t version = ntohl(wire[0]);
+    if (!version) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    buf->version = version < DMQP_VERSION ? version : DMQP_VERSION;
+    buf->features = ntohl(wire[1]) & DMQP_FEATURES;
+    if (buf->version < 2) {
+        buf->features &= ~DMQP_FEATURE_COMPACT_HEADER;
+    }
+    return 0;
+}
+
+/**
+ * Handles a message with method `DMQP_HELLO`: replies with the agreed version
+ * and features, always with a fixed header. The connection's reader already
+ * switched to compact headers if they were agreed on, see `dmqp_reader_take`.
+ * Shared memory channels never use compact headers.
+ *
+ * @param message message received by server
+ * @param client socket the message was received on
+ */
+static void hello_handshake(const struct dmqp_message *message, int client) {
+    struct dmqp_header header = {0};
+    header.method = DMQP_RESPONSE;
+    header.correlation_id = message->header.correlation_id;
+    struct dmqp_message response = {.header = header};
+
+    struct dmqp_session *session = current_session(client);
+    struct dmqp_hello hello;
+    uint32_t wire[2];
+    if (hello_negotiate(message, &hello) < 0) {
+        response.header.status_code = errno;
+    } else {
+        if (!session) {
+            hello.features &= ~DMQP_FEATURE_COMPACT_HEADER;
+        }
+
+        wire[0] = htonl(hello.version);
+        wire[1] = htonl(hello.features);
+        response.header.length = DMQP_HELLO_SIZE;
+        response.payload = wire;
+    }
+
+    if (!session) {
+        send_dmqp_message(client, &response, 0);
+        return;
+    }
+
+    // replies to the requests that follow must already be compact, while the
+    // client waits for this one before sending anything else, so it is the
+    // only reply in flight and skips the connection's send queue
+    if (!response.header.status_code) {
+        session->version = hello.version;
+        session->features = hello.features;
+        __atomic_store_n(&session->compact,
+                         (hello.features & DMQP_FEATURE_COMPACT_HEADER) != 0,
+                         __ATOMIC_RELEASE);
+    }
+    send_frame(client, &response, 0, 0);
+}
+
+void dispatch_received_dmqp_message(struct dmqp_message *message,
+                                    int client) {
+    if (dmqp_decompress(message) < 0) {
+        struct dmqp_header header = {0};
+        header.method = DMQP_RESPONSE;
+        header.status_code = errno;
+        header.correlation_id = message->header.correlation_id;
+        struct dmqp_message response = {.header = header};
+
+        send_dmqp_message(client, &response, 0);
+        return;
+    }
+
+    current_payload = message->payload;
+    dispatch_dmqp_message(message, client);
+    current_payload = NULL;
+}
+
+void *dmqp_payload_hold(const struct dmqp_message *message) {
+    if (!message || !message->payload ||
+        message->payload != current_payload) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return buffer_pool_ref(current_payload);
+}
+
+void dispatch_dmqp_message(const struct dmqp_message *message, int client) {
+    switch (message->header.method) {
+    case DMQP_PUSH:
+        handle_dmqp_push(message, client);
+        break;
+    case DMQP_POP:
+        handle_dmqp_pop(message, client);
+        break;
+    case DMQP_PEEK_SEQUENCE_ID:
+        handle_dmqp_peek_sequence_id(message, client);
+        break;
+    case DMQP_RESPONSE:
+        handle_dmqp_response(message, client);
+        break;
+    case DMQP_PUSH_BATCH:
+        handle_dmqp_push_batch(message, client);
+        break;
+    case DMQP_FETCH:
+        handle_dmqp_fetch(message, client);
+        break;
+    case DMQP_SUBSCRIBE:
+        handle_dmqp_subscribe(message, client);
+        break;
+    case DMQP_CREDIT:
+        handle_dmqp_credit(message, client);
+        break;
+    case DMQP_SHM_ATTACH:
+        shm_channel_attach(message, client);
+        break;
+    case DMQP_COMPRESS:
+        compression_handshake(message, client);
+        break;
+    case DMQP_HELLO:
+        hello_handshake(message, client);
+        break;
+    case DMQP_HEARTBEAT:;
+        struct dmqp_header heartbeat_header = {0};
+        heartbeat_header.method = DMQP_RESPONSE;
+        heartbeat_header.correlation_id = message->header.correlation_id;
+        struct dmqp_message heartbeat = {.header = heartbeat_header};
+
+        send_dmqp_message(client, &heartbeat, 0);
+        break;
+    case DMQP_READ:
+        handle_dmqp_read(message, client);
+        break;
+    default:;
+        struct dmqp_header header = {0};
+        header.method = DMQP_RESPONSE;
+        header.status_code = ENOSYS;
+        header.correlation_id = message->header.correlation_id;
+        struct dmqp_message response = {.header = header};
+
+        send_dmqp_message(client, &response, 0);
+        break;
+    }
+}
+
+/**
+ * Takes the complete message out of a reader and readies it for the next one.
+ * After a `DMQP_HELLO`, switches to the header format it agrees on right away,
+ * since the client sends its next message only once it got the reply.
+ *
+ * @param reader reader holding a complete message
+ * @returns the message, whose payload is now owned by the caller
+ */
+static struct dmqp_message dmqp_reader_take(struct dmqp_reader *reader) {
+    struct dmqp_message message = reader->message;
+    reader->message.payload = NULL;
+    reader->header_read = 0;
+    reader->header_size = 0;
+    reader->payload_read = 0;
+
+    struct dmqp_hello hello;
+    if (message.header.method == DMQP_HELLO &&
+        hello_negotiate(&message, &hello) == 0) {
+        reader->compact = (hello.features & DMQP_FEATURE_COMPACT_HEADER) != 0;
+    }
+    return message;
+}
+
+/**
+ * Takes the complete frame out of a reader and passes it to `on_message` if it
+ * completes a message, reassembling chunked messages first.
+ *
+ * @param reader reader holding a complete frame
+ * @param on_message called with the complete message, takes ownership of its
+ * payload. returns -1 if the connection must be closed
+ * @param ctx passed to `on_message`
+ * @returns 0 on success, -1 if the connection must be closed with global
+ * `errno` set
+ */
+static int dmqp_reader_deliver(struct dmqp_reader *reader,
+                               int (*on_message)(struct dmqp_message *message,
+                                                 void *ctx),
+                               void *ctx) {
+    struct dmqp_message message = dmqp_reader_take(reader);
+    int complete = dmqp_chunks_add(&reader->chunks, &message);
+    if (complete <= 0) {
+        return complete;
+    }
+
+    return on_message(&message, ctx);
+}
+
+int dmqp_reader_feed(struct dmqp_reader *reader, const char *data,
+                     size_t length,
+                     int (*on_message)(struct dmqp_message *message, void *ctx),
+                     void *ctx) {
+    while (length > 0) {
+        size_t n;
+        if (!reader->header_size) {
+            // a fixed header's size is known once its method is read
+            size_t header_max = DMQP_COMPACT_HEADER_MAX_SIZE;
+            if (!reader->compact) {
+                header_max = reader->header_read < DMQP_HEADER_SIZE
+                                 ? DMQP_HEADER_SIZE
+                                 : dmqp_header_size(reader->header_wire_buf);
+            }
+            n = header_max - reader->header_read;
+            n = n < length ? n : length;
+            memcpy(reader->header_wire_buf + reader->header_read, data, n);
+
+            int size = 0;
+            if (reader->compact) {
+                size = decode_compact_dmqp_header(reader->header_wire_buf,
+                                                  reader->header_read + n,
+                                                  &reader->message.header);
+                if (size < 0) {
+                    errno = EBADMSG;
+                    return -1;
+                }
+            } else if (reader->header_read + n >= DMQP_HEADER_SIZE &&
+                       reader->header_read + n ==
+                           dmqp_header_size(reader->header_wire_buf)) {
+                decode_dmqp_header(reader->header_wire_buf,
+                                   &reader->message.header);
+                size = reader->header_read + n;
+            }
+
+            if (!size) {
+                reader->header_read += n;
+                data += n;
+                length -= n;
+                continue;
+            }
+
+            // bytes copied past a compact header belong to the payload
+            n = size - reader->header_read;
+            reader->header_read = size;
+            reader->header_size = size;
+            data += n;
+            length -= n;
+
+            if (reader->message.header.length > MAX_PAYLOAD_LENGTH) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            if (reader->message.header.length > 0) {
+                reader->message.payload =
+                    buffer_pool_alloc(reader->message.header.length);
+                if (!reader->message.payload) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                continue;
+            }
+        } else {
+            n = reader->message.header.length - reader->payload_read;
+            n = n < length ? n : length;
+            memcpy((char *)reader->message.payload + reader->payload_read,
+                   data, n);
+            reader->payload_read += n;
+            data += n;
+            length -= n;
+
+            if (reader->payload_read < reader->message.header.length) {
+                break;
+            }
+        }
+
+        if (dmqp_reader_deliver(reader, on_message, ctx) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void dmqp_reader_reset(struct dmqp_reader *reader) {
+    buffer_pool_free(reader->message.payload);
+    reader->message.payload = NULL;
+    reader->header_read = 0;
+    reader->header_size = 0;
+    reader->payload_read = 0;
+    dmqp_chunks_reset(&reader->chunks);
+}
+
+struct event_loop {
+    pthread_t tid;
+    int epoll_fd;
+    pthread_mutex_t lock; // protects `connections`
+    struct dmqp_connection *connections;
+    // connections waiting for room in the worker pool, only touched by the
+    // loop's thread
+    struct dmqp_connection *stalled;
+    char read_buf[EVENT_LOOP_READ_BUFFER_SIZE]; // shared by all connections
+};
+
+static struct event_loop event_loops[EVENT_LOOP_MAX_THREADS];
+static unsigned int num_event_loops;
+
+unsigned int event_loop_count() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1) {
+        return 1;
+    }
+    if (cores > EVENT_LOOP_MAX_THREADS) {
+        return EVENT_LOOP_MAX_THREADS;
+    }
+
+    return (unsigned int)cores;
+}
+
+int thread_pin_cpu(pthread_t thread, unsigned int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) < 0) {
+        return -1;
+    }
+
+    int count = CPU_COUNT(&allowed);
+    if (!count) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int skip = index % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed) || skip--) {
+            continue;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int ret = pthread_setaffinity_np(thread, sizeof set, &set);
+        if (ret) {
+            errno = ret;
+            return -1;
+        }
+        return 0;
+    }
+
+    errno = EINVAL;
+    return -1;
+}
+
+int reuseport_steering_attach(int listener, unsigned int count) {
+    if (!server_reuseport_steering || !server_pin_cpus) {
+        return 0;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof allowed, &allowed) < 0) {
+        return -1;
+    }
+
+    unsigned int cpus = CPU_COUNT(&allowed);
+    if (!cpus || !count) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (cpus > count) { // the remaining CPUs have no listener of their own
+        cpus = count;
+    }
+
+    // A = CPU, then one test per CPU returning the index of the listener
+    // pinned to it. an index past the group falls back to hashing
+    size_t length = 2 * cpus + 2;
+    struct sock_filter *code = malloc(length * sizeof(struct sock_filter));
+    if (!code) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    size_t n = 0;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                                             SKF_AD_OFF + SKF_AD_CPU);
+    unsigned int index = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && index < cpus; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                                                 cpu, 0, 1);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, index++);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, UINT32_MAX);
+
+    struct sock_fprog program = {.len = n, .filter = code};
+    int ret = setsockopt(listener, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                         &program, sizeof program);
+    free(code);
+    return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Drops a reference to a connection, closing its socket once the last
+ * reference is gone. Payloads sent with `MSG_ZEROCOPY` are waited for first.
+ *
+ * @param conn connection to release
+ */
+static void connection_release(struct dmqp_connection *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    // the kernel keeps sending from the leases after `close` until their
+    // completions arrive, and they would be handed out again if released
+    // before. those it still holds when the wait fails are leaked instead
+    unsigned int pending = 0;
+    for (struct zerocopy_lease *lease = conn->zerocopy_leases; lease;
+         lease = lease->next) {
+        pending += lease->calls - lease->released;
+    }
+    if (pending && wait_zerocopy(conn->fd, pending) < 0) {
+        conn->zerocopy_leases = NULL;
+    }
+    while (conn->zerocopy_leases) {
+        struct zerocopy_lease *lease = conn->zerocopy_leases;
+        conn->zerocopy_leases = lease->next;
+        buffer_pool_free(lease->lease);
+        buffer_pool_free(lease);
+    }
+    dmqp_reader_reset(&conn->reader);
+    pthread_mutex_destroy(&conn->send_lock);
+    close(conn->fd);
+    free(conn);
+}
+
+/**
+ * Drops the messages of a connection that are still waiting for room in the
+ * worker pool.
+ *
+ * @param conn connection whose stalled messages to drop
+ */
+static void connection_drop_stalled(struct dmqp_connection *conn) {
+    while (conn->stalled_head) {
+        struct connection_task *task = conn->stalled_head;
+        conn->stalled_head = task->next;
+        buffer_pool_free(task->message.payload);
+        buffer_pool_free(task);
+        connection_release(conn);
+    }
+    conn->stalled_tail = NULL;
+}
+
+/**
+ * Stops reading from a connection and drops the event loop's reference. Must
+ * be called from the thread running the connection's event loop, or after that
+ * thread has exited.
+ *
+ * @param loop event loop owning the connection
+ * @param conn connection to close
+ */
+static void connection_close(struct event_loop *loop,
+                             struct dmqp_connection *conn) {
+    pthread_mutex_lock(&loop->lock);
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    // in-flight tasks keep the socket open, so it must leave the epoll set
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    __atomic_store_n(&conn->closed, 1, __ATOMIC_RELAXED);
+    connection_drop_stalled(conn);
+    connection_release(conn);
+}
+
+/**
+ * Handles a message on a worker thread.
+ *
+ * @param arg `struct connection_task` to run, freed once done
+ */
+static void connection_task_run(void *arg) {
+    struct connection_task *task = (struct connection_task *)arg;
+
+    current_connection = task->conn;
+    dispatch_received_dmqp_message(&task->message, task->conn->fd);
+    current_connection = NULL;
+
+    buffer_pool_free(task->message.payload);
+    connection_release(task->conn);
+    buffer_pool_free(task);
+}
+
+/**
+ * Hands a complete message to the worker pool. If every worker's deque is full,
+ * the message waits on the connection instead, and the event loop stops
+ * reading the connection until the pool has room for its waiting messages.
+ *
+ * @param message message received, its payload is owned by the task
+ * @param arg connection the message was received on
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+static int connection_submit(struct dmqp_message *message, void *arg) {
+    struct dmqp_connection *conn = (struct dmqp_connection *)arg;
+
+    struct connection_task *task =
+        buffer_pool_alloc(sizeof(struct connection_task));
+    if (!task) {
+        buffer_pool_free(message->payload);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    task->conn = conn;
+    task->message = *message;
+    task->next = NULL;
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+
+    // messages stay in order behind the ones already waiting
+    if (!conn->stalled_head &&
+        worker_pool_submit(&server_workers, connection_task_run, task) == 0) {
+        return 0;
+    }
+
+    if (conn->stalled_tail) {
+        conn->stalled_tail->next = task;
+    } else {
+        conn->stalled_head = task;
+    }
+    conn->stalled_tail = task;
+    return 0;
+}
+
+/**
+ * Reads as much as possible from a non-blocking connection, handing every
+ * complete message to the worker pool. Small messages are read through the
+ * event loop's buffer, so one `read` can pick up many frames. Returns once the
+ * socket is drained, or once the worker pool has no room for a message, in
+ * which case the caller must stall the connection.
+ *
+ * @param loop event loop owning the connection
+ * @param conn connection to read from
+ * @returns 0 if the socket is drained or the connection stalled, -1 if the
+ * connection must be closed
+ */
+static int connection_read(struct event_loop *loop,
+                           struct dmqp_connection *conn) {
+    struct dmqp_reader *reader = &conn->reader;
+
+    for (;;) {
+        // large payloads are read in place instead of being copied out of the
+        // buffer
+        char *dst = loop->read_buf;
+        size_t remaining = sizeof loop->read_buf;
+        if (reader->header_size &&
+            reader->message.header.length - reader->payload_read >=
+                sizeof loop->read_buf) {
+            dst = (char *)reader->message.payload + reader->payload_read;
+            remaining = reader->message.header.length - reader->payload_read;
+        }
+
+        ssize_t n = read(conn->fd, dst, remaining);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            return -1;
+        }
+        if (n == 0) { // peer closed
+            return -1;
+        }
+
+        if (dst != loop->read_buf) {
+            reader->payload_read += n;
+            if (reader->payload_read == reader->message.header.length &&
+                dmqp_reader_deliver(reader, connection_submit, conn) < 0) {
+                return -1;
+            }
+        } else if (dmqp_reader_feed(reader, dst, n, connection_submit, conn) <
+                   0) {
+            return -1;
+        }
+
+        // a short read drained the socket, and edge-triggered epoll reports
+        // any data that arrives after it
+        if ((size_t)n < remaining || conn->stalled_head) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * Reads from a connection, stalling it if the worker pool has no room for its
+ * messages, and closes it on error.
+ *
+ * @param loop event loop owning the connection
+ * @param conn connection to read from
+ */
+static void connection_poll(struct event_loop *loop,
+                            struct dmqp_connection *conn) {
+    if (connection_read(loop, conn) < 0) {
+        connection_close(loop, conn);
+    } else if (conn->stalled_head) {
+        conn->stalled_next = loop->stalled;
+        loop->stalled = conn;
+    }
+}
+
+/**
+ * Submits the waiting messages of stalled connections to the worker pool, and
+ * reads again from every connection whose messages all got in. Data that
+ * arrived while a connection was stalled is still in its socket, so reading
+ * once the pool has room picks it up even though edge-triggered epoll will not
+ * report it again.
+ *
+ * @param loop event loop whose stalled connections to resume
+ */
+static void connection_resume(struct event_loop *loop) {
+    struct dmqp_connection *conn = loop->stalled;
+    loop->stalled = NULL;
+
+    while (conn) {
+        struct dmqp_connection *next = conn->stalled_next;
+
+        while (conn->stalled_head) {
+            struct connection_task *task = conn->stalled_head;
+            struct connection_task *rest = task->next;
+            if (worker_pool_submit(&server_workers, connection_task_run,
+                                   task) < 0) {
+                break;
+            }
+            conn->stalled_head = rest;
+        }
+
+        if (conn->stalled_head) {
+            conn->stalled_next = loop->stalled;
+            loop->stalled = conn;
+        } else {
+            conn->stalled_tail = NULL;
+            connection_poll(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+/**
+ * Runs an event loop, multiplexing all connections assigned to it until the
+ * server stops.
+ *
+ * @param arg pointer to the `struct event_loop` to run
+ */
+static void *event_loop_thread(void *arg) {
+    struct event_loop *loop = (struct event_loop *)arg;
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    for (;;) {
+        pthread_mutex_lock(&server_lock);
+        int running = server_running;
+        pthread_mutex_unlock(&server_lock);
+
+        if (!running) {
+            break;
+        }
+
+        // 1s timeout so that server shutdown is noticed, 1ms while stalled
+        // connections wait for the worker pool to drain
+        int ready = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS,
+                               loop->stalled ? 1 : 1000);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            struct dmqp_connection *conn = events[i].data.ptr;
+            if ((events[i].events & EPOLLERR) && conn->zerocopy) {
+                connection_reap_zerocopy(conn);
+            }
+            // a stalled connection is read once it resumes
+            if (!conn->stalled_head) {
+                connection_poll(loop, conn);
+            }
+        }
+
+        connection_resume(loop);
+    }
+
+    return NULL;
+}
+
+/**
+ * Registers an accepted client with an event loop. The socket must already be
+ * non-blocking, and is closed on error.
+ *
+ * @param loop event loop to register with
+ * @param client client socket
+ * @returns 0 on success, -1 on error with global `errno` set
+ */
+static int event_loop_add(struct event_loop *loop, int client) {
+    struct dmqp_connection *conn = calloc(1, sizeof(struct dmqp_connection));
+    if (!conn) {
+        close(client);
+        errno = ENOMEM;
+        return -1;
+    }
+    conn->fd = client;
+    conn->refs = 1;
+    pthread_mutex_init(&conn->send_lock, NULL);
+
+    // enabled once here, so that large sends skip the `setsockopt`
+    int zerocopy = 1;
+    conn->zerocopy = send_zerocopy_threshold &&
+                     setsockopt(client, SOL_SOCKET, SO_ZEROCOPY, &zerocopy,
+                                sizeof zerocopy) == 0;
+
+    pthread_mutex_lock(&loop->lock);
+    conn->next = loop->connections;
+    if (loop->connections) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+    pthread_mutex_unlock(&loop->lock);
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+                                .data.ptr = conn};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client, &event) < 0) {
+        connection_close(loop, conn);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Starts the event loop threads.
+ *
+ * @returns 0 on success, -1 on error with global `errno` set
+ */
+static int event_loops_init() {
+    num_event_loops = event_loop_count();
+
+    for (unsigned int i = 0; i < num_event_loops; i++) {
+        struct event_loop *loop = &event_loops[i];
+        loop->connections = NULL;
+        loop->stalled = NULL;
+        pthread_mutex_init(&loop->lock, NULL);
+        if ((loop->epoll_fd = epoll_create1(0)) < 0 ||
+            pthread_create(&loop->tid, NULL, event_loop_thread, loop)) {
+            if (loop->epoll_fd >= 0) {
+                close(loop->epoll_fd);
+            }
+            pthread_mutex_destroy(&loop->lock);
+            num_event_loops = i;
+            return -1;
+        }
+
+        if (server_pin_cpus) {
+            thread_pin_cpu(loop->tid, i);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Waits for the event loop threads to exit, then closes their remaining
+ * connections. The server must no longer be running.
+ */
+static void event_loops_destroy() {
+    for (unsigned int i = 0; i < num_event_loops; i++) {
+        struct event_loop *loop = &event_loops[i];
+        pthread_join(loop->tid, NULL);
+
+        loop->stalled = NULL;
+        while (loop->connections) {
+            connection_close(loop, loop->connections);
+        }
+
+        close(loop->epoll_fd);
+        pthread_mutex_destroy(&loop->lock);
+    }
+
+    num_event_loops = 0;
+}
+
+int dmqp_unix_listener_init(int flags) {
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(server_unix_path) >= sizeof address.sun_path) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(address.sun_path, server_unix_path);
+
+    // a socket file nobody accepts on was left by a server that crashed
+    int probe = dmqp_client_init_unix(server_unix_path);
+    if (probe >= 0) {
+        close(probe);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(server_unix_path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | flags, 0);
+    if (listener < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (bind(listener, (struct sockaddr *)&address, sizeof address) < 0 ||
+        listen(listener, LISTEN_BACKLOG) < 0) {
+        close(listener);
+        errno = EIO;
+        return -1;
+    }
+
+    return listener;
+}
+
+void dmqp_unix_listener_destroy(int listener) {
+    if (listener < 0) {
+        return;
+    }
+
+    close(listener);
+    unlink(server_unix_path);
+}
+
+// accepts connections on its own `SO_REUSEPORT` listener and hands them to
+// the event loops
+struct acceptor {
+    pthread_t tid;
+    unsigned int index;
+    int listener;
+    int unix_listener; // only on the first acceptor, -1 otherwise
+    int epoll_fd;
+};
+
+static struct acceptor acceptors[EVENT_LOOP_MAX_THREADS];
+static unsigned int num_acceptors;
+
+/**
+ * Creates a non-blocking TCP listener bound to `port` with `SO_REUSEPORT`, so
+ * that the kernel spreads connections across the listeners of all acceptors.
+ *
+ * @param port port to bind to, 0 for an ephemeral port
+ * @returns the listening socket, -1 on error with global `errno` set
+ * @throws `EIO` unexpected error
+ */
+static int acceptor_listener_init(unsigned short port) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listener < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    int opt = 1;
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) < 0 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt) < 0 ||
+        bind(listener, (struct sockaddr *)&address, sizeof address) < 0 ||
+        listen(listener, LISTEN_BACKLOG) < 0) {
+        close(listener);
+        errno = EIO;
+        return -1;
+    }
+
+    return listener;
+}
+
+/**
+ * Accepts connections until the server stops. Acceptor `i` hands them in turn
+ * to event loops `i`, `i + num_acceptors` and so on, so that with as many
+ * acceptors as event loops a connection stays on the core that accepted it.
+ *
+ * @param arg the acceptor
+ * @returns `NULL`
+ */
+static void *acceptor_thread(void *arg) {
+    struct acceptor *acceptor = arg;
+    unsigned int first_loop = acceptor->index % num_event_loops;
+    unsigned int next_loop = first_loop;
+    int exhausted = 0; // last accept ran out of descriptors or memory
+
+    for (;;) {
+        pthread_mutex_lock(&server_lock);
+        int running = server_running;
+        pthread_mutex_unlock(&server_lock);
+
+        if (!running) {
+            break;
+        }
+
+        // the listeners are level-triggered and stay ready meanwhile
+        if (exhausted) {
+            struct timespec backoff = {.tv_nsec =
+                                           ACCEPT_BACKOFF_MS * 1000000L};
+            nanosleep(&backoff, NULL);
+            exhausted = 0;
+        }
+
+        // 1s timeout so that server shutdown is noticed
+        struct epoll_event events[2];
+        int ready = epoll_wait(acceptor->epoll_fd, events, 2, 1000);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            break;
+        }
+
+        for (int i = 0; i < ready; i++) {
+            int listener = events[i].data.fd;
+
+            // drain the accept queue
+            for (;;) {
+                int client = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+                if (client < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+
+                    exhausted = accept_exhausted(errno);
+                    break;
+                }
+
+                if (listener == acceptor->listener) {
+                    socket_keepalive_init(client);
+
+                    // replies are written whole, so Nagle would only delay
+                    // them
+                    int nodelay = 1;
+                    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                               sizeof nodelay);
+                }
+
+                if (event_loop_add(&event_loops[next_loop], client) < 0) {
+                    continue;
+                }
+                next_loop += num_acceptors;
+                if (next_loop >= num_event_loops) {
+                    next_loop = first_loop;
+                }
+            }
+        }
+    }
+
+    // a failing `epoll_wait` stops the whole server
+    pthread_mutex_lock(&server_lock);
+    server_running = 0;
+    pthread_mutex_unlock(&server_lock);
+    return NULL;
+}
+
+/**
+ * Creates the listeners and epoll instances of `count` acceptors.
+ *
+ * @param port port to bind to, 0 for an ephemeral port
+ * @param count number of acceptors
+ * @returns the bound port, -1 on error with global `errno` set
+ * @throws `EADDRINUSE` another server listens on `server_unix_path`
+ * @throws `EIO` unexpected error
+ */
+static int acceptors_init(unsigned short port, unsigned int count) {
+    for (num_acceptors = 0; num_acceptors < count; num_acceptors++) {
+        struct acceptor *acceptor = &acceptors[num_acceptors];
+        acceptor->index = num_acceptors;
+        acceptor->unix_listener = -1;
+        acceptor->epoll_fd = -1;
+
+        if ((acceptor->listener = acceptor_listener_init(port)) < 0) {
+            return -1;
+        }
+
+        if (!port) { // the remaining listeners share the ephemeral port
+            struct sockaddr_in address;
+            socklen_t address_len = sizeof address;
+            if (getsockname(acceptor->listener, (struct sockaddr *)&address,
+                            &address_len) < 0) {
+                num_acceptors++;
+                errno = EIO;
+                return -1;
+            }
+            port = ntohs(address.sin_port);
+        }
+    }
+
+    // falls back to the kernel's hashing if the program cannot be attached
+    reuseport_steering_attach(acceptors[0].listener, num_acceptors);
+
+    if (server_unix_path[0] &&
+        (acceptors[0].unix_listener = dmqp_unix_listener_init(SOCK_NONBLOCK)) <
+            0) {
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < num_acceptors; i++) {
+        struct acceptor *acceptor = &acceptors[i];
+        struct epoll_event event = {.events = EPOLLIN,
+                                    .data.fd = acceptor->listener};
+        struct epoll_event unix_event = {.events = EPOLLIN,
+                                         .data.fd = acceptor->unix_listener};
+        if ((acceptor->epoll_fd = epoll_create1(0)) < 0 ||
+            epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD, acceptor->listener,
+                      &event) < 0 ||
+            (acceptor->unix_listener >= 0 &&
+             epoll_ctl(acceptor->epoll_fd, EPOLL_CTL_ADD,
+                       acceptor->unix_listener, &unix_event) < 0)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return port;
+}
+
+/**
+ * Closes the sockets of all acceptors. Their threads must have exited.
+ */
+static void acceptors_destroy() {
+    for (unsigned int i = 0; i < num_acceptors; i++) {
+        struct acceptor *acceptor = &acceptors[i];
+        if (acceptor->epoll_fd >= 0) {
+            close(acceptor->epoll_fd);
+        }
+        dmqp_unix_listener_destroy(acceptor->unix_listener);
+        close(acceptor->listener);
+    }
+
+    num_acceptors = 0;
+}
+
+/**
+ * Runs the DMQP server on epoll. Same contract as `dmqp_server_init`.
+ *
+ * @param port the port to bind the server to
+ * @returns 0 on success, -1 on error with global `errno` set
+ * @throws `EADDRINUSE` another server listens on `server_unix_path`
+ * @throws `EIO` unexpected error
+ */
+static int epoll_server_init(unsigned short port) {
+    unsigned int count =
+        server_acceptors ? server_acceptors : event_loop_count();
+    if (count > EVENT_LOOP_MAX_THREADS) {
+        count = EVENT_LOOP_MAX_THREADS;
+    }
+
+    int bound_port = acceptors_init(port, count);
+    if (bound_port < 0) {
+        int _errno = errno;
+        acceptors_destroy();
+        errno = _errno;
+        return -1;
+    }
+
+    pthread_mutex_lock(&server_lock);
+    server_running = 1;
+    server_port = bound_port;
+    pthread_mutex_unlock(&server_lock);
+
+    if (event_loops_init() < 0) {
+        pthread_mutex_lock(&server_lock);
+        server_running = 0;
+        pthread_mutex_unlock(&server_lock);
+        event_loops_destroy();
+        acceptors_destroy();
+        errno = EIO;
+        return -1;
+    }
+
+    pthread_cond_broadcast(&server_running_cond);
+
+    printf("DMQP Server listening on port %d\n", server_port);
+    if (acceptors[0].unix_listener >= 0) {
+        printf("DMQP Server listening on %s\n", server_unix_path);
+    }
+
+    int ret = 0;
+    unsigned int started = 0;
+    for (; started < num_acceptors; started++) {
+        struct acceptor *acceptor = &acceptors[started];
+        if (pthread_create(&acceptor->tid, NULL, acceptor_thread, acceptor)) {
+            pthread_mutex_lock(&server_lock);
+            server_running = 0;
+            pthread_mutex_unlock(&server_lock);
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+
+        if (server_pin_cpus) {
+            thread_pin_cpu(acceptor->tid, started);
+        }
+    }
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(acceptors[i].tid, NULL);
+    }
+
+    pthread_mutex_lock(&server_lock);
+    server_running = 0;
+    pthread_mutex_unlock(&server_lock);
+    event_loops_destroy();
+    acceptors_destroy();
+    return ret;
+}
+
+struct dmqp_reply *dmqp_reply_defer(int client) {
+    struct dmqp_reply *reply = buffer_pool_alloc(sizeof(struct dmqp_reply));
+    if (!reply) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    reply->conn = NULL;
+    reply->uring_conn = NULL;
+    reply->shm_channel = shm_channel_hold(client);
+    if (!reply->shm_channel) {
+        reply->uring_conn = io_uring_connection_hold(client);
+    }
+    if (!reply->shm_channel && !reply->uring_conn) {
+        struct dmqp_connection *conn = current_connection;
+        if (!conn || conn->fd != client) {
+            buffer_pool_free(reply);
+            errno = EINVAL;
+            return NULL;
+        }
+
+        __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+        reply->conn = conn;
+    }
+
+    pthread_mutex_lock(&replies_lock);
+    reply->prev = NULL;
+    reply->next = replies;
+    if (replies) {
+        replies->prev = reply;
+    }
+    replies = reply;
+    pthread_mutex_unlock(&replies_lock);
+
+    return reply;
+}
+
+/**
+ * Marks a deferred reply in use, so that the server does not release its
+ * connection until `reply_release`.
+ *
+ * @param reply deferred reply to use
+ * @param take whether to also take it off the list of outstanding replies, so
+ * that `reply_release` drops its connection reference
+ * @returns 1 if marked, 0 if the server already stopped
+ */
+static int reply_acquire(struct dmqp_reply *reply, int take) {
+    pthread_mutex_lock(&replies_lock);
+    if (!reply->conn && !reply->uring_conn && !reply->shm_channel) {
+        pthread_mutex_unlock(&replies_lock);
+        return 0;
+    }
+
+    if (take) {
+        if (reply->prev) {
+            reply->prev->next = reply->next;
+        } else {
+            replies = reply->next;
+        }
+        if (reply->next) {
+            reply->next->prev = reply->prev;
+        }
+    }
+    replies_in_use++;
+    pthread_mutex_unlock(&replies_lock);
+
+    return 1;
+}
+
+/**
+ * Ends the use of a deferred reply marked by `reply_acquire`.
+ *
+ * @param reply deferred reply in use
+ * @param taken whether it was taken off the list of outstanding replies
+ */
+static void reply_release(struct dmqp_reply *reply, int taken) {
+    if (taken && reply->shm_channel) {
+        shm_channel_put(reply->shm_channel);
+    } else if (taken && reply->uring_conn) {
+        io_uring_connection_put(reply->uring_conn);
+    } else if (taken) {
+        connection_release(reply->conn);
+    }
+
+    pthread_mutex_lock(&replies_lock);
+    if (!--replies_in_use) {
+        pthread_cond_broadcast(&replies_idle);
+    }
+    pthread_mutex_unlock(&replies_lock);
+}
+
+/**
+ * Sends one frame on the connection of a deferred reply in use.
+ *
+ * @param buffer DMQP message of at most `MAX_PAYLOAD_LENGTH` bytes to send
+ * @param arg deferred reply marked by `reply_acquire`
+ * @returns 0 on success, -1 if error with global `errno` set
+ */
+static int reply_write_frame(const struct dmqp_message *buffer, void *arg) {
+    struct dmqp_reply *reply = (struct dmqp_reply *)arg;
+    if (reply->shm_channel) {
+        return shm_channel_send(reply->shm_channel, buffer);
+    }
+    if (reply->uring_conn) {
+        return io_uring_connection_send(reply->uring_conn, buffer);
+    }
+
+    return connection_send(reply->conn, buffer, 0);
+}
+
+/**
+ * Sends a message on the connection of a deferred reply in use, as chunks if
+ * its payload is above `MAX_PAYLOAD_LENGTH`.
+ *
+ * @param reply deferred reply marked by `reply_acquire`
+ * @param buffer DMQP message to send
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ * @throws `EIO` unexpected error
+ */
+static int reply_write(struct dmqp_reply *reply,
+                       const struct dmqp_message *buffer) {
+    if (buffer->header.length > MAX_PAYLOAD_LENGTH) {
+        return send_chunked_dmqp_message(buffer, reply_write_frame, reply);
+    }
+
+    return reply_write_frame(buffer, reply);
+}
+
+/**
+ * Validates a message to send on a deferred reply.
+ *
+ * @returns 0 if valid, -1 if not with global `errno` set
+ * @throws `EINVAL` invalid message
+ * @throws `EMSGSIZE` message payload too large
+ */
+static int reply_check(const struct dmqp_message *buffer) {
+    if (!buffer || (buffer->header.length > 0 && buffer->payload == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (buffer->header.length > DMQP_CHUNKED_MAX_LENGTH) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    return 0;
+}
+
+int dmqp_reply_send(struct dmqp_reply *reply,
+                    const struct dmqp_message *buffer) {
+    if (!reply) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (reply_check(buffer) < 0) {
+        int _errno = errno;
+        dmqp_reply_cancel(reply);
+        errno = _errno;
+        return -1;
+    }
+
+    if (!reply_acquire(reply, 1)) {
+        buffer_pool_free(reply);
+        errno = EPIPE;
+        return -1;
+    }
+
+    int ret = reply_write(reply, buffer);
+    int _errno = errno;
+    reply_release(reply, 1);
+    buffer_pool_free(reply);
+    errno = _errno;
+    return ret;
+}
+
+int dmqp_reply_push(struct dmqp_reply *reply,
+                    const struct dmqp_message *buffer) {
+    if (!reply) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (reply_check(buffer) < 0) {
+        return -1;
+    }
+
+    if (!reply_acquire(reply, 0)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    int ret = reply_write(reply, buffer);
+    int _errno = errno;
+    reply_release(reply, 0);
+    errno = _errno;
+    return ret;
+}
+
+void dmqp_reply_cancel(struct dmqp_reply *reply) {
+    if (!reply) {
+        return;
+    }
+
+    if (reply_acquire(reply, 1)) {
+        reply_release(reply, 1);
+    }
+    buffer_pool_free(reply);
+}
+
+int dmqp_reply_is_open(const struct dmqp_reply *reply) {
+    if (!reply) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&replies_lock);
+    int open = 0;
+    if (reply->shm_channel) {
+        open = shm_channel_is_open(reply->shm_channel);
+    } else if (reply->uring_conn) {
+        open = io_uring_connection_is_open(reply->uring_conn);
+    } else if (reply->conn) {
+        open = !__atomic_load_n(&reply->conn->closed, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&replies_lock);
+
+    return open;
+}
+
+/**
+ * Releases the connections of every outstanding deferred reply once the server
+ * stopped. Later calls on those replies only free them.
+ */
+static void replies_detach() {
+    pthread_mutex_lock(&replies_lock);
+    while (replies_in_use) {
+        pthread_cond_wait(&replies_idle, &replies_lock);
+    }
+
+    for (struct dmqp_reply *reply = replies; reply; reply = reply->next) {
+        if (reply->shm_channel) {
+            shm_channel_put(reply->shm_channel);
+        } else if (reply->uring_conn) {
+            io_uring_connection_put(reply->uring_conn);
+        } else {
+            connection_release(reply->conn);
+        }
+        reply->conn = NULL;
+        reply->uring_conn = NULL;
+        reply->shm_channel = NULL;
+    }
+    replies = NULL;
+    pthread_mutex_unlock(&replies_lock);
+}
+
+int dmqp_server_init(unsigned short port) {
+    signal_init();
+
+    if (worker_pool_init(&server_workers, 0) < 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    int ret;
+    if (server_io_backend == DMQP_IO_BACKEND_IO_URING) {
+        ret = io_uring_server_init(port);
+        if (ret < 0 && errno == ENOSYS) {
+            // io_uring unavailable (old kernel or seccomp), fall back to epoll
+            errno = 0;
+            ret = epoll_server_init(port);
+        }
+    } else {
+        ret = epoll_server_init(port);
+    }
+
+    // tasks still running and deferred replies may reply on io_uring
+    // connections, so both are done before they are freed. shared memory
+    // channels hand their messages to the same handlers, so they stop first
+    int _errno = errno;
+    shm_server_stop();
+    worker_pool_destroy(&server_workers);
+    replies_detach();
+    io_uring_server_destroy();
+    errno = _errno;
+    return ret;
+}
+
+unsigned int dmqp_server_worker_stats(struct worker_stats *stats,
+                                      unsigned int n) {
+    return worker_pool_stats(&server_workers, stats, n);
+}
+
+__attribute__((weak)) void handle_dmqp_push(const struct dmqp_message *message,
+                                            int client) {
+    (void)message;
+    (void)client;
+}
+
+__attribute__((weak)) void
+handle_dmqp_push_batch(const struct dmqp_message *message, int client) {
+    (void)message;
+    (void)client;
+}
+
+__attribute__((weak)) void
+handle_dmqp_fetch(const struct dmqp_message *message, int client) {
+    (void)message;
+    (void)client;
+}
+
+__attribute__((weak)) void
+handle_dmqp_subscribe(const struct dmqp_message *message, int client) {
+    (void)message;
+    (void)client;
+}
+
+__attribute__((weak)) void
+handle_dmqp_read(const struct dmqp_message *message, int client) {
+    (void)message;
+    (void)client;
+}
+
+__attribute__((weak)) void
+handle_dmqp_credit(const struct dmqp_message *message, int client) {
     (void)message;
     (void)client;
 }
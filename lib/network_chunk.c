@@ -0,0 +1,214 @@
+#include "messageq/buffer_pool.h"
+#include "network_internal.h"
+
+#include <errno.h>
+#include <string.h>
+
+/**
+ * Frees a chunked message and marks its stream unused.
+ *
+ * @param stream stream to free
+ */
+static void chunk_stream_free(struct dmqp_chunk_stream *stream) {
+    buffer_pool_free(stream->payload);
+    stream->payload = NULL;
+    stream->capacity = 0;
+}
+
+/**
+ * Makes room for `length` bytes in a stream's payload, doubling its capacity
+ * so that a message arriving in many chunks is only copied a few times.
+ *
+ * @param stream stream to grow
+ * @param length bytes the payload must hold, at most `DMQP_CHUNKED_MAX_LENGTH`
+ * @returns 0 on success, -1 if out of memory
+ */
+static int chunk_stream_reserve(struct dmqp_chunk_stream *stream,
+                                uint32_t length) {
+    if (stream->payload && length <= stream->capacity) {
+        return 0;
+    }
+
+    uint32_t capacity = stream->capacity ? stream->capacity : DMQP_CHUNK_SIZE;
+    while (capacity < length) {
+        capacity *= 2;
+    }
+    if (capacity > DMQP_CHUNKED_MAX_LENGTH) {
+        capacity = DMQP_CHUNKED_MAX_LENGTH;
+    }
+
+    char *payload = buffer_pool_alloc(capacity);
+    if (!payload) {
+        return -1;
+    }
+
+    if (stream->payload) {
+        memcpy(payload, stream->payload, stream->header.length);
+        buffer_pool_free(stream->payload);
+    }
+    stream->payload = payload;
+    stream->capacity = capacity;
+    return 0;
+}
+
+int dmqp_chunks_add(struct dmqp_chunks *chunks, struct dmqp_message *message) {
+    if (!chunks || !message ||
+        (message->header.length > 0 && message->payload == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!(message->header.method & DMQP_CHUNK)) {
+        return 1;
+    }
+
+    uint16_t method = message->header.method & ~(DMQP_CHUNK | DMQP_CHUNK_LAST);
+    struct dmqp_chunk_stream *stream = NULL;
+    struct dmqp_chunk_stream *unused = NULL;
+    for (int i = 0; i < DMQP_CHUNK_MAX_STREAMS; i++) {
+        struct dmqp_chunk_stream *curr = &chunks->streams[i];
+        if (!curr->payload) {
+            unused = unused ? unused : curr;
+        } else if (curr->header.correlation_id ==
+                   message->header.correlation_id) {
+            stream = curr;
+            break;
+        }
+    }
+
+    if (!stream) {
+        if (!unused) {
+            errno = EBUSY;
+            goto error;
+        }
+        stream = unused;
+        stream->header = message->header;
+        stream->header.method = method;
+        stream->header.length = 0;
+    } else if (stream->header.method != method) {
+        errno = EPROTO;
+        goto error;
+    }
+
+    uint32_t length = message->header.length;
+    if (length > DMQP_CHUNKED_MAX_LENGTH - stream->header.length) {
+        errno = EMSGSIZE;
+        goto error;
+    }
+    if (chunk_stream_reserve(stream, stream->header.length + length) < 0) {
+        errno = ENOMEM;
+        goto error;
+    }
+
+    if (length) {
+        memcpy(stream->payload + stream->header.length, message->payload,
+               length);
+        stream->header.length += length;
+    }
+    buffer_pool_free(message->payload);
+    message->payload = NULL;
+
+    if (!(message->header.method & DMQP_CHUNK_LAST)) {
+        return 0;
+    }
+
+    message->header = stream->header;
+    message->payload = stream->payload;
+    if (!message->header.length) {
+        buffer_pool_free(message->payload);
+        message->payload = NULL;
+    }
+    stream->payload = NULL;
+    stream->capacity = 0;
+    return 1;
+
+error:;
+    int _errno = errno;
+    if (stream) {
+        chunk_stream_free(stream);
+    }
+    buffer_pool_free(message->payload);
+    message->payload = NULL;
+    errno = _errno;
+    return -1;
+}
+
+void dmqp_chunks_reset(struct dmqp_chunks *chunks) {
+    if (!chunks) {
+        return;
+    }
+
+    for (int i = 0; i < DMQP_CHUNK_MAX_STREAMS; i++) {
+        chunk_stream_free(&chunks->streams[i]);
+    }
+}
+
+int send_dmqp_chunk(int fd, const struct dmqp_message *buffer, int last,
+                    int flags) {
+    if (fd < 0 || !buffer ||
+        (buffer->header.length > 0 && buffer->payload == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (buffer->header.length > MAX_PAYLOAD_LENGTH) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    struct dmqp_message chunk = *buffer;
+    chunk.header.method |= DMQP_CHUNK;
+    if (last) {
+        chunk.header.method |= DMQP_CHUNK_LAST;
+    }
+    return send_dmqp_message(fd, &chunk, flags);
+}
+
+int send_chunked_dmqp_message(
+    const struct dmqp_message *buffer,
+    int (*send_chunk)(const struct dmqp_message *chunk, void *ctx), void *ctx) {
+    if (buffer->header.length > DMQP_CHUNKED_MAX_LENGTH) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint32_t length = buffer->header.length;
+    uint32_t offset = 0;
+    while (offset < length) {
+        uint32_t n = length - offset < DMQP_CHUNK_SIZE ? length - offset
+                                                       : DMQP_CHUNK_SIZE;
+        struct dmqp_message chunk = *buffer;
+        chunk.header.length = n;
+        chunk.header.method |= DMQP_CHUNK;
+        chunk.payload = (char *)buffer->payload + offset;
+        offset += n;
+        if (offset == length) {
+            chunk.header.method |= DMQP_CHUNK_LAST;
+        }
+
+        if (send_chunk(&chunk, ctx) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int read_dmqp_chunked_message(int fd, struct dmqp_chunks *chunks,
+                              struct dmqp_message *buf) {
+    if (fd < 0 || !chunks || !buf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;) {
+        if (read_dmqp_message(fd, buf) < 0) {
+            return -1;
+        }
+
+        int complete = dmqp_chunks_add(chunks, buf);
+        if (complete) {
+            return complete < 0 ? -1 : 0;
+        }
+    }
+}
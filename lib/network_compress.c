@@ -0,0 +1,241 @@
+#include "messageq/buffer_pool.h"
+#include "messageq/network.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <zlib.h>
+
+#define COMPRESS_LEVEL Z_BEST_SPEED
+#define COMPRESS_LENGTH_SIZE 4 // bytes, raw length prefixing compressed payloads
+
+// zlib streams of the calling thread, reset for every message so that their
+// windows are only allocated once
+struct compress_streams {
+    z_stream deflate;
+    z_stream inflate;
+    int deflate_ready;
+    int inflate_ready;
+};
+
+static __thread struct compress_streams streams;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t streams_key;
+
+/**
+ * Frees the calling thread's streams when the thread exits.
+ */
+static void streams_destroy(void *arg) {
+    (void)arg;
+    if (streams.deflate_ready) {
+        deflateEnd(&streams.deflate);
+        streams.deflate_ready = 0;
+    }
+    if (streams.inflate_ready) {
+        inflateEnd(&streams.inflate);
+        streams.inflate_ready = 0;
+    }
+}
+
+static void compress_init() {
+    pthread_key_create(&streams_key, streams_destroy);
+}
+
+/**
+ * Gets the calling thread's deflate stream, ready for a new payload.
+ *
+ * @returns the stream, `NULL` if out of memory
+ */
+static z_stream *deflate_stream() {
+    if (streams.deflate_ready) {
+        deflateReset(&streams.deflate);
+        return &streams.deflate;
+    }
+
+    pthread_once(&init_once, compress_init);
+    memset(&streams.deflate, 0, sizeof streams.deflate);
+    if (deflateInit2(&streams.deflate, COMPRESS_LEVEL, Z_DEFLATED, -MAX_WBITS,
+                     8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    streams.deflate_ready = 1;
+    pthread_setspecific(streams_key, &streams);
+    return &streams.deflate;
+}
+
+/**
+ * Gets the calling thread's inflate stream, ready for a new payload.
+ *
+ * @returns the stream, `NULL` if out of memory
+ */
+static z_stream *inflate_stream() {
+    if (streams.inflate_ready) {
+        inflateReset(&streams.inflate);
+        return &streams.inflate;
+    }
+
+    pthread_once(&init_once, compress_init);
+    memset(&streams.inflate, 0, sizeof streams.inflate);
+    if (inflateInit2(&streams.inflate, -MAX_WBITS) != Z_OK) {
+        return NULL;
+    }
+
+    streams.inflate_ready = 1;
+    pthread_setspecific(streams_key, &streams);
+    return &streams.inflate;
+}
+
+/**
+ * Returns 1 if messages of a method carry payloads worth compressing, 0
+ * otherwise.
+ */
+static int is_compressible(uint16_t method) {
+    return method == DMQP_PUSH || method == DMQP_PUSH_BATCH ||
+           method == DMQP_RESPONSE;
+}
+
+int dmqp_compress(struct dmqp_compression *compression,
+                  const struct dmqp_message *message,
+                  struct dmqp_message *buf) {
+    if (!compression || !message || !buf ||
+        (message->header.length > 0 && message->payload == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *buf = *message;
+    uint32_t length = message->header.length;
+    uint32_t threshold =
+        __atomic_load_n(&compression->threshold, __ATOMIC_ACQUIRE);
+    // payloads too large for a frame are sent as chunks, which stay raw
+    if (!threshold || length < threshold || length > MAX_PAYLOAD_LENGTH ||
+        !is_compressible(message->header.method)) {
+        return 0;
+    }
+
+    // the skip counter is a heuristic, so racing senders may miscount it
+    int adaptive = __atomic_load_n(&compression->flags, __ATOMIC_RELAXED) &
+                   DMQP_COMPRESS_ADAPTIVE;
+    unsigned int skip = __atomic_load_n(&compression->skip, __ATOMIC_RELAXED);
+    if (adaptive && skip) {
+        __atomic_store_n(&compression->skip, skip - 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    // largest compressed payload worth sending
+    uint32_t limit = adaptive
+                         ? length - length / 100 * DMQP_COMPRESS_MIN_SAVING
+                         : length - 1;
+    if (limit <= COMPRESS_LENGTH_SIZE) {
+        return 0;
+    }
+
+    z_stream *stream = deflate_stream();
+    char *payload = buffer_pool_alloc(limit);
+    if (!stream || !payload) {
+        buffer_pool_free(payload);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    stream->next_in = (Bytef *)message->payload;
+    stream->avail_in = length;
+    stream->next_out = (Bytef *)payload + COMPRESS_LENGTH_SIZE;
+    stream->avail_out = limit - COMPRESS_LENGTH_SIZE;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        // ran out of room, the payload does not shrink enough
+        buffer_pool_free(payload);
+        if (adaptive) {
+            __atomic_store_n(&compression->skip, DMQP_COMPRESS_BACKOFF,
+                             __ATOMIC_RELAXED);
+        }
+        return 0;
+    }
+
+    uint32_t raw_length = htonl(length);
+    memcpy(payload, &raw_length, COMPRESS_LENGTH_SIZE);
+    buf->header.length = COMPRESS_LENGTH_SIZE + stream->total_out;
+    buf->header.method |= DMQP_COMPRESSED;
+    buf->payload = payload;
+    return 1;
+}
+
+int dmqp_decompress(struct dmqp_message *message) {
+    if (!message || (message->header.length > 0 && message->payload == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint16_t method = message->header.method & ~DMQP_COMPRESSED;
+    if (!(message->header.method & DMQP_COMPRESSED) ||
+        !is_compressible(method)) {
+        return 0;
+    }
+
+    uint32_t length;
+    if (message->header.length < COMPRESS_LENGTH_SIZE) {
+        errno = EBADMSG;
+        return -1;
+    }
+    memcpy(&length, message->payload, COMPRESS_LENGTH_SIZE);
+    length = ntohl(length);
+    if (!length || length > MAX_PAYLOAD_LENGTH) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    z_stream *stream = inflate_stream();
+    char *payload = buffer_pool_alloc(length);
+    if (!stream || !payload) {
+        buffer_pool_free(payload);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    stream->next_in = (Bytef *)message->payload + COMPRESS_LENGTH_SIZE;
+    stream->avail_in = message->header.length - COMPRESS_LENGTH_SIZE;
+    stream->next_out = (Bytef *)payload;
+    stream->avail_out = length;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END || stream->avail_out ||
+        stream->avail_in) {
+        buffer_pool_free(payload);
+        errno = EBADMSG;
+        return -1;
+    }
+
+    buffer_pool_free(message->payload);
+    message->payload = payload;
+    message->header.length = length;
+    message->header.method = method;
+    return 0;
+}
+
+int dmqp_client_compress(int client, uint32_t threshold, uint32_t flags,
+                         struct dmqp_compression *buf) {
+    if (client < 0 || !threshold || !buf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t wire[2] = {htonl(threshold), htonl(flags)};
+    struct dmqp_header header = {.length = DMQP_COMPRESS_SIZE,
+                                 .method = DMQP_COMPRESS};
+    struct dmqp_message message = {.header = header, .payload = wire};
+    if (send_dmqp_message(client, &message, 0) < 0 ||
+        read_dmqp_message(client, &message) < 0) {
+        return -1;
+    }
+    buffer_pool_free(message.payload);
+
+    if (message.header.status_code) {
+        errno = message.header.status_code;
+        return -1;
+    }
+
+    buf->threshold = threshold;
+    buf->flags = flags;
+    buf->skip = 0;
+    return 0;
+}
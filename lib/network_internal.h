@@ -0,0 +1,386 @@
+#ifndef NETWORK_INTERNAL_H
+#define NETWORK_INTERNAL_H
+
+// Shared between the DMQP I/O backends. Not part of the public API.
+
+#include "messageq/network.h"
+#include "messageq/worker_pool.h"
+
+#include <stddef.h>
+
+// pause of accepts once out of descriptors or memory
+#define ACCEPT_BACKOFF_MS 100
+
+/**
+ * Incremental DMQP frame parser. Bytes may arrive in arbitrary fragments; the
+ * partially read header and payload are kept here until a frame is complete.
+ * Switches to compact headers right after a `DMQP_HELLO` that agrees on them,
+ * and reassembles chunked messages.
+ */
+struct dmqp_reader {
+    char header_wire_buf[DMQP_COMPACT_HEADER_MAX_SIZE];
+    size_t header_read;
+    size_t header_size; // of the current frame once decoded, 0 before
+    int compact;
+    struct dmqp_message message;
+    size_t payload_read;
+    struct dmqp_chunks chunks;
+};
+
+// state of a server connection set up by the client's handshakes, shared by
+// the I/O backends
+struct dmqp_session {
+    struct dmqp_compression compression; // of replies, set by `DMQP_COMPRESS`
+    uint32_t version;                    // set by `DMQP_HELLO`, 0 before
+    uint32_t features;
+    int compact; // replies have compact headers
+};
+
+// handles received messages off the I/O threads of every backend
+extern struct worker_pool server_workers;
+
+/**
+ * Returns the size of a DMQP header in its wire format, from its first
+ * `DMQP_HEADER_SIZE` bytes: its correlation ID follows them if its method has
+ * `DMQP_CORRELATED` set.
+ *
+ * @param header_wire_buf `DMQP_HEADER_SIZE` bytes in wire format
+ * @returns size of the header, up to `DMQP_HEADER_MAX_SIZE`
+ */
+size_t dmqp_header_size(const char *header_wire_buf);
+
+/**
+ * Decodes a DMQP header from its wire format. Converts header fields to host
+ * byte order.
+ *
+ * @param header_wire_buf `dmqp_header_size` bytes in wire format
+ * @param buf DMQP header buffer to write to
+ */
+void decode_dmqp_header(const char *header_wire_buf, struct dmqp_header *buf);
+
+/**
+ * Encodes a DMQP header into its wire format. Converts header fields to
+ * network byte order (big endian). A correlation ID other than 0 is appended
+ * and flagged with `DMQP_CORRELATED`, so that headers without one keep the
+ * `DMQP_HEADER_SIZE` bytes every peer reads.
+ *
+ * @param buffer DMQP header to encode
+ * @param header_wire_buf output buffer of `DMQP_HEADER_MAX_SIZE` bytes
+ * @returns number of bytes written
+ */
+size_t encode_dmqp_header(const struct dmqp_header *buffer,
+                          char *header_wire_buf);
+
+/**
+ * Encodes a DMQP header in its compact wire format: a byte of flags telling
+ * which of the sequence ID, status code and correlation ID are not 0, then
+ * varints (7 bits per byte, least significant first) of the length, method
+ * and each of those fields. The status code is zigzag encoded.
+ *
+ * @param buffer DMQP header to encode
+ * @param header_wire_buf output buffer of `DMQP_COMPACT_HEADER_MAX_SIZE` bytes
+ * @returns number of bytes written
+ */
+size_t encode_compact_dmqp_header(const struct dmqp_header *buffer,
+                                  char *header_wire_buf);
+
+/**
+ * Encodes a DMQP header in its fixed or its compact wire format.
+ *
+ * @param buffer DMQP header to encode
+ * @param compact whether to use the compact format
+ * @param header_wire_buf output buffer of `DMQP_COMPACT_HEADER_MAX_SIZE` bytes
+ * @returns number of bytes written
+ */
+size_t encode_dmqp_frame_header(const struct dmqp_header *buffer, int compact,
+                                char *header_wire_buf);
+
+/**
+ * Decodes a DMQP header from its compact wire format.
+ *
+ * @param header_wire_buf bytes received
+ * @param length number of bytes received
+ * @param buf DMQP header buffer to write to
+ * @returns size of the header in bytes, 0 if `length` bytes do not hold all of
+ * it, -1 if malformed
+ */
+int decode_compact_dmqp_header(const char *header_wire_buf, size_t length,
+                               struct dmqp_header *buf);
+
+/**
+ * Sends a message above `MAX_PAYLOAD_LENGTH` as chunks of `DMQP_CHUNK_SIZE`
+ * bytes, one frame at a time so that other replies may go out between them.
+ *
+ * @param buffer DMQP message to send
+ * @param send_chunk sends one chunk's frame. returns -1 on error with global
+ * `errno` set
+ * @param ctx passed to `send_chunk`
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EMSGSIZE` message payload above `DMQP_CHUNKED_MAX_LENGTH`
+ * @throws same as `send_chunk`
+ */
+int send_chunked_dmqp_message(
+    const struct dmqp_message *buffer,
+    int (*send_chunk)(const struct dmqp_message *chunk, void *ctx), void *ctx);
+
+/**
+ * Sets up a TCP socket's keepalive as `dmqp_keepalive` says. Best effort.
+ *
+ * @param socket TCP socket of a client or server connection
+ */
+void socket_keepalive_init(int socket);
+
+/**
+ * Returns 1 if an accept failed for lack of descriptors or memory. The
+ * listener stays readable until some are freed, so accepting again right away
+ * would spin; accepts pause for `ACCEPT_BACKOFF_MS` instead.
+ *
+ * @param error `errno` of the failed accept
+ */
+int accept_exhausted(int error);
+
+/**
+ * Returns 1 if a client socket agreed on compact headers with
+ * `dmqp_client_hello`, 0 otherwise.
+ */
+int is_compact_client(int fd);
+
+/**
+ * Dispatches a DMQP message to its method handler. Replies `ENOSYS` if the
+ * method is unknown.
+ *
+ * @param message message received by server
+ * @param client socket to reply on
+ */
+void dispatch_dmqp_message(const struct dmqp_message *message, int client);
+
+/**
+ * Dispatches a message received on a server connection, decompressing its
+ * payload first. Replies `EBADMSG` if it does not decompress.
+ *
+ * @param message message received by server, whose payload is leased from the
+ * buffer pool and may be replaced. the caller still releases it
+ * @param client socket to reply on
+ */
+void dispatch_received_dmqp_message(struct dmqp_message *message, int client);
+
+/**
+ * Feeds received bytes to a reader, passing every complete message to
+ * `on_message` in order. Chunked messages are passed once reassembled.
+ *
+ * @param reader reader of the connection the bytes were received on
+ * @param data received bytes
+ * @param length number of received bytes
+ * @param on_message called with each complete message, takes ownership of its
+ * payload. returns -1 if the connection must be closed
+ * @param ctx passed to `on_message`
+ * @returns 0 on success, -1 if the connection must be closed with global
+ * `errno` set
+ * @throws `EMSGSIZE` message payload too large
+ * @throws `EBUSY` too many chunked messages in flight
+ * @throws `EPROTO` chunks of a message disagree on its method
+ * @throws `ENOMEM` out of memory
+ */
+int dmqp_reader_feed(struct dmqp_reader *reader, const char *data,
+                     size_t length,
+                     int (*on_message)(struct dmqp_message *message, void *ctx),
+                     void *ctx);
+
+/**
+ * Creates the `AF_UNIX` stream socket the server listens on at
+ * `server_unix_path`, replacing a socket file left by a server that crashed.
+ *
+ * @param flags socket type flags, e.g. `SOCK_NONBLOCK`
+ * @returns the listening socket, -1 on error with global `errno` set
+ * @throws `EINVAL` `server_unix_path` too long
+ * @throws `EADDRINUSE` another server listens on `server_unix_path`
+ * @throws `EIO` unexpected error
+ */
+int dmqp_unix_listener_init(int flags);
+
+/**
+ * Closes a listener created by `dmqp_unix_listener_init` and removes its socket
+ * file.
+ *
+ * @param listener listening socket, -1 for none
+ */
+void dmqp_unix_listener_destroy(int listener);
+
+/**
+ * Frees a reader's partially read message and chunked messages.
+ *
+ * @param reader reader to reset
+ */
+void dmqp_reader_reset(struct dmqp_reader *reader);
+
+/**
+ * Returns the number of event loop threads to run, one per online core.
+ *
+ * @returns number of event loops, between 1 and `EVENT_LOOP_MAX_THREADS`
+ */
+unsigned int event_loop_count(void);
+
+/**
+ * Pins a thread to the `index`-th CPU the calling thread may run on, wrapping
+ * around.
+ *
+ * @param thread thread to pin
+ * @param index index of the thread among those of its kind
+ * @returns 0 on success, -1 on error with global `errno` set
+ */
+int thread_pin_cpu(pthread_t thread, unsigned int index);
+
+/**
+ * Attaches a classic BPF program to a `SO_REUSEPORT` group of `count`
+ * listeners, whose `i`-th listener is served by the thread pinned with
+ * `thread_pin_cpu(thread, i)`. The program picks the listener of the CPU the
+ * connection's packets arrived on, and leaves connections arriving on CPUs
+ * past the `count`-th to the kernel's hashing. Does nothing unless both
+ * `server_reuseport_steering` and `server_pin_cpus` are set.
+ *
+ * @param listener any listener of the group, once all of them listen
+ * @param count number of listeners in the group
+ * @returns 0 on success, -1 on error with global `errno` set
+ * @throws `EINVAL` no CPU to steer to
+ * @throws `ENOMEM` out of memory
+ */
+int reuseport_steering_attach(int listener, unsigned int count);
+
+/**
+ * Runs the DMQP server on io_uring. Same contract as `dmqp_server_init`, but
+ * connections are only freed by `io_uring_server_destroy`.
+ *
+ * @param port the port to bind the server to
+ * @returns 0 on success, -1 on error with global `errno` set
+ * @throws `ENOSYS` io_uring is unavailable on this kernel
+ * @throws `EIO` unexpected error
+ */
+int io_uring_server_init(unsigned short port);
+
+/**
+ * Frees the io_urings and connections of a stopped io_uring server. No worker
+ * may still be handling one of its messages.
+ */
+void io_uring_server_destroy(void);
+
+/**
+ * Queues a DMQP message on an io_uring if `fd` is the io_uring connection
+ * whose message the calling thread is handling. The message is copied, so the
+ * caller may free it once this returns.
+ *
+ * @param fd socket to send to
+ * @param buffer DMQP message to send
+ * @returns 1 if queued, 0 if `fd` is not such a connection, -1 on error with
+ * global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+int io_uring_send_dmqp_message(int fd, const struct dmqp_message *buffer);
+
+/**
+ * Gets the session of the io_uring connection whose message the calling thread
+ * is handling, if `fd` is that connection.
+ *
+ * @param fd socket the message was received on
+ * @returns the session, `NULL` if `fd` is not such a connection
+ */
+struct dmqp_session *io_uring_connection_session(int fd);
+
+struct uring_connection;
+
+/**
+ * Keeps the io_uring connection whose message the calling thread is handling
+ * from being freed, if `fd` is that connection, until `io_uring_connection_put`.
+ *
+ * @param fd socket the message was received on
+ * @returns the connection, `NULL` if `fd` is not such a connection
+ */
+struct uring_connection *io_uring_connection_hold(int fd);
+
+/**
+ * Drops a reference taken by `io_uring_connection_hold`.
+ *
+ * @param conn connection to release
+ */
+void io_uring_connection_put(struct uring_connection *conn);
+
+/**
+ * Queues a DMQP message on the io_uring of a held connection, from any thread.
+ * The message is copied, so the caller may free it once this returns.
+ *
+ * @param conn connection to send to
+ * @param buffer DMQP message to send
+ * @returns 0 on success, -1 on error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+int io_uring_connection_send(struct uring_connection *conn,
+                             const struct dmqp_message *buffer);
+
+/**
+ * Returns 1 if a held connection is not closing, 0 otherwise.
+ */
+int io_uring_connection_is_open(const struct uring_connection *conn);
+
+/**
+ * Handles a DMQP message with method `DMQP_SHM_ATTACH`: maps a shared memory
+ * channel, passes it to the client over `client` and starts the thread that
+ * handles its requests. Replies `EOPNOTSUPP` unless `client` is an `AF_UNIX`
+ * connection.
+ *
+ * @param message message received by server
+ * @param client socket the message was received on
+ */
+void shm_channel_attach(const struct dmqp_message *message, int client);
+
+/**
+ * Stops the threads of all shared memory channels and waits for them to exit.
+ * Channels still held by deferred replies are freed once released.
+ */
+void shm_server_stop(void);
+
+/**
+ * Writes a DMQP message to the shared memory channel whose message the calling
+ * thread is handling, if `fd` is that channel.
+ *
+ * @param fd socket to send to
+ * @param buffer DMQP message to send
+ * @returns 1 if written, 0 if `fd` is not such a channel, -1 on error with
+ * global `errno` set
+ * @throws `EPIPE` channel closed or client stopped reading
+ */
+int shm_send_dmqp_message(int fd, const struct dmqp_message *buffer);
+
+struct shm_channel;
+
+/**
+ * Keeps the shared memory channel whose message the calling thread is
+ * handling from being freed, if `fd` is that channel, until `shm_channel_put`.
+ *
+ * @param fd socket the message was received on
+ * @returns the channel, `NULL` if `fd` is not such a channel
+ */
+struct shm_channel *shm_channel_hold(int fd);
+
+/**
+ * Drops a reference taken by `shm_channel_hold`.
+ *
+ * @param channel channel to release
+ */
+void shm_channel_put(struct shm_channel *channel);
+
+/**
+ * Writes a DMQP message to a held shared memory channel, from any thread.
+ *
+ * @param channel channel to send to
+ * @param buffer DMQP message to send
+ * @returns 0 on success, -1 on error with global `errno` set
+ * @throws `EPIPE` channel closed or client stopped reading
+ */
+int shm_channel_send(struct shm_channel *channel,
+                     const struct dmqp_message *buffer);
+
+/**
+ * Returns 1 if the thread of a held channel is still running, 0 otherwise.
+ */
+int shm_channel_is_open(const struct shm_channel *channel);
+
+#endif
@@ -0,0 +1,1134 @@
+#include "network_internal.h"
+#include "messageq/buffer_pool.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 256
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 256 // must be a power of 2
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_MAX_LINKED_SENDS 16
+
+enum uring_op_type {
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_WAKE,
+    URING_CANCEL
+};
+
+// Every submission's `user_data` points at one of these, so that completions
+// can be routed back to the owning object.
+struct uring_op {
+    enum uring_op_type type;
+};
+
+struct uring;
+struct uring_connection;
+struct uring_task;
+
+struct uring_send {
+    struct uring_op op; // must be first
+    struct uring_connection *conn;
+    size_t length;
+    size_t sent;
+    struct uring_send *next;
+    char data[]; // header and payload in wire format
+};
+
+struct uring_connection {
+    struct uring_op recv_op; // must be first
+    struct uring *ring;
+    int fd;
+    int recv_armed;
+    int recv_cancelled; // stalled, so the armed receive is being cancelled
+    int closing;
+    unsigned int sends_in_flight;
+    unsigned int tasks; // messages being handled by workers, deferred replies
+    struct dmqp_reader reader;
+    struct dmqp_session session;
+    // messages the worker pool had no room for, submitted in order before the
+    // receive is armed again
+    struct uring_task *stalled_head;
+    struct uring_task *stalled_tail;
+    struct uring_connection *stalled_next;
+    struct uring_send *sendq_head;
+    struct uring_send *sendq_tail;
+    int flush_queued;
+    struct uring_connection *flush_next;
+    struct uring_connection *prev;
+    struct uring_connection *next;
+};
+
+struct uring {
+    pthread_t tid;
+    int fd;
+    int listener;
+
+    void *ring_ptr;
+    size_t ring_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_array;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    unsigned short buf_tail;
+    char *buffers;
+
+    struct uring_op accept_op;
+    struct uring_op unix_accept_op; // on the `AF_UNIX` listener, if any
+    // accepts that ran out of descriptors or memory, re-armed once
+    // `accepts_resume` passes
+    int accept_paused;
+    int unix_accept_paused;
+    struct timespec accepts_resume;
+    struct uring_connection *connections;
+    struct uring_connection *closing; // waiting for operations and tasks
+    struct uring_connection *flush_list;
+    struct uring_connection *stalled; // waiting for room in the worker pool
+    struct uring_op cancel_op;        // completions of receive cancellations
+
+    // workers push replies here, newest first, and wake the ring through
+    // `wake_fd`
+    struct uring_send *remote_sends;
+    struct uring_op wake_op;
+    int wake_fd;
+    uint64_t wake_value;
+};
+
+struct uring_task {
+    struct uring_connection *conn;
+    struct dmqp_message message;
+    struct uring_task *next; // in the connection's stalled tasks
+};
+
+static struct uring urings[EVENT_LOOP_MAX_THREADS];
+static unsigned int num_urings;
+
+// shared by every io_uring, each keeping a multishot accept armed on it
+static int unix_listener = -1;
+
+// connection whose message is being handled on this thread. replies to that
+// connection are queued on its io_uring instead of being sent synchronously
+static __thread struct uring_connection *current_connection;
+
+/**
+ * Returns a buffer to the provided buffer ring.
+ *
+ * @param ring io_uring owning the buffer ring
+ * @param bid id of the buffer
+ */
+static void uring_recycle_buffer(struct uring *ring, unsigned short bid) {
+    struct io_uring_buf *buf =
+        &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates an io_uring, maps its rings and registers a provided buffer ring.
+ *
+ * @param ring io_uring to initialize
+ * @returns 0 on success, -1 on error with global `errno` set
+ * @throws `ENOSYS` io_uring or a required feature is unavailable
+ */
+static int uring_init(struct uring *ring) {
+    memset(ring, 0, sizeof *ring);
+    ring->listener = -1;
+    ring->accept_op.type = URING_ACCEPT;
+    ring->unix_accept_op.type = URING_ACCEPT;
+    ring->wake_op.type = URING_WAKE;
+    ring->cancel_op.type = URING_CANCEL;
+
+    struct io_uring_params params = {0};
+    ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_EXT_ARG)) {
+        goto cleanup_fd;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring->ring_ptr = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        goto cleanup_fd;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto cleanup_ring;
+    }
+
+    char *ptr = ring->ring_ptr;
+    ring->sq_head = (unsigned int *)(ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(ptr + params.sq_off.tail);
+    ring->sq_array = (unsigned int *)(ptr + params.sq_off.array);
+    ring->sq_mask = *(unsigned int *)(ptr + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned int *)(ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+
+    size_t buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    if (posix_memalign((void **)&ring->buf_ring, sysconf(_SC_PAGESIZE),
+                       buf_ring_size)) {
+        goto cleanup_sqes;
+    }
+    memset(ring->buf_ring, 0, buf_ring_size);
+
+    ring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (!ring->buffers) {
+        goto cleanup_buf_ring;
+    }
+
+    struct io_uring_buf_reg reg = {.ring_addr = (uintptr_t)ring->buf_ring,
+                                   .ring_entries = URING_BUFFER_COUNT,
+                                   .bgid = URING_BUFFER_GROUP};
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0) {
+        goto cleanup_buffers;
+    }
+
+    for (unsigned short bid = 0; bid < URING_BUFFER_COUNT; bid++) {
+        uring_recycle_buffer(ring, bid);
+    }
+
+    ring->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (ring->wake_fd < 0) {
+        goto cleanup_buffers;
+    }
+
+    return 0;
+
+cleanup_buffers:
+    free(ring->buffers);
+cleanup_buf_ring:
+    free(ring->buf_ring);
+cleanup_sqes:
+    munmap(ring->sqes, ring->sqes_size);
+cleanup_ring:
+    munmap(ring->ring_ptr, ring->ring_size);
+cleanup_fd:
+    close(ring->fd);
+    errno = ENOSYS;
+    return -1;
+}
+
+/**
+ * Frees a list of connections along with their queued replies.
+ *
+ * @param conn head of the list
+ */
+static void uring_connections_free(struct uring_connection *conn) {
+    while (conn) {
+        struct uring_connection *next = conn->next;
+
+        while (conn->stalled_head) {
+            struct uring_task *task = conn->stalled_head;
+            conn->stalled_head = task->next;
+            buffer_pool_free(task->message.payload);
+            buffer_pool_free(task);
+        }
+
+        while (conn->sendq_head) {
+            struct uring_send *send = conn->sendq_head;
+            conn->sendq_head = send->next;
+            buffer_pool_free(send);
+        }
+        dmqp_reader_reset(&conn->reader);
+        close(conn->fd);
+        free(conn);
+        conn = next;
+    }
+}
+
+/**
+ * Closes an io_uring, its listener and all of its connections. The io_uring's
+ * thread must have exited and no worker may still be handling one of its
+ * messages.
+ *
+ * @param ring io_uring to destroy
+ */
+static void uring_destroy(struct uring *ring) {
+    // closing the ring cancels every pending operation, so connections and
+    // sends can be freed afterwards
+    munmap(ring->sqes, ring->sqes_size);
+    munmap(ring->ring_ptr, ring->ring_size);
+    close(ring->fd);
+
+    struct uring_send *send = ring->remote_sends;
+    while (send) {
+        struct uring_send *next = send->next;
+        buffer_pool_free(send);
+        send = next;
+    }
+
+    uring_connections_free(ring->connections);
+    uring_connections_free(ring->closing);
+
+    if (ring->listener >= 0) {
+        close(ring->listener);
+    }
+    close(ring->wake_fd);
+    free(ring->buffers);
+    free(ring->buf_ring);
+}
+
+/**
+ * Submits queued submissions and optionally waits for completions, up to 1s
+ * so that server shutdown is noticed, or 1ms while stalled connections wait
+ * for the worker pool to drain.
+ *
+ * @param ring io_uring to submit to
+ * @param wait_nr number of completions to wait for
+ * @returns 0 on success, -1 on error with global `errno` set
+ */
+static int uring_enter(struct uring *ring, unsigned int wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned int to_submit =
+        ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec ts = {.tv_sec = 1};
+    if (ring->stalled) {
+        ts = (struct __kernel_timespec){.tv_nsec = 1000000};
+    } else if (ring->accept_paused || ring->unix_accept_paused) {
+        ts = (struct __kernel_timespec){.tv_nsec =
+                                            ACCEPT_BACKOFF_MS * 1000000L};
+    }
+    struct io_uring_getevents_arg arg = {.ts = (uintptr_t)&ts};
+    unsigned int flags = IORING_ENTER_EXT_ARG;
+    if (wait_nr) {
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+
+    if (syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, flags, &arg,
+                sizeof arg) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the number of free submission queue entries.
+ */
+static unsigned int uring_sq_space(struct uring *ring) {
+    return ring->sq_entries -
+           (ring->sq_local_tail -
+            __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Gets a zeroed submission queue entry, submitting queued entries first if the
+ * submission queue is full.
+ *
+ * @param ring io_uring to get the entry from
+ * @param op operation completions of this entry are routed to
+ * @returns the submission queue entry
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring,
+                                          struct uring_op *op) {
+    while (!uring_sq_space(ring)) {
+        uring_enter(ring, 0);
+    }
+
+    unsigned int index = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = (uintptr_t)op;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static void uring_prep_accept(struct uring *ring, struct uring_op *op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, op);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = op == &ring->unix_accept_op ? unix_listener : ring->listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+static void uring_prep_recv(struct uring *ring, struct uring_connection *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, &conn->recv_op);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    conn->recv_armed = 1;
+    conn->recv_cancelled = 0;
+}
+
+static void uring_prep_cancel_recv(struct uring *ring,
+                                   struct uring_connection *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, &ring->cancel_op);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&conn->recv_op;
+    conn->recv_cancelled = 1;
+}
+
+static void uring_prep_wake(struct uring *ring) {
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, &ring->wake_op);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ring->wake_fd;
+    sqe->addr = (uintptr_t)&ring->wake_value;
+    sqe->len = sizeof ring->wake_value;
+}
+
+/**
+ * Wakes an io_uring's thread from any thread.
+ */
+static void uring_wake(struct uring *ring) {
+    uint64_t value = 1;
+    if (write(ring->wake_fd, &value, sizeof value) < 0) {
+        // the counter only saturates when the ring is already due to wake up
+        errno = 0;
+    }
+}
+
+/**
+ * Appends a reply to its connection's send queue, or drops it if the
+ * connection is closing.
+ */
+static void uring_enqueue_send(struct uring *ring, struct uring_send *send);
+
+/**
+ * Moves the replies pushed by workers onto their connections' send queues, in
+ * the order they were pushed.
+ *
+ * @param ring io_uring the replies were pushed to
+ */
+static void uring_drain_remote_sends(struct uring *ring) {
+    struct uring_send *send =
+        __atomic_exchange_n(&ring->remote_sends, NULL, __ATOMIC_ACQUIRE);
+
+    struct uring_send *oldest = NULL;
+    while (send) {
+        struct uring_send *next = send->next;
+        send->next = oldest;
+        oldest = send;
+        send = next;
+    }
+
+    while (oldest) {
+        struct uring_send *next = oldest->next;
+        oldest->next = NULL;
+        uring_enqueue_send(ring, oldest);
+        oldest = next;
+    }
+}
+
+/**
+ * Frees a connection once it is closing and no operation or task references
+ * it.
+ *
+ * @param ring io_uring owning the connection
+ * @param conn connection to free
+ */
+static void uring_connection_release(struct uring *ring,
+                                     struct uring_connection *conn) {
+    if (!conn->closing || conn->recv_armed || conn->sends_in_flight ||
+        conn->flush_queued || __atomic_load_n(&conn->tasks, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+
+    // replies pushed by the connection's last tasks may still reference it
+    uring_drain_remote_sends(ring);
+
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        ring->closing = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    while (conn->sendq_head) {
+        struct uring_send *send = conn->sendq_head;
+        conn->sendq_head = send->next;
+        buffer_pool_free(send);
+    }
+    dmqp_reader_reset(&conn->reader);
+    close(conn->fd);
+    free(conn);
+}
+
+/**
+ * Starts closing a connection. Shutting the socket down completes its pending
+ * receive and sends, after which the connection is freed once its tasks are
+ * done.
+ *
+ * @param ring io_uring owning the connection
+ * @param conn connection to close
+ */
+static void uring_connection_close(struct uring *ring,
+                                   struct uring_connection *conn) {
+    if (conn->closing) {
+        return;
+    }
+
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        ring->connections = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    conn->prev = NULL;
+    conn->next = ring->closing;
+    if (ring->closing) {
+        ring->closing->prev = conn;
+    }
+    ring->closing = conn;
+
+    // pairs with the ordering in `uring_task_run`, so that either the task
+    // sees the connection closing or the ring sees the task done
+    __atomic_store_n(&conn->closing, 1, __ATOMIC_SEQ_CST);
+    shutdown(conn->fd, SHUT_RDWR);
+}
+
+/**
+ * Submits the queued replies of every connection with no sends in flight. The
+ * replies of one connection are linked so that they are sent in order.
+ *
+ * @param ring io_uring to submit to
+ */
+static void uring_flush(struct uring *ring) {
+    while (ring->flush_list) {
+        struct uring_connection *conn = ring->flush_list;
+        ring->flush_list = conn->flush_next;
+        conn->flush_queued = 0;
+
+        if (conn->closing || conn->sends_in_flight) {
+            uring_connection_release(ring, conn);
+            continue;
+        }
+
+        if (uring_sq_space(ring) < URING_MAX_LINKED_SENDS) {
+            uring_enter(ring, 0);
+        }
+
+        struct uring_send *send = conn->sendq_head;
+        for (unsigned int i = 0; send && i < URING_MAX_LINKED_SENDS; i++) {
+            struct io_uring_sqe *sqe = uring_get_sqe(ring, &send->op);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->fd;
+            sqe->addr = (uintptr_t)(send->data + send->sent);
+            sqe->len = send->length - send->sent;
+            // a short send fails the link instead of letting the next reply
+            // overtake the rest of this one
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+            conn->sends_in_flight++;
+            send = send->next;
+            if (send && i + 1 < URING_MAX_LINKED_SENDS) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+        }
+    }
+}
+
+/**
+ * Queues a connection for `uring_flush`.
+ */
+static void uring_queue_flush(struct uring *ring,
+                              struct uring_connection *conn) {
+    if (conn->flush_queued) {
+        return;
+    }
+
+    conn->flush_queued = 1;
+    conn->flush_next = ring->flush_list;
+    ring->flush_list = conn;
+}
+
+static void uring_enqueue_send(struct uring *ring, struct uring_send *send) {
+    struct uring_connection *conn = send->conn;
+    if (conn->closing) {
+        buffer_pool_free(send);
+        return;
+    }
+
+    if (conn->sendq_tail) {
+        conn->sendq_tail->next = send;
+    } else {
+        conn->sendq_head = send;
+    }
+    conn->sendq_tail = send;
+
+    uring_queue_flush(ring, conn);
+}
+
+int io_uring_connection_send(struct uring_connection *conn,
+                             const struct dmqp_message *buffer) {
+    struct dmqp_message compressed;
+    if (dmqp_compress(&conn->session.compression, buffer, &compressed) < 0) {
+        return -1;
+    }
+
+    int compact = __atomic_load_n(&conn->session.compact, __ATOMIC_ACQUIRE);
+    struct uring_send *send =
+        buffer_pool_alloc(sizeof(struct uring_send) +
+                          DMQP_COMPACT_HEADER_MAX_SIZE +
+                          compressed.header.length);
+    if (!send) {
+        if (compressed.payload != buffer->payload) {
+            buffer_pool_free(compressed.payload);
+        }
+        errno = ENOMEM;
+        return -1;
+    }
+
+    send->op.type = URING_SEND;
+    send->conn = conn;
+    size_t header_size =
+        encode_dmqp_frame_header(&compressed.header, compact, send->data);
+    send->length = header_size + compressed.header.length;
+    send->sent = 0;
+    send->next = NULL;
+    if (compressed.header.length) {
+        memcpy(send->data + header_size, compressed.payload,
+               compressed.header.length);
+    }
+    if (compressed.payload != buffer->payload) {
+        buffer_pool_free(compressed.payload);
+    }
+
+    struct uring *ring = conn->ring;
+    send->next = __atomic_load_n(&ring->remote_sends, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ring->remote_sends, &send->next, send,
+                                        1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+    // only the first reply pushed since the last drain needs to wake the ring
+    if (!send->next) {
+        uring_wake(ring);
+    }
+    return 0;
+}
+
+int io_uring_send_dmqp_message(int fd, const struct dmqp_message *buffer) {
+    struct uring_connection *conn = current_connection;
+    if (!conn || conn->fd != fd) {
+        return 0;
+    }
+
+    return io_uring_connection_send(conn, buffer) < 0 ? -1 : 1;
+}
+
+struct dmqp_session *io_uring_connection_session(int fd) {
+    struct uring_connection *conn = current_connection;
+    if (!conn || conn->fd != fd) {
+        return NULL;
+    }
+
+    return &conn->session;
+}
+
+struct uring_connection *io_uring_connection_hold(int fd) {
+    struct uring_connection *conn = current_connection;
+    if (!conn || conn->fd != fd) {
+        return NULL;
+    }
+
+    __atomic_add_fetch(&conn->tasks, 1, __ATOMIC_SEQ_CST);
+    return conn;
+}
+
+void io_uring_connection_put(struct uring_connection *conn) {
+    // the ring frees a closing connection once its last task is done
+    if (!__atomic_sub_fetch(&conn->tasks, 1, __ATOMIC_SEQ_CST) &&
+        __atomic_load_n(&conn->closing, __ATOMIC_SEQ_CST) &&
+        !pthread_equal(pthread_self(), conn->ring->tid)) {
+        uring_wake(conn->ring);
+    }
+}
+
+int io_uring_connection_is_open(const struct uring_connection *conn) {
+    return !__atomic_load_n(&conn->closing, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Handles a message on a worker thread.
+ *
+ * @param arg `struct uring_task` to run, freed once done
+ */
+static void uring_task_run(void *arg) {
+    struct uring_task *task = (struct uring_task *)arg;
+    struct uring_connection *conn = task->conn;
+
+    current_connection = conn;
+    dispatch_received_dmqp_message(&task->message, conn->fd);
+    current_connection = NULL;
+
+    buffer_pool_free(task->message.payload);
+    buffer_pool_free(task);
+    io_uring_connection_put(conn);
+}
+
+/**
+ * Hands a complete message to the worker pool. If every worker's deque is full,
+ * the message waits on the connection instead, and the connection's receive is
+ * not armed again until the pool has room for its waiting messages.
+ *
+ * @param message message received, its payload is owned by the task
+ * @param arg connection the message was received on
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+static int uring_submit(struct dmqp_message *message, void *arg) {
+    struct uring_connection *conn = (struct uring_connection *)arg;
+
+    struct uring_task *task = buffer_pool_alloc(sizeof(struct uring_task));
+    if (!task) {
+        buffer_pool_free(message->payload);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    task->conn = conn;
+    task->message = *message;
+    task->next = NULL;
+    __atomic_add_fetch(&conn->tasks, 1, __ATOMIC_SEQ_CST);
+
+    // messages stay in order behind the ones already waiting
+    if (!conn->stalled_head &&
+        worker_pool_submit(&server_workers, uring_task_run, task) == 0) {
+        return 0;
+    }
+
+    if (conn->stalled_tail) {
+        conn->stalled_tail->next = task;
+    } else {
+        conn->stalled_head = task;
+    }
+    conn->stalled_tail = task;
+    return 0;
+}
+
+/**
+ * Submits the waiting messages of stalled connections to the worker pool, and
+ * arms the receive again of every connection whose messages all got in. The
+ * messages of a connection that closed meanwhile are dropped.
+ *
+ * @param ring io_uring whose stalled connections to resume
+ */
+static void uring_resume(struct uring *ring) {
+    struct uring_connection *conn = ring->stalled;
+    ring->stalled = NULL;
+
+    while (conn) {
+        struct uring_connection *next = conn->stalled_next;
+
+        while (conn->stalled_head) {
+            struct uring_task *task = conn->stalled_head;
+            struct uring_task *rest = task->next;
+            if (conn->closing) {
+                buffer_pool_free(task->message.payload);
+                buffer_pool_free(task);
+                __atomic_sub_fetch(&conn->tasks, 1, __ATOMIC_SEQ_CST);
+            } else if (worker_pool_submit(&server_workers, uring_task_run,
+                                          task) < 0) {
+                break;
+            }
+            conn->stalled_head = rest;
+        }
+
+        if (conn->stalled_head) {
+            conn->stalled_next = ring->stalled;
+            ring->stalled = conn;
+        } else {
+            conn->stalled_tail = NULL;
+            if (!conn->recv_armed && !conn->closing) {
+                uring_prep_recv(ring, conn);
+            }
+            uring_connection_release(ring, conn);
+        }
+        conn = next;
+    }
+}
+
+static void uring_handle_accept(struct uring *ring, struct uring_op *op,
+                                const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res < 0 &&
+        accept_exhausted(-cqe->res)) {
+        *(op == &ring->accept_op ? &ring->accept_paused
+                                 : &ring->unix_accept_paused) = 1;
+        clock_gettime(CLOCK_MONOTONIC, &ring->accepts_resume);
+        ring->accepts_resume.tv_nsec += ACCEPT_BACKOFF_MS * 1000000L;
+        if (ring->accepts_resume.tv_nsec >= 1000000000L) {
+            ring->accepts_resume.tv_sec++;
+            ring->accepts_resume.tv_nsec -= 1000000000L;
+        }
+    } else if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_prep_accept(ring, op);
+    }
+
+    if (cqe->res < 0) {
+        return;
+    }
+
+    struct uring_connection *conn = calloc(1, sizeof(struct uring_connection));
+    if (!conn) {
+        close(cqe->res);
+        return;
+    }
+
+    conn->recv_op.type = URING_RECV;
+    conn->ring = ring;
+    conn->fd = cqe->res;
+
+    if (op == &ring->accept_op) {
+        socket_keepalive_init(conn->fd);
+
+        // replies are written whole, so Nagle would only delay them
+        int nodelay = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                   sizeof nodelay);
+    }
+
+    conn->next = ring->connections;
+    if (ring->connections) {
+        ring->connections->prev = conn;
+    }
+    ring->connections = conn;
+
+    uring_prep_recv(ring, conn);
+}
+
+static void uring_handle_recv(struct uring *ring,
+                              struct uring_connection *conn,
+                              const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = 0;
+    }
+
+    int stalled = conn->stalled_head != NULL;
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!conn->closing &&
+            dmqp_reader_feed(&conn->reader,
+                             ring->buffers + (size_t)bid * URING_BUFFER_SIZE,
+                             cqe->res, uring_submit, conn) < 0) {
+            uring_connection_close(ring, conn);
+        }
+        uring_recycle_buffer(ring, bid);
+    } else if (cqe->res != -ENOBUFS &&
+               !(cqe->res == -ECANCELED && conn->recv_cancelled)) {
+        // peer closed or error
+        uring_connection_close(ring, conn);
+    }
+
+    // stop receiving until the worker pool has room for the messages waiting
+    if (!stalled && conn->stalled_head) {
+        conn->stalled_next = ring->stalled;
+        ring->stalled = conn;
+        if (conn->recv_armed) {
+            uring_prep_cancel_recv(ring, conn);
+        }
+    }
+
+    if (!conn->recv_armed && !conn->closing && !conn->stalled_head) {
+        uring_prep_recv(ring, conn);
+    }
+
+    uring_connection_release(ring, conn);
+}
+
+static void uring_handle_send(struct uring *ring, struct uring_send *send,
+                              const struct io_uring_cqe *cqe) {
+    struct uring_connection *conn = send->conn;
+    conn->sends_in_flight--;
+
+    if (cqe->res > 0) {
+        send->sent += cqe->res;
+    } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+        uring_connection_close(ring, conn);
+    }
+
+    if (conn->sends_in_flight) {
+        return;
+    }
+
+    // the whole chain completed, drop sent replies and resubmit the rest
+    while (conn->sendq_head &&
+           conn->sendq_head->sent == conn->sendq_head->length) {
+        struct uring_send *done = conn->sendq_head;
+        conn->sendq_head = done->next;
+        buffer_pool_free(done);
+    }
+    if (!conn->sendq_head) {
+        conn->sendq_tail = NULL;
+    } else if (!conn->closing) {
+        uring_queue_flush(ring, conn);
+    }
+
+    uring_connection_release(ring, conn);
+}
+
+/**
+ * Picks up the replies pushed by workers and frees the closing connections
+ * whose tasks are done.
+ */
+static void uring_handle_wake(struct uring *ring,
+                              const struct io_uring_cqe *cqe) {
+    (void)cqe;
+    uring_prep_wake(ring);
+    uring_drain_remote_sends(ring);
+
+    struct uring_connection *conn = ring->closing;
+    while (conn) {
+        struct uring_connection *next = conn->next;
+        uring_connection_release(ring, conn);
+        conn = next;
+    }
+}
+
+/**
+ * Re-arms the accepts paused for lack of descriptors or memory once their
+ * backoff has passed.
+ */
+static void uring_resume_accepts(struct uring *ring) {
+    if (!ring->accept_paused && !ring->unix_accept_paused) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec < ring->accepts_resume.tv_sec ||
+        (now.tv_sec == ring->accepts_resume.tv_sec &&
+         now.tv_nsec < ring->accepts_resume.tv_nsec)) {
+        return;
+    }
+
+    if (ring->accept_paused) {
+        uring_prep_accept(ring, &ring->accept_op);
+        ring->accept_paused = 0;
+    }
+    if (ring->unix_accept_paused) {
+        uring_prep_accept(ring, &ring->unix_accept_op);
+        ring->unix_accept_paused = 0;
+    }
+}
+
+/**
+ * Runs an io_uring event loop until the server stops.
+ *
+ * @param arg pointer to the `struct uring` to run
+ */
+static void *uring_thread(void *arg) {
+    struct uring *ring = (struct uring *)arg;
+    uring_prep_accept(ring, &ring->accept_op);
+    if (unix_listener >= 0) {
+        uring_prep_accept(ring, &ring->unix_accept_op);
+    }
+    uring_prep_wake(ring);
+
+    for (;;) {
+        pthread_mutex_lock(&server_lock);
+        int running = server_running;
+        pthread_mutex_unlock(&server_lock);
+
+        if (!running) {
+            break;
+        }
+
+        uring_resume_accepts(ring);
+        uring_flush(ring);
+        if (uring_enter(ring, 1) < 0 && errno != ETIME && errno != EINTR &&
+            errno != EBUSY) {
+            break;
+        }
+
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            struct uring_op *op = (struct uring_op *)(uintptr_t)cqe->user_data;
+
+            switch (op->type) {
+            case URING_ACCEPT:
+                uring_handle_accept(ring, op, cqe);
+                break;
+            case URING_RECV:
+                uring_handle_recv(ring, (struct uring_connection *)op, cqe);
+                break;
+            case URING_SEND:
+                uring_handle_send(ring, (struct uring_send *)op, cqe);
+                break;
+            case URING_WAKE:
+                uring_handle_wake(ring, cqe);
+                break;
+            case URING_CANCEL: // the receive's own completion is what counts
+                break;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        uring_resume(ring);
+    }
+
+    errno = 0;
+    return NULL;
+}
+
+/**
+ * Creates a listening socket bound to `port` with `SO_REUSEPORT`, so that the
+ * kernel spreads connections across the listeners of all io_urings.
+ *
+ * @param port port to bind to, 0 for an ephemeral port
+ * @returns the listening socket, -1 on error
+ */
+static int uring_listener_init(unsigned short port) {
+    int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        return -1;
+    }
+
+    int opt = 1;
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof opt) < 0 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof opt) < 0 ||
+        bind(listener, (struct sockaddr *)&address, sizeof address) < 0 ||
+        listen(listener, LISTEN_BACKLOG) < 0) {
+        close(listener);
+        return -1;
+    }
+
+    return listener;
+}
+
+int io_uring_server_init(unsigned short port) {
+    int ret = 0;
+    unsigned int count = event_loop_count();
+
+    for (num_urings = 0; num_urings < count; num_urings++) {
+        struct uring *ring = &urings[num_urings];
+        if (uring_init(ring) < 0) {
+            ret = -1;
+            goto cleanup;
+        }
+
+        if ((ring->listener = uring_listener_init(port)) < 0) {
+            num_urings++;
+            errno = EIO;
+            ret = -1;
+            goto cleanup;
+        }
+
+        if (!port) { // the remaining listeners share the ephemeral port
+            struct sockaddr_in address;
+            socklen_t address_len = sizeof address;
+            getsockname(ring->listener, (struct sockaddr *)&address,
+                        &address_len);
+            port = ntohs(address.sin_port);
+        }
+    }
+
+    // falls back to the kernel's hashing if the program cannot be attached
+    reuseport_steering_attach(urings[0].listener, num_urings);
+
+    if (server_unix_path[0] &&
+        (unix_listener = dmqp_unix_listener_init(SOCK_CLOEXEC)) < 0) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    pthread_mutex_lock(&server_lock);
+    server_running = 1;
+    server_port = port;
+    pthread_mutex_unlock(&server_lock);
+    pthread_cond_broadcast(&server_running_cond);
+
+    printf("DMQP Server listening on port %d (io_uring)\n", server_port);
+    if (unix_listener >= 0) {
+        printf("DMQP Server listening on %s (io_uring)\n", server_unix_path);
+    }
+
+    unsigned int started = 0;
+    for (; started < num_urings; started++) {
+        if (pthread_create(&urings[started].tid, NULL, uring_thread,
+                           &urings[started])) {
+            pthread_mutex_lock(&server_lock);
+            server_running = 0;
+            pthread_mutex_unlock(&server_lock);
+            errno = EIO;
+            ret = -1;
+            break;
+        }
+
+        if (server_pin_cpus) {
+            thread_pin_cpu(urings[started].tid, started);
+        }
+    }
+
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(urings[i].tid, NULL);
+    }
+
+    // workers may still reply on the connections, which are freed by
+    // `io_uring_server_destroy` once the worker pool is drained
+    return ret;
+
+cleanup:
+    io_uring_server_destroy();
+    return ret;
+}
+
+void io_uring_server_destroy(void) {
+    for (unsigned int i = 0; i < num_urings; i++) {
+        uring_destroy(&urings[i]);
+    }
+    num_urings = 0;
+
+    dmqp_unix_listener_destroy(unix_listener);
+    unix_listener = -1;
+}
@@ -0,0 +1,708 @@
+#include "messageq/buffer_pool.h"
+#include "network_internal.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_RING_MASK (DMQP_SHM_RING_SIZE - 1)
+#define SHM_FRAME_ALIGN 8
+#define SHM_SPIN_COUNT 4096 // ring polls before a consumer sleeps, multicore
+#define SHM_FDS 3           // memfd, request and response eventfds
+
+_Static_assert((DMQP_SHM_RING_SIZE & SHM_RING_MASK) == 0,
+               "DMQP_SHM_RING_SIZE must be a power of two");
+
+// Precedes every message in a ring. Messages never wrap around the end of the
+// ring, which is skipped instead, so handlers can read payloads in place.
+struct shm_frame {
+    uint32_t size; // bytes taken in the ring, 0 to skip to the ring's start
+    uint32_t reserved;
+    struct dmqp_header header; // host byte order
+};
+
+// Single-producer single-consumer ring. `head` and `tail` are free-running
+// byte offsets, each written by one side only and kept on their own cache line
+struct shm_ring {
+    _Alignas(64) uint32_t head;
+    uint32_t waiting; // the consumer sleeps on its eventfd
+    _Alignas(64) uint32_t tail;
+    _Alignas(64) char data[DMQP_SHM_RING_SIZE];
+};
+
+// mapped by both the server and the client
+struct shm_region {
+    struct shm_ring requests;  // client to server
+    struct shm_ring responses; // server to client
+};
+
+struct shm_channel {
+    int fd; // duplicate of the client's socket, the `client` of handlers
+    struct shm_region *region;
+    int request_efd;           // wakes the channel thread
+    int response_efd;          // wakes the client
+    pthread_mutex_t send_lock; // responses may be sent from any thread
+    unsigned int refs;         // channel thread and deferred replies
+    int closed;                // the channel thread exited
+    struct shm_channel *prev;
+    struct shm_channel *next;
+};
+
+struct dmqp_shm_client {
+    int socket;
+    struct shm_region *region;
+    int request_efd;
+    int response_efd;
+};
+
+// channels with a running thread
+static pthread_mutex_t channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t channels_idle = PTHREAD_COND_INITIALIZER;
+static struct shm_channel *channels;
+static unsigned int channels_count;
+static int channels_stopping;
+
+// channel whose message is being handled on this thread
+static __thread struct shm_channel *current_channel;
+
+static uint32_t frame_size(uint32_t length) {
+    return (sizeof(struct shm_frame) + length + SHM_FRAME_ALIGN - 1) &
+           ~(uint32_t)(SHM_FRAME_ALIGN - 1);
+}
+
+/**
+ * Returns the number of times a consumer polls its ring before it sleeps. On a
+ * single core, spinning only keeps the producer from running.
+ */
+static int spin_count() {
+    static int count = -1;
+    int n = __atomic_load_n(&count, __ATOMIC_RELAXED);
+    if (n < 0) {
+        n = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN_COUNT : 0;
+        __atomic_store_n(&count, n, __ATOMIC_RELAXED);
+    }
+
+    return n;
+}
+
+static void spin_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Writes a message to a ring if it has room, and wakes the consumer only if
+ * it is sleeping. Must be called by the ring's only producer.
+ *
+ * @param ring ring to write to
+ * @param message message to write, with a valid length
+ * @param efd eventfd the consumer sleeps on
+ * @returns 1 if written, 0 if the ring is full
+ */
+static int ring_write(struct shm_ring *ring, const struct dmqp_message *message,
+                      int efd) {
+    uint32_t size = frame_size(message->header.length);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t offset = tail & SHM_RING_MASK;
+    uint32_t skip =
+        DMQP_SHM_RING_SIZE - offset < size ? DMQP_SHM_RING_SIZE - offset : 0;
+
+    if (DMQP_SHM_RING_SIZE - (tail - head) < skip + size) {
+        return 0;
+    }
+
+    if (skip) {
+        ((struct shm_frame *)(ring->data + offset))->size = 0;
+        tail += skip;
+        offset = 0;
+    }
+
+    struct shm_frame *frame = (struct shm_frame *)(ring->data + offset);
+    frame->size = size;
+    frame->header = message->header;
+    if (message->header.length) {
+        memcpy(frame + 1, message->payload, message->header.length);
+    }
+
+    // pairs with the consumer setting `waiting` before checking `tail` again.
+    // clearing it sends a single wakeup however many messages follow
+    __atomic_store_n(&ring->tail, tail + size, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+        (void)!write(efd, &one, sizeof one);
+    }
+
+    return 1;
+}
+
+/**
+ * Gets the oldest message of a ring without consuming it. Must be called by
+ * the ring's only consumer.
+ *
+ * @param ring ring to read from
+ * @returns the message's frame, `NULL` if the ring is empty
+ */
+static struct shm_frame *ring_peek(struct shm_ring *ring) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return NULL;
+    }
+
+    struct shm_frame *frame = (struct shm_frame *)(ring->data +
+                                                   (head & SHM_RING_MASK));
+    if (!frame->size) {
+        head += DMQP_SHM_RING_SIZE - (head & SHM_RING_MASK);
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        if (head == tail) {
+            return NULL;
+        }
+        frame = (struct shm_frame *)ring->data;
+    }
+
+    return frame;
+}
+
+/**
+ * Frees the ring space of a frame returned by `ring_peek`.
+ *
+ * @param ring ring the frame was read from
+ * @param size size of the frame, as validated by the consumer
+ */
+static void ring_consume(struct shm_ring *ring, uint32_t size) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+/**
+ * Waits for a ring to hold a message. Spins first, so that a busy producer
+ * never pays for a wakeup, then sleeps on the consumer's eventfd.
+ *
+ * @param ring ring to wait on
+ * @param efd eventfd the producer wakes the consumer with
+ * @param peer socket of the other side, to notice it disconnecting
+ * @param timeout_ms longest sleep
+ * @returns 1 if the ring may hold a message, 0 on timeout, -1 if the peer
+ * disconnected
+ */
+static int ring_wait(struct shm_ring *ring, int efd, int peer,
+                     int timeout_ms) {
+    for (int i = 0, n = spin_count(); i < n; i++) {
+        if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) !=
+            __atomic_load_n(&ring->head, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+        spin_pause();
+    }
+
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) !=
+        __atomic_load_n(&ring->head, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    struct pollfd fds[2] = {{.fd = efd, .events = POLLIN},
+                            {.fd = peer, .events = POLLRDHUP}};
+    int ready = poll(fds, 2, timeout_ms);
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+
+    if (ready > 0 && (fds[0].revents & POLLIN)) {
+        uint64_t value;
+        (void)!read(efd, &value, sizeof value);
+    }
+
+    if (ready > 0 && (fds[1].revents & (POLLRDHUP | POLLHUP | POLLERR))) {
+        return -1;
+    }
+
+    return ready > 0;
+}
+
+/**
+ * Checks that a frame written by the other side stays within its ring.
+ *
+ * @returns 1 if valid, 0 if not
+ */
+static int frame_valid(const struct shm_frame *frame,
+                       const struct dmqp_header *header) {
+    return header->length <= MAX_PAYLOAD_LENGTH &&
+           frame->size == frame_size(header->length);
+}
+
+static void channel_free(struct shm_channel *channel) {
+    munmap(channel->region, sizeof(struct shm_region));
+    close(channel->request_efd);
+    close(channel->response_efd);
+    close(channel->fd);
+    pthread_mutex_destroy(&channel->send_lock);
+    free(channel);
+}
+
+void shm_channel_put(struct shm_channel *channel) {
+    if (!__atomic_sub_fetch(&channel->refs, 1, __ATOMIC_ACQ_REL)) {
+        channel_free(channel);
+    }
+}
+
+struct shm_channel *shm_channel_hold(int fd) {
+    struct shm_channel *channel = current_channel;
+    if (!channel || channel->fd != fd) {
+        return NULL;
+    }
+
+    __atomic_add_fetch(&channel->refs, 1, __ATOMIC_RELAXED);
+    return channel;
+}
+
+int shm_channel_is_open(const struct shm_channel *channel) {
+    return !__atomic_load_n(&channel->closed, __ATOMIC_RELAXED);
+}
+
+int shm_channel_send(struct shm_channel *channel,
+                     const struct dmqp_message *buffer) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the client drains responses, so a full ring only waits for it
+    pthread_mutex_lock(&channel->send_lock);
+    while (!ring_write(&channel->region->responses, buffer,
+                       channel->response_efd)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!shm_channel_is_open(channel) ||
+            now.tv_sec - start.tv_sec >= SOCKET_TIMEOUT_SEC) {
+            pthread_mutex_unlock(&channel->send_lock);
+            errno = EPIPE;
+            return -1;
+        }
+        sched_yield();
+    }
+    pthread_mutex_unlock(&channel->send_lock);
+
+    return 0;
+}
+
+int shm_send_dmqp_message(int fd, const struct dmqp_message *buffer) {
+    struct shm_channel *channel = current_channel;
+    if (!channel || channel->fd != fd) {
+        return 0;
+    }
+
+    return shm_channel_send(channel, buffer) < 0 ? -1 : 1;
+}
+
+/**
+ * Handles the requests of a channel in order, in place in the ring, until the
+ * client disconnects or the server stops.
+ *
+ * @param arg the `struct shm_channel` to serve
+ */
+static void *channel_thread(void *arg) {
+    struct shm_channel *channel = (struct shm_channel *)arg;
+    struct shm_ring *ring = &channel->region->requests;
+    current_channel = channel;
+
+    while (!__atomic_load_n(&channels_stopping, __ATOMIC_RELAXED)) {
+        struct shm_frame *frame = ring_peek(ring);
+        if (!frame) {
+            // 1s timeout so that server shutdown is noticed
+            if (ring_wait(ring, channel->request_efd, channel->fd, 1000) < 0) {
+                break;
+            }
+            continue;
+        }
+
+        // the client shares the ring, so the header is copied before use
+        struct dmqp_message message = {.header = frame->header};
+        uint32_t size = frame->size;
+        if (!frame_valid(frame, &message.header) ||
+            size > DMQP_SHM_RING_SIZE) {
+            break;
+        }
+        message.payload = message.header.length ? frame + 1 : NULL;
+
+        dispatch_dmqp_message(&message, channel->fd);
+        ring_consume(ring, size);
+    }
+
+    current_channel = NULL;
+    __atomic_store_n(&channel->closed, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&channels_lock);
+    if (channel->prev) {
+        channel->prev->next = channel->next;
+    } else {
+        channels = channel->next;
+    }
+    if (channel->next) {
+        channel->next->prev = channel->prev;
+    }
+    if (!--channels_count) {
+        pthread_cond_broadcast(&channels_idle);
+    }
+    pthread_mutex_unlock(&channels_lock);
+
+    shm_channel_put(channel);
+    return NULL;
+}
+
+/**
+ * Sends a message along with file descriptors. The connection must have no
+ * other reply in flight.
+ *
+ * @returns 0 on success, -1 if error with global `errno` set
+ */
+static int send_with_fds(int socket, const struct dmqp_message *message,
+                         const int *fds, unsigned int n) {
+    char header[DMQP_HEADER_MAX_SIZE];
+    size_t header_size = encode_dmqp_header(&message->header, header);
+    struct iovec iov = {.iov_base = header, .iov_len = header_size};
+
+    union {
+        char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof control);
+
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = CMSG_SPACE(n * sizeof(int))};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n * sizeof(int));
+
+    struct pollfd pfd = {.fd = socket, .events = POLLOUT};
+    for (;;) {
+        ssize_t sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (sent == (ssize_t)header_size) {
+            return 0;
+        }
+
+        // the header is tiny, so a partial write means a broken connection
+        if (sent >= 0 || (errno != EAGAIN && errno != EINTR) ||
+            (errno == EAGAIN && poll(&pfd, 1, SOCKET_TIMEOUT_SEC * 1000) <= 0)) {
+            errno = EIO;
+            return -1;
+        }
+    }
+}
+
+void shm_channel_attach(const struct dmqp_message *message, int client) {
+    struct dmqp_header header = {0};
+    header.method = DMQP_RESPONSE;
+    header.correlation_id = message->header.correlation_id;
+    struct dmqp_message response = {.header = header, .payload = NULL};
+
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof address;
+    if (current_channel ||
+        getsockname(client, (struct sockaddr *)&address, &address_len) < 0 ||
+        address.ss_family != AF_UNIX) {
+        response.header.status_code = EOPNOTSUPP;
+        send_dmqp_message(client, &response, 0);
+        return;
+    }
+
+    struct shm_channel *channel = calloc(1, sizeof(struct shm_channel));
+    int memfd = memfd_create("dmqp-shm", MFD_CLOEXEC);
+    if (!channel || memfd < 0) {
+        response.header.status_code = ENOMEM;
+        goto cleanup;
+    }
+
+    channel->fd = -1;
+    channel->request_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    channel->response_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    channel->region = MAP_FAILED;
+    if (channel->request_efd < 0 || channel->response_efd < 0 ||
+        ftruncate(memfd, sizeof(struct shm_region)) < 0 ||
+        (channel->region = mmap(NULL, sizeof(struct shm_region),
+                                PROT_READ | PROT_WRITE, MAP_SHARED, memfd,
+                                0)) == MAP_FAILED ||
+        (channel->fd = dup(client)) < 0) {
+        response.header.status_code = ENOMEM;
+        goto cleanup;
+    }
+    pthread_mutex_init(&channel->send_lock, NULL);
+    channel->refs = 1;
+
+    pthread_mutex_lock(&channels_lock);
+    if (channels_count >= DMQP_SHM_MAX_CHANNELS || channels_stopping) {
+        pthread_mutex_unlock(&channels_lock);
+        response.header.status_code = EBUSY;
+        goto cleanup_channel;
+    }
+
+    int fds[SHM_FDS] = {memfd, channel->request_efd, channel->response_efd};
+    if (send_with_fds(client, &response, fds, SHM_FDS) < 0) {
+        pthread_mutex_unlock(&channels_lock);
+        close(memfd);
+        shm_channel_put(channel);
+        return;
+    }
+    close(memfd);
+
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, channel_thread, channel)) {
+        // the client sees the channel close as if the server went away
+        pthread_mutex_unlock(&channels_lock);
+        pthread_attr_destroy(&attr);
+        shm_channel_put(channel);
+        return;
+    }
+    pthread_attr_destroy(&attr);
+
+    channel->next = channels;
+    if (channels) {
+        channels->prev = channel;
+    }
+    channels = channel;
+    channels_count++;
+    pthread_mutex_unlock(&channels_lock);
+    return;
+
+cleanup_channel:
+    close(memfd);
+    shm_channel_put(channel);
+    send_dmqp_message(client, &response, 0);
+    return;
+
+cleanup:
+    if (channel) {
+        if (channel->region != MAP_FAILED) {
+            munmap(channel->region, sizeof(struct shm_region));
+        }
+        if (channel->request_efd >= 0) {
+            close(channel->request_efd);
+        }
+        if (channel->response_efd >= 0) {
+            close(channel->response_efd);
+        }
+        free(channel);
+    }
+    if (memfd >= 0) {
+        close(memfd);
+    }
+    send_dmqp_message(client, &response, 0);
+}
+
+void shm_server_stop(void) {
+    pthread_mutex_lock(&channels_lock);
+    channels_stopping = 1;
+    for (struct shm_channel *curr = channels; curr; curr = curr->next) {
+        uint64_t one = 1;
+        (void)!write(curr->request_efd, &one, sizeof one);
+    }
+    while (channels_count) {
+        pthread_cond_wait(&channels_idle, &channels_lock);
+    }
+    channels_stopping = 0;
+    pthread_mutex_unlock(&channels_lock);
+}
+
+struct dmqp_shm_client *dmqp_shm_attach(int client) {
+    if (client < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // the response comes with a fixed header, along with the channel's fds
+    if (is_compact_client(client)) {
+        errno = EOPNOTSUPP;
+        return NULL;
+    }
+
+    struct dmqp_header request_header = {.method = DMQP_SHM_ATTACH};
+    struct dmqp_message request = {.header = request_header, .payload = NULL};
+    if (send_dmqp_message(client, &request, 0) < 0) {
+        return NULL;
+    }
+
+    // the request had no correlation ID to echo, so the header is fixed
+    char header[DMQP_HEADER_SIZE];
+    struct iovec iov = {.iov_base = header, .iov_len = sizeof header};
+    union {
+        char buf[CMSG_SPACE(SHM_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof control.buf};
+
+    ssize_t received;
+    do {
+        received = recvmsg(client, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    } while (received < 0 && errno == EINTR);
+    if (received != (ssize_t)sizeof header) {
+        errno = EIO;
+        return NULL;
+    }
+
+    int fds[SHM_FDS] = {-1, -1, -1};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(SHM_FDS * sizeof(int))) {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+    }
+
+    struct dmqp_header response;
+    if (dmqp_header_size(header) != sizeof header) {
+        errno = EPROTO;
+        goto cleanup;
+    }
+    decode_dmqp_header(header, &response);
+
+    struct dmqp_shm_client *shm = NULL;
+    if (response.status_code) {
+        errno = response.status_code;
+        goto cleanup;
+    }
+
+    if (fds[0] < 0 || response.length) {
+        errno = EPROTO;
+        goto cleanup;
+    }
+
+    shm = malloc(sizeof(struct dmqp_shm_client));
+    if (!shm) {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+
+    shm->region = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fds[0], 0);
+    if (shm->region == MAP_FAILED) {
+        free(shm);
+        shm = NULL;
+        errno = ENOMEM;
+        goto cleanup;
+    }
+
+    close(fds[0]);
+    shm->socket = client;
+    shm->request_efd = fds[1];
+    shm->response_efd = fds[2];
+    return shm;
+
+cleanup:
+    for (int i = 0; i < SHM_FDS; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+    return NULL;
+}
+
+int dmqp_shm_send(struct dmqp_shm_client *shm,
+                  const struct dmqp_message *buffer) {
+    if (!shm || !buffer ||
+        (buffer->header.length > 0 && buffer->payload == NULL)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (buffer->header.length > MAX_PAYLOAD_LENGTH) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (ring_write(&shm->region->requests, buffer, shm->request_efd)) {
+        return 0;
+    }
+
+    // the server drains requests, so a full ring only waits for it
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!ring_write(&shm->region->requests, buffer, shm->request_efd)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - start.tv_sec >= SOCKET_TIMEOUT_SEC) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        sched_yield();
+    }
+
+    return 0;
+}
+
+int dmqp_shm_read(struct dmqp_shm_client *shm, struct dmqp_message *buf) {
+    if (!shm || !buf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct shm_ring *ring = &shm->region->responses;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    struct shm_frame *frame;
+    while (!(frame = ring_peek(ring))) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited_ms = (now.tv_sec - start.tv_sec) * 1000 +
+                         (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (waited_ms >= SOCKET_TIMEOUT_SEC * 1000) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+
+        if (ring_wait(ring, shm->response_efd, shm->socket,
+                      SOCKET_TIMEOUT_SEC * 1000 - waited_ms) < 0) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    buf->header = frame->header;
+    uint32_t size = frame->size;
+    if (!frame_valid(frame, &buf->header)) {
+        errno = EIO;
+        return -1;
+    }
+
+    buf->payload = NULL;
+    if (buf->header.length) {
+        buf->payload = buffer_pool_alloc(buf->header.length);
+        if (!buf->payload) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(buf->payload, frame + 1, buf->header.length);
+    }
+
+    ring_consume(ring, size);
+    return 0;
+}
+
+void dmqp_shm_detach(struct dmqp_shm_client *shm) {
+    if (!shm) {
+        return;
+    }
+
+    munmap(shm->region, sizeof(struct shm_region));
+    close(shm->request_efd);
+    close(shm->response_efd);
+    free(shm);
+}
@@ -0,0 +1,208 @@
+#include "messageq/buffer_pool.h"
+#include "messageq/test.h"
+#include "messageq/util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+int test_buffer_pool_alloc_fits_size() {
+    // arrange
+    errno = 0;
+    size_t sizes[] = {1, 64, 65, 4000, 1 << BUFFER_POOL_MAX_SHIFT};
+
+    for (int i = 0; i < arrlen(sizes); i++) {
+        // act
+        char *buffer = buffer_pool_alloc(sizes[i]);
+
+        // assert
+        assert(buffer != NULL);
+        assert((uintptr_t)buffer % _Alignof(max_align_t) == 0);
+        memset(buffer, 'x', sizes[i]);
+        assert(buffer[sizes[i] - 1] == 'x');
+
+        // teardown
+        buffer_pool_free(buffer);
+    }
+
+    assert(!errno);
+    return 0;
+}
+
+int test_buffer_pool_alloc_misses_when_empty() {
+    // arrange
+    errno = 0;
+    struct buffer_pool_stats before;
+    struct buffer_pool_stats after;
+    buffer_pool_stats(&before);
+
+    // act: nothing of this size class was freed before
+    void *buffer = buffer_pool_alloc(300 * 1024);
+    buffer_pool_stats(&after);
+
+    // assert
+    assert(buffer != NULL);
+    assert(after.misses == before.misses + 1);
+    assert(after.hits == before.hits);
+
+    // teardown
+    buffer_pool_free(buffer);
+    return 0;
+}
+
+int test_buffer_pool_alloc_reuses_freed_buffer() {
+    // arrange
+    errno = 0;
+    void *buffer = buffer_pool_alloc(100);
+    assert(buffer != NULL);
+    buffer_pool_free(buffer);
+
+    struct buffer_pool_stats before;
+    struct buffer_pool_stats after;
+    buffer_pool_stats(&before);
+
+    // act: same size class, different size
+    void *reused = buffer_pool_alloc(128);
+    buffer_pool_stats(&after);
+
+    // assert
+    assert(reused == buffer);
+    assert(after.hits == before.hits + 1);
+    assert(after.misses == before.misses);
+
+    // teardown
+    buffer_pool_free(reused);
+    return 0;
+}
+
+int test_buffer_pool_alloc_does_not_pool_oversize() {
+    // arrange
+    errno = 0;
+    size_t size = (1 << BUFFER_POOL_MAX_SHIFT) + 1;
+    struct buffer_pool_stats before;
+    struct buffer_pool_stats after;
+
+    char *buffer = buffer_pool_alloc(size);
+    assert(buffer != NULL);
+    memset(buffer, 'x', size);
+    buffer_pool_free(buffer);
+    buffer_pool_stats(&before);
+
+    // act
+    buffer = buffer_pool_alloc(size);
+    buffer_pool_stats(&after);
+
+    // assert
+    assert(buffer != NULL);
+    assert(after.misses == before.misses + 1);
+
+    // teardown
+    buffer_pool_free(buffer);
+    return 0;
+}
+
+int test_buffer_pool_free_accepts_null() {
+    // arrange
+    errno = 0;
+
+    // act
+    buffer_pool_free(NULL);
+
+    // assert
+    assert(!errno);
+    return 0;
+}
+
+int test_buffer_pool_ref_keeps_buffer_until_last_free() {
+    // arrange
+    errno = 0;
+    void *buffer = buffer_pool_alloc(200);
+    assert(buffer != NULL);
+
+    // act: a shared buffer is not returned while referenced
+    assert(buffer_pool_ref(buffer) == buffer);
+    buffer_pool_free(buffer);
+    void *other = buffer_pool_alloc(200);
+
+    // assert
+    assert(other != buffer);
+
+    // act: the last reference returns it
+    buffer_pool_free(buffer);
+    void *reused = buffer_pool_alloc(200);
+
+    // assert
+    assert(reused == buffer);
+    assert(!buffer_pool_ref(NULL));
+    assert(!errno);
+
+    // teardown
+    buffer_pool_free(reused);
+    buffer_pool_free(other);
+    return 0;
+}
+
+static void *free_buffers(void *arg) {
+    void **buffers = arg;
+    for (int i = 0; i < 4; i++) {
+        buffer_pool_free(buffers[i]);
+    }
+    return NULL;
+}
+
+int test_buffer_pool_reuses_buffers_of_exited_threads() {
+    // arrange
+    errno = 0;
+    void *buffers[4];
+    for (int i = 0; i < 4; i++) {
+        buffers[i] = buffer_pool_alloc(16 * 1024);
+        assert(buffers[i] != NULL);
+    }
+
+    // buffers freed on another thread land in the global pool when it exits
+    pthread_t tid;
+    assert(!pthread_create(&tid, NULL, free_buffers, buffers));
+    assert(!pthread_join(tid, NULL));
+
+    struct buffer_pool_stats before;
+    struct buffer_pool_stats after;
+    buffer_pool_stats(&before);
+
+    // act
+    void *reused = buffer_pool_alloc(16 * 1024);
+    buffer_pool_stats(&after);
+
+    // assert
+    int found = 0;
+    for (int i = 0; i < 4; i++) {
+        found |= reused == buffers[i];
+    }
+    assert(found);
+    assert(after.hits == before.hits + 1);
+
+    // teardown
+    buffer_pool_free(reused);
+    return 0;
+}
+
+struct test_case tests[] = {
+    {"test_buffer_pool_alloc_fits_size", NULL, NULL,
+     test_buffer_pool_alloc_fits_size},
+    {"test_buffer_pool_alloc_misses_when_empty", NULL, NULL,
+     test_buffer_pool_alloc_misses_when_empty},
+    {"test_buffer_pool_alloc_reuses_freed_buffer", NULL, NULL,
+     test_buffer_pool_alloc_reuses_freed_buffer},
+    {"test_buffer_pool_alloc_does_not_pool_oversize", NULL, NULL,
+     test_buffer_pool_alloc_does_not_pool_oversize},
+    {"test_buffer_pool_free_accepts_null", NULL, NULL,
+     test_buffer_pool_free_accepts_null},
+    {"test_buffer_pool_ref_keeps_buffer_until_last_free", NULL, NULL,
+     test_buffer_pool_ref_keeps_buffer_until_last_free},
+    {"test_buffer_pool_reuses_buffers_of_exited_threads", NULL, NULL,
+     test_buffer_pool_reuses_buffers_of_exited_threads}};
+
+struct test_suite suite = {
+    .name = "test_buffer_pool", .setup = NULL, .teardown = NULL};
+
+int main() { run_suite(); }
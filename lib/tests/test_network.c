@@ -1,15 +1,22 @@
+#include "messageq/buffer_pool.h"
 #include "messageq/network.h"
 #include "messageq/test.h"
 #include "messageq/util.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#define UNKNOWN_METHOD 0x0fff // not a DMQP method, answered with `ENOSYS`
+#define TEST_UNIX_PATH "/tmp/messageq-test_network.sock"
+
 struct targs {
     unsigned short port;
     int result;
@@ -23,6 +30,87 @@ static void *start_test_dmqp_server(void *arg) {
     return NULL;
 }
 
+// reply deferred by the test server's `DMQP_POP` handler
+static struct dmqp_reply *deferred_reply;
+
+void handle_dmqp_pop(const struct dmqp_message *message, int client) {
+    (void)message;
+    __atomic_store_n(&deferred_reply, dmqp_reply_defer(client),
+                     __ATOMIC_RELEASE);
+}
+
+// echoes the payload back, as received by the handler
+void handle_dmqp_push(const struct dmqp_message *message, int client) {
+    struct dmqp_header header = {
+        .length = message->header.length,
+        .method = DMQP_RESPONSE,
+        .correlation_id = message->header.correlation_id};
+    struct dmqp_message response = {.header = header,
+                                    .payload = message->payload};
+    send_dmqp_message(client, &response, DMQP_SEND_LEASED);
+}
+
+// while set, the test server's `DMQP_FETCH` handler blocks its worker
+static int fetch_blocked;
+static int fetch_running;     // `DMQP_FETCH` handlers running right now
+static int fetch_running_max; // most `DMQP_FETCH` handlers ever run at once
+
+// answers with an empty response once `fetch_blocked` is cleared
+void handle_dmqp_fetch(const struct dmqp_message *message, int client) {
+    int running = __atomic_add_fetch(&fetch_running, 1, __ATOMIC_SEQ_CST);
+    int max = __atomic_load_n(&fetch_running_max, __ATOMIC_SEQ_CST);
+    while (running > max &&
+           !__atomic_compare_exchange_n(&fetch_running_max, &max, running, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+    }
+
+    while (__atomic_load_n(&fetch_blocked, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    __atomic_sub_fetch(&fetch_running, 1, __ATOMIC_SEQ_CST);
+
+    struct dmqp_header header = {
+        .method = DMQP_RESPONSE,
+        .correlation_id = message->header.correlation_id};
+    struct dmqp_message response = {.header = header, .payload = NULL};
+    send_dmqp_message(client, &response, 0);
+}
+
+static void *unblock_fetch(void *arg) {
+    (void)arg;
+    sleep(1);
+    __atomic_store_n(&fetch_blocked, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * Fills a buffer with text that compresses well.
+ */
+static void fill_compressible(char *buf, size_t length) {
+    const char *text = "{\"sensor\": 42, \"temperature\": 21.5}, ";
+    for (size_t i = 0; i < length; i++) {
+        buf[i] = text[i % strlen(text)];
+    }
+}
+
+/**
+ * Waits for the test server's `DMQP_POP` handler to defer its reply.
+ *
+ * @returns the deferred reply, `NULL` if none within 1s
+ */
+static struct dmqp_reply *take_deferred_reply() {
+    for (int retries = 100; retries > 0; retries--) {
+        struct dmqp_reply *reply =
+            __atomic_exchange_n(&deferred_reply, NULL, __ATOMIC_ACQUIRE);
+        if (reply) {
+            return reply;
+        }
+        usleep(10000);
+    }
+
+    return NULL;
+}
+
 static int read_all(int fd, void *buf, size_t count) {
     unsigned int total = 0;
 
@@ -102,6 +190,30 @@ int test_dmqp_client_init_success() {
     return 0;
 }
 
+int test_dmqp_client_connect_throws_when_invalid_args() {
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(dmqp_client_connect(NULL) < 0);
+    assert(errno == EINVAL);
+
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(dmqp_client_connect("127.0.0.1") < 0);
+    assert(errno == EINVAL);
+
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(dmqp_client_connect("127.0.0.1:80x") < 0);
+    assert(errno == EINVAL);
+    return 0;
+}
+
 int test_dmqp_server_init_handles_signals() {
     // arrange
     errno = 0;
@@ -259,8 +371,86 @@ int test_read_dmqp_message_success_with_payload() {
     assert(memcmp(buf.payload, payload, 13) == 0);
 
     // teardown
-    free(buf.payload);
+    buffer_pool_free(buf.payload);
+    close(fds[0]);
+    return 0;
+}
+
+int test_read_dmqp_message_success_with_correlation_id() {
+    // arrange
+    errno = 0;
+
+    // a header flagged with `DMQP_CORRELATED`, followed by its correlation ID
+    char header_wire[DMQP_HEADER_MAX_SIZE];
+    memset(header_wire, 0, sizeof header_wire);
+    uint32_t length = htonl(5);
+    uint16_t method = htons(DMQP_RESPONSE | DMQP_CORRELATED);
+    uint32_t correlation_id = htonl(42);
+
+    memcpy(header_wire + 4, &length, 4);
+    memcpy(header_wire + 8, &method, 2);
+    memcpy(header_wire + 12, &correlation_id, 4);
+
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    send_all(fds[1], header_wire, DMQP_HEADER_MAX_SIZE, 0);
+    send_all(fds[1], "hello", 5, 0);
+    close(fds[1]);
+
+    struct dmqp_message buf = {.payload = NULL};
+
+    // act & assert
+    assert(read_dmqp_message(fds[0], &buf) >= 0);
+    assert(!errno);
+    assert(buf.header.length == 5);
+    assert(buf.header.method == DMQP_RESPONSE);
+    assert(buf.header.correlation_id == 42);
+    assert(memcmp(buf.payload, "hello", 5) == 0);
+
+    // teardown
+    buffer_pool_free(buf.payload);
+    close(fds[0]);
+    return 0;
+}
+
+int test_read_dmqp_message_tells_idle_timeouts_from_errors() {
+    // arrange
+    errno = 0;
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    struct timeval timeout = {.tv_usec = 100000};
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+    struct dmqp_header header = {.length = 5, .method = DMQP_RESPONSE};
+    struct dmqp_message message = {.header = header, .payload = "hello"};
+    struct dmqp_message buf;
+
+    // act & assert: an idle connection times out and remains usable
+    assert(read_dmqp_message(fds[0], &buf) < 0);
+    assert(errno == ETIMEDOUT);
+    errno = 0;
+    assert(send_dmqp_message(fds[1], &message, 0) >= 0);
+    assert(read_dmqp_message(fds[0], &buf) >= 0);
+    assert(memcmp(buf.payload, "hello", 5) == 0);
+    buffer_pool_free(buf.payload);
+
+    // act & assert: a frame cut short is an error
+    char header_wire[DMQP_HEADER_SIZE] = {0};
+    send_all(fds[1], header_wire, 5, 0);
+    assert(read_dmqp_message(fds[0], &buf) < 0);
+    assert(errno == EIO);
+
+    // act & assert: a closed connection is told apart
+    int closed_fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, closed_fds);
+    close(closed_fds[1]);
+    assert(read_dmqp_message(closed_fds[0], &buf) < 0);
+    assert(errno == ECONNRESET);
+
+    // teardown
     close(fds[0]);
+    close(fds[1]);
+    close(closed_fds[0]);
     return 0;
 }
 
@@ -300,7 +490,7 @@ int test_send_dmqp_message_throws_when_payload_too_large() {
     errno = 0;
 
     struct dmqp_header header = {.sequence_id = 0,
-                                 .length = MAX_PAYLOAD_LENGTH + 1,
+                                 .length = DMQP_CHUNKED_MAX_LENGTH + 1,
                                  .method = 0,
                                  .status_code = 0};
 
@@ -330,23 +520,25 @@ int test_send_dmqp_message_success_when_no_payload() {
     struct dmqp_header header = {.sequence_id = 5,
                                  .length = 0,
                                  .method = DMQP_RESPONSE,
-                                 .status_code = 0};
+                                 .status_code = 0,
+                                 .correlation_id = 42};
 
     int fds[2];
     socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
 
     struct dmqp_message buf = {.header = header, .payload = NULL};
-    char header_wire_buf[DMQP_HEADER_SIZE];
+    char header_wire_buf[DMQP_HEADER_MAX_SIZE];
 
     uint32_t expected_sequence_id = htonl(5);
     uint32_t expected_length = 0;
-    uint16_t expected_method = htons(DMQP_RESPONSE);
+    uint16_t expected_method = htons(DMQP_RESPONSE | DMQP_CORRELATED);
     int16_t expected_status_code = 0;
+    uint32_t expected_correlation_id = htonl(42);
 
     // act & assert
     assert(send_dmqp_message(fds[1], &buf, 0) >= 0);
     assert(!errno);
-    read_all(fds[0], header_wire_buf, DMQP_HEADER_SIZE);
+    read_all(fds[0], header_wire_buf, DMQP_HEADER_MAX_SIZE);
 
     // assert that `send_dmqp_message` didn't send a payload
     assert(recv(fds[0], &buf, 1, MSG_PEEK | MSG_DONTWAIT) <= 0);
@@ -355,6 +547,7 @@ int test_send_dmqp_message_success_when_no_payload() {
     assert(memcmp(header_wire_buf + 4, &expected_length, 4) == 0);
     assert(memcmp(header_wire_buf + 8, &expected_method, 2) == 0);
     assert(memcmp(header_wire_buf + 10, &expected_status_code, 2) == 0);
+    assert(memcmp(header_wire_buf + 12, &expected_correlation_id, 4) == 0);
 
     // teardown
     close(fds[0]);
@@ -405,34 +598,1581 @@ int test_send_dmqp_message_success_with_payload() {
     return 0;
 }
 
-int test_dmqp_server_init_handles_message_with_unknown_method() {
+int test_send_dmqp_message_success_with_zerocopy_payload() {
     // arrange
     errno = 0;
-    struct targs args = {.port = 8084};
-    pthread_t tid;
-    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
-    sleep(1); // wait 1s for server to initialize
 
-    int client = dmqp_client_init("127.0.0.1", 8084);
+    // zerocopy needs a tcp socket
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address = {.sin_family = AF_INET};
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t address_len = sizeof address;
+    assert(bind(listener, (struct sockaddr *)&address, address_len) >= 0);
+    assert(listen(listener, 1) >= 0);
+    getsockname(listener, (struct sockaddr *)&address, &address_len);
+
+    int sender = dmqp_client_init("127.0.0.1", ntohs(address.sin_port));
+    assert(sender >= 0);
+    int receiver = accept(listener, NULL, NULL);
+    assert(receiver >= 0);
+
+    // small enough to fit in the socket buffers, so nothing has to be read
+    // before the kernel releases the payload
+    size_t length = 32 * 1024;
+    char *payload = malloc(length);
+    for (size_t i = 0; i < length; i++) {
+        payload[i] = (char)i;
+    }
+    struct dmqp_header header = {.length = length, .method = DMQP_RESPONSE};
+    struct dmqp_message buf = {.header = header, .payload = payload};
+    send_zerocopy_threshold = 1;
 
-    struct dmqp_header header = {0};
-    header.method = DMQP_RESPONSE + 1;
-    struct dmqp_message message = {.header = header, .payload = NULL};
+    // act
+    assert(send_dmqp_message(sender, &buf, 0) >= 0);
+    assert(!errno);
+    send_zerocopy_threshold = 0;
+
+    // the payload was released, so overwriting it must not change the bytes
+    // on the wire
+    memset(payload, 0, length);
+
+    struct dmqp_message received;
+    assert(read_dmqp_message(receiver, &received) >= 0);
+
+    // assert
+    assert(received.header.length == length);
+    for (size_t i = 0; i < length; i++) {
+        assert(((char *)received.payload)[i] == (char)i);
+    }
+
+    // teardown
+    buffer_pool_free(received.payload);
+    free(payload);
+    close(receiver);
+    close(sender);
+    close(listener);
+    return 0;
+}
+
+int test_dmqp_batch_pack_throws_when_invalid_args() {
+    // arrange
+    errno = 0;
+    struct dmqp_batch_entry entries[2] = {{.data = "Hello", .length = 5},
+                                          {.data = NULL, .length = 5}};
+    struct dmqp_message buf = {0};
 
     // act & assert
-    assert(send_dmqp_message(client, &message, 0) >= 0);
+    assert(dmqp_batch_pack(NULL, 1, &buf) < 0);
+    assert(errno == EINVAL);
+
+    assert(dmqp_batch_pack(entries, 0, &buf) < 0);
+    assert(errno == EINVAL);
+
+    assert(dmqp_batch_pack(entries, 1, NULL) < 0);
+    assert(errno == EINVAL);
+
+    assert(dmqp_batch_pack(entries, 2, &buf) < 0);
+    assert(errno == EINVAL);
+
+    // arrange
+    errno = 0;
+    entries[1].data = "World";
+    entries[1].length = MAX_PAYLOAD_LENGTH;
+
+    // act & assert
+    assert(dmqp_batch_pack(entries, 2, &buf) < 0);
+    assert(errno == EMSGSIZE);
+    return 0;
+}
+
+int test_dmqp_batch_unpack_throws_when_malformed() {
+    // arrange
+    errno = 0;
+    char payload[] = {0, 0, 0, 5, 'H', 'e', 'l', 'l', 'o', 0, 0};
+    struct dmqp_message message = {.header = {.length = sizeof payload},
+                                   .payload = payload};
+
+    // act & assert: truncated length prefix
+    assert(dmqp_batch_unpack(&message, NULL, 0) < 0);
+    assert(errno == EBADMSG);
+
+    // arrange: length prefix larger than the rest of the payload
+    errno = 0;
+    payload[3] = 6;
+    message.header.length = 9;
+
+    // act & assert
+    assert(dmqp_batch_unpack(&message, NULL, 0) < 0);
+    assert(errno == EBADMSG);
+
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(dmqp_batch_unpack(NULL, NULL, 0) < 0);
+    assert(errno == EINVAL);
+    return 0;
+}
+
+int test_dmqp_batch_unpack_success() {
+    // arrange
+    errno = 0;
+    struct dmqp_batch_entry entries[3] = {{.data = "Hello", .length = 5},
+                                          {.data = NULL, .length = 0},
+                                          {.data = "World!", .length = 6}};
+    struct dmqp_message message = {0};
+    assert(dmqp_batch_pack(entries, 3, &message) >= 0);
+
+    struct dmqp_batch_entry unpacked[2];
+
+    // act & assert
+    assert(message.header.length == 3 * DMQP_BATCH_LENGTH_SIZE + 11);
+    assert(dmqp_batch_unpack(&message, NULL, 0) == 3);
+    assert(dmqp_batch_unpack(&message, unpacked, arrlen(unpacked)) == 3);
     assert(!errno);
-    assert(read_dmqp_message(client, &message) >= 0);
+
+    assert(unpacked[0].length == 5);
+    assert(memcmp(unpacked[0].data, "Hello", 5) == 0);
+    assert(unpacked[1].length == 0);
+
+    // teardown
+    buffer_pool_free(message.payload);
+    return 0;
+}
+
+int test_dmqp_fetch_unpack_throws_when_malformed() {
+    // arrange: a length prefix without its sequence ID
+    errno = 0;
+    char payload[] = {0, 0, 0, 1, 0, 0, 0, 1, 'x', 0, 0, 0, 1};
+    struct dmqp_message message = {.header = {.length = sizeof payload},
+                                   .payload = payload};
+
+    // act & assert
+    assert(dmqp_fetch_unpack(&message, NULL, 0) < 0);
+    assert(errno == EBADMSG);
+    return 0;
+}
+
+int test_dmqp_fetch_unpack_success() {
+    // arrange
+    errno = 0;
+    struct dmqp_batch_entry entries[2] = {
+        {.data = "Hello", .length = 5, .sequence_id = 7},
+        {.data = "World!", .length = 6, .sequence_id = 9}};
+    struct dmqp_message message = {0};
+    assert(dmqp_fetch_pack(entries, 2, &message) >= 0);
+
+    struct dmqp_batch_entry unpacked[2];
+
+    // act & assert
+    assert(message.header.length == 2 * DMQP_FETCH_ENTRY_HEADER_SIZE + 11);
+    assert(dmqp_fetch_unpack(&message, unpacked, arrlen(unpacked)) == 2);
     assert(!errno);
-    assert(message.header.sequence_id == 0);
-    assert(message.header.length == 0);
-    assert(message.header.method == DMQP_RESPONSE);
-    assert(message.header.status_code == ENOSYS);
+
+    assert(unpacked[0].sequence_id == 7);
+    assert(unpacked[0].length == 5);
+    assert(memcmp(unpacked[0].data, "Hello", 5) == 0);
+    assert(unpacked[1].sequence_id == 9);
+    assert(unpacked[1].length == 6);
+    assert(memcmp(unpacked[1].data, "World!", 6) == 0);
 
     // teardown
-    pthread_kill(tid, SIGTERM);
-    pthread_join(tid, NULL);
-    close(client);
+    buffer_pool_free(message.payload);
+    return 0;
+}
+
+int test_dmqp_read_unpack_throws_when_malformed() {
+    // arrange: a payload too short for the offset
+    errno = 0;
+    char payload[] = {0, 0, 0, 0};
+    struct dmqp_message message = {.header = {.length = sizeof payload},
+                                   .payload = payload};
+    uint64_t offset;
+
+    // act & assert
+    assert(dmqp_read_unpack(&message, &offset, NULL, 0) < 0);
+    assert(errno == EBADMSG);
+
+    assert(dmqp_read_unpack(&message, NULL, NULL, 0) < 0);
+    assert(errno == EINVAL);
+    return 0;
+}
+
+int test_dmqp_read_unpack_success() {
+    // arrange
+    errno = 0;
+    struct dmqp_batch_entry entries[2] = {
+        {.data = "Hello", .length = 5, .sequence_id = 7},
+        {.data = "World!", .length = 6, .sequence_id = 9}};
+    struct dmqp_message message = {0};
+    uint64_t first = (uint64_t)1 << 40;
+    assert(dmqp_read_pack(entries, 2, first, &message) >= 0);
+
+    struct dmqp_batch_entry unpacked[2];
+    uint64_t offset = 0;
+
+    // act & assert
+    assert(message.header.length ==
+           DMQP_READ_OFFSET_SIZE + 2 * DMQP_FETCH_ENTRY_HEADER_SIZE + 11);
+    assert(dmqp_read_unpack(&message, &offset, unpacked, arrlen(unpacked)) ==
+           2);
+    assert(!errno);
+
+    assert(offset == first);
+    assert(unpacked[0].sequence_id == 7);
+    assert(memcmp(unpacked[0].data, "Hello", 5) == 0);
+    assert(unpacked[1].sequence_id == 9);
+    assert(unpacked[1].length == 6);
+    assert(memcmp(unpacked[1].data, "World!", 6) == 0);
+
+    // teardown
+    buffer_pool_free(message.payload);
+    return 0;
+}
+
+int test_dmqp_credits_unpack_throws_when_no_credits() {
+    // arrange: a batch response with two statuses and no credits
+    errno = 0;
+    char payload[] = {0, 0, 0, 0};
+    struct dmqp_message message = {.header = {.length = sizeof payload},
+                                   .payload = payload};
+    struct dmqp_credits credits;
+
+    // act & assert
+    assert(dmqp_credits_unpack(&message, &credits) < 0);
+    assert(errno == EBADMSG);
+    return 0;
+}
+
+int test_dmqp_credits_unpack_success_after_statuses() {
+    // arrange
+    errno = 0;
+    struct dmqp_credits credits = {.messages = 3, .bytes = 70000};
+    char payload[2 * DMQP_BATCH_STATUS_SIZE + DMQP_CREDITS_SIZE] = {0};
+    dmqp_credits_pack(&credits, payload + 2 * DMQP_BATCH_STATUS_SIZE);
+    struct dmqp_message message = {.header = {.length = sizeof payload},
+                                   .payload = payload};
+    struct dmqp_credits unpacked;
+
+    // act & assert
+    assert(dmqp_credits_unpack(&message, &unpacked) >= 0);
+    assert(!errno);
+    assert(unpacked.messages == 3);
+    assert(unpacked.bytes == 70000);
+    return 0;
+}
+
+int test_dmqp_credits_take_throws_when_out_of_credits() {
+    // arrange
+    errno = 0;
+    struct dmqp_credits credits = {.messages = 2, .bytes = 10};
+
+    // act & assert
+    assert(dmqp_credits_take(&credits, 6) >= 0);
+    assert(credits.messages == 1);
+    assert(credits.bytes == 4);
+
+    assert(dmqp_credits_take(&credits, 5) < 0);
+    assert(errno == ENOBUFS);
+    assert(credits.messages == 1);
+    assert(credits.bytes == 4);
+
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(dmqp_credits_take(&credits, 4) >= 0);
+    assert(dmqp_credits_take(&credits, 0) < 0);
+    assert(errno == ENOBUFS);
+    return 0;
+}
+
+int test_dmqp_compress_leaves_payload_raw() {
+    // arrange
+    errno = 0;
+    struct dmqp_compression compression = {.threshold = 64,
+                                           .flags = DMQP_COMPRESS_ADAPTIVE};
+    char compressible[4096];
+    fill_compressible(compressible, sizeof compressible);
+    char random[4096];
+    for (size_t i = 0; i < sizeof random; i++) {
+        random[i] = rand();
+    }
+
+    struct dmqp_header header = {.length = 32, .method = DMQP_PUSH};
+    struct dmqp_message message = {.header = header, .payload = compressible};
+    struct dmqp_message buf;
+
+    // act & assert: below the threshold
+    assert(dmqp_compress(&compression, &message, &buf) == 0);
+    assert(buf.payload == compressible);
+    assert(buf.header.length == 32);
+    assert(buf.header.method == DMQP_PUSH);
+
+    // act & assert: not a method carrying entries
+    message.header.length = sizeof compressible;
+    message.header.method = DMQP_FETCH;
+    assert(dmqp_compress(&compression, &message, &buf) == 0);
+    assert(buf.payload == compressible);
+
+    // act & assert: incompressible, so the next payloads are skipped
+    message.header.method = DMQP_PUSH;
+    message.payload = random;
+    assert(dmqp_compress(&compression, &message, &buf) == 0);
+    assert(buf.payload == random);
+    assert(compression.skip == DMQP_COMPRESS_BACKOFF);
+
+    message.payload = compressible;
+    assert(dmqp_compress(&compression, &message, &buf) == 0);
+    assert(buf.payload == compressible);
+    assert(compression.skip == DMQP_COMPRESS_BACKOFF - 1);
+
+    // act & assert: disabled
+    compression.threshold = 0;
+    compression.skip = 0;
+    assert(dmqp_compress(&compression, &message, &buf) == 0);
+    assert(buf.payload == compressible);
+    assert(!errno);
+
+    assert(dmqp_compress(NULL, &message, &buf) < 0);
+    assert(errno == EINVAL);
+    return 0;
+}
+
+int test_dmqp_decompress_restores_compressed_payload() {
+    // arrange
+    errno = 0;
+    struct dmqp_compression compression = {.threshold = 64};
+    char payload[4096];
+    fill_compressible(payload, sizeof payload);
+
+    struct dmqp_header header = {.length = sizeof payload,
+                                 .method = DMQP_PUSH_BATCH,
+                                 .correlation_id = 3};
+    struct dmqp_message message = {.header = header, .payload = payload};
+    struct dmqp_message buf;
+
+    // act
+    assert(dmqp_compress(&compression, &message, &buf) == 1);
+    assert(buf.header.method == (DMQP_PUSH_BATCH | DMQP_COMPRESSED));
+    assert(buf.header.length < sizeof payload / 4);
+    assert(dmqp_decompress(&buf) >= 0);
+
+    // assert
+    assert(!errno);
+    assert(buf.header.method == DMQP_PUSH_BATCH);
+    assert(buf.header.length == sizeof payload);
+    assert(buf.header.correlation_id == 3);
+    assert(memcmp(buf.payload, payload, sizeof payload) == 0);
+    buffer_pool_free(buf.payload);
+
+    // act & assert: truncated
+    assert(dmqp_compress(&compression, &message, &buf) == 1);
+    buf.header.length -= 2;
+    assert(dmqp_decompress(&buf) < 0);
+    assert(errno == EBADMSG);
+    assert(buf.header.method == (DMQP_PUSH_BATCH | DMQP_COMPRESSED));
+    buffer_pool_free(buf.payload);
+
+    // act & assert: not compressed
+    errno = 0;
+    message.header.method = UNKNOWN_METHOD;
+    assert(dmqp_decompress(&message) >= 0);
+    assert(message.payload == payload);
+    assert(message.header.method == UNKNOWN_METHOD);
+    assert(!errno);
+    return 0;
+}
+
+int test_dmqp_chunks_add_reassembles_interleaved_messages() {
+    // arrange
+    errno = 0;
+    struct dmqp_chunks chunks = {0};
+    const char *parts[] = {"Hello, ", "World!"};
+    struct dmqp_message message;
+
+    // act & assert: a chunk of each of two messages, then their last chunks
+    for (int i = 0; i < 4; i++) {
+        const char *part = parts[i / 2];
+        message.header = (struct dmqp_header){
+            .sequence_id = 7,
+            .length = strlen(part),
+            .method = DMQP_PUSH | DMQP_CHUNK | (i >= 2 ? DMQP_CHUNK_LAST : 0),
+            .correlation_id = 1 + i % 2};
+        message.payload = buffer_pool_alloc(strlen(part));
+        memcpy(message.payload, part, strlen(part));
+
+        assert(dmqp_chunks_add(&chunks, &message) == (i >= 2));
+        if (i >= 2) {
+            assert(message.header.method == DMQP_PUSH);
+            assert(message.header.sequence_id == 7);
+            assert(message.header.correlation_id == (uint32_t)(1 + i % 2));
+            assert(message.header.length == 13);
+            assert(memcmp(message.payload, "Hello, World!", 13) == 0);
+            buffer_pool_free(message.payload);
+        }
+    }
+
+    // act & assert: other frames are left as is
+    message.header = (struct dmqp_header){.method = DMQP_HEARTBEAT};
+    message.payload = NULL;
+    assert(dmqp_chunks_add(&chunks, &message) == 1);
+    assert(message.header.method == DMQP_HEARTBEAT);
+
+    // act & assert: a chunk of another method than the message's first
+    message.header = (struct dmqp_header){
+        .length = 1, .method = DMQP_PUSH | DMQP_CHUNK, .correlation_id = 3};
+    message.payload = buffer_pool_alloc(1);
+    assert(dmqp_chunks_add(&chunks, &message) == 0);
+    message.header.method = DMQP_RESPONSE | DMQP_CHUNK | DMQP_CHUNK_LAST;
+    message.payload = buffer_pool_alloc(1);
+    assert(dmqp_chunks_add(&chunks, &message) < 0);
+    assert(errno == EPROTO);
+    assert(!message.payload);
+
+    // act & assert: too many messages in flight
+    errno = 0;
+    for (uint32_t i = 0; i <= DMQP_CHUNK_MAX_STREAMS; i++) {
+        message.header = (struct dmqp_header){
+            .length = 1, .method = DMQP_PUSH | DMQP_CHUNK, .correlation_id = i};
+        message.payload = buffer_pool_alloc(1);
+        assert(dmqp_chunks_add(&chunks, &message) ==
+               (i < DMQP_CHUNK_MAX_STREAMS ? 0 : -1));
+    }
+    assert(errno == EBUSY);
+
+    // teardown
+    dmqp_chunks_reset(&chunks);
+    return 0;
+}
+
+int test_dmqp_reply_defer_throws_when_not_handling_message() {
+    // arrange
+    errno = 0;
+    struct dmqp_message message = {0};
+
+    // act & assert
+    assert(!dmqp_reply_defer(0));
+    assert(errno == EINVAL);
+
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(dmqp_reply_send(NULL, &message) < 0);
+    assert(errno == EINVAL);
+    assert(!dmqp_reply_is_open(NULL));
+    return 0;
+}
+
+int test_dmqp_payload_hold_throws_when_not_handling_message() {
+    // arrange
+    errno = 0;
+    char *payload = buffer_pool_alloc(5);
+    struct dmqp_header header = {.length = 5, .method = DMQP_PUSH};
+    struct dmqp_message message = {.header = header, .payload = payload};
+
+    // act & assert
+    assert(!dmqp_payload_hold(NULL));
+    assert(errno == EINVAL);
+
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(!dmqp_payload_hold(&message));
+    assert(errno == EINVAL);
+
+    // teardown
+    buffer_pool_free(payload);
+    return 0;
+}
+
+int test_dmqp_reply_send_answers_after_handler_returns() {
+    enum dmqp_io_backend backends[] = {DMQP_IO_BACKEND_EPOLL,
+                                       DMQP_IO_BACKEND_IO_URING};
+
+    for (int i = 0; i < arrlen(backends); i++) {
+        // arrange
+        errno = 0;
+        server_io_backend = backends[i];
+        struct targs args = {.port = 8089 + i};
+        pthread_t tid;
+        pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+        sleep(1); // wait 1s for server to initialize
+
+        int client = dmqp_client_init("127.0.0.1", args.port);
+        assert(client >= 0);
+
+        struct dmqp_header header = {.method = DMQP_POP, .correlation_id = 42};
+        struct dmqp_message message = {.header = header, .payload = NULL};
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+
+        struct dmqp_reply *reply = take_deferred_reply();
+        assert(reply);
+        assert(dmqp_reply_is_open(reply));
+
+        char byte;
+        assert(recv(client, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0);
+        assert(errno == EAGAIN || errno == EWOULDBLOCK);
+        errno = 0;
+
+        struct dmqp_header res_header = {.length = 5,
+                                         .method = DMQP_RESPONSE,
+                                         .correlation_id = 42};
+        struct dmqp_message response = {.header = res_header,
+                                        .payload = "Hello"};
+
+        // act: the handler returned long ago
+        assert(dmqp_reply_send(reply, &response) >= 0);
+
+        // assert
+        assert(read_dmqp_message(client, &message) >= 0);
+        assert(message.header.method == DMQP_RESPONSE);
+        assert(message.header.correlation_id == 42);
+        assert(message.header.length == 5);
+        assert(memcmp(message.payload, "Hello", 5) == 0);
+        buffer_pool_free(message.payload);
+
+        // arrange: a reply whose client disconnects
+        message.header = header;
+        message.payload = NULL;
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+        reply = take_deferred_reply();
+        assert(reply);
+
+        // act
+        close(client);
+        for (int retries = 100; dmqp_reply_is_open(reply) && retries > 0;
+             retries--) {
+            usleep(10000);
+        }
+
+        // assert
+        assert(!dmqp_reply_is_open(reply));
+        assert(!errno);
+
+        // teardown
+        dmqp_reply_cancel(reply);
+        pthread_kill(tid, SIGTERM);
+        pthread_join(tid, NULL);
+    }
+
+    server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    return 0;
+}
+
+int test_dmqp_reply_push_streams_messages() {
+    // arrange
+    errno = 0;
+    struct targs args = {.port = 8092};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int client = dmqp_client_init("127.0.0.1", 8092);
+    assert(client >= 0);
+
+    struct dmqp_header header = {.method = DMQP_POP, .correlation_id = 7};
+    struct dmqp_message message = {.header = header, .payload = NULL};
+    assert(send_dmqp_message(client, &message, 0) >= 0);
+
+    struct dmqp_reply *reply = take_deferred_reply();
+    assert(reply);
+
+    // act
+    for (uint32_t i = 0; i < 3; i++) {
+        struct dmqp_header res_header = {.sequence_id = i,
+                                         .method = DMQP_RESPONSE,
+                                         .correlation_id = 7};
+        struct dmqp_message response = {.header = res_header};
+        assert(dmqp_reply_push(reply, &response) >= 0);
+    }
+
+    struct dmqp_header end_header = {.sequence_id = 3,
+                                     .method = DMQP_RESPONSE,
+                                     .status_code = ECANCELED,
+                                     .correlation_id = 7};
+    struct dmqp_message end = {.header = end_header};
+    assert(dmqp_reply_send(reply, &end) >= 0);
+
+    // assert
+    for (uint32_t i = 0; i < 4; i++) {
+        assert(read_dmqp_message(client, &message) >= 0);
+        assert(message.header.sequence_id == i);
+        assert(message.header.correlation_id == 7);
+    }
+    assert(message.header.status_code == ECANCELED);
+    assert(!errno);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    return 0;
+}
+
+int test_dmqp_server_init_handles_message_with_unknown_method() {
+    // arrange
+    errno = 0;
+    struct targs args = {.port = 8084};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int client = dmqp_client_init("127.0.0.1", 8084);
+
+    struct dmqp_header header = {0};
+    header.method = UNKNOWN_METHOD;
+    struct dmqp_message message = {.header = header, .payload = NULL};
+
+    // act & assert
+    assert(send_dmqp_message(client, &message, 0) >= 0);
+    assert(!errno);
+    assert(read_dmqp_message(client, &message) >= 0);
+    assert(!errno);
+    assert(message.header.sequence_id == 0);
+    assert(message.header.length == 0);
+    assert(message.header.method == DMQP_RESPONSE);
+    assert(message.header.status_code == ENOSYS);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    return 0;
+}
+
+int test_dmqp_server_init_accepts_unix_clients() {
+    // arrange
+    errno = 0;
+    strcpy(server_unix_path, TEST_UNIX_PATH);
+    struct targs args = {.port = 8093};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    // advertised like a partition's ZNode, so the local socket is preferred
+    int client = dmqp_client_connect("127.0.0.1:8093," TEST_UNIX_PATH
+                                     ";/topics/topic/shards/shard-0");
+    assert(client >= 0);
+
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof address;
+    assert(getsockname(client, (struct sockaddr *)&address, &address_len) >= 0);
+    assert(address.ss_family == AF_UNIX);
+
+    struct dmqp_header header = {.method = UNKNOWN_METHOD,
+                                 .correlation_id = 7};
+    struct dmqp_message message = {.header = header, .payload = NULL};
+
+    // act & assert
+    assert(send_dmqp_message(client, &message, 0) >= 0);
+    assert(read_dmqp_message(client, &message) >= 0);
+    assert(!errno);
+    assert(message.header.method == DMQP_RESPONSE);
+    assert(message.header.status_code == ENOSYS);
+    assert(message.header.correlation_id == 7);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    struct stat st;
+    assert(stat(TEST_UNIX_PATH, &st) < 0);
+    server_unix_path[0] = '\0';
+    return 0;
+}
+
+int test_dmqp_server_init_io_uring_backend_accepts_unix_clients() {
+    // arrange
+    errno = 0;
+    server_io_backend = DMQP_IO_BACKEND_IO_URING;
+    strcpy(server_unix_path, TEST_UNIX_PATH);
+    struct targs args = {.port = 8094};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int clients[4];
+    for (int i = 0; i < arrlen(clients); i++) {
+        clients[i] = dmqp_client_init_unix(TEST_UNIX_PATH);
+        assert(clients[i] >= 0);
+    }
+
+    // act & assert
+    for (int i = 0; i < arrlen(clients); i++) {
+        struct dmqp_header header = {.method = UNKNOWN_METHOD,
+                                     .correlation_id = i};
+        struct dmqp_message message = {.header = header, .payload = NULL};
+        assert(send_dmqp_message(clients[i], &message, 0) >= 0);
+        assert(read_dmqp_message(clients[i], &message) >= 0);
+        assert(message.header.status_code == ENOSYS);
+        assert(message.header.correlation_id == (uint32_t)i);
+    }
+    assert(!errno);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    for (int i = 0; i < arrlen(clients); i++) {
+        close(clients[i]);
+    }
+    server_unix_path[0] = '\0';
+    server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    return 0;
+}
+
+int test_dmqp_shm_attach_throws_when_not_unix_socket() {
+    // arrange
+    errno = 0;
+    struct targs args = {.port = 8095};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int client = dmqp_client_init("127.0.0.1", 8095);
+    assert(client >= 0);
+
+    // act
+    struct dmqp_shm_client *shm = dmqp_shm_attach(client);
+
+    // assert
+    assert(!shm);
+    assert(errno == EOPNOTSUPP);
+
+    errno = 0;
+    assert(!dmqp_shm_attach(-1));
+    assert(errno == EINVAL);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    return 0;
+}
+
+int test_dmqp_shm_attach_handles_messages_through_rings() {
+    enum dmqp_io_backend backends[] = {DMQP_IO_BACKEND_EPOLL,
+                                       DMQP_IO_BACKEND_IO_URING};
+
+    for (int i = 0; i < arrlen(backends); i++) {
+        // arrange
+        errno = 0;
+        server_io_backend = backends[i];
+        strcpy(server_unix_path, TEST_UNIX_PATH);
+        struct targs args = {.port = 8096 + i};
+        pthread_t tid;
+        pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+        sleep(1); // wait 1s for server to initialize
+
+        int client = dmqp_client_init_unix(TEST_UNIX_PATH);
+        assert(client >= 0);
+        struct dmqp_shm_client *shm = dmqp_shm_attach(client);
+        assert(shm);
+
+        // act & assert: more messages than fit in the ring at once
+        char *payload = calloc(1, 64 * 1024);
+        for (int j = 0; j < 256; j++) {
+            struct dmqp_header header = {.length = 64 * 1024,
+                                         .method = UNKNOWN_METHOD,
+                                         .correlation_id = j};
+            struct dmqp_message message = {.header = header,
+                                           .payload = payload};
+            assert(dmqp_shm_send(shm, &message) >= 0);
+
+            assert(dmqp_shm_read(shm, &message) >= 0);
+            assert(message.header.method == DMQP_RESPONSE);
+            assert(message.header.status_code == ENOSYS);
+            assert(message.header.correlation_id == (uint32_t)j);
+            assert(message.header.length == 0);
+        }
+        free(payload);
+
+        // act & assert: deferred replies go through the ring too
+        struct dmqp_header header = {.method = DMQP_POP, .correlation_id = 42};
+        struct dmqp_message message = {.header = header, .payload = NULL};
+        assert(dmqp_shm_send(shm, &message) >= 0);
+
+        struct dmqp_reply *reply = take_deferred_reply();
+        assert(reply);
+        assert(dmqp_reply_is_open(reply));
+
+        struct dmqp_header res_header = {.length = 5,
+                                         .method = DMQP_RESPONSE,
+                                         .correlation_id = 42};
+        struct dmqp_message response = {.header = res_header,
+                                        .payload = "Hello"};
+        assert(dmqp_reply_send(reply, &response) >= 0);
+
+        assert(dmqp_shm_read(shm, &message) >= 0);
+        assert(message.header.correlation_id == 42);
+        assert(message.header.length == 5);
+        assert(memcmp(message.payload, "Hello", 5) == 0);
+        buffer_pool_free(message.payload);
+        assert(!errno);
+
+        // teardown
+        dmqp_shm_detach(shm);
+        close(client);
+        pthread_kill(tid, SIGTERM);
+        pthread_join(tid, NULL);
+        server_unix_path[0] = '\0';
+        server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    }
+
+    return 0;
+}
+
+int test_dmqp_client_compress_compresses_both_directions() {
+    enum dmqp_io_backend backends[] = {DMQP_IO_BACKEND_EPOLL,
+                                       DMQP_IO_BACKEND_IO_URING};
+
+    for (int i = 0; i < arrlen(backends); i++) {
+        // arrange
+        errno = 0;
+        server_io_backend = backends[i];
+        struct targs args = {.port = 8098 + i};
+        pthread_t tid;
+        pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+        sleep(1); // wait 1s for server to initialize
+
+        int client = dmqp_client_init("127.0.0.1", args.port);
+        assert(client >= 0);
+
+        struct dmqp_compression compression;
+        assert(dmqp_client_compress(client, 64, DMQP_COMPRESS_ADAPTIVE,
+                                    &compression) >= 0);
+        assert(compression.threshold == 64);
+
+        char payload[4096];
+        fill_compressible(payload, sizeof payload);
+        struct dmqp_header header = {.length = sizeof payload,
+                                     .method = DMQP_PUSH,
+                                     .correlation_id = 9};
+        struct dmqp_message message = {.header = header, .payload = payload};
+        struct dmqp_message compressed;
+        assert(dmqp_compress(&compression, &message, &compressed) == 1);
+
+        // act: the server echoes the decompressed push
+        assert(send_dmqp_message(client, &compressed, 0) >= 0);
+        buffer_pool_free(compressed.payload);
+
+        // assert: the echo is compressed on the wire
+        char header_wire_buf[DMQP_HEADER_MAX_SIZE];
+        assert(read_all(client, header_wire_buf, DMQP_HEADER_MAX_SIZE) >= 0);
+        struct dmqp_message response = {0};
+        memcpy(&response.header.length, header_wire_buf + 4, 4);
+        memcpy(&response.header.method, header_wire_buf + 8, 2);
+        memcpy(&response.header.correlation_id, header_wire_buf + 12, 4);
+        response.header.length = ntohl(response.header.length);
+        response.header.method = ntohs(response.header.method);
+        response.header.correlation_id = ntohl(response.header.correlation_id);
+        assert(response.header.method ==
+               (DMQP_RESPONSE | DMQP_COMPRESSED | DMQP_CORRELATED));
+        assert(response.header.correlation_id == 9);
+        assert(response.header.length < sizeof payload / 4);
+        response.header.method &= ~DMQP_CORRELATED;
+
+        response.payload = buffer_pool_alloc(response.header.length);
+        assert(read_all(client, response.payload, response.header.length) >=
+               0);
+        assert(dmqp_decompress(&response) >= 0);
+        assert(response.header.length == sizeof payload);
+        assert(memcmp(response.payload, payload, sizeof payload) == 0);
+        buffer_pool_free(response.payload);
+
+        // assert: small replies stay raw
+        message.header.length = 16;
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+        assert(read_dmqp_message(client, &response) >= 0);
+        assert(response.header.method == DMQP_RESPONSE);
+        assert(response.header.length == 16);
+        buffer_pool_free(response.payload);
+        assert(!errno);
+
+        // teardown
+        pthread_kill(tid, SIGTERM);
+        pthread_join(tid, NULL);
+        close(client);
+        server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    }
+
+    return 0;
+}
+
+int test_dmqp_client_hello_throws_when_invalid_args() {
+    // arrange
+    errno = 0;
+    struct dmqp_hello hello;
+
+    // act & assert
+    assert(dmqp_client_hello(-1, DMQP_VERSION, DMQP_FEATURES, &hello) < 0);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(dmqp_client_hello(0, 0, DMQP_FEATURES, &hello) < 0);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(dmqp_client_hello(0, DMQP_VERSION, DMQP_FEATURES, NULL) < 0);
+    assert(errno == EINVAL);
+
+    return 0;
+}
+
+int test_dmqp_client_hello_negotiates_compact_headers() {
+    enum dmqp_io_backend backends[] = {DMQP_IO_BACKEND_EPOLL,
+                                       DMQP_IO_BACKEND_IO_URING};
+
+    for (int i = 0; i < arrlen(backends); i++) {
+        // arrange
+        errno = 0;
+        server_io_backend = backends[i];
+        struct targs args = {.port = 8100 + i};
+        pthread_t tid;
+        pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+        sleep(1); // wait 1s for server to initialize
+
+        int v1_client = dmqp_client_init("127.0.0.1", args.port);
+        int client = dmqp_client_init("127.0.0.1", args.port);
+        assert(v1_client >= 0 && client >= 0);
+
+        // act
+        struct dmqp_hello v1_hello;
+        struct dmqp_hello hello;
+        assert(dmqp_client_hello(v1_client, 1, DMQP_FEATURES, &v1_hello) >=
+               0);
+        assert(dmqp_client_hello(client, DMQP_VERSION, 0xff, &hello) >= 0);
+
+        // assert: version 1 keeps fixed headers, followed by the correlation ID
+        assert(v1_hello.version == 1);
+        assert(v1_hello.features ==
+               (DMQP_FEATURES & ~DMQP_FEATURE_COMPACT_HEADER));
+        assert(hello.version == DMQP_VERSION);
+        assert(hello.features == DMQP_FEATURES);
+
+        struct dmqp_header header = {
+            .length = 5, .method = DMQP_PUSH, .correlation_id = 300};
+        struct dmqp_message message = {.header = header, .payload = "hello"};
+        assert(send_dmqp_message(v1_client, &message, 0) >= 0);
+        char wire[DMQP_HEADER_MAX_SIZE + 5];
+        assert(recv(v1_client, wire, sizeof wire, MSG_PEEK | MSG_WAITALL) ==
+               sizeof wire);
+        assert(memcmp(wire + DMQP_HEADER_MAX_SIZE, "hello", 5) == 0);
+
+        struct dmqp_message response;
+        assert(read_dmqp_message(v1_client, &response) >= 0);
+        assert(response.header.correlation_id == 300);
+        buffer_pool_free(response.payload);
+
+        // assert: flags, length, method and correlation ID take 5 bytes
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+        assert(recv(client, wire, 10, MSG_PEEK | MSG_WAITALL) == 10);
+        assert(memcmp(wire + 5, "hello", 5) == 0);
+
+        assert(read_dmqp_message(client, &response) >= 0);
+        assert(response.header.method == DMQP_RESPONSE);
+        assert(response.header.length == 5);
+        assert(response.header.correlation_id == 300);
+        assert(memcmp(response.payload, "hello", 5) == 0);
+        buffer_pool_free(response.payload);
+
+        // assert: large payloads and error replies round trip
+        char *payload = malloc(MAX_PAYLOAD_LENGTH);
+        fill_compressible(payload, MAX_PAYLOAD_LENGTH);
+        message.header.length = MAX_PAYLOAD_LENGTH;
+        message.header.sequence_id = 7;
+        message.payload = payload;
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+        assert(read_dmqp_message(client, &response) >= 0);
+        assert(response.header.length == MAX_PAYLOAD_LENGTH);
+        assert(memcmp(response.payload, payload, MAX_PAYLOAD_LENGTH) == 0);
+        buffer_pool_free(response.payload);
+        free(payload);
+
+        message.header.length = 0;
+        message.header.method = 0x7fff;
+        message.payload = NULL;
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+        assert(read_dmqp_message(client, &response) >= 0);
+        assert(response.header.status_code == ENOSYS);
+        assert(!errno);
+
+        // teardown
+        pthread_kill(tid, SIGTERM);
+        pthread_join(tid, NULL);
+        dmqp_client_close(v1_client);
+        dmqp_client_close(client);
+        server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    }
+
+    return 0;
+}
+
+int test_dmqp_client_heartbeat_keeps_idle_connection_alive() {
+    // arrange
+    errno = 0;
+    dmqp_keepalive.idle_sec = 5;
+    struct targs args = {.port = 8105};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int client = dmqp_client_init("127.0.0.1", 8105);
+    assert(client >= 0);
+    struct timeval timeout = {.tv_usec = 200000};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+    // act & assert
+    int idle_sec = 0;
+    socklen_t idle_sec_len = sizeof idle_sec;
+    getsockopt(client, IPPROTO_TCP, TCP_KEEPIDLE, &idle_sec, &idle_sec_len);
+    assert(idle_sec == 5);
+
+    struct dmqp_message message;
+    assert(read_dmqp_message(client, &message) < 0);
+    assert(errno == ETIMEDOUT);
+    errno = 0;
+    assert(dmqp_client_heartbeat(client) >= 0);
+    assert(!errno);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    dmqp_keepalive.idle_sec = DMQP_KEEPALIVE_IDLE_SEC;
+    return 0;
+}
+
+int test_dmqp_server_init_multiplexes_clients() {
+    // arrange
+    errno = 0;
+    struct targs args = {.port = 8085};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int clients[64];
+    for (int i = 0; i < arrlen(clients); i++) {
+        clients[i] = dmqp_client_init("127.0.0.1", 8085);
+        assert(clients[i] >= 0);
+    }
+
+    // wire format of a header with an unknown method
+    char header_wire[DMQP_HEADER_SIZE] = {0};
+    uint16_t method = htons(UNKNOWN_METHOD);
+    memcpy(header_wire + 8, &method, 2);
+
+    // act: split every header across two writes so that the server must
+    // resume partially read frames
+    for (int i = 0; i < arrlen(clients); i++) {
+        assert(send_all(clients[i], header_wire, 5, 0) >= 0);
+    }
+    usleep(100000);
+    for (int i = 0; i < arrlen(clients); i++) {
+        assert(send_all(clients[i], header_wire + 5, DMQP_HEADER_SIZE - 5,
+                        0) >= 0);
+    }
+
+    // assert
+    for (int i = 0; i < arrlen(clients); i++) {
+        struct dmqp_message message;
+        assert(read_dmqp_message(clients[i], &message) >= 0);
+        assert(message.header.method == DMQP_RESPONSE);
+        assert(message.header.status_code == ENOSYS);
+    }
+    assert(!errno);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    for (int i = 0; i < arrlen(clients); i++) {
+        close(clients[i]);
+    }
+    return 0;
+}
+
+int test_dmqp_server_init_accepts_clients_on_every_acceptor() {
+    // arrange
+    errno = 0;
+    server_acceptors = 4;
+    server_pin_cpus = 1;
+    struct targs args = {.port = 8102};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    // act: enough connections that the kernel hashes some to every listener
+    int clients[64];
+    for (int i = 0; i < arrlen(clients); i++) {
+        clients[i] = dmqp_client_init("127.0.0.1", 8102);
+        assert(clients[i] >= 0);
+    }
+
+    struct dmqp_header header = {.length = 4, .method = DMQP_PUSH};
+    for (int i = 0; i < arrlen(clients); i++) {
+        header.correlation_id = i;
+        struct dmqp_message message = {.header = header, .payload = "ping"};
+        assert(send_dmqp_message(clients[i], &message, 0) >= 0);
+    }
+
+    // assert
+    for (int i = 0; i < arrlen(clients); i++) {
+        struct dmqp_message message;
+        assert(read_dmqp_message(clients[i], &message) >= 0);
+        assert(message.header.method == DMQP_RESPONSE);
+        assert(message.header.correlation_id == (uint32_t)i);
+        assert(memcmp(message.payload, "ping", 4) == 0);
+        buffer_pool_free(message.payload);
+    }
+    assert(!errno);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    for (int i = 0; i < arrlen(clients); i++) {
+        close(clients[i]);
+    }
+    server_acceptors = 0;
+    server_pin_cpus = 0;
+    return 0;
+}
+
+int test_dmqp_server_init_steers_clients_to_pinned_threads() {
+    enum dmqp_io_backend backends[] = {DMQP_IO_BACKEND_EPOLL,
+                                       DMQP_IO_BACKEND_IO_URING};
+
+    for (int i = 0; i < arrlen(backends); i++) {
+        // arrange
+        errno = 0;
+        server_io_backend = backends[i];
+        server_acceptors = 4;
+        server_pin_cpus = 1;
+        server_reuseport_steering = 1;
+        struct targs args = {.port = 8103 + i};
+        pthread_t tid;
+        pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+        sleep(1); // wait 1s for server to initialize
+
+        // act
+        int clients[16];
+        for (int j = 0; j < arrlen(clients); j++) {
+            clients[j] = dmqp_client_init("127.0.0.1", args.port);
+            assert(clients[j] >= 0);
+        }
+
+        struct dmqp_header header = {.length = 4, .method = DMQP_PUSH};
+        for (int j = 0; j < arrlen(clients); j++) {
+            header.correlation_id = j;
+            struct dmqp_message message = {.header = header,
+                                           .payload = "ping"};
+            assert(send_dmqp_message(clients[j], &message, 0) >= 0);
+        }
+
+        // assert
+        for (int j = 0; j < arrlen(clients); j++) {
+            struct dmqp_message message;
+            assert(read_dmqp_message(clients[j], &message) >= 0);
+            assert(message.header.correlation_id == (uint32_t)j);
+            buffer_pool_free(message.payload);
+        }
+        assert(!errno);
+
+        // teardown
+        pthread_kill(tid, SIGTERM);
+        pthread_join(tid, NULL);
+        for (int j = 0; j < arrlen(clients); j++) {
+            close(clients[j]);
+        }
+        server_io_backend = DMQP_IO_BACKEND_EPOLL;
+        server_acceptors = 0;
+        server_pin_cpus = 0;
+        server_reuseport_steering = 0;
+    }
+
+    return 0;
+}
+
+int test_dmqp_server_init_io_uring_backend_handles_messages() {
+    // arrange
+    errno = 0;
+    server_io_backend = DMQP_IO_BACKEND_IO_URING;
+    struct targs args = {.port = 8086};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int client = dmqp_client_init("127.0.0.1", 8086);
+    assert(client >= 0);
+
+    // three frames with an unknown method in a single write, the second with
+    // a correlation ID
+    char wire[3 * DMQP_HEADER_SIZE + DMQP_CORRELATION_ID_SIZE] = {0};
+    size_t offset = 0;
+    for (int i = 0; i < 3; i++) {
+        uint32_t sequence_id = htonl(i);
+        uint16_t method =
+            htons(UNKNOWN_METHOD | (i == 1 ? DMQP_CORRELATED : 0));
+        memcpy(wire + offset, &sequence_id, 4);
+        memcpy(wire + offset + 8, &method, 2);
+        offset += DMQP_HEADER_SIZE;
+        if (i == 1) {
+            uint32_t correlation_id = htonl(7);
+            memcpy(wire + offset, &correlation_id, 4);
+            offset += DMQP_CORRELATION_ID_SIZE;
+        }
+    }
+
+    // act
+    assert(send_all(client, wire, sizeof wire, 0) >= 0);
+
+    // assert
+    int correlated = 0;
+    for (int i = 0; i < 3; i++) {
+        struct dmqp_message message;
+        assert(read_dmqp_message(client, &message) >= 0);
+        assert(message.header.method == DMQP_RESPONSE);
+        assert(message.header.status_code == ENOSYS);
+        assert(message.header.correlation_id == 0 ||
+               message.header.correlation_id == 7);
+        correlated += message.header.correlation_id == 7;
+    }
+    assert(correlated == 1);
+    assert(!errno);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    return 0;
+}
+
+int test_dmqp_server_init_sends_leased_replies_with_zerocopy() {
+    // arrange
+    errno = 0;
+    send_zerocopy_threshold = 1;
+    struct targs args = {.port = 8097};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int client = dmqp_client_init("127.0.0.1", 8097);
+    assert(client >= 0);
+
+    size_t length = 256 * 1024;
+    char *payload = malloc(length);
+    for (size_t i = 0; i < length; i++) {
+        payload[i] = (char)(i % 251);
+    }
+
+    // act: the server echoes each payload from the received lease, which it
+    // releases once the kernel is done sending from it
+    for (int i = 0; i < 8; i++) {
+        struct dmqp_header header = {
+            .length = length, .method = DMQP_PUSH, .correlation_id = i};
+        struct dmqp_message message = {.header = header, .payload = payload};
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+    }
+
+    // assert
+    for (int i = 0; i < 8; i++) {
+        struct dmqp_message message;
+        assert(read_dmqp_message(client, &message) >= 0);
+        assert(message.header.method == DMQP_RESPONSE);
+        assert(message.header.length == length);
+        assert(!memcmp(message.payload, payload, length));
+        buffer_pool_free(message.payload);
+    }
+    assert(!errno);
+
+    // teardown
+    send_zerocopy_threshold = 0;
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    free(payload);
+    return 0;
+}
+
+int test_dmqp_server_init_echoes_correlation_ids_of_pipelined_requests() {
+    // arrange
+    errno = 0;
+    struct targs args = {.port = 8087};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int client = dmqp_client_init("127.0.0.1", 8087);
+    assert(client >= 0);
+
+    // act: send every request before reading any response
+    int seen[32] = {0};
+    for (int i = 0; i < arrlen(seen); i++) {
+        struct dmqp_header header = {.method = UNKNOWN_METHOD,
+                                     .correlation_id = 1000 + i};
+        struct dmqp_message message = {.header = header, .payload = NULL};
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+    }
+
+    // assert: responses may arrive in any order, but each request is
+    // answered exactly once
+    for (int i = 0; i < arrlen(seen); i++) {
+        struct dmqp_message message;
+        assert(read_dmqp_message(client, &message) >= 0);
+        assert(message.header.method == DMQP_RESPONSE);
+        assert(message.header.status_code == ENOSYS);
+        assert(message.header.correlation_id >= 1000 &&
+               message.header.correlation_id < 1000 + arrlen(seen));
+        assert(!seen[message.header.correlation_id - 1000]);
+        seen[message.header.correlation_id - 1000] = 1;
+    }
+    assert(!errno);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    return 0;
+}
+
+int test_dmqp_server_init_reads_large_and_small_frames_together() {
+    // arrange
+    errno = 0;
+    struct targs args = {.port = 8088};
+    pthread_t tid;
+    pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+    sleep(1); // wait 1s for server to initialize
+
+    int client = dmqp_client_init("127.0.0.1", 8088);
+    assert(client >= 0);
+
+    // a payload larger than the event loop's read buffer, then a small frame
+    size_t large = 4 * EVENT_LOOP_READ_BUFFER_SIZE;
+    char *payload = calloc(1, large);
+    struct dmqp_header header = {.length = large,
+                                 .method = UNKNOWN_METHOD,
+                                 .correlation_id = 1};
+    struct dmqp_message message = {.header = header, .payload = payload};
+
+    // act
+    assert(send_dmqp_message(client, &message, 0) >= 0);
+    message.header.length = 0;
+    message.header.correlation_id = 2;
+    message.payload = NULL;
+    assert(send_dmqp_message(client, &message, 0) >= 0);
+
+    // assert
+    int seen = 0;
+    for (int i = 0; i < 2; i++) {
+        assert(read_dmqp_message(client, &message) >= 0);
+        assert(message.header.method == DMQP_RESPONSE);
+        assert(message.header.status_code == ENOSYS);
+        seen |= 1 << message.header.correlation_id;
+    }
+    assert(seen == ((1 << 1) | (1 << 2)));
+    assert(!errno);
+
+    // teardown
+    pthread_kill(tid, SIGTERM);
+    pthread_join(tid, NULL);
+    close(client);
+    free(payload);
+    return 0;
+}
+
+int test_dmqp_server_init_stalls_connection_when_worker_pool_full() {
+    enum dmqp_io_backend backends[] = {DMQP_IO_BACKEND_EPOLL,
+                                       DMQP_IO_BACKEND_IO_URING};
+    for (int i = 0; i < arrlen(backends); i++) {
+        // arrange
+        errno = 0;
+        server_io_backend = backends[i];
+        struct targs args = {.port = 8108 + i};
+        pthread_t tid;
+        pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+        sleep(1); // wait 1s for server to initialize
+
+        int client = dmqp_client_init("127.0.0.1", args.port);
+        assert(client >= 0);
+
+        // enough requests to fill every worker and its deque, and then some
+        struct worker_stats stats[WORKER_POOL_MAX_WORKERS];
+        unsigned int workers =
+            dmqp_server_worker_stats(stats, WORKER_POOL_MAX_WORKERS);
+        assert(workers > 0);
+        unsigned int n = workers * (WORKER_QUEUE_CAPACITY + 1) + 64;
+        char *seen = calloc(n, 1);
+
+        __atomic_store_n(&fetch_blocked, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&fetch_running_max, 0, __ATOMIC_RELEASE);
+        pthread_t unblocker;
+        pthread_create(&unblocker, NULL, unblock_fetch, NULL);
+
+        // act
+        for (unsigned int j = 0; j < n; j++) {
+            struct dmqp_header header = {.method = DMQP_FETCH,
+                                         .correlation_id = j};
+            struct dmqp_message message = {.header = header, .payload = NULL};
+            assert(send_dmqp_message(client, &message, 0) >= 0);
+        }
+
+        // assert: every request is answered once, and only workers ran the
+        // handler while the pool was full
+        for (unsigned int j = 0; j < n; j++) {
+            struct dmqp_message message;
+            assert(read_dmqp_message(client, &message) >= 0);
+            assert(message.header.method == DMQP_RESPONSE);
+            assert(message.header.correlation_id < n);
+            assert(!seen[message.header.correlation_id]);
+            seen[message.header.correlation_id] = 1;
+        }
+        assert(__atomic_load_n(&fetch_running_max, __ATOMIC_ACQUIRE) <=
+               (int)workers);
+        assert(!errno);
+
+        // teardown
+        pthread_join(unblocker, NULL);
+        pthread_kill(tid, SIGTERM);
+        pthread_join(tid, NULL);
+        close(client);
+        free(seen);
+    }
+    server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    return 0;
+}
+
+/**
+ * Returns the CPU time the process has used, in microseconds.
+ */
+static long cpu_time_us() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+int test_dmqp_server_init_backs_off_when_out_of_descriptors() {
+    enum dmqp_io_backend backends[] = {DMQP_IO_BACKEND_EPOLL,
+                                       DMQP_IO_BACKEND_IO_URING};
+    for (int i = 0; i < arrlen(backends); i++) {
+        // arrange
+        errno = 0;
+        server_io_backend = backends[i];
+        struct targs args = {.port = 8090 + i};
+        pthread_t tid;
+        pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+        sleep(1); // wait 1s for server to initialize
+
+        // leave the client's socket the last descriptor, so that the
+        // server's accept fails with `EMFILE`
+        struct rlimit limit;
+        getrlimit(RLIMIT_NOFILE, &limit);
+        int lowest = dup(0);
+        close(lowest);
+        struct rlimit low = {.rlim_cur = lowest + 1,
+                             .rlim_max = limit.rlim_max};
+        assert(setrlimit(RLIMIT_NOFILE, &low) >= 0);
+
+        int client = dmqp_client_init("127.0.0.1", args.port);
+        assert(client >= 0);
+
+        // act
+        usleep(100000);
+        long start = cpu_time_us();
+        usleep(500000);
+        long used = cpu_time_us() - start;
+        assert(setrlimit(RLIMIT_NOFILE, &limit) >= 0);
+
+        // assert: the server waited instead of spinning on the listener, and
+        // accepted the client once descriptors were freed
+        assert(used < 250000);
+
+        struct dmqp_header header = {.length = 4, .method = DMQP_PUSH};
+        struct dmqp_message message = {.header = header, .payload = "ping"};
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+        assert(read_dmqp_message(client, &message) >= 0);
+        assert(message.header.method == DMQP_RESPONSE);
+        assert(memcmp(message.payload, "ping", 4) == 0);
+        buffer_pool_free(message.payload);
+        assert(!errno);
+
+        // teardown
+        pthread_kill(tid, SIGTERM);
+        pthread_join(tid, NULL);
+        close(client);
+    }
+    server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    return 0;
+}
+
+int test_dmqp_server_init_interleaves_chunked_messages() {
+    enum dmqp_io_backend backends[] = {DMQP_IO_BACKEND_EPOLL,
+                                       DMQP_IO_BACKEND_IO_URING};
+    for (int i = 0; i < arrlen(backends); i++) {
+        // arrange
+        errno = 0;
+        server_io_backend = backends[i];
+        struct targs args = {.port = 8106 + i};
+        pthread_t tid;
+        pthread_create(&tid, NULL, start_test_dmqp_server, &args);
+        sleep(1); // wait 1s for server to initialize
+
+        int client = dmqp_client_init("127.0.0.1", args.port);
+        assert(client >= 0);
+
+        size_t length = 3 * MAX_PAYLOAD_LENGTH;
+        char *payload = malloc(length);
+        for (size_t j = 0; j < length; j++) {
+            payload[j] = j % 251;
+        }
+        struct dmqp_header header = {.length = MAX_PAYLOAD_LENGTH,
+                                     .method = DMQP_PUSH,
+                                     .correlation_id = 1};
+        struct dmqp_message message = {.header = header, .payload = payload};
+        struct dmqp_header heartbeat_header = {.method = DMQP_HEARTBEAT,
+                                               .correlation_id = 2};
+        struct dmqp_message heartbeat = {.header = heartbeat_header};
+        struct dmqp_chunks chunks = {0};
+        struct dmqp_message response;
+
+        // act & assert: a heartbeat is answered between the chunks of a push
+        assert(send_dmqp_chunk(client, &message, 0, 0) >= 0);
+        assert(send_dmqp_message(client, &heartbeat, 0) >= 0);
+        assert(read_dmqp_chunked_message(client, &chunks, &response) >= 0);
+        assert(response.header.correlation_id == 2);
+        assert(response.header.status_code == 0);
+
+        for (int j = 1; j < 3; j++) {
+            message.payload = payload + j * MAX_PAYLOAD_LENGTH;
+            assert(send_dmqp_chunk(client, &message, j == 2, 0) >= 0);
+        }
+        assert(read_dmqp_chunked_message(client, &chunks, &response) >= 0);
+        assert(response.header.method == DMQP_RESPONSE);
+        assert(response.header.correlation_id == 1);
+        assert(response.header.length == length);
+        assert(memcmp(response.payload, payload, length) == 0);
+        buffer_pool_free(response.payload);
+
+        // act & assert: larger payloads are chunked by `send_dmqp_message`
+        message.header.length = length;
+        message.header.correlation_id = 3;
+        message.payload = payload;
+        assert(send_dmqp_message(client, &message, 0) >= 0);
+        assert(read_dmqp_chunked_message(client, &chunks, &response) >= 0);
+        assert(response.header.correlation_id == 3);
+        assert(response.header.length == length);
+        assert(memcmp(response.payload, payload, length) == 0);
+        buffer_pool_free(response.payload);
+        assert(!errno);
+
+        // teardown
+        pthread_kill(tid, SIGTERM);
+        pthread_join(tid, NULL);
+        close(client);
+        free(payload);
+        server_io_backend = DMQP_IO_BACKEND_EPOLL;
+    }
+
     return 0;
 }
 
@@ -443,6 +2183,8 @@ struct test_case tests[] = {
      test_dmqp_client_init_throws_when_server_does_not_exist},
     {"test_dmqp_client_init_success", NULL, NULL,
      test_dmqp_client_init_success},
+    {"test_dmqp_client_connect_throws_when_invalid_args", NULL, NULL,
+     test_dmqp_client_connect_throws_when_invalid_args},
     {"test_dmqp_server_init_handles_signals", NULL, NULL,
      test_dmqp_server_init_handles_signals},
     {"test_read_dmqp_message_throws_when_invalid_args", NULL, NULL,
@@ -453,6 +2195,10 @@ struct test_case tests[] = {
      test_read_dmqp_message_success_when_no_payload},
     {"test_read_dmqp_message_success_with_payload", NULL, NULL,
      test_read_dmqp_message_success_with_payload},
+    {"test_read_dmqp_message_success_with_correlation_id", NULL, NULL,
+     test_read_dmqp_message_success_with_correlation_id},
+    {"test_read_dmqp_message_tells_idle_timeouts_from_errors", NULL, NULL,
+     test_read_dmqp_message_tells_idle_timeouts_from_errors},
     {"test_send_dmqp_message_throws_when_invalid_args", NULL, NULL,
      test_send_dmqp_message_throws_when_invalid_args},
     {"test_send_dmqp_message_throws_when_payload_too_large", NULL, NULL,
@@ -461,8 +2207,81 @@ struct test_case tests[] = {
      test_send_dmqp_message_success_when_no_payload},
     {"test_send_dmqp_message_success_with_payload", NULL, NULL,
      test_send_dmqp_message_success_with_payload},
+    {"test_send_dmqp_message_success_with_zerocopy_payload", NULL, NULL,
+     test_send_dmqp_message_success_with_zerocopy_payload},
+    {"test_dmqp_batch_pack_throws_when_invalid_args", NULL, NULL,
+     test_dmqp_batch_pack_throws_when_invalid_args},
+    {"test_dmqp_batch_unpack_throws_when_malformed", NULL, NULL,
+     test_dmqp_batch_unpack_throws_when_malformed},
+    {"test_dmqp_batch_unpack_success", NULL, NULL,
+     test_dmqp_batch_unpack_success},
+    {"test_dmqp_fetch_unpack_throws_when_malformed", NULL, NULL,
+     test_dmqp_fetch_unpack_throws_when_malformed},
+    {"test_dmqp_fetch_unpack_success", NULL, NULL,
+     test_dmqp_fetch_unpack_success},
+    {"test_dmqp_read_unpack_throws_when_malformed", NULL, NULL,
+     test_dmqp_read_unpack_throws_when_malformed},
+    {"test_dmqp_read_unpack_success", NULL, NULL,
+     test_dmqp_read_unpack_success},
+    {"test_dmqp_credits_unpack_throws_when_no_credits", NULL, NULL,
+     test_dmqp_credits_unpack_throws_when_no_credits},
+    {"test_dmqp_credits_unpack_success_after_statuses", NULL, NULL,
+     test_dmqp_credits_unpack_success_after_statuses},
+    {"test_dmqp_credits_take_throws_when_out_of_credits", NULL, NULL,
+     test_dmqp_credits_take_throws_when_out_of_credits},
+    {"test_dmqp_compress_leaves_payload_raw", NULL, NULL,
+     test_dmqp_compress_leaves_payload_raw},
+    {"test_dmqp_decompress_restores_compressed_payload", NULL, NULL,
+     test_dmqp_decompress_restores_compressed_payload},
+    {"test_dmqp_chunks_add_reassembles_interleaved_messages", NULL, NULL,
+     test_dmqp_chunks_add_reassembles_interleaved_messages},
+    {"test_dmqp_reply_defer_throws_when_not_handling_message", NULL, NULL,
+     test_dmqp_reply_defer_throws_when_not_handling_message},
+    {"test_dmqp_payload_hold_throws_when_not_handling_message", NULL, NULL,
+     test_dmqp_payload_hold_throws_when_not_handling_message},
+    {"test_dmqp_reply_send_answers_after_handler_returns", NULL, NULL,
+     test_dmqp_reply_send_answers_after_handler_returns},
+    {"test_dmqp_reply_push_streams_messages", NULL, NULL,
+     test_dmqp_reply_push_streams_messages},
     {"test_dmqp_server_init_handles_message_with_unknown_method", NULL, NULL,
-     test_dmqp_server_init_handles_message_with_unknown_method}};
+     test_dmqp_server_init_handles_message_with_unknown_method},
+    {"test_dmqp_server_init_accepts_unix_clients", NULL, NULL,
+     test_dmqp_server_init_accepts_unix_clients},
+    {"test_dmqp_server_init_io_uring_backend_accepts_unix_clients", NULL, NULL,
+     test_dmqp_server_init_io_uring_backend_accepts_unix_clients},
+    {"test_dmqp_shm_attach_throws_when_not_unix_socket", NULL, NULL,
+     test_dmqp_shm_attach_throws_when_not_unix_socket},
+    {"test_dmqp_shm_attach_handles_messages_through_rings", NULL, NULL,
+     test_dmqp_shm_attach_handles_messages_through_rings},
+    {"test_dmqp_client_compress_compresses_both_directions", NULL, NULL,
+     test_dmqp_client_compress_compresses_both_directions},
+    {"test_dmqp_client_hello_throws_when_invalid_args", NULL, NULL,
+     test_dmqp_client_hello_throws_when_invalid_args},
+    {"test_dmqp_client_hello_negotiates_compact_headers", NULL, NULL,
+     test_dmqp_client_hello_negotiates_compact_headers},
+    {"test_dmqp_client_heartbeat_keeps_idle_connection_alive", NULL, NULL,
+     test_dmqp_client_heartbeat_keeps_idle_connection_alive},
+    {"test_dmqp_server_init_multiplexes_clients", NULL, NULL,
+     test_dmqp_server_init_multiplexes_clients},
+    {"test_dmqp_server_init_accepts_clients_on_every_acceptor", NULL, NULL,
+     test_dmqp_server_init_accepts_clients_on_every_acceptor},
+    {"test_dmqp_server_init_steers_clients_to_pinned_threads", NULL, NULL,
+     test_dmqp_server_init_steers_clients_to_pinned_threads},
+    {"test_dmqp_server_init_io_uring_backend_handles_messages", NULL, NULL,
+     test_dmqp_server_init_io_uring_backend_handles_messages},
+    {"test_dmqp_server_init_sends_leased_replies_with_zerocopy", NULL, NULL,
+     test_dmqp_server_init_sends_leased_replies_with_zerocopy},
+    {"test_dmqp_server_init_echoes_correlation_ids_of_pipelined_requests",
+     NULL, NULL,
+     test_dmqp_server_init_echoes_correlation_ids_of_pipelined_requests},
+    {"test_dmqp_server_init_reads_large_and_small_frames_together", NULL, NULL,
+     test_dmqp_server_init_reads_large_and_small_frames_together},
+    {"test_dmqp_server_init_stalls_connection_when_worker_pool_full", NULL,
+     NULL, test_dmqp_server_init_stalls_connection_when_worker_pool_full},
+    {"test_dmqp_server_init_backs_off_when_out_of_descriptors", NULL, NULL,
+     test_dmqp_server_init_backs_off_when_out_of_descriptors},
+    {"test_dmqp_server_init_interleaves_chunked_messages", NULL, NULL,
+     test_dmqp_server_init_interleaves_chunked_messages}};
 
 struct test_suite suite = {
     .name = "test_network", .setup = NULL, .teardown = NULL};
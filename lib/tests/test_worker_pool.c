@@ -0,0 +1,200 @@
+// Testing concurrency deterministically is difficult, so the developer should
+// run this test suite multiple times
+
+#include "messageq/test.h"
+#include "messageq/util.h"
+#include "messageq/worker_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+
+static unsigned int counter;
+
+static pthread_mutex_t gate_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gate_cond = PTHREAD_COND_INITIALIZER;
+static int gate_open;
+
+static void increment_task(void *arg) {
+    (void)arg;
+    __atomic_add_fetch(&counter, 1, __ATOMIC_SEQ_CST);
+}
+
+// blocks the worker running it until `open_gate` is called
+static void gate_task(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&gate_lock);
+    while (!gate_open) {
+        pthread_cond_wait(&gate_cond, &gate_lock);
+    }
+    pthread_mutex_unlock(&gate_lock);
+}
+
+static void open_gate() {
+    pthread_mutex_lock(&gate_lock);
+    gate_open = 1;
+    pthread_mutex_unlock(&gate_lock);
+    pthread_cond_broadcast(&gate_cond);
+}
+
+static void reset() {
+    counter = 0;
+    gate_open = 0;
+}
+
+int test_worker_pool_init_throws_when_invalid_args() {
+    // arrange
+    errno = 0;
+    struct worker_pool pool;
+
+    // act & assert
+    assert(worker_pool_init(NULL, 1) < 0);
+    assert(errno == EINVAL);
+
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(worker_pool_init(&pool, WORKER_POOL_MAX_WORKERS + 1) < 0);
+    assert(errno == EINVAL);
+    return 0;
+}
+
+int test_worker_pool_init_defaults_to_core_count() {
+    // arrange
+    errno = 0;
+    struct worker_pool pool;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // act & assert
+    assert(worker_pool_init(&pool, 0) >= 0);
+    assert(pool.num_workers ==
+           (cores > WORKER_POOL_MAX_WORKERS ? WORKER_POOL_MAX_WORKERS
+                                            : (unsigned int)cores));
+
+    // teardown
+    worker_pool_destroy(&pool);
+    return 0;
+}
+
+int test_worker_pool_submit_throws_when_invalid_args() {
+    // arrange
+    errno = 0;
+    struct worker_pool pool;
+    assert(worker_pool_init(&pool, 1) >= 0);
+
+    // act & assert
+    assert(worker_pool_submit(NULL, increment_task, NULL) < 0);
+    assert(errno == EINVAL);
+
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(worker_pool_submit(&pool, NULL, NULL) < 0);
+    assert(errno == EINVAL);
+
+    // teardown
+    worker_pool_destroy(&pool);
+    return 0;
+}
+
+int test_worker_pool_submit_runs_every_task() {
+    // arrange
+    errno = 0;
+    struct worker_pool pool;
+    assert(worker_pool_init(&pool, 4) >= 0);
+
+    // act
+    for (int i = 0; i < 1000; i++) {
+        while (worker_pool_submit(&pool, increment_task, NULL) < 0) {
+            assert(errno == EAGAIN);
+            errno = 0;
+            usleep(1000);
+        }
+    }
+    worker_pool_destroy(&pool);
+
+    // assert
+    assert(counter == 1000);
+    assert(!errno);
+    return 0;
+}
+
+int test_worker_pool_submit_throws_when_full() {
+    // arrange
+    errno = 0;
+    struct worker_pool pool;
+    assert(worker_pool_init(&pool, 1) >= 0);
+    assert(worker_pool_submit(&pool, gate_task, NULL) >= 0);
+    usleep(100000); // wait for the worker to block on the gate
+
+    for (int i = 0; i < WORKER_QUEUE_CAPACITY; i++) {
+        assert(worker_pool_submit(&pool, increment_task, NULL) >= 0);
+    }
+
+    // act & assert
+    assert(worker_pool_submit(&pool, increment_task, NULL) < 0);
+    assert(errno == EAGAIN);
+
+    struct worker_stats stats;
+    assert(worker_pool_stats(&pool, &stats, 1) == 1);
+    assert(stats.depth == WORKER_QUEUE_CAPACITY);
+
+    // teardown
+    open_gate();
+    worker_pool_destroy(&pool);
+    return 0;
+}
+
+int test_worker_pool_stats_reports_steals() {
+    // arrange
+    errno = 0;
+    struct worker_pool pool;
+    assert(worker_pool_init(&pool, 2) >= 0);
+
+    // one worker blocks with tasks queued behind it on its own deque
+    assert(worker_pool_submit(&pool, gate_task, NULL) >= 0);
+    usleep(100000);
+    for (int i = 0; i < 10; i++) {
+        assert(worker_pool_submit(&pool, increment_task, NULL) >= 0);
+    }
+
+    // act: wait for the idle worker to steal the blocked worker's tasks
+    for (int retries = 100; counter < 10 && retries > 0; retries--) {
+        usleep(10000);
+    }
+
+    struct worker_stats stats[2];
+    unsigned int n = worker_pool_stats(&pool, stats, arrlen(stats));
+
+    // assert
+    assert(n == 2);
+    assert(counter == 10);
+    assert(stats[0].steals + stats[1].steals >= 5);
+    assert(stats[0].depth == 0 && stats[1].depth == 0);
+
+    // teardown
+    open_gate();
+    worker_pool_destroy(&pool);
+    return 0;
+}
+
+struct test_case tests[] = {
+    {"test_worker_pool_init_throws_when_invalid_args", reset, NULL,
+     test_worker_pool_init_throws_when_invalid_args},
+    {"test_worker_pool_init_defaults_to_core_count", reset, NULL,
+     test_worker_pool_init_defaults_to_core_count},
+    {"test_worker_pool_submit_throws_when_invalid_args", reset, NULL,
+     test_worker_pool_submit_throws_when_invalid_args},
+    {"test_worker_pool_submit_runs_every_task", reset, NULL,
+     test_worker_pool_submit_runs_every_task},
+    {"test_worker_pool_submit_throws_when_full", reset, NULL,
+     test_worker_pool_submit_throws_when_full},
+    {"test_worker_pool_stats_reports_steals", reset, NULL,
+     test_worker_pool_stats_reports_steals}};
+
+struct test_suite suite = {
+    .name = "test_worker_pool", .setup = NULL, .teardown = NULL};
+
+int main() { run_suite(); }
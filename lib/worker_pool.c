@@ -0,0 +1,233 @@
+#include "messageq/worker_pool.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * Takes the oldest task from a worker's own deque.
+ *
+ * @param worker worker owning the deque
+ * @param task output param for the task
+ * @returns 1 if a task was taken, 0 if the deque is empty
+ */
+static int take_task(struct worker *worker, struct worker_task *task) {
+    pthread_mutex_lock(&worker->lock);
+    if (!worker->size) {
+        pthread_mutex_unlock(&worker->lock);
+        return 0;
+    }
+
+    *task = worker->tasks[worker->head];
+    worker->head = (worker->head + 1) % WORKER_QUEUE_CAPACITY;
+    worker->size--;
+    pthread_mutex_unlock(&worker->lock);
+    return 1;
+}
+
+/**
+ * Steals the newest task from another worker's deque.
+ *
+ * @param thief worker looking for work
+ * @param task output param for the task
+ * @returns 1 if a task was stolen, 0 if every other deque is empty
+ */
+static int steal_task(struct worker *thief, struct worker_task *task) {
+    struct worker_pool *pool = thief->pool;
+
+    for (unsigned int i = 1; i < pool->num_workers; i++) {
+        struct worker *victim =
+            &pool->workers[(thief->index + i) % pool->num_workers];
+
+        pthread_mutex_lock(&victim->lock);
+        if (!victim->size) {
+            pthread_mutex_unlock(&victim->lock);
+            continue;
+        }
+
+        victim->size--;
+        *task = victim->tasks[(victim->head + victim->size) %
+                              WORKER_QUEUE_CAPACITY];
+        pthread_mutex_unlock(&victim->lock);
+
+        __atomic_add_fetch(&thief->steals, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void *worker_thread(void *arg) {
+    struct worker *worker = (struct worker *)arg;
+    struct worker_pool *pool = worker->pool;
+
+    for (;;) {
+        struct worker_task task;
+        if (take_task(worker, &task) || steal_task(worker, &task)) {
+            __atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+            task.fn(task.arg);
+            __atomic_add_fetch(&worker->executed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->idle_lock);
+        // publish idleness before re-checking `pending`, pairs with the
+        // ordering in `worker_pool_submit` so that no wakeup is lost
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        while (!__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) &&
+               pool->running) {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+        }
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+
+        int done = !pool->running &&
+                   !__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->idle_lock);
+
+        if (done) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int worker_pool_init(struct worker_pool *pool, unsigned int num_workers) {
+    if (!pool || num_workers > WORKER_POOL_MAX_WORKERS) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!num_workers) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cores < 1 ? 1 : (unsigned int)cores;
+        if (num_workers > WORKER_POOL_MAX_WORKERS) {
+            num_workers = WORKER_POOL_MAX_WORKERS;
+        }
+    }
+
+    pool->workers = calloc(num_workers, sizeof(struct worker));
+    if (!pool->workers) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pool->num_workers = 0;
+    pool->next_worker = 0;
+    pool->pending = 0;
+    pool->idle = 0;
+    pool->running = 1;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    for (unsigned int i = 0; i < num_workers; i++) {
+        struct worker *worker = &pool->workers[i];
+        worker->index = i;
+        worker->pool = pool;
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+
+    // workers steal from `num_workers` peers, so it must be final before any
+    // worker starts
+    pool->num_workers = num_workers;
+    for (unsigned int i = 0; i < num_workers; i++) {
+        if (pthread_create(&pool->workers[i].tid, NULL, worker_thread,
+                           &pool->workers[i])) {
+            pool->num_workers = i;
+            worker_pool_destroy(pool);
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void worker_pool_destroy(struct worker_pool *pool) {
+    if (!pool || !pool->workers) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->running = 0;
+    pthread_mutex_unlock(&pool->idle_lock);
+    pthread_cond_broadcast(&pool->idle_cond);
+
+    for (unsigned int i = 0; i < pool->num_workers; i++) {
+        pthread_join(pool->workers[i].tid, NULL);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+    }
+
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_lock);
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->num_workers = 0;
+}
+
+int worker_pool_submit(struct worker_pool *pool, void (*fn)(void *arg),
+                       void *arg) {
+    if (!pool || !pool->workers || !fn) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned int start =
+        __atomic_fetch_add(&pool->next_worker, 1, __ATOMIC_RELAXED);
+
+    int queued = 0;
+    for (unsigned int i = 0; i < pool->num_workers && !queued; i++) {
+        struct worker *worker =
+            &pool->workers[(start + i) % pool->num_workers];
+
+        pthread_mutex_lock(&worker->lock);
+        if (worker->size < WORKER_QUEUE_CAPACITY) {
+            struct worker_task *task =
+                &worker->tasks[(worker->head + worker->size) %
+                               WORKER_QUEUE_CAPACITY];
+            task->fn = fn;
+            task->arg = arg;
+            worker->size++;
+            queued = 1;
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+
+    if (!queued) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // publish the task before checking for idle workers, pairs with the
+    // ordering in `worker_thread`
+    __atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&pool->idle_lock);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_lock);
+    }
+
+    return 0;
+}
+
+unsigned int worker_pool_stats(struct worker_pool *pool,
+                               struct worker_stats *stats, unsigned int n) {
+    if (!pool || !pool->workers) {
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < pool->num_workers && i < n && stats; i++) {
+        struct worker *worker = &pool->workers[i];
+
+        pthread_mutex_lock(&worker->lock);
+        stats[i].depth = worker->size;
+        pthread_mutex_unlock(&worker->lock);
+
+        stats[i].executed =
+            __atomic_load_n(&worker->executed, __ATOMIC_RELAXED);
+        stats[i].steals = __atomic_load_n(&worker->steals, __ATOMIC_RELAXED);
+    }
+
+    return pool->num_workers;
+}
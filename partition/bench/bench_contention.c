@@ -0,0 +1,130 @@
+// Compares the chunked queue behind a mutex, as partitions kept entries
+// before, with the lock-free queue as more threads share them. Every thread
+// pushes an entry and pops one in a loop, on a queue holding a backlog of
+// entries, so producers and consumers hit both ends at once. Entries are
+// 64 bytes, copied on push and held in a lease of the buffer pool once popped
+// by both, like the partition does to send them.
+//
+// Usage: bench_contention [operations]
+
+#include "mpmc_queue.h"
+#include "queue.h"
+
+#include <messageq/buffer_pool.h>
+#include <messageq/util.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_OPERATIONS (1 << 21) // push and pop pairs, across all threads
+#define BENCH_BACKLOG 1024
+#define BENCH_ENTRY_SIZE 64 // bytes per entry
+#define BENCH_MAX_THREADS 64
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char payload[BENCH_ENTRY_SIZE];
+
+static struct queue locked_queue;
+static pthread_mutex_t locked_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mpmc_queue lock_free_queue;
+
+static void *run_locked(void *arg) {
+    unsigned int n = *(unsigned int *)arg;
+    struct queue_entry entry = {.data = payload, .size = BENCH_ENTRY_SIZE};
+    struct queue_entry popped;
+
+    for (unsigned int i = 0; i < n; i++) {
+        pthread_mutex_lock(&locked_queue_lock);
+        queue_push(&locked_queue, &entry);
+        pthread_mutex_unlock(&locked_queue_lock);
+
+        pthread_mutex_lock(&locked_queue_lock);
+        queue_pop(&locked_queue, &popped);
+        void *held = queue_entry_hold(&popped);
+        pthread_mutex_unlock(&locked_queue_lock);
+        buffer_pool_free(held);
+    }
+
+    return NULL;
+}
+
+static void *run_lock_free(void *arg) {
+    unsigned int n = *(unsigned int *)arg;
+    struct queue_entry entry = {.data = payload, .size = BENCH_ENTRY_SIZE};
+    struct queue_entry popped;
+
+    for (unsigned int i = 0; i < n; i++) {
+        mpmc_queue_push(&lock_free_queue, &entry);
+        while (mpmc_queue_pop(&lock_free_queue, &popped, SIZE_MAX) < 0) {
+            sched_yield();
+        }
+        buffer_pool_free(popped.data);
+    }
+
+    return NULL;
+}
+
+/**
+ * Runs a benchmark thread function on `threads` threads at once.
+ *
+ * @param run thread function, taking the number of pairs to run
+ * @param threads number of threads
+ * @param operations push and pop pairs, across all threads
+ * @returns millions of pairs per second
+ */
+static double bench_threads(void *(*run)(void *), unsigned int threads,
+                            unsigned int operations) {
+    pthread_t tids[BENCH_MAX_THREADS];
+    unsigned int n = operations / threads;
+
+    double start = now();
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_create(&tids[i], NULL, run, &n);
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    return (double)n * threads / (now() - start) / 1e6;
+}
+
+int main(int argc, char **argv) {
+    unsigned int operations = argc > 1 ? atoi(argv[1]) : BENCH_OPERATIONS;
+    if (operations < BENCH_MAX_THREADS) {
+        fprintf(stderr, "Usage: %s [operations]\n", argv[0]);
+        return 1;
+    }
+
+    queue_init(&locked_queue);
+    mpmc_queue_init(&lock_free_queue);
+    for (unsigned int id = 0; id < BENCH_BACKLOG; id++) {
+        struct queue_entry entry = {
+            .id = id, .data = payload, .size = BENCH_ENTRY_SIZE};
+        queue_push(&locked_queue, &entry);
+        mpmc_queue_push(&lock_free_queue, &entry);
+    }
+
+    unsigned int threads[] = {1, 2, 4, 8, 16, 32, 64};
+
+    printf("%ld online cores\n", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%8s %14s %16s\n", "threads", "mutex Mops/s", "lock-free Mops/s");
+    for (int i = 0; i < arrlen(threads); i++) {
+        double locked = bench_threads(run_locked, threads[i], operations);
+        double lock_free = bench_threads(run_lock_free, threads[i], operations);
+        printf("%8u %14.2f %16.2f\n", threads[i], locked, lock_free);
+    }
+
+    mpmc_queue_destroy(&lock_free_queue);
+    queue_destroy(&locked_queue);
+    return 0;
+}
@@ -0,0 +1,205 @@
+// Compares the partition's chunked queue with the linked list of one node per
+// entry it replaced. Each run fills a queue with a backlog of entries, then
+// drains it, then keeps the backlog steady with a pop after every push, as a
+// partition does when consumers keep up with a lagging queue. Entries are
+// 64 bytes, the list leasing them from the buffer pool like it did pushed
+// payloads. The heap bytes taken per queued entry are counted after the fill.
+//
+// Usage: bench_queue [entries]
+
+#include "queue.h"
+
+#include <messageq/buffer_pool.h>
+#include <messageq/util.h>
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_ENTRIES (1 << 20) // default backlog
+#define BENCH_ENTRY_SIZE 64     // bytes per entry
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the queue as it was before chunks, kept here as the baseline
+struct list_node {
+    struct queue_entry entry;
+    struct list_node *next;
+};
+
+struct list_queue {
+    struct list_node *head;
+    struct list_node *tail;
+    unsigned int length;
+};
+
+static int list_push(struct list_queue *queue,
+                     const struct queue_entry *entry) {
+    struct list_node *node = buffer_pool_alloc(sizeof(struct list_node));
+    if (!node) {
+        return -1;
+    }
+
+    node->entry.data = buffer_pool_alloc(entry->size);
+    if (!node->entry.data) {
+        buffer_pool_free(node);
+        return -1;
+    }
+    memcpy(node->entry.data, entry->data, entry->size);
+    node->entry.size = entry->size;
+    node->entry.id = entry->id;
+    node->next = NULL;
+
+    if (!queue->head) {
+        queue->head = node;
+    } else {
+        queue->tail->next = node;
+    }
+    queue->tail = node;
+    queue->length++;
+    return 0;
+}
+
+static struct queue_entry *list_pop(struct list_queue *queue) {
+    struct list_node *node = queue->head;
+    if (!node) {
+        return NULL;
+    }
+
+    queue->head = node->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    queue->length--;
+    return &node->entry;
+}
+
+// timings of one run, in ns per operation
+struct bench_result {
+    double push;
+    double pop;
+    double steady; // a push and a pop
+    double bytes;  // heap bytes per queued entry
+};
+
+/**
+ * Runs the benchmark on the list queue.
+ *
+ * @param n entries in the backlog
+ * @param payload data of every entry
+ * @param result output param for the timings
+ */
+static void bench_list(unsigned int n, char *payload,
+                       struct bench_result *result) {
+    struct list_queue queue = {0};
+    struct queue_entry entry = {.data = payload, .size = BENCH_ENTRY_SIZE};
+
+    size_t heap = mallinfo2().uordblks;
+    double start = now();
+    for (entry.id = 0; entry.id < n; entry.id++) {
+        list_push(&queue, &entry);
+    }
+    result->push = (now() - start) / n * 1e9;
+    result->bytes = (double)(mallinfo2().uordblks - heap) / n;
+
+    start = now();
+    for (unsigned int i = 0; i < n; i++) {
+        struct queue_entry *popped = list_pop(&queue);
+        buffer_pool_free(popped->data);
+        buffer_pool_free(popped);
+    }
+    result->pop = (now() - start) / n * 1e9;
+
+    for (entry.id = 0; entry.id < n; entry.id++) {
+        list_push(&queue, &entry);
+    }
+    start = now();
+    for (unsigned int i = 0; i < n; i++) {
+        list_push(&queue, &entry);
+        struct queue_entry *popped = list_pop(&queue);
+        buffer_pool_free(popped->data);
+        buffer_pool_free(popped);
+    }
+    result->steady = (now() - start) / n * 1e9;
+
+    struct queue_entry *popped;
+    while ((popped = list_pop(&queue))) {
+        buffer_pool_free(popped->data);
+        buffer_pool_free(popped);
+    }
+}
+
+/**
+ * Runs the benchmark on the chunked queue.
+ *
+ * @param n entries in the backlog
+ * @param payload data of every entry
+ * @param result output param for the timings
+ */
+static void bench_chunked(unsigned int n, char *payload,
+                          struct bench_result *result) {
+    struct queue queue;
+    queue_init(&queue);
+    struct queue_entry entry = {.data = payload, .size = BENCH_ENTRY_SIZE};
+    struct queue_entry popped;
+
+    size_t heap = mallinfo2().uordblks;
+    double start = now();
+    for (entry.id = 0; entry.id < n; entry.id++) {
+        queue_push(&queue, &entry);
+    }
+    result->push = (now() - start) / n * 1e9;
+    result->bytes = (double)(mallinfo2().uordblks - heap) / n;
+
+    start = now();
+    for (unsigned int i = 0; i < n; i++) {
+        queue_pop(&queue, &popped);
+    }
+    result->pop = (now() - start) / n * 1e9;
+
+    for (entry.id = 0; entry.id < n; entry.id++) {
+        queue_push(&queue, &entry);
+    }
+    start = now();
+    for (unsigned int i = 0; i < n; i++) {
+        queue_push(&queue, &entry);
+        queue_pop(&queue, &popped);
+    }
+    result->steady = (now() - start) / n * 1e9;
+
+    queue_destroy(&queue);
+}
+
+int main(int argc, char **argv) {
+    unsigned int entries = argc > 1 ? atoi(argv[1]) : BENCH_ENTRIES;
+    if (!entries) {
+        fprintf(stderr, "Usage: %s [entries]\n", argv[0]);
+        return 1;
+    }
+
+    char payload[BENCH_ENTRY_SIZE] = {0};
+    unsigned int backlogs[] = {entries, 4 * entries};
+
+    printf("%8s %10s %10s %10s %12s %12s\n", "queue", "entries", "push ns",
+           "pop ns", "steady ns", "bytes/entry");
+    for (int i = 0; i < arrlen(backlogs); i++) {
+        struct bench_result list;
+        struct bench_result chunked;
+        bench_list(backlogs[i], payload, &list);
+        bench_chunked(backlogs[i], payload, &chunked);
+
+        printf("%8s %10u %10.1f %10.1f %12.1f %12.1f\n", "list", backlogs[i],
+               list.push, list.pop, list.steady, list.bytes);
+        printf("%8s %10u %10.1f %10.1f %12.1f %12.1f\n", "chunked",
+               backlogs[i], chunked.push, chunked.pop, chunked.steady,
+               chunked.bytes);
+    }
+
+    return 0;
+}
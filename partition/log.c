@@ -0,0 +1,413 @@
+#include "log.h"
+
+#include <messageq/buffer_pool.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+int log_init(struct log *log, size_t retention_bytes,
+             uint64_t retention_entries) {
+    if (!log) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < LOG_MAX_SEGMENTS; i++) {
+        log->segments[i] = NULL;
+    }
+    log->start = 0;
+    log->end = 0;
+    log->bytes = 0;
+    log->retention_bytes = retention_bytes;
+    log->retention_entries = retention_entries;
+    for (int i = 0; i < LOG_MAX_CURSORS; i++) {
+        log->cursors[i].offset = LOG_CURSOR_CLOSED;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    return 0;
+}
+
+/**
+ * Returns the directory slot of the segment holding an offset.
+ *
+ * @param log the log
+ * @param offset offset of an entry
+ * @returns the slot, `NULL` in it if the segment is not allocated
+ */
+static struct log_segment **segment_slot(struct log *log, uint64_t offset) {
+    return &log->segments[(offset / LOG_SEGMENT_ENTRIES) % LOG_MAX_SEGMENTS];
+}
+
+/**
+ * Releases the data of a segment's first `n` entries and frees it.
+ *
+ * @param segment segment to free
+ * @param n number of entries appended to it
+ */
+static void free_segment(struct log_segment *segment, uint64_t n) {
+    for (uint64_t i = 0; i < n; i++) {
+        buffer_pool_free(segment->entries[i].data);
+    }
+    free(segment);
+}
+
+void log_destroy(struct log *log) {
+    if (!log) {
+        return;
+    }
+
+    for (uint64_t offset = log->start; offset < log->end;
+         offset += LOG_SEGMENT_ENTRIES) {
+        uint64_t n = log->end - offset;
+        free_segment(*segment_slot(log, offset),
+                     n < LOG_SEGMENT_ENTRIES ? n : LOG_SEGMENT_ENTRIES);
+        *segment_slot(log, offset) = NULL;
+    }
+
+    pthread_mutex_destroy(&log->lock);
+    log->start = 0;
+    log->end = 0;
+    log->bytes = 0;
+}
+
+size_t log_reclaim(struct log *log) {
+    if (!log) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&log->lock);
+
+    // cursors only move forward without the lock, so none can fall below
+    // `min` once it is computed
+    uint64_t min = log->end;
+    for (int i = 0; i < LOG_MAX_CURSORS; i++) {
+        uint64_t offset =
+            __atomic_load_n(&log->cursors[i].offset, __ATOMIC_ACQUIRE);
+        if (offset != LOG_CURSOR_CLOSED && offset < min) {
+            min = offset;
+        }
+    }
+
+    size_t reclaimed = 0;
+    while (log->start + LOG_SEGMENT_ENTRIES <= min) {
+        struct log_segment *segment = *segment_slot(log, log->start);
+        uint64_t entries_left = log->end - log->start - LOG_SEGMENT_ENTRIES;
+        if (log->bytes - segment->bytes < log->retention_bytes &&
+            entries_left < log->retention_entries) {
+            break;
+        }
+
+        log->bytes -= segment->bytes;
+        *segment_slot(log, log->start) = NULL;
+        free_segment(segment, LOG_SEGMENT_ENTRIES);
+        log->start += LOG_SEGMENT_ENTRIES;
+        reclaimed += LOG_SEGMENT_ENTRIES;
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return reclaimed;
+}
+
+/**
+ * Makes sure the segments for the next `n` entries of a log are allocated,
+ * reclaiming what it can first if a new one is needed.
+ *
+ * @param log the log to update
+ * @param n number of entries about to be appended
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOBUFS` log full, a cursor holds back its oldest segment
+ * @throws `ENOMEM` out of memory
+ */
+static int reserve_segments(struct log *log, unsigned int n) {
+    uint64_t end = log->end;
+    uint64_t first = (end + LOG_SEGMENT_ENTRIES - 1) / LOG_SEGMENT_ENTRIES *
+                     LOG_SEGMENT_ENTRIES; // first offset of a new segment
+    if (first >= end + n) {
+        return 0;
+    }
+
+    log_reclaim(log);
+    uint64_t last = end + n - 1;
+    if (last / LOG_SEGMENT_ENTRIES - log->start / LOG_SEGMENT_ENTRIES >=
+        LOG_MAX_SEGMENTS) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for (uint64_t offset = first; offset <= last;
+         offset += LOG_SEGMENT_ENTRIES) {
+        struct log_segment *segment = malloc(sizeof(struct log_segment));
+        if (!segment) {
+            for (uint64_t allocated = first; allocated < offset;
+                 allocated += LOG_SEGMENT_ENTRIES) {
+                free(*segment_slot(log, allocated));
+                *segment_slot(log, allocated) = NULL;
+            }
+            errno = ENOMEM;
+            return -1;
+        }
+
+        segment->bytes = 0;
+        *segment_slot(log, offset) = segment;
+    }
+
+    return 0;
+}
+
+/**
+ * Writes an entry at an offset of a reserved segment. Readers see it once
+ * `end` is moved past it.
+ *
+ * @param log the log to update
+ * @param offset offset of the entry
+ * @param entry the entry to write
+ * @param data lease holding the entry's data, owned by the log from then on
+ */
+static void store_entry(struct log *log, uint64_t offset,
+                        const struct queue_entry *entry, void *data) {
+    struct log_segment *segment = *segment_slot(log, offset);
+    struct queue_entry *stored =
+        &segment->entries[offset % LOG_SEGMENT_ENTRIES];
+    stored->data = data;
+    stored->id = entry->id;
+    stored->size = entry->size;
+    segment->bytes += entry->size;
+    log->bytes += entry->size;
+}
+
+/**
+ * Appends an entry to a log.
+ *
+ * @param log the log to update
+ * @param entry the entry to append
+ * @param data lease holding the entry's data, owned by the log on success
+ * @param offset output param for the offset of the entry, may be `NULL`
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOBUFS` log full, a cursor holds back its oldest segment
+ * @throws `ENOMEM` out of memory
+ */
+static int append_entry(struct log *log, const struct queue_entry *entry,
+                        void *data, uint64_t *offset) {
+    if (reserve_segments(log, 1) < 0) {
+        return -1;
+    }
+
+    uint64_t end = log->end;
+    store_entry(log, end, entry, data);
+    __atomic_store_n(&log->end, end + 1, __ATOMIC_RELEASE);
+    if (offset) {
+        *offset = end;
+    }
+    return 0;
+}
+
+int log_append(struct log *log, const struct queue_entry *entry,
+               uint64_t *offset) {
+    if (!log || !entry || !entry->data || !entry->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *data = buffer_pool_alloc(entry->size);
+    if (!data) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(data, entry->data, entry->size);
+
+    if (append_entry(log, entry, data, offset) < 0) {
+        buffer_pool_free(data);
+        return -1;
+    }
+
+    return 0;
+}
+
+int log_append_leased(struct log *log, const struct queue_entry *entry,
+                      uint64_t *offset) {
+    if (!log || !entry || !entry->data || !entry->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return append_entry(log, entry, entry->data, offset);
+}
+
+int log_append_batch(struct log *log, const struct queue_entry *entries,
+                     unsigned int n, uint64_t *offset) {
+    if (!log || !entries || !n) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        if (!entries[i].data || !entries[i].size) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    // copy every entry and allocate their segments before storing any, so a
+    // failure leaves the log untouched
+    void **leased = buffer_pool_alloc(n * sizeof *leased);
+    if (!leased) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    unsigned int count = 0;
+    for (; count < n; count++) {
+        if (!(leased[count] = buffer_pool_alloc(entries[count].size))) {
+            errno = ENOMEM;
+            goto cleanup;
+        }
+        memcpy(leased[count], entries[count].data, entries[count].size);
+    }
+
+    if (reserve_segments(log, n) < 0) {
+        goto cleanup;
+    }
+
+    uint64_t end = log->end;
+    for (unsigned int i = 0; i < n; i++) {
+        store_entry(log, end + i, &entries[i], leased[i]);
+    }
+
+    // readers see the whole batch at once
+    __atomic_store_n(&log->end, end + n, __ATOMIC_RELEASE);
+    if (offset) {
+        *offset = end;
+    }
+    buffer_pool_free(leased);
+    return 0;
+
+cleanup:
+    for (unsigned int i = 0; i < count; i++) {
+        buffer_pool_free(leased[i]);
+    }
+    buffer_pool_free(leased);
+    return -1;
+}
+
+int log_cursor_open(struct log *log, uint64_t offset) {
+    if (!log) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&log->lock);
+
+    int cursor = -1;
+    uint64_t end = __atomic_load_n(&log->end, __ATOMIC_ACQUIRE);
+    if (offset == LOG_OLDEST) {
+        offset = log->start;
+    }
+    if (offset < log->start || offset > end) {
+        errno = ERANGE;
+        goto cleanup;
+    }
+
+    for (int i = 0; i < LOG_MAX_CURSORS; i++) {
+        if (log->cursors[i].offset == LOG_CURSOR_CLOSED) {
+            cursor = i;
+            break;
+        }
+    }
+    if (cursor < 0) {
+        errno = EMFILE;
+        goto cleanup;
+    }
+
+    __atomic_store_n(&log->cursors[cursor].offset, offset, __ATOMIC_RELEASE);
+
+cleanup:
+    pthread_mutex_unlock(&log->lock);
+    return cursor;
+}
+
+int log_cursor_seek(struct log *log, int cursor, uint64_t offset) {
+    if (!log || cursor < 0 || cursor >= LOG_MAX_CURSORS ||
+        log->cursors[cursor].offset == LOG_CURSOR_CLOSED) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // a cursor moved back must not land on a segment being reclaimed
+    pthread_mutex_lock(&log->lock);
+
+    int ret = 0;
+    uint64_t end = __atomic_load_n(&log->end, __ATOMIC_ACQUIRE);
+    if (offset < log->start || offset > end) {
+        errno = ERANGE;
+        ret = -1;
+    } else {
+        __atomic_store_n(&log->cursors[cursor].offset, offset,
+                         __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return ret;
+}
+
+void log_cursor_close(struct log *log, int cursor) {
+    if (!log || cursor < 0 || cursor >= LOG_MAX_CURSORS) {
+        return;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    __atomic_store_n(&log->cursors[cursor].offset, LOG_CURSOR_CLOSED,
+                     __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&log->lock);
+}
+
+int log_read(struct log *log, int cursor, struct queue_entry *entries,
+             unsigned int n, size_t max_bytes, uint64_t *offset) {
+    if (!log || cursor < 0 || cursor >= LOG_MAX_CURSORS || !entries || !n) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint64_t next =
+        __atomic_load_n(&log->cursors[cursor].offset, __ATOMIC_RELAXED);
+    if (next == LOG_CURSOR_CLOSED) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // entries below `end` are fully written, and the cursor keeps the
+    // segments from `next` onwards from being reclaimed
+    uint64_t end = __atomic_load_n(&log->end, __ATOMIC_ACQUIRE);
+    if (next >= end) {
+        errno = ENODATA;
+        return -1;
+    }
+
+    unsigned int count = 0;
+    size_t bytes = 0;
+    while (count < n && next + count < end) {
+        uint64_t at = next + count;
+        struct queue_entry *entry =
+            &(*segment_slot(log, at))->entries[at % LOG_SEGMENT_ENTRIES];
+        if (entry->size > max_bytes - bytes) {
+            break;
+        }
+
+        entries[count] = *entry;
+        entries[count].data = buffer_pool_ref(entry->data);
+        bytes += entry->size;
+        count++;
+    }
+
+    if (!count) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    __atomic_store_n(&log->cursors[cursor].offset, next + count,
+                     __ATOMIC_RELEASE);
+    if (offset) {
+        *offset = next;
+    }
+    return count;
+}
@@ -0,0 +1,190 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include "queue.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_SEGMENT_ENTRIES 1024 // entries per segment, reclaimed together
+#define LOG_MAX_SEGMENTS 4096    // segments kept at once
+#define LOG_MAX_CURSORS 64
+#define LOG_CURSOR_CLOSED UINT64_MAX // `offset` of an unused cursor
+#define LOG_OLDEST UINT64_MAX        // opens a cursor at the first offset kept
+
+// run of entries at consecutive offsets. the data of every entry is leased
+// from the buffer pool
+struct log_segment {
+    size_t bytes; // data bytes of its entries
+    struct queue_entry entries[LOG_SEGMENT_ENTRIES];
+};
+
+// position of a consumer in a log
+struct log_cursor {
+    uint64_t offset; // next offset to read, `LOG_CURSOR_CLOSED` if unused
+};
+
+// append-only log of entries addressed by offset. Entries are never removed
+// by reads: each consumer reads from its own cursor, and whole segments are
+// reclaimed once every cursor is past them and the retention policy lets them
+// go. Appends come from one thread at a time and publish `end` last, so reads
+// take no lock. Segments live in a fixed directory and stay put while any
+// cursor may read them, so a reader never sees memory freed or moved under it
+struct log {
+    // segment holding offset `o` is at `(o / LOG_SEGMENT_ENTRIES) %
+    // LOG_MAX_SEGMENTS`
+    struct log_segment *segments[LOG_MAX_SEGMENTS];
+    uint64_t start; // first offset kept, a multiple of `LOG_SEGMENT_ENTRIES`
+    uint64_t end;   // offset the next entry is appended at
+    size_t bytes;   // data bytes of the entries kept
+    // the newest entries are kept for replay even once every cursor read
+    // them, up to these many data bytes and entries
+    size_t retention_bytes;
+    uint64_t retention_entries;
+    struct log_cursor cursors[LOG_MAX_CURSORS];
+    pthread_mutex_t lock; // opening and moving back cursors, and reclaiming
+};
+
+/**
+ * Initializes a log.
+ *
+ * @param log the log to init
+ * @param retention_bytes data bytes of the newest entries to keep for replay,
+ * even once every cursor read them
+ * @param retention_entries number of the newest entries to keep for replay.
+ * A segment is reclaimed once either limit is still met without it, so 0 for
+ * both reclaims entries as soon as every cursor read them
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ */
+int log_init(struct log *log, size_t retention_bytes,
+             uint64_t retention_entries);
+
+/**
+ * Destroys a log, releasing the data of its entries. No other thread may still
+ * use it.
+ *
+ * @param log the log to destroy
+ */
+void log_destroy(struct log *log);
+
+/**
+ * Appends an entry to a log, copying its data. Appends to one log must not run
+ * concurrently with each other, but may with reads.
+ *
+ * @param log the log to update
+ * @param entry the entry to append
+ * @param offset output param for the offset of the entry, may be `NULL`
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOBUFS` log full, a cursor holds back its oldest segment
+ * @throws `ENOMEM` out of memory
+ */
+int log_append(struct log *log, const struct queue_entry *entry,
+               uint64_t *offset);
+
+/**
+ * Appends an entry whose data is a buffer pool lease to a log, taking over the
+ * lease. On error the caller still owns it. Appends to one log must not run
+ * concurrently with each other, but may with reads.
+ *
+ * @param log the log to update
+ * @param entry the entry to append, with data leased from the buffer pool
+ * @param offset output param for the offset of the entry, may be `NULL`
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOBUFS` log full, a cursor holds back its oldest segment
+ * @throws `ENOMEM` out of memory
+ */
+int log_append_leased(struct log *log, const struct queue_entry *entry,
+                      uint64_t *offset);
+
+/**
+ * Appends a batch of entries to a log at consecutive offsets, copying their
+ * data. Either every entry is appended or none is, and readers see them all
+ * at once. Appends to one log must not run concurrently with each other, but
+ * may with reads.
+ *
+ * @param log the log to update
+ * @param entries the entries to append
+ * @param n number of entries
+ * @param offset output param for the offset of the first entry, may be `NULL`
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOBUFS` log full, a cursor holds back its oldest segment
+ * @throws `ENOMEM` out of memory
+ */
+int log_append_batch(struct log *log, const struct queue_entry *entries,
+                     unsigned int n, uint64_t *offset);
+
+/**
+ * Opens a cursor on a log, pinning the entries from `offset` onwards until the
+ * cursor moves past them or is closed.
+ *
+ * @param log the log to update
+ * @param offset first offset to read, between the first offset kept and the
+ * next offset appended, or `LOG_OLDEST`
+ * @returns the cursor's index, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ERANGE` entry at `offset` reclaimed or not appended yet
+ * @throws `EMFILE` `LOG_MAX_CURSORS` cursors already open
+ */
+int log_cursor_open(struct log *log, uint64_t offset);
+
+/**
+ * Moves an open cursor to another offset, to replay entries or skip some. A
+ * cursor must not be moved while it is read.
+ *
+ * @param log the log to update
+ * @param cursor index of the cursor
+ * @param offset next offset to read, between the first offset kept and the
+ * next offset appended
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ERANGE` entry at `offset` reclaimed or not appended yet
+ */
+int log_cursor_seek(struct log *log, int cursor, uint64_t offset);
+
+/**
+ * Closes a cursor, so that it no longer holds back reclamation.
+ *
+ * @param log the log to update
+ * @param cursor index of the cursor, may be -1
+ */
+void log_cursor_close(struct log *log, int cursor);
+
+/**
+ * Reads a run of entries at a cursor and moves the cursor past them. Takes no
+ * lock, so it runs concurrently with appends and reads of other cursors, but
+ * not of the same cursor. Each entry read holds a reference to its data,
+ * shared with the log and the other readers, to release with
+ * `buffer_pool_free`.
+ *
+ * @param log the log to read
+ * @param cursor index of the cursor
+ * @param entries output array of at least `n` entries
+ * @param n maximum number of entries to read
+ * @param max_bytes maximum total data size of the entries read
+ * @param offset output param for the offset of the first entry read, may be
+ * `NULL`
+ * @returns number of entries read, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENODATA` no entry past the cursor
+ * @throws `EMSGSIZE` next entry larger than `max_bytes`
+ */
+int log_read(struct log *log, int cursor, struct queue_entry *entries,
+             unsigned int n, size_t max_bytes, uint64_t *offset);
+
+/**
+ * Reclaims the segments every cursor is past that the retention policy lets
+ * go. Appends reclaim as they start each segment; a caller may reclaim in
+ * between to free memory as cursors move. Must not run concurrently with
+ * appends.
+ *
+ * @param log the log to update
+ * @returns number of entries reclaimed
+ */
+size_t log_reclaim(struct log *log);
+
+#endif
@@ -1,29 +1,126 @@
 #include <messageq/constants.h>
+#include <messageq/network.h>
 
 #include <errno.h>
 #include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "partition.h"
 
+#define USAGE                                                                  \
+    "Usage: %s [-s] [host:port] [-b] [epoll|io_uring] [-z] [bytes] [-m] "      \
+    "[bytes] [-u] [socket_path] [-c] [bytes] [-a] [acceptors] [-p] [-r] "      \
+    "[-k] [idle_sec,interval_sec,probes] [-l] [retention_bytes]\n"
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s [-s] [host:port]\n", argv[0]);
+    if (argc < 3) {
+        fprintf(stderr, USAGE, argv[0]);
         return 1;
     }
 
     int opt;
-    char service_discovery_host[MAX_HOST_LEN + 1];
+    char service_discovery_host[MAX_HOST_LEN + 1] = {0};
 
-    while ((opt = getopt(argc, argv, "s:")) != -1) {
+    while ((opt = getopt(argc, argv, "s:b:z:m:u:c:a:prk:l:")) != -1) {
         switch (opt) {
         case 's':
             strncpy(service_discovery_host, optarg, MAX_HOST_LEN);
             service_discovery_host[MAX_HOST_LEN] = '\0';
             break;
+        case 'b':
+            if (strcmp(optarg, "epoll") == 0) {
+                server_io_backend = DMQP_IO_BACKEND_EPOLL;
+            } else if (strcmp(optarg, "io_uring") == 0) {
+                server_io_backend = DMQP_IO_BACKEND_IO_URING;
+            } else {
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+            }
+            break;
+        case 'z': {
+            char *end;
+            unsigned long threshold = strtoul(optarg, &end, 10);
+            if (!*optarg || *end) {
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+            }
+            send_zerocopy_threshold = threshold;
+            break;
+        }
+        case 'm': {
+            char *end;
+            unsigned long max_bytes = strtoul(optarg, &end, 10);
+            if (!*optarg || *end || !max_bytes) {
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+            }
+            queue_max_bytes = max_bytes;
+            break;
+        }
+        case 'u':
+            if (strlen(optarg) >= DMQP_UNIX_PATH_MAX) {
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+            }
+            strcpy(server_unix_path, optarg);
+            break;
+        case 'c': {
+            char *end;
+            unsigned long threshold = strtoul(optarg, &end, 10);
+            if (!*optarg || *end || threshold > UINT32_MAX) {
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+            }
+            replication_compress_threshold = threshold;
+            break;
+        }
+        case 'a': {
+            char *end;
+            unsigned long acceptors = strtoul(optarg, &end, 10);
+            if (!*optarg || *end || !acceptors ||
+                acceptors > EVENT_LOOP_MAX_THREADS) {
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+            }
+            server_acceptors = acceptors;
+            break;
+        }
+        case 'p':
+            server_pin_cpus = 1;
+            break;
+        case 'r':
+            server_pin_cpus = 1;
+            server_reuseport_steering = 1;
+            break;
+        case 'k': {
+            struct dmqp_keepalive keepalive;
+            char end;
+            if (sscanf(optarg, "%d,%d,%d%c", &keepalive.idle_sec,
+                       &keepalive.interval_sec, &keepalive.probes,
+                       &end) != 3 ||
+                keepalive.idle_sec < 0 || keepalive.interval_sec < 1 ||
+                keepalive.probes < 1) {
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+            }
+            dmqp_keepalive = keepalive;
+            break;
+        }
+        case 'l': {
+            char *end;
+            unsigned long retention_bytes = strtoul(optarg, &end, 10);
+            if (!*optarg || *end) {
+                fprintf(stderr, USAGE, argv[0]);
+                return 1;
+            }
+            log_mode = 1;
+            log_retention_bytes = retention_bytes;
+            break;
+        }
         default:
-            fprintf(stderr, "Usage: %s [-s] [host:port]\n", argv[0]);
+            fprintf(stderr, USAGE, argv[0]);
             return 1;
         }
     }
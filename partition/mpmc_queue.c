@@ -0,0 +1,475 @@
+#include "mpmc_queue.h"
+
+#include <messageq/buffer_pool.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// hazard pointers of a thread, shared by every lock-free queue. records are
+// never freed, and the record of a thread that exited is taken over by the
+// next thread, along with the nodes it retired
+struct hazard_record {
+    _Atomic(struct mpmc_node *) pointers[MPMC_QUEUE_HAZARDS];
+    atomic_int active;
+    struct mpmc_node *retired; // popped nodes not freed yet, by `retired_next`
+    unsigned int retired_count;
+    struct hazard_record *next;
+};
+
+static _Atomic(struct hazard_record *) hazard_records;
+static atomic_uint hazard_records_count;
+
+static __thread struct hazard_record *hazard;
+static pthread_once_t hazard_once = PTHREAD_ONCE_INIT;
+static pthread_key_t hazard_key;
+
+/**
+ * Hands the record of a thread that exits to the next thread, with its hazard
+ * pointers cleared.
+ */
+static void hazard_release(void *arg) {
+    struct hazard_record *record = arg;
+    for (int i = 0; i < MPMC_QUEUE_HAZARDS; i++) {
+        atomic_store(&record->pointers[i], NULL);
+    }
+    atomic_store(&record->active, 0);
+    hazard = NULL;
+}
+
+static void hazard_init() { pthread_key_create(&hazard_key, hazard_release); }
+
+/**
+ * Gets the calling thread's hazard record, taking over a released one or
+ * allocating one on first use.
+ *
+ * @returns the record, `NULL` if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+static struct hazard_record *hazard_get() {
+    if (hazard) {
+        return hazard;
+    }
+
+    pthread_once(&hazard_once, hazard_init);
+
+    struct hazard_record *record = atomic_load(&hazard_records);
+    for (; record; record = record->next) {
+        int inactive = 0;
+        if (!atomic_load_explicit(&record->active, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&record->active, &inactive, 1)) {
+            break;
+        }
+    }
+
+    if (!record) {
+        record = calloc(1, sizeof(struct hazard_record));
+        if (!record) {
+            errno = ENOMEM;
+            return NULL;
+        }
+
+        // counted before it is linked, so that the count is never below the
+        // records reachable from an earlier `hazard_records`
+        atomic_init(&record->active, 1);
+        atomic_fetch_add(&hazard_records_count, 1);
+        record->next = atomic_load(&hazard_records);
+        while (!atomic_compare_exchange_weak(&hazard_records, &record->next,
+                                             record)) {
+        }
+    }
+
+    pthread_setspecific(hazard_key, record);
+    hazard = record;
+    return record;
+}
+
+/**
+ * Loads a node and publishes it in a hazard pointer, loading it again until
+ * it did not change in between, so that it was not freed before it was
+ * published.
+ *
+ * @param record calling thread's hazard record
+ * @param i index of the hazard pointer
+ * @param src pointer to the node
+ * @returns the node, protected until the hazard pointer is cleared
+ */
+static struct mpmc_node *hazard_protect(struct hazard_record *record, int i,
+                                        _Atomic(struct mpmc_node *) *src) {
+    struct mpmc_node *node = atomic_load(src);
+    for (;;) {
+        atomic_store(&record->pointers[i], node);
+        struct mpmc_node *again = atomic_load(src);
+        if (again == node) {
+            return node;
+        }
+        node = again;
+    }
+}
+
+static void hazard_clear(struct hazard_record *record) {
+    for (int i = 0; i < MPMC_QUEUE_HAZARDS; i++) {
+        atomic_store_explicit(&record->pointers[i], NULL,
+                              memory_order_release);
+    }
+}
+
+static int compare_pointers(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t) * (const struct mpmc_node *const *)a;
+    uintptr_t y = (uintptr_t) * (const struct mpmc_node *const *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Retires a popped node, freeing it once no hazard pointer points to it.
+ * Retired nodes are scanned once there are enough of them for a scan to free
+ * at least `MPMC_QUEUE_RETIRED` whatever the hazard pointers, against a sorted
+ * copy of the hazard pointers, so that each pop frees its node in amortized
+ * logarithmic time of the number of threads.
+ *
+ * @param record calling thread's hazard record
+ * @param node node to retire, unlinked from its queue
+ */
+static void hazard_retire(struct hazard_record *record,
+                          struct mpmc_node *node) {
+    node->retired_next = record->retired;
+    record->retired = node;
+    record->retired_count++;
+
+    unsigned int capacity =
+        atomic_load(&hazard_records_count) * MPMC_QUEUE_HAZARDS;
+    if (record->retired_count < capacity + MPMC_QUEUE_RETIRED) {
+        return;
+    }
+
+    // records linked after `first` are skipped, their threads only read nodes
+    // still linked once they published them, and these ones were unlinked
+    struct hazard_record *first = atomic_load(&hazard_records);
+    capacity = atomic_load(&hazard_records_count) * MPMC_QUEUE_HAZARDS;
+
+    struct mpmc_node **hazards =
+        buffer_pool_alloc(capacity * sizeof(struct mpmc_node *));
+    if (!hazards) {
+        return; // scanned on the next retire
+    }
+
+    unsigned int n = 0;
+    for (struct hazard_record *other = first; other; other = other->next) {
+        for (int i = 0; i < MPMC_QUEUE_HAZARDS; i++) {
+            struct mpmc_node *pointer = atomic_load(&other->pointers[i]);
+            if (pointer) {
+                hazards[n++] = pointer;
+            }
+        }
+    }
+    qsort(hazards, n, sizeof *hazards, compare_pointers);
+
+    struct mpmc_node *retired = record->retired;
+    record->retired = NULL;
+    record->retired_count = 0;
+    while (retired) {
+        struct mpmc_node *next = retired->retired_next;
+        if (bsearch(&retired, hazards, n, sizeof *hazards, compare_pointers)) {
+            retired->retired_next = record->retired;
+            record->retired = retired;
+            record->retired_count++;
+        } else {
+            buffer_pool_free(retired);
+        }
+        retired = next;
+    }
+    buffer_pool_free(hazards);
+}
+
+int mpmc_queue_init(struct mpmc_queue *queue) {
+    if (!queue) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mpmc_node *dummy = buffer_pool_alloc(sizeof(struct mpmc_node));
+    if (!dummy) {
+        errno = ENOMEM;
+        return -1;
+    }
+    atomic_init(&dummy->next, NULL);
+    dummy->entry.data = NULL;
+
+    atomic_init(&queue->head, dummy);
+    atomic_init(&queue->tail, dummy);
+    atomic_init(&queue->length, 0);
+    atomic_init(&queue->bytes, 0);
+    return 0;
+}
+
+void mpmc_queue_destroy(struct mpmc_queue *queue) {
+    if (!queue) {
+        return;
+    }
+
+    // the dummy's entry was popped, the others' data is still the queue's
+    struct mpmc_node *node = atomic_load(&queue->head);
+    struct mpmc_node *next = atomic_load(&node->next);
+    buffer_pool_free(node);
+    for (node = next; node; node = next) {
+        next = atomic_load(&node->next);
+        buffer_pool_free(node->entry.data);
+        buffer_pool_free(node);
+    }
+
+    atomic_store(&queue->head, NULL);
+    atomic_store(&queue->tail, NULL);
+    atomic_store(&queue->length, 0);
+    atomic_store(&queue->bytes, 0);
+}
+
+/**
+ * Links a chain of nodes at the tail of a queue, with a CAS on the tail
+ * node's `next`. A tail left behind by another producer is moved forward
+ * first, so that no producer waits for another to finish.
+ *
+ * @param queue the queue to update
+ * @param first first node of the chain
+ * @param last last node of the chain, whose `next` is `NULL`
+ * @param n number of nodes
+ * @param bytes total size of the nodes' data
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+static int link_nodes(struct mpmc_queue *queue, struct mpmc_node *first,
+                      struct mpmc_node *last, unsigned int n, size_t bytes) {
+    struct hazard_record *record = hazard_get();
+    if (!record) {
+        return -1;
+    }
+
+    atomic_fetch_add(&queue->length, n);
+    atomic_fetch_add(&queue->bytes, bytes);
+
+    for (;;) {
+        struct mpmc_node *tail = hazard_protect(record, 0, &queue->tail);
+        struct mpmc_node *next = atomic_load(&tail->next);
+        if (next) {
+            atomic_compare_exchange_strong(&queue->tail, &tail, next);
+            continue;
+        }
+
+        if (atomic_compare_exchange_weak(&tail->next, &next, first)) {
+            atomic_compare_exchange_strong(&queue->tail, &tail, last);
+            break;
+        }
+    }
+
+    hazard_clear(record);
+    return 0;
+}
+
+/**
+ * Allocates an unlinked node for an entry, taking over its data.
+ *
+ * @returns the node, `NULL` if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+static struct mpmc_node *node_alloc(const struct queue_entry *entry,
+                                    void *data) {
+    struct mpmc_node *node = buffer_pool_alloc(sizeof(struct mpmc_node));
+    if (!node) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    atomic_init(&node->next, NULL);
+    node->entry.id = entry->id;
+    node->entry.size = entry->size;
+    node->entry.data = data;
+    return node;
+}
+
+int mpmc_queue_push(struct mpmc_queue *queue, const struct queue_entry *entry) {
+    if (!queue || !entry || !entry->data || !entry->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    void *data = buffer_pool_alloc(entry->size);
+    if (!data) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(data, entry->data, entry->size);
+
+    struct mpmc_node *node = node_alloc(entry, data);
+    if (!node) {
+        buffer_pool_free(data);
+        return -1;
+    }
+
+    if (link_nodes(queue, node, node, 1, entry->size) < 0) {
+        buffer_pool_free(node);
+        buffer_pool_free(data);
+        return -1;
+    }
+    return 0;
+}
+
+int mpmc_queue_push_leased(struct mpmc_queue *queue,
+                           const struct queue_entry *entry) {
+    if (!queue || !entry || !entry->data || !entry->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct mpmc_node *node = node_alloc(entry, entry->data);
+    if (!node) {
+        return -1;
+    }
+
+    if (link_nodes(queue, node, node, 1, entry->size) < 0) {
+        buffer_pool_free(node);
+        return -1;
+    }
+    return 0;
+}
+
+int mpmc_queue_push_batch(struct mpmc_queue *queue,
+                          const struct queue_entry *entries, unsigned int n) {
+    if (!queue || !entries || !n) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        if (!entries[i].data || !entries[i].size) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    // the chain is built before it is linked, so that it is linked whole
+    struct mpmc_node *first = NULL;
+    struct mpmc_node *last = NULL;
+    size_t bytes = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        void *data = buffer_pool_alloc(entries[i].size);
+        struct mpmc_node *node = data ? node_alloc(&entries[i], data) : NULL;
+        if (!node) {
+            buffer_pool_free(data);
+            errno = ENOMEM;
+            goto cleanup;
+        }
+        memcpy(data, entries[i].data, entries[i].size);
+
+        if (last) {
+            atomic_store_explicit(&last->next, node, memory_order_relaxed);
+        } else {
+            first = node;
+        }
+        last = node;
+        bytes += entries[i].size;
+    }
+
+    if (link_nodes(queue, first, last, n, bytes) >= 0) {
+        return 0;
+    }
+
+cleanup:
+    while (first) {
+        struct mpmc_node *next = atomic_load(&first->next);
+        buffer_pool_free(first->entry.data);
+        buffer_pool_free(first);
+        first = next;
+    }
+    return -1;
+}
+
+int mpmc_queue_pop(struct mpmc_queue *queue, struct queue_entry *buf,
+                   size_t max_size) {
+    if (!queue || !buf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct hazard_record *record = hazard_get();
+    if (!record) {
+        return -1;
+    }
+
+    struct mpmc_node *head;
+    for (;;) {
+        head = hazard_protect(record, 0, &queue->head);
+        // `next` is only retired once `head` moved past it, so it is safe to
+        // read if `head` is still the head once it is published
+        struct mpmc_node *next = hazard_protect(record, 1, &head->next);
+        if (head != atomic_load(&queue->head)) {
+            continue;
+        }
+
+        if (!next) {
+            errno = ENODATA;
+            goto cleanup;
+        }
+
+        // a tail left behind by a producer is moved past the head first
+        struct mpmc_node *tail = atomic_load(&queue->tail);
+        if (head == tail) {
+            atomic_compare_exchange_strong(&queue->tail, &tail, next);
+            continue;
+        }
+
+        if (next->entry.size > max_size) {
+            errno = EMSGSIZE;
+            goto cleanup;
+        }
+
+        // `next` becomes the dummy, its entry is handed to the thread whose
+        // CAS moves the head
+        *buf = next->entry;
+        if (atomic_compare_exchange_weak(&queue->head, &head, next)) {
+            break;
+        }
+    }
+
+    hazard_clear(record);
+    atomic_fetch_sub(&queue->length, 1);
+    atomic_fetch_sub(&queue->bytes, buf->size);
+    hazard_retire(record, head);
+    return 0;
+
+cleanup:
+    hazard_clear(record);
+    return -1;
+}
+
+int mpmc_queue_peek_id(struct mpmc_queue *queue) {
+    if (!queue) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct hazard_record *record = hazard_get();
+    if (!record) {
+        return -1;
+    }
+
+    int ret;
+    for (;;) {
+        struct mpmc_node *head = hazard_protect(record, 0, &queue->head);
+        struct mpmc_node *next = hazard_protect(record, 1, &head->next);
+        if (head != atomic_load(&queue->head)) {
+            continue;
+        }
+
+        if (!next) {
+            errno = ENODATA;
+            ret = -1;
+        } else {
+            ret = next->entry.id;
+        }
+        break;
+    }
+
+    hazard_clear(record);
+    return ret;
+}
@@ -0,0 +1,118 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include "queue.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define MPMC_QUEUE_HAZARDS 2  // hazard pointers per thread
+#define MPMC_QUEUE_RETIRED 64 // popped nodes a thread frees per scan, at least
+
+// entry linked into a lock-free queue. the head node is a dummy, whose entry
+// was already popped
+struct mpmc_node {
+    _Atomic(struct mpmc_node *) next;
+    struct mpmc_node *retired_next; // on its retiring thread's list
+    struct queue_entry entry;       // data leased from the buffer pool
+};
+
+// unbounded FIFO of entries for many producers and consumers, pushed and
+// popped without locks: a linked list from a dummy `head`, where producers
+// link nodes with a CAS on the tail node's `next` and consumers unlink them
+// with a CAS on `head`. threads publish the nodes they read in hazard
+// pointers, and popped nodes are only freed once none points to them, so a
+// thread reading a node another one popped meanwhile never reads freed memory
+struct mpmc_queue {
+    _Alignas(64) _Atomic(struct mpmc_node *) head;
+    _Alignas(64) _Atomic(struct mpmc_node *) tail;
+    // counted before entries are linked and after they are unlinked, so they
+    // are never below the entries a pop could take
+    _Alignas(64) atomic_uint length;
+    atomic_size_t bytes; // total size of the entries' data
+};
+
+/**
+ * Initializes a lock-free queue.
+ *
+ * @param queue the queue to init
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOMEM` out of memory
+ */
+int mpmc_queue_init(struct mpmc_queue *queue);
+
+/**
+ * Destroys a lock-free queue, freeing all its resources. No thread may use it
+ * meanwhile.
+ *
+ * @param queue the queue to destroy
+ */
+void mpmc_queue_destroy(struct mpmc_queue *queue);
+
+/**
+ * Pushes a copy of an entry on a lock-free queue.
+ *
+ * @param queue the queue to update
+ * @param entry the entry to push
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOMEM` out of memory
+ */
+int mpmc_queue_push(struct mpmc_queue *queue, const struct queue_entry *entry);
+
+/**
+ * Pushes an entry whose data is leased from the buffer pool on a lock-free
+ * queue, taking over the caller's reference instead of copying the data.
+ *
+ * @param queue the queue to update
+ * @param entry the entry to push, whose data is released by the queue on
+ * success and still owned by the caller on error
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOMEM` out of memory
+ */
+int mpmc_queue_push_leased(struct mpmc_queue *queue,
+                           const struct queue_entry *entry);
+
+/**
+ * Pushes copies of a batch of entries on a lock-free queue atomically: either
+ * every entry is pushed, in order and with no other entry in between, or none
+ * is.
+ *
+ * @param queue the queue to update
+ * @param entries the entries to push
+ * @param n number of entries
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args, or any entry is empty
+ * @throws `ENOMEM` out of memory
+ */
+int mpmc_queue_push_batch(struct mpmc_queue *queue,
+                          const struct queue_entry *entries, unsigned int n);
+
+/**
+ * Pops the head of a lock-free queue if its data is at most `max_size` bytes.
+ *
+ * @param queue the queue to update
+ * @param buf output param for the popped entry, whose data is leased from the
+ * buffer pool and must be released with `buffer_pool_free`
+ * @param max_size maximum size of the popped entry's data
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENODATA` queue empty
+ * @throws `EMSGSIZE` head entry larger than `max_size`
+ */
+int mpmc_queue_pop(struct mpmc_queue *queue, struct queue_entry *buf,
+                   size_t max_size);
+
+/**
+ * Gets the ID of the head of a lock-free queue.
+ *
+ * @param queue the queue to peek
+ * @returns queue's head id if success, -1 if error
+ * @throws `EINVAL` invalid args
+ * @throws `ENODATA` queue empty
+ */
+int mpmc_queue_peek_id(struct mpmc_queue *queue);
+
+#endif
@@ -1,15 +1,23 @@
 #include "partition.h"
 
+#include <messageq/buffer_pool.h>
 #include <messageq/locking.h>
 #include <messageq/network.h>
 #include <messageq/zookeeper.h>
 
+#include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "queue.h"
+#include "log.h"
+#include "mpmc_queue.h"
 
 enum role role = FREE;
 int partition_id = -1;
@@ -17,8 +25,140 @@ char assigned_topic[MAX_TOPIC_LEN + 1] = {0};
 char assigned_shard[MAX_SHARD_LEN + 1] = {0};
 
 static zhandle_t *zh;
-static struct queue queue;
-static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// entries of a partition in queue mode, pushed and popped without a lock, so
+// that producers and consumers do not wait for each other
+static struct mpmc_queue queue;
+
+// guards what pushes and pops share besides the entries: waiting pops,
+// subscriptions, producer credits, entries put back after a failed send and
+// the log. pushes take it for their credits, and pops only if entries were put
+// back, a consumer waits to be served or a producer for credits
+static pthread_mutex_t bookkeeping_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// waiting pops and subscriptions, read by pushes without `bookkeeping_lock`
+// to serve consumers only if any waits. a pop parks and then serves consumers,
+// so that an entry pushed before the push saw it waiting is still handed out
+static atomic_uint consumers_count;
+
+// pop waiting for a push to an empty queue
+struct pop_waiter {
+    struct dmqp_reply *reply;
+    uint32_t correlation_id;
+    struct timespec deadline; // `CLOCK_MONOTONIC`
+    struct pop_waiter *next;
+};
+
+// waiting pops in arrival order, protected by `bookkeeping_lock`.
+// `waiters_cond` wakes the thread answering expired pops when one starts
+// waiting
+static struct pop_waiter *waiters_head;
+static struct pop_waiter *waiters_tail;
+static pthread_cond_t waiters_cond;
+static int waiters_running;
+
+// consumer that entries are pushed to as they arrive
+struct subscription {
+    struct dmqp_reply *reply;
+    int client;
+    uint32_t correlation_id;
+    uint32_t credits; // entries that may be pushed before the next grant
+    // entries handed to it and not sent yet, all from the list `sending_list`.
+    // other lists skip it until they are sent, so that entries arrive in order
+    unsigned int sending;
+    struct delivery **sending_list;
+    int send_failed; // an entry of `sending_list` failed, skip the rest
+    int removed;     // unlinked while sending, ended once the entries are sent
+    int status;      // status code to end it with once removed
+    struct subscription *prev;
+    struct subscription *next;
+};
+
+// entry popped for a consumer, sent by `deliveries_send` once
+// `bookkeeping_lock` is released
+struct delivery {
+    struct dmqp_reply *reply;
+    uint32_t correlation_id;
+    struct subscription *sub; // `NULL` for a waiting pop
+    struct queue_entry entry; // data leased from the buffer pool
+    int status;               // error sending it, 0 if sent
+    struct delivery *next;
+};
+
+// entries that failed to send, in order, popped before the ones of `queue`.
+// protected by `bookkeeping_lock`, which pops only take while
+// `requeued_length` is not 0
+static struct delivery *requeued;
+static atomic_uint requeued_length;
+static size_t requeued_bytes;
+
+// protected by `bookkeeping_lock`. entries are handed out round-robin,
+// starting at `subscriptions_cursor`
+static struct subscription *subscriptions;
+static struct subscription *subscriptions_cursor;
+static unsigned int subscriptions_count;
+
+size_t queue_max_bytes = QUEUE_MAX_BYTES;
+unsigned int queue_max_messages = QUEUE_MAX_MESSAGES;
+
+int log_mode = 0;
+size_t log_retention_bytes = LOG_RETENTION_BYTES;
+unsigned int log_retention_messages = LOG_RETENTION_MESSAGES;
+
+// entries of a partition in log mode, appended under `bookkeeping_lock` and
+// read without it
+static struct log entry_log;
+
+// connection reading the log, from its own cursor
+struct reader {
+    struct dmqp_reply *hold; // keeps the connection, so `client` is not reused
+    int client;
+    int cursor;           // of `entry_log`
+    pthread_mutex_t lock; // reads of the connection, which share the cursor
+    struct reader *next;
+};
+
+// protected by `readers_lock`, never held along with `bookkeeping_lock`, so
+// that reads do not wait for pushes
+static struct reader *readers;
+static pthread_mutex_t readers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned int replication_compress_threshold = DMQP_COMPRESS_THRESHOLD;
+
+// settings of every replication connection, so that adaptive mode learns from
+// all replicated payloads
+static struct dmqp_compression replication_compression = {
+    .flags = DMQP_COMPRESS_ADAPTIVE};
+
+// connection pushing to a leader and the credits it was granted. the queue and
+// the credits of every producer together stay within `queue_max_bytes` and
+// `queue_max_messages`
+struct producer {
+    struct dmqp_reply *hold; // keeps the connection, so `client` is not reused
+    int client;
+    struct dmqp_credits credits; // granted and not yet used
+    struct dmqp_reply *waiting;  // `DMQP_CREDIT` waiting for credits, or `NULL`
+    uint32_t waiting_correlation_id;
+    uint32_t waiting_bytes; // byte credits `waiting` waits for
+    struct producer *prev;
+    struct producer *next;
+};
+
+// protected by `bookkeeping_lock`. credits are replenished round-robin,
+// starting at `producers_cursor`
+static struct producer *producers;
+static struct producer *producers_cursor;
+static size_t granted_bytes;
+static unsigned int granted_messages;
+
+// producers with a waiting `DMQP_CREDIT`, read by pops without
+// `bookkeeping_lock` to replenish credits only if any waits
+static atomic_uint producers_waiting;
+
+// entries whose credits were taken and that are not pushed to `queue` yet,
+// counted as stored so that their capacity is not granted again meanwhile
+static atomic_uint pushing_messages;
+static atomic_size_t pushing_bytes;
 
 struct targ {
     int result;
@@ -143,6 +283,548 @@ static void partition_znode_watcher(zhandle_t *zzh, int type, int state,
     }
 }
 
+/**
+ * Replies `ENODATA` to a waiting pop and frees it.
+ *
+ * @param waiter waiting pop to answer
+ */
+static void waiter_reply_empty(struct pop_waiter *waiter) {
+    struct dmqp_header res_header = {0};
+    res_header.method = DMQP_RESPONSE;
+    res_header.status_code = ENODATA;
+    res_header.correlation_id = waiter->correlation_id;
+    struct dmqp_message res_message = {.header = res_header, .payload = NULL};
+    dmqp_reply_send(waiter->reply, &res_message);
+    buffer_pool_free(waiter);
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * Answers waiting pops whose timeout expired, sleeping until the earliest
+ * deadline in between. Answers every waiting pop once `waiters_running` is
+ * cleared.
+ */
+static void *waiters_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&bookkeeping_lock);
+    while (waiters_running) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        struct timespec next_deadline = {0};
+        int waiting = 0;
+        struct pop_waiter *prev = NULL;
+        struct pop_waiter *waiter = waiters_head;
+        while (waiter) {
+            struct pop_waiter *next = waiter->next;
+            if (timespec_before(&now, &waiter->deadline)) {
+                if (!waiting ||
+                    timespec_before(&waiter->deadline, &next_deadline)) {
+                    next_deadline = waiter->deadline;
+                }
+                waiting = 1;
+                prev = waiter;
+                waiter = next;
+                continue;
+            }
+
+            if (prev) {
+                prev->next = next;
+            } else {
+                waiters_head = next;
+            }
+            if (waiters_tail == waiter) {
+                waiters_tail = prev;
+            }
+            atomic_fetch_sub(&consumers_count, 1);
+            waiter_reply_empty(waiter);
+            waiter = next;
+        }
+
+        if (waiting) {
+            pthread_cond_timedwait(&waiters_cond, &bookkeeping_lock,
+                                   &next_deadline);
+        } else {
+            pthread_cond_wait(&waiters_cond, &bookkeeping_lock);
+        }
+    }
+
+    while (waiters_head) {
+        struct pop_waiter *next = waiters_head->next;
+        atomic_fetch_sub(&consumers_count, 1);
+        waiter_reply_empty(waiters_head);
+        waiters_head = next;
+    }
+    waiters_tail = NULL;
+    pthread_mutex_unlock(&bookkeeping_lock);
+
+    return NULL;
+}
+
+/**
+ * Parks a pop of an empty queue until a push or its timeout. Must hold
+ * `bookkeeping_lock`.
+ *
+ * @param message pop being handled
+ * @param client socket to reply on
+ * @param wait_ms timeout in milliseconds
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ESHUTDOWN` partition stopping
+ * @throws `EINVAL` calling thread is not handling a message from `client`
+ * @throws `ENOMEM` out of memory
+ */
+static int waiter_park(const struct dmqp_message *message, int client,
+                       uint32_t wait_ms) {
+    if (!waiters_running) {
+        errno = ESHUTDOWN;
+        return -1;
+    }
+
+    struct pop_waiter *waiter = buffer_pool_alloc(sizeof(struct pop_waiter));
+    if (!waiter) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    waiter->reply = dmqp_reply_defer(client);
+    if (!waiter->reply) {
+        buffer_pool_free(waiter);
+        return -1;
+    }
+
+    waiter->correlation_id = message->header.correlation_id;
+    clock_gettime(CLOCK_MONOTONIC, &waiter->deadline);
+    waiter->deadline.tv_sec += wait_ms / 1000;
+    waiter->deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+    if (waiter->deadline.tv_nsec >= 1000000000) {
+        waiter->deadline.tv_sec++;
+        waiter->deadline.tv_nsec -= 1000000000;
+    }
+
+    waiter->next = NULL;
+    if (waiters_tail) {
+        waiters_tail->next = waiter;
+    } else {
+        waiters_head = waiter;
+    }
+    waiters_tail = waiter;
+    atomic_fetch_add(&consumers_count, 1);
+
+    pthread_cond_signal(&waiters_cond);
+    return 0;
+}
+
+/**
+ * Ends the stream of an unlinked subscription and frees it.
+ *
+ * @param sub subscription to end
+ * @param status status code to end the stream with, 0 to end it silently
+ */
+static void subscription_end(struct subscription *sub, int status) {
+    if (status) {
+        struct dmqp_header res_header = {0};
+        res_header.method = DMQP_RESPONSE;
+        res_header.status_code = status;
+        res_header.correlation_id = sub->correlation_id;
+        struct dmqp_message res_message = {.header = res_header,
+                                           .payload = NULL};
+        dmqp_reply_send(sub->reply, &res_message);
+    } else {
+        dmqp_reply_cancel(sub->reply);
+    }
+    buffer_pool_free(sub);
+}
+
+/**
+ * Unlinks a subscription and frees it. One with entries still being sent is
+ * ended by their sender instead, once they are. Must hold `bookkeeping_lock`.
+ *
+ * @param sub subscription to remove
+ * @param status status code to end the stream with, 0 to end it silently
+ */
+static void subscription_remove(struct subscription *sub, int status) {
+    if (sub->prev) {
+        sub->prev->next = sub->next;
+    } else {
+        subscriptions = sub->next;
+    }
+    if (sub->next) {
+        sub->next->prev = sub->prev;
+    }
+    if (subscriptions_cursor == sub) {
+        subscriptions_cursor = sub->next;
+    }
+    subscriptions_count--;
+    atomic_fetch_sub(&consumers_count, 1);
+
+    if (sub->sending) {
+        sub->removed = 1;
+        sub->status = status;
+        return;
+    }
+    subscription_end(sub, status);
+}
+
+/**
+ * Returns the data bytes of the entries stored, in the queue or the log. Must
+ * hold `bookkeeping_lock`.
+ */
+static size_t stored_bytes() {
+    if (log_mode) {
+        return entry_log.bytes;
+    }
+    return atomic_load(&queue.bytes) + requeued_bytes +
+           atomic_load(&pushing_bytes);
+}
+
+/**
+ * Returns the number of entries stored, in the queue or the log. Must hold
+ * `bookkeeping_lock`.
+ */
+static unsigned int stored_messages() {
+    if (log_mode) {
+        return entry_log.end - entry_log.start;
+    }
+    return atomic_load(&queue.length) + atomic_load(&requeued_length) +
+           atomic_load(&pushing_messages);
+}
+
+/**
+ * Tops up a producer's credits to its window, out of the capacity that is
+ * neither stored nor granted to other producers. Must hold `bookkeeping_lock`.
+ *
+ * @param producer producer to grant credits to
+ */
+static void producer_grant(struct producer *producer) {
+    size_t used_bytes = stored_bytes() + granted_bytes;
+    size_t free_bytes =
+        used_bytes < queue_max_bytes ? queue_max_bytes - used_bytes : 0;
+    unsigned int used_messages = stored_messages() + granted_messages;
+    unsigned int free_messages = used_messages < queue_max_messages
+                                     ? queue_max_messages - used_messages
+                                     : 0;
+
+    uint32_t bytes = PRODUCER_WINDOW_BYTES - producer->credits.bytes;
+    if (bytes > free_bytes) {
+        bytes = free_bytes;
+    }
+    uint32_t messages = PRODUCER_WINDOW_MESSAGES - producer->credits.messages;
+    if (messages > free_messages) {
+        messages = free_messages;
+    }
+
+    producer->credits.bytes += bytes;
+    producer->credits.messages += messages;
+    granted_bytes += bytes;
+    granted_messages += messages;
+}
+
+/**
+ * Takes the credits for pushing `n` entries of `bytes` bytes in total from a
+ * producer. Must hold `bookkeeping_lock`.
+ *
+ * @param producer producer pushing, `NULL` if the push needs no credits
+ * @param n number of entries
+ * @param bytes total size of the entries
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOBUFS` not enough credits
+ */
+static int producer_take(struct producer *producer, uint32_t n, size_t bytes) {
+    if (!producer) {
+        return 0;
+    }
+
+    if (producer->credits.messages < n || producer->credits.bytes < bytes) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    producer->credits.messages -= n;
+    producer->credits.bytes -= bytes;
+    granted_messages -= n;
+    granted_bytes -= bytes;
+    return 0;
+}
+
+/**
+ * Gives back the credits taken by `producer_take` for a push that failed. Must
+ * hold `bookkeeping_lock`.
+ *
+ * @param producer producer pushing, may be `NULL`
+ * @param n number of entries
+ * @param bytes total size of the entries
+ */
+static void producer_refund(struct producer *producer, uint32_t n,
+                            size_t bytes) {
+    if (!producer) {
+        return;
+    }
+
+    producer->credits.messages += n;
+    producer->credits.bytes += bytes;
+    granted_messages += n;
+    granted_bytes += bytes;
+}
+
+/**
+ * Answers a producer's waiting `DMQP_CREDIT` with its credits. Must hold
+ * `bookkeeping_lock`.
+ *
+ * @param producer producer with a waiting `DMQP_CREDIT`
+ * @param status status code of the response
+ */
+static void producer_answer(struct producer *producer, int status) {
+    char credits[DMQP_CREDITS_SIZE];
+    dmqp_credits_pack(&producer->credits, credits);
+
+    struct dmqp_header res_header = {0};
+    res_header.length = DMQP_CREDITS_SIZE;
+    res_header.method = DMQP_RESPONSE;
+    res_header.status_code = status;
+    res_header.correlation_id = producer->waiting_correlation_id;
+    struct dmqp_message res_message = {.header = res_header,
+                                       .payload = credits};
+    dmqp_reply_send(producer->waiting, &res_message);
+    producer->waiting = NULL;
+    atomic_fetch_sub(&producers_waiting, 1);
+}
+
+/**
+ * Unlinks a producer, takes back its credits and frees it. A waiting
+ * `DMQP_CREDIT` is answered with `ESHUTDOWN`. Must hold `bookkeeping_lock`.
+ *
+ * @param producer producer to remove
+ */
+static void producer_remove(struct producer *producer) {
+    if (producer->prev) {
+        producer->prev->next = producer->next;
+    } else {
+        producers = producer->next;
+    }
+    if (producer->next) {
+        producer->next->prev = producer->prev;
+    }
+    if (producers_cursor == producer) {
+        producers_cursor = producer->next;
+    }
+
+    granted_messages -= producer->credits.messages;
+    granted_bytes -= producer->credits.bytes;
+    producer->credits.messages = 0;
+    producer->credits.bytes = 0;
+
+    if (producer->waiting) {
+        producer_answer(producer, ESHUTDOWN);
+    }
+    dmqp_reply_cancel(producer->hold);
+    buffer_pool_free(producer);
+}
+
+/**
+ * Gets the producer of a connection. A connection's first request registers
+ * it with as much of a window of credits as the capacity left allows.
+ * Producers that disconnected are dropped on the way. Must hold
+ * `bookkeeping_lock`.
+ *
+ * @param client socket the message being handled was received on
+ * @returns the producer, `NULL` if error with global `errno` set
+ * @throws `EINVAL` calling thread is not handling a message from `client`
+ * @throws `ENOMEM` out of memory
+ */
+static struct producer *producer_get(int client) {
+    struct producer *producer = producers;
+    while (producer) {
+        struct producer *next = producer->next;
+        if (producer->client == client) {
+            return producer;
+        }
+
+        if (!dmqp_reply_is_open(producer->hold)) {
+            producer_remove(producer);
+        }
+        producer = next;
+    }
+
+    producer = buffer_pool_alloc(sizeof(struct producer));
+    if (!producer) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    producer->hold = dmqp_reply_defer(client);
+    if (!producer->hold) {
+        buffer_pool_free(producer);
+        return NULL;
+    }
+
+    producer->client = client;
+    producer->credits.messages = 0;
+    producer->credits.bytes = 0;
+    producer->waiting = NULL;
+    producer->prev = NULL;
+    producer->next = producers;
+    if (producers) {
+        producers->prev = producer;
+    }
+    producers = producer;
+
+    producer_grant(producer);
+    return producer;
+}
+
+/**
+ * Replenishes the credits of producers out of the capacity consumers freed and
+ * answers the `DMQP_CREDIT` requests that got the credits they wait for.
+ * Producers are topped up in turn, each call starting one producer further,
+ * so that none is starved when capacity runs short. Producers that
+ * disconnected give their credits back. Must hold `bookkeeping_lock`.
+ */
+static void replenish_producers() {
+    struct producer *producer = producers;
+    while (producer) {
+        struct producer *next = producer->next;
+        if (!dmqp_reply_is_open(producer->hold)) {
+            producer_remove(producer);
+        }
+        producer = next;
+    }
+
+    if (!producers) {
+        return;
+    }
+
+    struct producer *first = producers_cursor ? producers_cursor : producers;
+    producer = first;
+    do {
+        producer_grant(producer);
+        if (producer->waiting && producer->credits.messages &&
+            producer->credits.bytes >= producer->waiting_bytes) {
+            producer_answer(producer, 0);
+        }
+        producer = producer->next ? producer->next : producers;
+    } while (producer != first);
+
+    producers_cursor = first->next;
+}
+
+/**
+ * Unlinks a reader, closes its cursor and frees it, once a read of its
+ * connection still running is done. Must hold `readers_lock`.
+ *
+ * @param prev reader linked before it, `NULL` if it is the first
+ * @param reader reader to remove
+ */
+static void reader_remove(struct reader *prev, struct reader *reader) {
+    if (prev) {
+        prev->next = reader->next;
+    } else {
+        readers = reader->next;
+    }
+
+    // reads lock their reader before releasing `readers_lock`, so no other
+    // read can wait for it
+    pthread_mutex_lock(&reader->lock);
+    pthread_mutex_unlock(&reader->lock);
+    pthread_mutex_destroy(&reader->lock);
+
+    log_cursor_close(&entry_log, reader->cursor);
+    dmqp_reply_cancel(reader->hold);
+    buffer_pool_free(reader);
+}
+
+/**
+ * Removes the readers whose connection closed, so that their cursors no longer
+ * hold back reclamation. Must not hold `bookkeeping_lock`.
+ *
+ * @returns number of readers removed
+ */
+static int readers_sweep() {
+    int removed = 0;
+    pthread_mutex_lock(&readers_lock);
+    struct reader *prev = NULL;
+    struct reader *reader = readers;
+    while (reader) {
+        struct reader *next = reader->next;
+        if (!dmqp_reply_is_open(reader->hold)) {
+            reader_remove(prev, reader);
+            removed++;
+        } else {
+            prev = reader;
+        }
+        reader = next;
+    }
+    pthread_mutex_unlock(&readers_lock);
+    return removed;
+}
+
+/**
+ * Gets the reader of a connection and locks it. A connection's first read
+ * registers it with a cursor at the oldest entry kept. Readers that
+ * disconnected are dropped on the way.
+ *
+ * @param client socket the message being handled was received on
+ * @returns the locked reader, `NULL` if error with global `errno` set
+ * @throws `EINVAL` calling thread is not handling a message from `client`
+ * @throws `EMFILE` `LOG_MAX_CURSORS` connections already read the log
+ * @throws `ENOMEM` out of memory
+ */
+static struct reader *reader_get(int client) {
+    pthread_mutex_lock(&readers_lock);
+
+    struct reader *prev = NULL;
+    struct reader *reader = readers;
+    while (reader) {
+        struct reader *next = reader->next;
+        if (reader->client == client) {
+            goto found;
+        }
+
+        if (!dmqp_reply_is_open(reader->hold)) {
+            reader_remove(prev, reader);
+        } else {
+            prev = reader;
+        }
+        reader = next;
+    }
+
+    reader = buffer_pool_alloc(sizeof(struct reader));
+    if (!reader) {
+        errno = ENOMEM;
+        goto cleanup;
+    }
+
+    reader->hold = dmqp_reply_defer(client);
+    if (!reader->hold) {
+        buffer_pool_free(reader);
+        reader = NULL;
+        goto cleanup;
+    }
+
+    reader->cursor = log_cursor_open(&entry_log, LOG_OLDEST);
+    if (reader->cursor < 0) {
+        dmqp_reply_cancel(reader->hold);
+        buffer_pool_free(reader);
+        reader = NULL;
+        goto cleanup;
+    }
+
+    reader->client = client;
+    pthread_mutex_init(&reader->lock, NULL);
+    reader->next = readers;
+    readers = reader;
+
+found:
+    pthread_mutex_lock(&reader->lock);
+cleanup:
+    pthread_mutex_unlock(&readers_lock);
+    return reader;
+}
+
 /**
  * Registers a partition into the service registry.
  */
@@ -150,8 +832,14 @@ static void reigster_partition() {
     acquire_distributed_lock("/partitions/lock", zh);
 
     // TODO: must dynamically detect host in the future
-    char host[MAX_HOST_LEN + 1];
-    snprintf(host, sizeof host, "127.0.0.1:%d", server_port);
+    // local clients connect to the unix socket advertised after the port
+    char host[MAX_HOST_LEN + DMQP_UNIX_PATH_MAX + 1];
+    if (server_unix_path[0]) {
+        snprintf(host, sizeof host, "127.0.0.1:%d,%s", server_port,
+                 server_unix_path);
+    } else {
+        snprintf(host, sizeof host, "127.0.0.1:%d", server_port);
+    }
     char path[MAX_PATH_LEN + 1];
     zoo_create(zh, "/partitions/partition-", host, strlen(host),
                &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL_SEQUENTIAL, path,
@@ -173,10 +861,38 @@ int start_partition(char *service_discovery_host) {
 
     int ret = 0;
 
-    queue_init(&queue);
+    if (!server_unix_path[0]) {
+        snprintf(server_unix_path, sizeof server_unix_path,
+                 "/tmp/messageq-partition-%d.sock", getpid());
+    }
+
+    if (log_mode && (log_retention_bytes >= queue_max_bytes ||
+                     log_retention_messages >= queue_max_messages)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    replication_compression.threshold = replication_compress_threshold;
+    if (mpmc_queue_init(&queue) < 0) {
+        return -1;
+    }
+    if (log_mode) {
+        log_init(&entry_log, log_retention_bytes, log_retention_messages);
+    }
+
+    pthread_condattr_t waiters_cond_attr;
+    pthread_condattr_init(&waiters_cond_attr);
+    pthread_condattr_setclock(&waiters_cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&waiters_cond, &waiters_cond_attr);
+    pthread_condattr_destroy(&waiters_cond_attr);
+
+    waiters_running = 1;
+    pthread_t waiters_tid;
+    pthread_create(&waiters_tid, NULL, waiters_thread, NULL);
+
     if (!(zh = zoo_init(service_discovery_host))) {
         ret = -1;
-        goto cleanup_queue;
+        goto cleanup_waiters;
     }
 
     pthread_t *server_tid = start_dmqp_server();
@@ -191,12 +907,55 @@ int start_partition(char *service_discovery_host) {
 
 cleanup_zookeeper:
     zookeeper_close(zh);
-cleanup_queue:
-    queue_destroy(&queue);
+cleanup_waiters:
+    pthread_mutex_lock(&bookkeeping_lock);
+    waiters_running = 0;
+    pthread_cond_signal(&waiters_cond);
+    while (subscriptions) {
+        subscription_remove(subscriptions, 0);
+    }
+    while (producers) {
+        producer_remove(producers);
+    }
+    pthread_mutex_unlock(&bookkeeping_lock);
+    pthread_join(waiters_tid, NULL);
+    pthread_cond_destroy(&waiters_cond);
+
+    if (log_mode) {
+        pthread_mutex_lock(&readers_lock);
+        while (readers) {
+            reader_remove(NULL, readers);
+        }
+        pthread_mutex_unlock(&readers_lock);
+        log_destroy(&entry_log);
+    }
+    while (requeued) {
+        struct delivery *next = requeued->next;
+        buffer_pool_free(requeued->entry.data);
+        buffer_pool_free(requeued);
+        requeued = next;
+    }
+    atomic_store(&requeued_length, 0);
+    requeued_bytes = 0;
+    mpmc_queue_destroy(&queue);
     return ret;
 }
 
+/**
+ * Returns 1 if a socket is an `AF_UNIX` socket, 0 otherwise.
+ */
+static int is_unix_socket(int fd) {
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof address;
+    return getsockname(fd, (struct sockaddr *)&address, &address_len) == 0 &&
+           address.ss_family == AF_UNIX;
+}
+
 static void replicate_message(const struct dmqp_message *message) {
+    // compressed once, for the first replica on another host
+    struct dmqp_message compressed = *message;
+    int compress_tried = 0;
+
     char path[MAX_PATH_LEN + 1];
     snprintf(path, sizeof path, "/topics/%s/shards/%s/partitions",
              assigned_topic, assigned_shard);
@@ -212,79 +971,627 @@ static void replicate_message(const struct dmqp_message *message) {
         snprintf(path, sizeof path, "/topics/%s/shards/%s/partitions/%s",
                  assigned_topic, assigned_shard, replicas.data[i]);
         char buf[512];
-        int buflen = sizeof buf;
+        int buflen = sizeof buf - 1;
         zoo_get(zh, path, 0, buf, &buflen, NULL);
+        buf[buflen < 0 ? 0 : buflen] = '\0';
+
+        // replicas on this host are reached over their unix socket
+        int client = dmqp_client_connect(buf);
+        if (client < 0) {
+            continue;
+        }
 
-        char *host = strtok(buf, ";");
-        char *ipv4 = strtok(host, ":");
-        char *port = strtok(NULL, ":");
+        // payloads sent over the unix socket never touch a NIC
+        int local = is_unix_socket(client);
+        if (!local && !compress_tried) {
+            dmqp_compress(&replication_compression, message, &compressed);
+            compress_tried = 1;
+        }
 
-        int client = dmqp_client_init(ipv4, atoi(port));
-        send_dmqp_message(client, message, 0);
+        send_dmqp_message(client, local ? message : &compressed, 0);
         close(client);
     }
 
+    if (compressed.payload != message->payload) {
+        buffer_pool_free(compressed.payload);
+    }
     deallocate_String_vector(&replicas);
 }
 
-// TODO: test all of these DMQP handlers
-void handle_dmqp_push(const struct dmqp_message *message, int client) {
-    if (!message || client < 0 || role == FREE || partition_id < 0 ||
-        !assigned_topic[0] || !assigned_shard[0]) {
-        return;
+/**
+ * Sends an entry handed to a consumer on its deferred reply, then replicates
+ * its pop. Replicas pop their head, so replicated pops need no order, and an
+ * entry put back after a failed send is still held by them.
+ *
+ * @param delivery the entry and the consumer to send it to
+ * @returns 0 on success, -1 if error with global `errno` set
+ */
+static int deliver_entry(const struct delivery *delivery) {
+    struct dmqp_header res_header = {0};
+    res_header.sequence_id = delivery->entry.id;
+    res_header.length = delivery->entry.size;
+    res_header.method = DMQP_RESPONSE;
+    res_header.correlation_id = delivery->correlation_id;
+    struct dmqp_message res_message = {.header = res_header,
+                                       .payload = delivery->entry.data};
+    int ret = delivery->sub ? dmqp_reply_push(delivery->reply, &res_message)
+                            : dmqp_reply_send(delivery->reply, &res_message);
+    if (ret < 0) {
+        return -1;
     }
 
-    char lock_path[MAX_PATH_LEN + 1];
-    snprintf(lock_path, sizeof lock_path, "/topics/%s/sequence-id/lock",
-             assigned_topic);
-    ;
-    acquire_distributed_lock(lock_path, zh);
+    if (role == LEADER) {
+        struct dmqp_message pop = {.header = {.method = DMQP_POP}};
+        replicate_message(&pop);
+    }
+    return 0;
+}
 
-    char path[MAX_PATH_LEN + 1];
-    snprintf(path, sizeof path, "/topics/%s/sequence-id", assigned_topic);
-    char buf[512];
-    int buflen = sizeof buf;
-    zoo_get(zh, path, 0, buf, &buflen, NULL);
+/**
+ * Pops the head of the entries put back after a failed send, or of the queue
+ * if there are none. Must hold `bookkeeping_lock`.
+ *
+ * @param buf output param for the popped entry, whose data is leased from the
+ * buffer pool and must be released with `buffer_pool_free`
+ * @param max_size maximum size of the popped entry's data
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENODATA` queue empty
+ * @throws `EMSGSIZE` head entry larger than `max_size`
+ */
+static int entries_pop_locked(struct queue_entry *buf, size_t max_size) {
+    struct delivery *delivery = requeued;
+    if (!delivery) {
+        return mpmc_queue_pop(&queue, buf, max_size);
+    }
 
-    unsigned int seqid = atoi(buf);
+    if (delivery->entry.size > max_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
 
-    struct dmqp_header res_header;
-    struct dmqp_message res_message;
-    if (message->header.sequence_id != seqid) {
-        res_header.sequence_id = 0;
-        res_header.length = 0;
-        res_header.method = DMQP_RESPONSE;
-        res_header.status_code = EINVAL;
+    *buf = delivery->entry;
+    requeued = delivery->next;
+    requeued_bytes -= delivery->entry.size;
+    atomic_fetch_sub(&requeued_length, 1);
+    buffer_pool_free(delivery);
+    return 0;
+}
 
-        res_message.header = res_header;
-        res_message.payload = NULL;
-        send_dmqp_message(client, &res_message, 0);
-        goto cleanup;
+/**
+ * Pops the head of the entries put back after a failed send, or of the queue
+ * if there are none, taking `bookkeeping_lock` only in the first case. Must
+ * not hold it.
+ *
+ * @param buf output param for the popped entry, whose data is leased from the
+ * buffer pool and must be released with `buffer_pool_free`
+ * @param max_size maximum size of the popped entry's data
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENODATA` queue empty
+ * @throws `EMSGSIZE` head entry larger than `max_size`
+ */
+static int entries_pop(struct queue_entry *buf, size_t max_size) {
+    if (!atomic_load(&requeued_length)) {
+        return mpmc_queue_pop(&queue, buf, max_size);
+    }
+
+    pthread_mutex_lock(&bookkeeping_lock);
+    int ret = entries_pop_locked(buf, max_size);
+    pthread_mutex_unlock(&bookkeeping_lock);
+    return ret;
+}
+
+/**
+ * Pops the head of the queue for a waiting pop or a subscription, prepending
+ * the delivery to `deliveries`, to be sent once `bookkeeping_lock` is
+ * released. Must hold `bookkeeping_lock`.
+ *
+ * @param reply deferred reply to send the entry on
+ * @param correlation_id correlation ID of the request the entry answers
+ * @param sub subscription the entry is pushed to, `NULL` for a waiting pop
+ * @param deliveries list to prepend the delivery to
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENODATA` queue empty
+ * @throws `ENOMEM` out of memory, the queue is left as is
+ */
+static int deliver_head(struct dmqp_reply *reply, uint32_t correlation_id,
+                        struct subscription *sub,
+                        struct delivery **deliveries) {
+    // allocated before popping, so that the entry is never lost to it
+    struct delivery *delivery = buffer_pool_alloc(sizeof(struct delivery));
+    if (!delivery) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (entries_pop_locked(&delivery->entry, SIZE_MAX) < 0) {
+        buffer_pool_free(delivery);
+        return -1;
     }
+    delivery->reply = reply;
+    delivery->correlation_id = correlation_id;
+    delivery->sub = sub;
+    delivery->status = 0;
+    delivery->next = *deliveries;
+    *deliveries = delivery;
+
+    if (sub) {
+        sub->sending++;
+        sub->sending_list = deliveries;
+    }
+    return 0;
+}
+
+/**
+ * Releases a delivery and the data it kept.
+ *
+ * @param delivery delivery to free
+ */
+static void delivery_free(struct delivery *delivery) {
+    buffer_pool_free(delivery->entry.data);
+    buffer_pool_free(delivery);
+}
+
+/**
+ * Puts an entry that failed to send back at the head of the queue, in
+ * `requeued`. Its pop was never replicated, so replicas still hold it at
+ * their head. Must hold `bookkeeping_lock`.
+ *
+ * @param delivery delivery of the entry, kept in `requeued` until the entry
+ * is popped again
+ */
+static void delivery_requeue(struct delivery *delivery) {
+    delivery->next = requeued;
+    requeued = delivery;
+    requeued_bytes += delivery->entry.size;
+    atomic_fetch_add(&requeued_length, 1);
+}
+
+static void serve_consumers(struct delivery **deliveries);
 
-    pthread_mutex_lock(&queue_lock);
+/**
+ * Sends the entries `serve_consumers` handed out, in order. An entry that
+ * fails to send is put back at the head of the queue, in the order it was
+ * popped, and ends the subscription it was pushed to. Consumers are then
+ * served again, for the subscriptions skipped while these were sent. Must not
+ * hold `bookkeeping_lock`.
+ *
+ * @param deliveries first delivery to send, may be `NULL`
+ */
+static void deliveries_send(struct delivery *deliveries) {
+    while (deliveries) {
+        for (struct delivery *d = deliveries; d; d = d->next) {
+            // the rest of a failed stream is put back, keeping its order
+            if (d->sub && d->sub->send_failed) {
+                d->status = ECANCELED;
+            } else if (deliver_entry(d) < 0) {
+                d->status = errno;
+                if (d->sub) {
+                    d->sub->send_failed = 1;
+                }
+            }
+        }
+
+        // settled last to first, so that entries put back keep their order
+        struct delivery *reversed = NULL;
+        while (deliveries) {
+            struct delivery *delivery = deliveries;
+            deliveries = delivery->next;
+            delivery->next = reversed;
+            reversed = delivery;
+        }
+        deliveries = reversed;
+
+        struct subscription *ended = NULL;
+        struct delivery *next = NULL;
+        pthread_mutex_lock(&bookkeeping_lock);
+        while (deliveries) {
+            struct delivery *delivery = deliveries;
+            deliveries = delivery->next;
+
+            struct subscription *sub = delivery->sub;
+            if (sub && delivery->status && !sub->removed) {
+                subscription_remove(sub, delivery->status);
+            }
+            if (sub && !--sub->sending) {
+                sub->sending_list = NULL;
+                sub->send_failed = 0;
+                // unlinked, so `next` is free to list it
+                if (sub->removed) {
+                    sub->next = ended;
+                    ended = sub;
+                }
+            }
+
+            if (delivery->status) {
+                delivery_requeue(delivery);
+            } else {
+                delivery_free(delivery);
+            }
+        }
+        serve_consumers(&next);
+        pthread_mutex_unlock(&bookkeeping_lock);
+
+        while (ended) {
+            struct subscription *sub = ended;
+            ended = sub->next;
+            subscription_end(sub, sub->status);
+        }
+        deliveries = next;
+    }
+}
+
+/**
+ * Hands queued entries to consumers waiting for them. Waiting pops are served
+ * first, in arrival order, one entry each, so that a push only wakes as many
+ * consumers as it has entries. The rest go round-robin to subscriptions with
+ * credits left and no entries being sent from another list. Producers are then
+ * granted the capacity the entries freed. Must hold `bookkeeping_lock`.
+ *
+ * @param deliveries output list of the entries handed out, empty on entry, to
+ * send with `deliveries_send` once `bookkeeping_lock` is released
+ */
+static void serve_consumers(struct delivery **deliveries) {
+    int served = 0;
+
+    while (waiters_head) {
+        struct pop_waiter *waiter = waiters_head;
+
+        // an entry popped for a disconnected consumer would be lost
+        int open = dmqp_reply_is_open(waiter->reply);
+        if (open && deliver_head(waiter->reply, waiter->correlation_id, NULL,
+                                 deliveries) < 0) {
+            break; // queue empty, or out of memory and served by the next push
+        }
+
+        served |= open;
+        waiters_head = waiter->next;
+        if (!waiters_head) {
+            waiters_tail = NULL;
+        }
+        atomic_fetch_sub(&consumers_count, 1);
+        if (!open) {
+            dmqp_reply_cancel(waiter->reply);
+        }
+        buffer_pool_free(waiter);
+    }
+
+    struct subscription *sub =
+        subscriptions_cursor ? subscriptions_cursor : subscriptions;
+    unsigned int idle = 0; // subscriptions passed in a row without credits
+    while (sub && idle < subscriptions_count) {
+        struct subscription *next = sub->next ? sub->next : subscriptions;
+
+        // its sender finds out about a closed connection itself
+        if (sub->sending && sub->sending_list != deliveries) {
+            idle++;
+            sub = next;
+            continue;
+        }
+
+        if (!dmqp_reply_is_open(sub->reply)) {
+            subscription_remove(sub, 0);
+            sub = subscriptions_count ? next : NULL;
+            continue;
+        }
+
+        if (!sub->credits) {
+            idle++;
+        } else if (deliver_head(sub->reply, sub->correlation_id, sub,
+                                deliveries) < 0) {
+            break; // queue empty, or out of memory and served by the next push
+        } else {
+            sub->credits--;
+            served = 1;
+            idle = 0;
+        }
+        sub = next;
+    }
+    subscriptions_cursor = sub;
+
+    // handed out newest first, sent oldest first
+    struct delivery *sorted = NULL;
+    while (*deliveries) {
+        struct delivery *delivery = *deliveries;
+        *deliveries = delivery->next;
+        delivery->next = sorted;
+        sorted = delivery;
+    }
+    *deliveries = sorted;
+
+    if (served) {
+        replenish_producers();
+    }
+}
+
+/**
+ * Pushes an entry to the queue, or appends it to the log in log mode. Must
+ * hold `bookkeeping_lock` in log mode.
+ *
+ * @param entry the entry to store
+ * @param leased whether the entry's data is a lease to take over
+ * @returns 0 on success, -1 if error with global `errno` set
+ */
+static int store_entry(const struct queue_entry *entry, int leased) {
+    if (log_mode) {
+        return leased ? log_append_leased(&entry_log, entry, NULL)
+                      : log_append(&entry_log, entry, NULL);
+    }
+    return leased ? mpmc_queue_push_leased(&queue, entry)
+                  : mpmc_queue_push(&queue, entry);
+}
+
+/**
+ * Pushes a batch of entries to the queue, or appends it to the log in log
+ * mode, atomically. Must hold `bookkeeping_lock` in log mode.
+ *
+ * @param entries the entries to store
+ * @param n number of entries
+ * @returns 0 on success, -1 if error with global `errno` set
+ */
+static int store_batch(const struct queue_entry *entries, unsigned int n) {
+    if (log_mode) {
+        return log_append_batch(&entry_log, entries, n, NULL);
+    }
+    return mpmc_queue_push_batch(&queue, entries, n);
+}
+
+/**
+ * Stores the entry of a `DMQP_PUSH` with `store_entry`. Must hold
+ * `bookkeeping_lock` in log mode.
+ *
+ * @param message the push being handled
+ * @returns 0 on success, -1 if error with global `errno` set
+ */
+static int store_message(const struct dmqp_message *message) {
+    // large payloads are moved into the queue or the log, and stay shared
+    // with the replication and the pop or read responses until their last
+    // reference is dropped
+    void *leased = message->header.length > QUEUE_INLINE_MAX
+                       ? dmqp_payload_hold(message)
+                       : NULL;
     struct queue_entry entry = {
         .id = message->header.sequence_id,
-        .data = message->payload,
+        .data = leased ? leased : message->payload,
         .size = message->header.length,
     };
-    queue_push(&queue, &entry);
-    pthread_mutex_unlock(&queue_lock);
+    if (store_entry(&entry, leased != NULL) < 0) {
+        buffer_pool_free(leased);
+        return -1;
+    }
+    return 0;
+}
 
-    // TODO: batch-based replication
-    if (role == LEADER) {
-        replicate_message(message);
+// TODO: test all of these DMQP handlers
+void handle_dmqp_push(const struct dmqp_message *message, int client) {
+    if (!message || client < 0 || role == FREE || partition_id < 0 ||
+        !assigned_topic[0] || !assigned_shard[0]) {
+        return;
     }
 
-    res_header.sequence_id = 0;
-    res_header.length = 0;
+    char lock_path[MAX_PATH_LEN + 1];
+    snprintf(lock_path, sizeof lock_path, "/topics/%s/sequence-id/lock",
+             assigned_topic);
+    ;
+    acquire_distributed_lock(lock_path, zh);
+
+    char path[MAX_PATH_LEN + 1];
+    snprintf(path, sizeof path, "/topics/%s/sequence-id", assigned_topic);
+    char buf[512];
+    int buflen = sizeof buf;
+    zoo_get(zh, path, 0, buf, &buflen, NULL);
+
+    unsigned int seqid = atoi(buf);
+
+    struct dmqp_header res_header = {0};
     res_header.method = DMQP_RESPONSE;
-    res_header.status_code = 0;
-    res_message.header = res_header;
+    res_header.correlation_id = message->header.correlation_id;
+    struct dmqp_message res_message = {.header = res_header, .payload = NULL};
+    char credits[DMQP_CREDITS_SIZE];
+
+    // readers that disconnected pin the segments they were reading, and a log
+    // only pushed to would otherwise never drop them
+    int swept = log_mode ? readers_sweep() : 0;
+
+    // only leaders take pushes from producers, replicas take them from leaders
+    pthread_mutex_lock(&bookkeeping_lock);
+    if (swept && log_reclaim(&entry_log)) {
+        replenish_producers();
+    }
+    struct producer *producer = NULL;
+    int pushing = 0;
+    if (role == LEADER && !(producer = producer_get(client))) {
+        res_message.header.status_code = errno;
+    } else if (message->header.sequence_id != seqid) {
+        res_message.header.status_code = EINVAL;
+    } else if (producer_take(producer, 1, message->header.length) < 0) {
+        res_message.header.status_code = ENOBUFS;
+    } else if (log_mode) {
+        if (store_message(message) < 0) {
+            res_message.header.status_code = errno;
+            producer_refund(producer, 1, message->header.length);
+        }
+    } else {
+        pushing = 1;
+        atomic_fetch_add(&pushing_messages, 1);
+        atomic_fetch_add(&pushing_bytes, message->header.length);
+    }
+
+    if (producer) {
+        producer_grant(producer);
+        dmqp_credits_pack(&producer->credits, credits);
+        res_message.header.length = DMQP_CREDITS_SIZE;
+        res_message.payload = credits;
+    }
+    pthread_mutex_unlock(&bookkeeping_lock);
+
+    // the queue is pushed to without the lock. credits of a failed push are
+    // not refunded, the capacity is granted again by the next `producer_grant`
+    if (pushing) {
+        if (store_message(message) < 0) {
+            res_message.header.status_code = errno;
+        }
+        atomic_fetch_sub(&pushing_messages, 1);
+        atomic_fetch_sub(&pushing_bytes, message->header.length);
+    }
+
+    struct delivery *deliveries = NULL;
+    if (!res_message.header.status_code) {
+        // TODO: batch-based replication
+        if (role == LEADER) {
+            replicate_message(message);
+        }
+
+        if (atomic_load(&consumers_count)) {
+            pthread_mutex_lock(&bookkeeping_lock);
+            serve_consumers(&deliveries);
+            pthread_mutex_unlock(&bookkeeping_lock);
+        }
+    }
+
     send_dmqp_message(client, &res_message, 0);
+    release_distributed_lock(lock_path, zh);
 
-cleanup:
+    // sent once the topic's other producers no longer wait for the lock
+    deliveries_send(deliveries);
+}
+
+void handle_dmqp_push_batch(const struct dmqp_message *message, int client) {
+    if (!message || client < 0 || role == FREE || partition_id < 0 ||
+        !assigned_topic[0] || !assigned_shard[0]) {
+        return;
+    }
+
+    char lock_path[MAX_PATH_LEN + 1];
+    snprintf(lock_path, sizeof lock_path, "/topics/%s/sequence-id/lock",
+             assigned_topic);
+    acquire_distributed_lock(lock_path, zh);
+
+    char path[MAX_PATH_LEN + 1];
+    snprintf(path, sizeof path, "/topics/%s/sequence-id", assigned_topic);
+    char buf[512];
+    int buflen = sizeof buf;
+    zoo_get(zh, path, 0, buf, &buflen, NULL);
+
+    unsigned int seqid = atoi(buf);
+
+    struct dmqp_header res_header = {0};
+    res_header.method = DMQP_RESPONSE;
+    res_header.correlation_id = message->header.correlation_id;
+    struct dmqp_message res_message = {.header = res_header, .payload = NULL};
+
+    struct dmqp_batch_entry *batch = NULL;
+    struct queue_entry *entries = NULL;
+    int16_t *statuses = NULL;
+    struct delivery *deliveries = NULL;
+
+    int n = dmqp_batch_unpack(message, NULL, 0);
+    if (n < 0) {
+        res_message.header.status_code = EBADMSG;
+        goto reply;
+    }
+
+    if (!n || message->header.sequence_id != seqid) {
+        res_message.header.status_code = EINVAL;
+        goto reply;
+    }
+
+    batch = buffer_pool_alloc(n * sizeof *batch);
+    entries = buffer_pool_alloc(n * sizeof *entries);
+    statuses = buffer_pool_alloc(n * sizeof *statuses + DMQP_CREDITS_SIZE);
+    if (!batch || !entries || !statuses) {
+        res_message.header.status_code = ENOMEM;
+        goto reply;
+    }
+
+    dmqp_batch_unpack(message, batch, n);
+
+    // empty messages fail the whole batch, the others are reported cancelled
+    int16_t status = 0;
+    size_t bytes = 0;
+    for (int i = 0; i < n; i++) {
+        entries[i].id = seqid + i;
+        entries[i].data = batch[i].data;
+        entries[i].size = batch[i].length;
+        bytes += batch[i].length;
+        if (!batch[i].length) {
+            status = EINVAL;
+        }
+    }
+
+    // readers that disconnected pin the segments they were reading
+    int swept = log_mode ? readers_sweep() : 0;
+
+    pthread_mutex_lock(&bookkeeping_lock);
+    if (swept && log_reclaim(&entry_log)) {
+        replenish_producers();
+    }
+    struct producer *producer = NULL;
+    int pushing = 0;
+    if (role == LEADER && !(producer = producer_get(client))) {
+        status = errno;
+    } else if (!status && producer_take(producer, n, bytes) < 0) {
+        status = ENOBUFS;
+    } else if (!status && log_mode) {
+        if (store_batch(entries, n) < 0) {
+            status = errno;
+            producer_refund(producer, n, bytes);
+        }
+    } else if (!status) {
+        pushing = 1;
+        atomic_fetch_add(&pushing_messages, n);
+        atomic_fetch_add(&pushing_bytes, bytes);
+    }
+
+    // credits follow the statuses
+    res_message.header.length = n * DMQP_BATCH_STATUS_SIZE;
+    if (producer) {
+        producer_grant(producer);
+        dmqp_credits_pack(&producer->credits,
+                          (char *)statuses + res_message.header.length);
+        res_message.header.length += DMQP_CREDITS_SIZE;
+    }
+    pthread_mutex_unlock(&bookkeeping_lock);
+
+    // pushed to the queue without the lock, like a single entry
+    if (pushing) {
+        if (store_batch(entries, n) < 0) {
+            status = errno;
+        }
+        atomic_fetch_sub(&pushing_messages, n);
+        atomic_fetch_sub(&pushing_bytes, bytes);
+    }
+
+    for (int i = 0; i < n; i++) {
+        int16_t entry_status = status;
+        if (status == EINVAL) {
+            entry_status = batch[i].length ? ECANCELED : EINVAL;
+        }
+        statuses[i] = htons(entry_status);
+    }
+
+    // replicated as one message, like the batch was received
+    if (!status && role == LEADER) {
+        replicate_message(message);
+    }
+    if (!status && atomic_load(&consumers_count)) {
+        pthread_mutex_lock(&bookkeeping_lock);
+        serve_consumers(&deliveries);
+        pthread_mutex_unlock(&bookkeeping_lock);
+    }
+
+    res_message.header.sequence_id = seqid;
+    res_message.header.status_code = status;
+    res_message.payload = statuses;
+
+reply:
+    send_dmqp_message(client, &res_message, 0);
+    buffer_pool_free(statuses);
+    buffer_pool_free(entries);
+    buffer_pool_free(batch);
     release_distributed_lock(lock_path, zh);
+
+    // sent once the topic's other producers no longer wait for the lock
+    deliveries_send(deliveries);
 }
 
 void handle_dmqp_pop(const struct dmqp_message *message, int client) {
@@ -293,44 +1600,505 @@ void handle_dmqp_pop(const struct dmqp_message *message, int client) {
         return;
     }
 
-    pthread_mutex_lock(&queue_lock);
-    struct queue_entry *entry = queue_pop(&queue);
+    // entries of a log are read with `DMQP_READ`, never popped
+    if (log_mode) {
+        struct dmqp_header res_header = {0};
+        res_header.method = DMQP_RESPONSE;
+        res_header.status_code = EOPNOTSUPP;
+        res_header.correlation_id = message->header.correlation_id;
+        struct dmqp_message res_message = {.header = res_header,
+                                           .payload = NULL};
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
 
-    struct dmqp_header res_header;
-    if (!entry) {
-        res_header.sequence_id = 0;
-        res_header.length = 0;
+    uint32_t wait_ms = 0;
+    if (message->header.length >= DMQP_POP_WAIT_SIZE) {
+        memcpy(&wait_ms, message->payload, DMQP_POP_WAIT_SIZE);
+        wait_ms = ntohl(wait_ms);
+        if (wait_ms > DMQP_POP_MAX_WAIT_MS) {
+            wait_ms = DMQP_POP_MAX_WAIT_MS;
+        }
+    }
+
+    // a push between the pop and parking saw no waiting pop, so a parked pop
+    // serves consumers itself once it is counted
+    struct queue_entry entry;
+    if (entries_pop(&entry, SIZE_MAX) < 0) {
+        struct delivery *deliveries = NULL;
+        int parked = 0;
+        if (wait_ms) {
+            pthread_mutex_lock(&bookkeeping_lock);
+            parked = waiter_park(message, client, wait_ms) >= 0;
+            if (parked) {
+                serve_consumers(&deliveries);
+            }
+            pthread_mutex_unlock(&bookkeeping_lock);
+        }
+
+        if (parked) {
+            deliveries_send(deliveries);
+            return;
+        }
+
+        struct dmqp_header res_header = {0};
         res_header.method = DMQP_RESPONSE;
         res_header.status_code = ENODATA;
-
+        res_header.correlation_id = message->header.correlation_id;
         struct dmqp_message res_message = {.header = res_header,
                                            .payload = NULL};
         send_dmqp_message(client, &res_message, 0);
-        goto cleanup;
+        return;
+    }
+
+    if (atomic_load(&producers_waiting)) {
+        pthread_mutex_lock(&bookkeeping_lock);
+        replenish_producers();
+        pthread_mutex_unlock(&bookkeeping_lock);
     }
 
     // TODO: batch-based replication
+    // replicated without a timeout, replicas must not wait for a push.
+    // replicas pop their head, so replicated pops need no order
     if (role == LEADER) {
-        replicate_message(message);
+        struct dmqp_message pop = {.header = {.method = DMQP_POP}};
+        replicate_message(&pop);
     }
 
-    res_header.sequence_id = entry->id;
-    res_header.length = entry->size;
+    struct dmqp_header res_header = {0};
+    res_header.sequence_id = entry.id;
+    res_header.length = entry.size;
     res_header.method = DMQP_RESPONSE;
-    res_header.status_code = errno;
+    res_header.status_code = 0;
+    res_header.correlation_id = message->header.correlation_id;
     struct dmqp_message res_message = {.header = res_header,
-                                       .payload = entry->data};
-    send_dmqp_message(client, &res_message, 0);
+                                       .payload = entry.data};
+    send_dmqp_message(client, &res_message, DMQP_SEND_LEASED);
+    buffer_pool_free(entry.data);
+}
+
+/**
+ * Packs a run of popped entries into a `DMQP_FETCH` response, setting its
+ * status code on error.
+ *
+ * @param popped the popped entries
+ * @param batch scratch array of at least `n` batch entries
+ * @param n number of entries
+ * @param res_message response to pack the entries into
+ */
+static void fetch_pack(const struct queue_entry *popped,
+                       struct dmqp_batch_entry *batch, int n,
+                       struct dmqp_message *res_message) {
+    for (int i = 0; i < n; i++) {
+        batch[i].data = popped[i].data;
+        batch[i].length = popped[i].size;
+        batch[i].sequence_id = popped[i].id;
+    }
+
+    if (dmqp_fetch_pack(batch, n, res_message) < 0) {
+        res_message->header.status_code = errno;
+    }
+    res_message->header.sequence_id = popped[0].id;
+}
+
+void handle_dmqp_fetch(const struct dmqp_message *message, int client) {
+    if (!message || client < 0 || role == FREE || partition_id < 0 ||
+        !assigned_topic[0] || !assigned_shard[0]) {
+        return;
+    }
+
+    struct dmqp_header res_header = {0};
+    res_header.method = DMQP_RESPONSE;
+    res_header.correlation_id = message->header.correlation_id;
+    struct dmqp_message res_message = {.header = res_header, .payload = NULL};
+
+    // entries of a log are read with `DMQP_READ`, never popped
+    if (log_mode) {
+        res_message.header.status_code = EOPNOTSUPP;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+
+    uint32_t max_messages;
+    uint32_t max_bytes;
+    if (message->header.length != DMQP_FETCH_REQUEST_SIZE) {
+        res_message.header.status_code = EINVAL;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+    memcpy(&max_messages, message->payload, 4);
+    memcpy(&max_bytes, (char *)message->payload + 4, 4);
+    max_messages = ntohl(max_messages);
+    max_bytes = ntohl(max_bytes);
+
+    if (!max_messages) {
+        res_message.header.status_code = EINVAL;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+
+    // the response must fit in one frame along with each message's prefix
+    if (max_messages > DMQP_FETCH_MAX_MESSAGES) {
+        max_messages = DMQP_FETCH_MAX_MESSAGES;
+    }
+    uint32_t budget =
+        MAX_PAYLOAD_LENGTH - max_messages * DMQP_FETCH_ENTRY_HEADER_SIZE;
+    if (max_bytes > budget) {
+        max_bytes = budget;
+    }
+
+    // replicas pop as many entries as the leader did, whatever their size,
+    // since fetches are replicated once popped and so may reach them in
+    // another order than they popped on the leader
+    if (role != LEADER) {
+        max_bytes = UINT32_MAX;
+    }
+
+    struct queue_entry *popped =
+        buffer_pool_alloc(max_messages * sizeof *popped);
+    struct dmqp_batch_entry *batch =
+        buffer_pool_alloc(max_messages * sizeof *batch);
+    if (!popped || !batch) {
+        res_message.header.status_code = ENOMEM;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+
+    // popped one at a time, other pops may take entries in between
+    int n = 0;
+    size_t bytes = 0;
+    for (; n < (int)max_messages; n++) {
+        if (entries_pop(&popped[n], max_bytes - bytes) < 0) {
+            break;
+        }
+        bytes += popped[n].size;
+    }
+    if (!n) {
+        res_message.header.status_code = errno;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+
+    if (atomic_load(&producers_waiting)) {
+        pthread_mutex_lock(&bookkeeping_lock);
+        replenish_producers();
+        pthread_mutex_unlock(&bookkeeping_lock);
+    }
+
+    fetch_pack(popped, batch, n, &res_message);
+    for (int i = 0; i < n; i++) {
+        buffer_pool_free(popped[i].data);
+    }
+
+    // replicas pop a run of the same length, since they hold the same queue
+    if (role == LEADER) {
+        uint32_t request[2] = {htonl(n), htonl(UINT32_MAX)};
+        struct dmqp_message fetch = {.header = message->header,
+                                     .payload = request};
+        replicate_message(&fetch);
+    }
+
+    send_dmqp_message(client, &res_message, DMQP_SEND_LEASED);
+    buffer_pool_free(res_message.payload);
 
 cleanup:
-    if (entry) {
-        if (entry->data) {
-            free(entry->data);
+    buffer_pool_free(batch);
+    buffer_pool_free(popped);
+}
+
+void handle_dmqp_read(const struct dmqp_message *message, int client) {
+    if (!message || client < 0 || role == FREE || partition_id < 0 ||
+        !assigned_topic[0] || !assigned_shard[0]) {
+        return;
+    }
+
+    struct dmqp_header res_header = {0};
+    res_header.method = DMQP_RESPONSE;
+    res_header.correlation_id = message->header.correlation_id;
+    struct dmqp_message res_message = {.header = res_header, .payload = NULL};
+
+    if (!log_mode) {
+        res_message.header.status_code = EOPNOTSUPP;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+
+    uint64_t offset;
+    uint32_t max_messages;
+    uint32_t max_bytes;
+    if (message->header.length != DMQP_READ_REQUEST_SIZE) {
+        res_message.header.status_code = EINVAL;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+    memcpy(&offset, message->payload, 8);
+    memcpy(&max_messages, (char *)message->payload + 8, 4);
+    memcpy(&max_bytes, (char *)message->payload + 12, 4);
+    offset = be64toh(offset);
+    max_messages = ntohl(max_messages);
+    max_bytes = ntohl(max_bytes);
+
+    if (!max_messages) {
+        res_message.header.status_code = EINVAL;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+
+    // the response must fit in one frame along with the offset and each
+    // message's prefix
+    if (max_messages > DMQP_FETCH_MAX_MESSAGES) {
+        max_messages = DMQP_FETCH_MAX_MESSAGES;
+    }
+    uint32_t budget = MAX_PAYLOAD_LENGTH - DMQP_READ_OFFSET_SIZE -
+                      max_messages * DMQP_FETCH_ENTRY_HEADER_SIZE;
+    if (max_bytes > budget) {
+        max_bytes = budget;
+    }
+
+    struct queue_entry *read = buffer_pool_alloc(max_messages * sizeof *read);
+    struct dmqp_batch_entry *batch =
+        buffer_pool_alloc(max_messages * sizeof *batch);
+    if (!read || !batch) {
+        res_message.header.status_code = ENOMEM;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+
+    // appends run under `bookkeeping_lock` meanwhile, the read takes only the
+    // connection's own lock
+    struct reader *reader = reader_get(client);
+    if (!reader) {
+        res_message.header.status_code = errno;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+
+    uint64_t first = 0;
+    int n = -1;
+    if (offset == DMQP_READ_NEXT ||
+        log_cursor_seek(&entry_log, reader->cursor, offset) >= 0) {
+        n = log_read(&entry_log, reader->cursor, read, max_messages, max_bytes,
+                     &first);
+    }
+    pthread_mutex_unlock(&reader->lock);
+    if (n < 0) {
+        res_message.header.status_code = errno;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+
+    // a read moving past a segment may free it, and the capacity it held
+    if (first / LOG_SEGMENT_ENTRIES != (first + n) / LOG_SEGMENT_ENTRIES) {
+        pthread_mutex_lock(&bookkeeping_lock);
+        if (log_reclaim(&entry_log)) {
+            replenish_producers();
         }
+        pthread_mutex_unlock(&bookkeeping_lock);
+    }
+
+    for (int i = 0; i < n; i++) {
+        batch[i].data = read[i].data;
+        batch[i].length = read[i].size;
+        batch[i].sequence_id = read[i].id;
+    }
+
+    if (dmqp_read_pack(batch, n, first, &res_message) < 0) {
+        res_message.header.status_code = errno;
+    }
+    res_message.header.sequence_id = read[0].id;
+    send_dmqp_message(client, &res_message, DMQP_SEND_LEASED);
+    buffer_pool_free(res_message.payload);
+
+    // the entries' data stays in the log for other readers
+    for (int i = 0; i < n; i++) {
+        buffer_pool_free(read[i].data);
+    }
+
+cleanup:
+    buffer_pool_free(batch);
+    buffer_pool_free(read);
+}
+
+void handle_dmqp_subscribe(const struct dmqp_message *message, int client) {
+    if (!message || client < 0 || role == FREE || partition_id < 0 ||
+        !assigned_topic[0] || !assigned_shard[0]) {
+        return;
+    }
+
+    struct dmqp_header res_header = {0};
+    res_header.method = DMQP_RESPONSE;
+    res_header.correlation_id = message->header.correlation_id;
+    struct dmqp_message res_message = {.header = res_header, .payload = NULL};
+
+    // entries of a log are read with `DMQP_READ`, never handed out
+    if (log_mode) {
+        res_message.header.status_code = EOPNOTSUPP;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+
+    if (message->header.length != DMQP_SUBSCRIBE_SIZE) {
+        res_message.header.status_code = EINVAL;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+
+    uint32_t credits;
+    memcpy(&credits, message->payload, DMQP_SUBSCRIBE_SIZE);
+    credits = ntohl(credits);
+
+    struct delivery *deliveries = NULL;
+    pthread_mutex_lock(&bookkeeping_lock);
+
+    // a subscription keeps its connection open, so its socket is not reused
+    struct subscription *sub = subscriptions;
+    while (sub && (sub->client != client ||
+                   sub->correlation_id != message->header.correlation_id)) {
+        sub = sub->next;
+    }
+
+    if (sub && !credits) {
+        subscription_remove(sub, ECANCELED);
+        goto cleanup;
+    }
+
+    if (sub) {
+        sub->credits = credits > UINT32_MAX - sub->credits
+                           ? UINT32_MAX
+                           : sub->credits + credits;
+        serve_consumers(&deliveries);
+        goto cleanup;
+    }
+
+    if (!credits) {
+        res_message.header.status_code = EINVAL;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+
+    sub = buffer_pool_alloc(sizeof(struct subscription));
+    if (!sub) {
+        res_message.header.status_code = ENOMEM;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
 
-        free(entry);
+    sub->reply = dmqp_reply_defer(client);
+    if (!sub->reply) {
+        res_message.header.status_code = errno;
+        send_dmqp_message(client, &res_message, 0);
+        buffer_pool_free(sub);
+        goto cleanup;
     }
-    pthread_mutex_unlock(&queue_lock);
+
+    sub->client = client;
+    sub->correlation_id = message->header.correlation_id;
+    sub->credits = credits;
+    sub->sending = 0;
+    sub->sending_list = NULL;
+    sub->send_failed = 0;
+    sub->removed = 0;
+    sub->status = 0;
+    sub->prev = NULL;
+    sub->next = subscriptions;
+    if (subscriptions) {
+        subscriptions->prev = sub;
+    }
+    subscriptions = sub;
+    subscriptions_count++;
+    atomic_fetch_add(&consumers_count, 1);
+
+    serve_consumers(&deliveries);
+
+cleanup:
+    pthread_mutex_unlock(&bookkeeping_lock);
+    deliveries_send(deliveries);
+}
+
+void handle_dmqp_credit(const struct dmqp_message *message, int client) {
+    if (!message || client < 0 || role == FREE || partition_id < 0 ||
+        !assigned_topic[0] || !assigned_shard[0]) {
+        return;
+    }
+
+    struct dmqp_header res_header = {0};
+    res_header.method = DMQP_RESPONSE;
+    res_header.correlation_id = message->header.correlation_id;
+    struct dmqp_message res_message = {.header = res_header, .payload = NULL};
+
+    // replicas take no pushes from producers
+    if (role != LEADER) {
+        res_message.header.status_code = EPERM;
+        send_dmqp_message(client, &res_message, 0);
+        return;
+    }
+
+    uint32_t bytes = 1;
+    if (message->header.length >= DMQP_CREDIT_SIZE) {
+        memcpy(&bytes, message->payload, DMQP_CREDIT_SIZE);
+        bytes = ntohl(bytes);
+    }
+
+    // the capacity a producer waits for may be held by readers that
+    // disconnected, or by entries every reader is past
+    if (log_mode) {
+        readers_sweep();
+    }
+
+    pthread_mutex_lock(&bookkeeping_lock);
+    if (log_mode) {
+        log_reclaim(&entry_log);
+    }
+
+    // more than a window could never be granted
+    if (bytes > PRODUCER_WINDOW_BYTES) {
+        bytes = PRODUCER_WINDOW_BYTES;
+    }
+    if (bytes > queue_max_bytes) {
+        bytes = queue_max_bytes;
+    }
+
+    struct producer *producer = producer_get(client);
+    if (!producer) {
+        res_message.header.status_code = errno;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+
+    producer_grant(producer);
+    if (producer->credits.messages && producer->credits.bytes >= bytes) {
+        char credits[DMQP_CREDITS_SIZE];
+        dmqp_credits_pack(&producer->credits, credits);
+        res_message.header.length = DMQP_CREDITS_SIZE;
+        res_message.payload = credits;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+
+    // a producer waits for credits once, the newer request takes over
+    if (producer->waiting) {
+        producer_answer(producer, ECANCELED);
+    }
+
+    producer->waiting = dmqp_reply_defer(client);
+    if (!producer->waiting) {
+        res_message.header.status_code = errno;
+        send_dmqp_message(client, &res_message, 0);
+        goto cleanup;
+    }
+    producer->waiting_correlation_id = message->header.correlation_id;
+    producer->waiting_bytes = bytes;
+    atomic_fetch_add(&producers_waiting, 1);
+
+    // a pop that freed capacity before the producer was counted as waiting
+    // did not replenish it
+    producer_grant(producer);
+    if (producer->credits.messages && producer->credits.bytes >= bytes) {
+        producer_answer(producer, 0);
+    }
+
+cleanup:
+    pthread_mutex_unlock(&bookkeeping_lock);
 }
 
 void handle_dmqp_peek_sequence_id(const struct dmqp_message *message,
@@ -340,11 +2108,18 @@ void handle_dmqp_peek_sequence_id(const struct dmqp_message *message,
         return;
     }
 
-    pthread_mutex_lock(&queue_lock);
-    int seqid = queue_peek_id(&queue);
-    pthread_mutex_unlock(&queue_lock);
+    int seqid;
+    if (atomic_load(&requeued_length)) {
+        pthread_mutex_lock(&bookkeeping_lock);
+        seqid =
+            requeued ? (int)requeued->entry.id : mpmc_queue_peek_id(&queue);
+        pthread_mutex_unlock(&bookkeeping_lock);
+    } else {
+        seqid = mpmc_queue_peek_id(&queue);
+    }
 
     struct dmqp_header res_header = {0};
+    res_header.correlation_id = message->header.correlation_id;
     if (seqid < 0) {
         res_header.method = DMQP_RESPONSE;
         res_header.status_code = ENODATA;
@@ -366,6 +2141,7 @@ void handle_dmqp_response(const struct dmqp_message *message, int client) {
     struct dmqp_header res_header = {0};
     res_header.method = DMQP_RESPONSE;
     res_header.status_code = EPROTO;
+    res_header.correlation_id = message->header.correlation_id;
     struct dmqp_message res_message = {.header = res_header, .payload = NULL};
     send_dmqp_message(client, &res_message, 0);
 }
@@ -3,6 +3,17 @@
 
 #include <messageq/constants.h>
 
+#include <stddef.h>
+
+#define QUEUE_MAX_BYTES (256 * 1024 * 1024) // default `queue_max_bytes`
+#define QUEUE_MAX_MESSAGES (1 << 20)        // default `queue_max_messages`
+
+#define PRODUCER_WINDOW_BYTES (16 * 1024 * 1024) // credits per connection
+#define PRODUCER_WINDOW_MESSAGES 4096
+
+#define LOG_RETENTION_BYTES (64 * 1024 * 1024) // default `log_retention_bytes`
+#define LOG_RETENTION_MESSAGES (1 << 18) // default `log_retention_messages`
+
 enum role { LEADER, REPLICA, FREE };
 
 extern enum role role;
@@ -11,12 +22,31 @@ extern char partition_path[MAX_PATH_LEN + 1];
 extern char assigned_topic[MAX_TOPIC_LEN + 1];
 extern char assigned_shard[MAX_SHARD_LEN + 1];
 
+// bound the queued entries and the credits granted to producers, together
+extern size_t queue_max_bytes;
+extern unsigned int queue_max_messages;
+
+// a partition in log mode appends pushed entries to a log that consumers read
+// with `DMQP_READ` from their own offsets, instead of a queue they pop. the
+// newest entries are kept for replay up to the retention limits, which must be
+// below `queue_max_bytes` and `queue_max_messages`; older ones are reclaimed
+// once every connection read them
+extern int log_mode;
+extern size_t log_retention_bytes;
+extern unsigned int log_retention_messages;
+
+// replicated payloads of at least this many bytes are compressed for replicas
+// on other hosts, 0 disables compression
+extern unsigned int replication_compress_threshold;
+
 /**
  * Starts a partition.
  *
  * @param service_discovery_host host of metadata (zookeeper) server
  * @returns 0 if success, -1 if error with global `errno` set
- * @throws `EINVAL` invalid args
+ * @throws `EINVAL` invalid args, or log retention limits not below the queue
+ * limits
+ * @throws `ENOMEM` out of memory
  * @throws `ECONNREFUSED` conn failure to metadata server
  * @throws `ETIMEDOUT` conn timeout to metadata server
  */
@@ -1,5 +1,7 @@
 #include "queue.h"
 
+#include <messageq/buffer_pool.h>
+
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +14,119 @@ void queue_init(struct queue *queue) {
 
     queue->head = NULL;
     queue->tail = NULL;
+    queue->pop_chunk = NULL;
+    queue->pop_offset = 0;
+    queue->release_offset = 0;
+    queue->spares = NULL;
+    queue->spares_count = 0;
+    queue->length = 0;
+    queue->bytes = 0;
+}
+
+/**
+ * Returns the bytes an entry takes in a chunk.
+ *
+ * @param size size of the entry's data
+ * @returns bytes of its record
+ */
+static size_t record_size(unsigned int size) {
+    if (size > QUEUE_INLINE_MAX) {
+        return sizeof(struct queue_record) + sizeof(void *);
+    }
+    return sizeof(struct queue_record) + ((size + 7) & ~7u);
+}
+
+/**
+ * Returns the data of a record, stored right after it or leased from the
+ * buffer pool.
+ *
+ * @param record the record
+ * @returns its data
+ */
+static void *record_data(struct queue_record *record) {
+    if (record->size > QUEUE_INLINE_MAX) {
+        return *(void **)(record + 1);
+    }
+    return record + 1;
+}
+
+/**
+ * Releases the data of the records of a chunk between two offsets.
+ *
+ * @param chunk chunk of the records
+ * @param offset offset of the first record
+ * @param end offset past the last record
+ */
+static void release_records(struct queue_chunk *chunk, size_t offset,
+                            size_t end) {
+    while (offset < end) {
+        struct queue_record *record = (void *)(chunk->data + offset);
+        if (record->size > QUEUE_INLINE_MAX) {
+            buffer_pool_free(record_data(record));
+        }
+        offset += record_size(record->size);
+    }
+}
+
+/**
+ * Frees a list of chunks linked by `next`.
+ *
+ * @param chunk first chunk of the list, may be `NULL`
+ */
+static void free_chunks(struct queue_chunk *chunk) {
+    while (chunk) {
+        struct queue_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+/**
+ * Keeps a chunk no longer in use for reuse, or frees it if there are enough
+ * spare chunks already.
+ *
+ * @param queue the queue the chunk was used by
+ * @param chunk chunk to recycle
+ */
+static void recycle_chunk(struct queue *queue, struct queue_chunk *chunk) {
+    if (queue->spares_count >= QUEUE_SPARE_CHUNKS) {
+        free(chunk);
+        return;
+    }
+
+    chunk->next = queue->spares;
+    queue->spares = chunk;
+    queue->spares_count++;
+}
+
+/**
+ * Releases the entries popped since the last call, recycling the chunks they
+ * emptied. A queue left empty rewinds to the start of its chunk, so that a
+ * queue kept short never takes another one.
+ *
+ * @param queue the queue to update
+ */
+static void release_popped(struct queue *queue) {
+    if (!queue->head) {
+        return;
+    }
+
+    while (queue->head != queue->pop_chunk) {
+        struct queue_chunk *chunk = queue->head;
+        release_records(chunk, queue->release_offset, chunk->end);
+        queue->head = chunk->next;
+        queue->release_offset = 0;
+        recycle_chunk(queue, chunk);
+    }
+
+    release_records(queue->head, queue->release_offset, queue->pop_offset);
+    queue->release_offset = queue->pop_offset;
+
+    if (!queue->length) {
+        queue->head->end = 0;
+        queue->pop_offset = 0;
+        queue->release_offset = 0;
+    }
 }
 
 void queue_destroy(struct queue *queue) {
@@ -19,44 +134,125 @@ void queue_destroy(struct queue *queue) {
         return;
     }
 
-    struct queue_node *curr = queue->head;
-    while (curr) {
-        struct queue_node *temp = curr->next;
-        free(curr->entry.data);
-        free(curr);
-        curr = temp;
+    release_popped(queue);
+    size_t offset = queue->pop_offset;
+    for (struct queue_chunk *chunk = queue->pop_chunk; chunk;
+         chunk = chunk->next) {
+        release_records(chunk, offset, chunk->end);
+        offset = 0;
     }
 
-    queue->head = NULL;
-    queue->tail = NULL;
+    free_chunks(queue->head);
+    free_chunks(queue->spares);
+    queue_init(queue);
 }
 
 /**
- * Creates a new queue node with the given entry. Deep copies the entry.
+ * Takes a chunk for the tail of a queue, reusing a spare one if any.
  *
- * @param entry entry to copy in node
- * @returns pointer to the queue node, `NULL` if error with global `errno` set
- * @throws `ENOMEM` malloc failure
+ * @param queue the queue the chunk is for
+ * @returns the chunk, `NULL` if error with global `errno` set
+ * @throws `ENOMEM` out of memory
  */
-static struct queue_node *create_node(const struct queue_entry *entry) {
-    struct queue_node *node = malloc(sizeof(struct queue_node));
-    if (!node) {
+static struct queue_chunk *take_chunk(struct queue *queue) {
+    struct queue_chunk *chunk = queue->spares;
+    if (chunk) {
+        queue->spares = chunk->next;
+        queue->spares_count--;
+    } else if (!(chunk = malloc(sizeof(struct queue_chunk)))) {
         errno = ENOMEM;
         return NULL;
     }
 
-    node->entry.data = malloc(entry->size);
-    if (!node->entry.data) {
-        free(node);
-        errno = ENOMEM;
-        return NULL;
+    chunk->next = NULL;
+    chunk->end = 0;
+    return chunk;
+}
+
+/**
+ * Makes room for a batch of entries at the tail of a queue, taking spare or
+ * new chunks so that pushing them cannot fail. Chunks not used in the end stay
+ * spare.
+ *
+ * @param queue the queue to update
+ * @param entries the entries to make room for
+ * @param n number of entries
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+static int reserve_records(struct queue *queue,
+                           const struct queue_entry *entries, unsigned int n) {
+    // pack the records as pushing them would, to count the chunks they need
+    size_t end = queue->tail ? queue->tail->end : QUEUE_CHUNK_SIZE;
+    unsigned int chunks = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        size_t size = record_size(entries[i].size);
+        if (end + size > QUEUE_CHUNK_SIZE) {
+            chunks++;
+            end = 0;
+        }
+        end += size;
     }
-    memcpy(node->entry.data, entry->data, entry->size);
-    node->entry.size = entry->size;
-    node->entry.id = entry->id;
-    node->next = NULL;
 
-    return node;
+    while (queue->spares_count < chunks) {
+        struct queue_chunk *chunk = malloc(sizeof(struct queue_chunk));
+        if (!chunk) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        chunk->next = queue->spares;
+        queue->spares = chunk;
+        queue->spares_count++;
+    }
+
+    return 0;
+}
+
+/**
+ * Appends a record at the tail of a queue, linking a new tail chunk if it does
+ * not fit in the tail.
+ *
+ * @param queue the queue to update
+ * @param entry the entry to append
+ * @param data lease holding the entry's data, `NULL` to copy the data inline
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+static int append_record(struct queue *queue, const struct queue_entry *entry,
+                         void *data) {
+    size_t size = record_size(entry->size);
+    if (!queue->tail || queue->tail->end + size > QUEUE_CHUNK_SIZE) {
+        struct queue_chunk *chunk = take_chunk(queue);
+        if (!chunk) {
+            return -1;
+        }
+
+        if (!queue->tail) { // no chunk in use
+            queue->head = chunk;
+            queue->pop_chunk = chunk;
+            queue->pop_offset = 0;
+            queue->release_offset = 0;
+        } else {
+            queue->tail->next = chunk;
+        }
+        queue->tail = chunk;
+    }
+
+    struct queue_record *record =
+        (void *)(queue->tail->data + queue->tail->end);
+    record->id = entry->id;
+    record->size = entry->size;
+    if (data) {
+        *(void **)(record + 1) = data;
+    } else {
+        memcpy(record + 1, entry->data, entry->size);
+    }
+
+    queue->tail->end += size;
+    queue->length++;
+    queue->bytes += entry->size;
+    return 0;
 }
 
 int queue_push(struct queue *queue, const struct queue_entry *entry) {
@@ -65,46 +261,302 @@ int queue_push(struct queue *queue, const struct queue_entry *entry) {
         return -1;
     }
 
-    struct queue_node *node = create_node(entry);
-    if (!node) {
+    release_popped(queue);
+
+    void *data = NULL;
+    if (entry->size > QUEUE_INLINE_MAX &&
+        !(data = buffer_pool_alloc(entry->size))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (data) {
+        memcpy(data, entry->data, entry->size);
+    }
+
+    if (append_record(queue, entry, data) < 0) {
+        buffer_pool_free(data);
+        return -1;
+    }
+
+    return 0;
+}
+
+int queue_push_leased(struct queue *queue, const struct queue_entry *entry) {
+    if (!queue || !entry || !entry->data || !entry->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    release_popped(queue);
+
+    if (entry->size > QUEUE_INLINE_MAX) {
+        return append_record(queue, entry, entry->data);
+    }
+
+    if (append_record(queue, entry, NULL) < 0) {
+        return -1;
+    }
+    buffer_pool_free(entry->data);
+    return 0;
+}
+
+int queue_push_batch(struct queue *queue, const struct queue_entry *entries,
+                     unsigned int n) {
+    if (!queue || !entries || !n) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        if (!entries[i].data || !entries[i].size) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    release_popped(queue);
+
+    // lease buffers for the entries too large to store inline and make room
+    // for every entry before pushing any, so a failure leaves the queue
+    // untouched
+    void **leased = buffer_pool_alloc(n * sizeof *leased);
+    if (!leased) {
+        errno = ENOMEM;
         return -1;
     }
 
-    if (!queue->head) { // empty
-        queue->head = node;
-        queue->tail = node;
-    } else if (queue->head == queue->tail) { // queue has 1 element
-        queue->head->next = node;
-        queue->tail = node;
+    unsigned int count = 0;
+    for (; count < n; count++) {
+        leased[count] = NULL;
+        if (entries[count].size > QUEUE_INLINE_MAX &&
+            !(leased[count] = buffer_pool_alloc(entries[count].size))) {
+            goto cleanup;
+        }
+        if (leased[count]) {
+            memcpy(leased[count], entries[count].data, entries[count].size);
+        }
+    }
+
+    if (reserve_records(queue, entries, n) < 0) {
+        goto cleanup;
+    }
+
+    for (unsigned int i = 0; i < n; i++) {
+        append_record(queue, &entries[i], leased[i]);
+    }
+
+    buffer_pool_free(leased);
+    return 0;
+
+cleanup:
+    for (unsigned int i = 0; i < count; i++) {
+        buffer_pool_free(leased[i]);
+    }
+    buffer_pool_free(leased);
+    errno = ENOMEM;
+    return -1;
+}
+
+/**
+ * Inserts a record before the head of a queue. The released records before
+ * `pop_offset` leave room for it in the head chunk, else a chunk is linked in
+ * front, filled from its end so that later records fit before this one.
+ * Popped records must be released.
+ *
+ * @param queue the queue to update
+ * @param entry the entry to insert
+ * @param data lease holding the entry's data, `NULL` to copy the data inline
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `ENOMEM` out of memory
+ */
+static int prepend_record(struct queue *queue, const struct queue_entry *entry,
+                          void *data) {
+    if (!queue->length) {
+        return append_record(queue, entry, data);
+    }
+
+    size_t size = record_size(entry->size);
+    if (queue->pop_offset < size) {
+        struct queue_chunk *front = take_chunk(queue);
+        if (!front) {
+            return -1;
+        }
+
+        // the head chunk is read from its start once `front` is popped, so
+        // its released records go first
+        struct queue_chunk *chunk = queue->pop_chunk;
+        memmove(chunk->data, chunk->data + queue->pop_offset,
+                chunk->end - queue->pop_offset);
+        chunk->end -= queue->pop_offset;
+
+        front->next = chunk;
+        front->end = QUEUE_CHUNK_SIZE;
+        queue->head = front;
+        queue->pop_chunk = front;
+        queue->pop_offset = QUEUE_CHUNK_SIZE;
+    }
+
+    queue->pop_offset -= size;
+    queue->release_offset = queue->pop_offset;
+    struct queue_record *record =
+        (void *)(queue->pop_chunk->data + queue->pop_offset);
+    record->id = entry->id;
+    record->size = entry->size;
+    if (data) {
+        *(void **)(record + 1) = data;
     } else {
-        queue->tail->next = node;
-        queue->tail = node;
+        memcpy(record + 1, entry->data, entry->size);
     }
 
+    queue->length++;
+    queue->bytes += entry->size;
     return 0;
 }
 
-struct queue_entry *queue_pop(struct queue *queue) {
-    if (!queue) {
+int queue_push_front(struct queue *queue, const struct queue_entry *entry) {
+    if (!queue || !entry || !entry->data || !entry->size) {
         errno = EINVAL;
-        return NULL;
+        return -1;
+    }
+
+    release_popped(queue);
+
+    void *data = NULL;
+    if (entry->size > QUEUE_INLINE_MAX &&
+        !(data = buffer_pool_alloc(entry->size))) {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (data) {
+        memcpy(data, entry->data, entry->size);
+    }
+
+    if (prepend_record(queue, entry, data) < 0) {
+        buffer_pool_free(data);
+        return -1;
     }
 
-    if (!queue->head) { // empty
+    return 0;
+}
+
+int queue_push_front_leased(struct queue *queue,
+                            const struct queue_entry *entry) {
+    if (!queue || !entry || !entry->data || !entry->size) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    release_popped(queue);
+
+    if (entry->size > QUEUE_INLINE_MAX) {
+        return prepend_record(queue, entry, entry->data);
+    }
+
+    if (prepend_record(queue, entry, NULL) < 0) {
+        return -1;
+    }
+    buffer_pool_free(entry->data);
+    return 0;
+}
+
+/**
+ * Returns the head record of a non-empty queue, moving on to the next chunk
+ * if all records of the current one were popped.
+ *
+ * @param queue the queue to peek
+ * @returns the head record
+ */
+static struct queue_record *head_record(struct queue *queue) {
+    while (queue->pop_offset == queue->pop_chunk->end) {
+        queue->pop_chunk = queue->pop_chunk->next;
+        queue->pop_offset = 0;
+    }
+
+    return (void *)(queue->pop_chunk->data + queue->pop_offset);
+}
+
+/**
+ * Removes the head entry of a non-empty queue. Its record stays in the chunk
+ * until the next push or pop releases it.
+ *
+ * @param queue the queue to update
+ * @param buf output param for the removed entry
+ */
+static void take_head(struct queue *queue, struct queue_entry *buf) {
+    struct queue_record *record = head_record(queue);
+    buf->data = record_data(record);
+    buf->id = record->id;
+    buf->size = record->size;
+
+    queue->pop_offset += record_size(record->size);
+    queue->length--;
+    queue->bytes -= buf->size;
+}
+
+int queue_pop(struct queue *queue, struct queue_entry *buf) {
+    if (!queue || !buf) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    release_popped(queue);
+
+    if (!queue->length) { // empty
         errno = ENODATA;
+        return -1;
+    }
+
+    take_head(queue, buf);
+    return 0;
+}
+
+void *queue_entry_hold(const struct queue_entry *entry) {
+    if (!entry || !entry->data) {
+        errno = EINVAL;
         return NULL;
     }
 
-    struct queue_node *node = queue->head;
+    if (entry->size > QUEUE_INLINE_MAX) {
+        return buffer_pool_ref(entry->data);
+    }
 
-    if (queue->head == queue->tail) { // queue has 1 element
-        queue->head = NULL;
-        queue->tail = NULL;
-    } else {
-        queue->head = queue->head->next;
+    void *data = buffer_pool_alloc(entry->size);
+    if (!data) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(data, entry->data, entry->size);
+    return data;
+}
+
+int queue_pop_batch(struct queue *queue, struct queue_entry *entries,
+                    unsigned int n, size_t max_bytes) {
+    if (!queue || !entries || !n) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    release_popped(queue);
+
+    if (!queue->length) { // empty
+        errno = ENODATA;
+        return -1;
     }
 
-    return &node->entry;
+    if (head_record(queue)->size > max_bytes) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    unsigned int count = 0;
+    size_t bytes = 0;
+    while (queue->length && count < n &&
+           head_record(queue)->size <= max_bytes - bytes) {
+        take_head(queue, &entries[count]);
+        bytes += entries[count++].size;
+    }
+
+    return count;
 }
 
 int queue_peek_id(struct queue *queue) {
@@ -113,10 +565,10 @@ int queue_peek_id(struct queue *queue) {
         return -1;
     }
 
-    if (!queue->head) {
+    if (!queue->length) {
         errno = ENODATA;
         return -1;
     }
 
-    return queue->head->entry.id;
+    return head_record(queue)->id;
 }
@@ -1,20 +1,46 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include <stddef.h>
+
+#define QUEUE_CHUNK_SIZE (64 * 1024) // bytes of entries per chunk
+#define QUEUE_INLINE_MAX 256         // largest payload stored in its chunk
+#define QUEUE_SPARE_CHUNKS 4         // emptied chunks kept for reuse
+
 struct queue_entry {
-    unsigned int id;
     void *data;
+    unsigned int id;
+    unsigned int size;
+};
+
+// header of an entry in a chunk, followed by its payload rounded up to 8 bytes
+// if at most `QUEUE_INLINE_MAX` bytes, by a pointer to its payload otherwise
+struct queue_record {
+    unsigned int id;
     unsigned int size;
 };
 
-struct queue_node {
-    struct queue_entry entry;
-    struct queue_node *next;
+// fixed-size run of contiguous entries, linked into a queue
+struct queue_chunk {
+    struct queue_chunk *next;
+    size_t end; // bytes of entries in `data`
+    _Alignas(8) char data[QUEUE_CHUNK_SIZE];
 };
 
+// FIFO of entries packed into a list of chunks, pushed at the end of the tail
+// chunk and popped from `pop_chunk`. Popped entries are released, and the
+// chunks they emptied kept for reuse up to `QUEUE_SPARE_CHUNKS` of them, on
+// the next push or pop
 struct queue {
-    struct queue_node *head;
-    struct queue_node *tail;
+    struct queue_chunk *head; // `NULL` if no chunk is in use
+    struct queue_chunk *tail;
+    struct queue_chunk *pop_chunk; // chunk of the next entry to pop
+    size_t pop_offset;             // of the next entry to pop in `pop_chunk`
+    size_t release_offset; // of the first popped entry not released in `head`
+    struct queue_chunk *spares; // emptied chunks, linked by `next`
+    unsigned int spares_count;
+    unsigned int length; // number of entries
+    size_t bytes;        // total size of the entries' data
 };
 
 /**
@@ -42,16 +68,104 @@ void queue_destroy(struct queue *queue);
  */
 int queue_push(struct queue *queue, const struct queue_entry *entry);
 
+/**
+ * Pushes an entry whose data is leased from the buffer pool, taking over the
+ * caller's reference instead of copying the data if it is too large to be
+ * stored inline.
+ *
+ * @param queue the queue to update
+ * @param entry the entry to push, whose data is released by the queue on
+ * success and still owned by the caller on error
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOMEM` out of memory
+ */
+int queue_push_leased(struct queue *queue, const struct queue_entry *entry);
+
+/**
+ * Pushes a batch of entries on a queue atomically: either every entry is
+ * pushed, in order, or none is.
+ *
+ * @param queue the queue to update
+ * @param entries the entries to push
+ * @param n number of entries
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args, or any entry is empty
+ * @throws `ENOMEM` out of memory
+ */
+int queue_push_batch(struct queue *queue, const struct queue_entry *entries,
+                     unsigned int n);
+
+/**
+ * Pushes an entry back at the head of a queue, so that it is the next one
+ * popped, e.g. a popped entry that could not be delivered. Copies the data
+ * like `queue_push`.
+ *
+ * @param queue the queue to update
+ * @param entry the entry to push
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOMEM` out of memory
+ */
+int queue_push_front(struct queue *queue, const struct queue_entry *entry);
+
+/**
+ * Pushes an entry whose data is leased from the buffer pool back at the head
+ * of a queue, taking over the lease like `queue_push_leased`.
+ *
+ * @param queue the queue to update
+ * @param entry the entry to push, whose data is released by the queue on
+ * success and still owned by the caller on error
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOMEM` out of memory
+ */
+int queue_push_front_leased(struct queue *queue,
+                            const struct queue_entry *entry);
+
 /**
  * Pops data off a queue.
  *
  * @param queue the queue to update
- * @returns popped queue entry if success, must be freed by caller. `NULL` if
- * error with global `errno` set
+ * @param buf output param for the popped entry, whose data is owned by the
+ * queue and valid until its next push, pop or destroy. The data of entries
+ * above `QUEUE_INLINE_MAX` bytes is leased from the buffer pool, so a
+ * reference to it can be kept with `buffer_pool_ref`
+ * @returns 0 on success, -1 if error with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENODATA` queue empty
+ */
+int queue_pop(struct queue *queue, struct queue_entry *buf);
+
+/**
+ * Keeps the data of a popped entry valid past the next update of its queue,
+ * sharing the lease of an entry stored out of line and copying an inline one.
+ *
+ * @param entry entry popped from a queue not updated since
+ * @returns the data, to be released with `buffer_pool_free`, `NULL` if error
+ * with global `errno` set
+ * @throws `EINVAL` invalid args
+ * @throws `ENOMEM` out of memory
+ */
+void *queue_entry_hold(const struct queue_entry *entry);
+
+/**
+ * Pops a run of entries off a queue: up to `n` entries whose sizes sum to at
+ * most `max_bytes`.
+ *
+ * @param queue the queue to update
+ * @param entries output array of at least `n` popped entries, whose data is
+ * owned by the queue and valid until its next push, pop or destroy
+ * @param n capacity of `entries`
+ * @param max_bytes maximum total size of the popped entries' data
+ * @returns number of entries popped if success, -1 if error with global `errno`
+ * set
  * @throws `EINVAL` invalid args
  * @throws `ENODATA` queue empty
+ * @throws `EMSGSIZE` head entry larger than `max_bytes`
  */
-struct queue_entry *queue_pop(struct queue *queue);
+int queue_pop_batch(struct queue *queue, struct queue_entry *entries,
+                    unsigned int n, size_t max_bytes);
 
 /**
  * Gets the ID of the head of a queue.
@@ -0,0 +1,479 @@
+#include "log.h"
+
+#include <messageq/buffer_pool.h>
+#include <messageq/test.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_THREADS 4
+#define TEST_ENTRIES 100000
+
+static struct log entry_log;
+
+/**
+ * Appends `n` entries holding their offset as ID and "Hello" as data.
+ *
+ * @returns 0 on success, -1 if an append failed
+ */
+static int append_entries(unsigned int n) {
+    for (unsigned int i = 0; i < n; i++) {
+        struct queue_entry entry = {
+            .id = entry_log.end, .data = "Hello", .size = 5};
+        if (log_append(&entry_log, &entry, NULL) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Releases the data of entries read by `log_read`.
+ */
+static void free_entries(struct queue_entry *entries, int n) {
+    for (int i = 0; i < n; i++) {
+        buffer_pool_free(entries[i].data);
+    }
+}
+
+int test_log_init_throws_when_invalid_args() {
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(log_init(NULL, 0, 0) < 0);
+    assert(errno == EINVAL);
+    return 0;
+}
+
+int test_log_append_throws_when_invalid_args() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    struct queue_entry entry = {.id = 1, .data = "Hello", .size = 5};
+    struct queue_entry empty = {.id = 1, .data = "Hello", .size = 0};
+
+    // act & assert
+    assert(log_append(NULL, &entry, NULL) < 0);
+    assert(errno == EINVAL);
+
+    assert(log_append(&entry_log, NULL, NULL) < 0);
+    assert(errno == EINVAL);
+
+    assert(log_append(&entry_log, &empty, NULL) < 0);
+    assert(errno == EINVAL);
+
+    assert(log_append_leased(&entry_log, &empty, NULL) < 0);
+    assert(errno == EINVAL);
+
+    // teardown
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_append_success_at_consecutive_offsets() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    struct queue_entry entry = {.id = 7, .data = "Hello", .size = 5};
+    uint64_t offset;
+
+    // act & assert
+    assert(log_append(&entry_log, &entry, &offset) >= 0);
+    assert(offset == 0);
+
+    void *leased = buffer_pool_alloc(5);
+    memcpy(leased, "World", 5);
+    struct queue_entry large = {.id = 8, .data = leased, .size = 5};
+    assert(log_append_leased(&entry_log, &large, &offset) >= 0);
+    assert(offset == 1);
+
+    assert(entry_log.end == 2);
+    assert(entry_log.bytes == 10);
+    assert(!errno);
+
+    // teardown
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_append_batch_success_across_segments() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    int cursor = log_cursor_open(&entry_log, LOG_OLDEST);
+    assert(append_entries(1) >= 0);
+    unsigned int n = LOG_SEGMENT_ENTRIES + 1;
+    struct queue_entry *entries = malloc(n * sizeof *entries);
+    for (unsigned int i = 0; i < n; i++) {
+        entries[i] = (struct queue_entry){
+            .id = 1 + i, .data = "World", .size = 5};
+    }
+    uint64_t offset;
+
+    // act
+    int appended = log_append_batch(&entry_log, entries, n, &offset);
+
+    // assert
+    assert(appended >= 0);
+    assert(offset == 1);
+    assert(entry_log.end == n + 1);
+    assert(entry_log.bytes == (n + 1) * 5);
+
+    int count = log_read(&entry_log, cursor, entries, n, SIZE_MAX, NULL);
+    assert(count == (int)n);
+    for (unsigned int i = 0; i < n; i++) {
+        assert(entries[i].id == i);
+    }
+    free_entries(entries, count);
+
+    // an empty entry fails the whole batch
+    entries[0] = (struct queue_entry){.id = 1, .data = "!", .size = 1};
+    entries[1] = (struct queue_entry){.id = 2, .data = "!", .size = 0};
+    assert(log_append_batch(&entry_log, entries, 2, NULL) < 0);
+    assert(errno == EINVAL);
+    assert(entry_log.end == n + 1);
+
+    // teardown
+    free(entries);
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_read_success_from_every_cursor() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    assert(append_entries(3) >= 0);
+    int first = log_cursor_open(&entry_log, 0);
+    int second = log_cursor_open(&entry_log, 0);
+    struct queue_entry read_first[4];
+    struct queue_entry read_second[4];
+    uint64_t offset;
+
+    // act
+    int n_first = log_read(&entry_log, first, read_first, 4, SIZE_MAX, &offset);
+    int n_second = log_read(&entry_log, second, read_second, 4, SIZE_MAX, NULL);
+
+    // assert: both cursors see every entry, sharing one copy of the data
+    assert(n_first == 3);
+    assert(n_second == 3);
+    assert(offset == 0);
+    for (unsigned int i = 0; i < 3; i++) {
+        assert(read_first[i].id == i);
+        assert(read_second[i].id == i);
+        assert(read_first[i].data == read_second[i].data);
+        assert(memcmp(read_first[i].data, "Hello", 5) == 0);
+    }
+    assert(entry_log.cursors[first].offset == 3);
+    assert(entry_log.end == 3);
+    assert(!errno);
+
+    // teardown
+    free_entries(read_first, n_first);
+    free_entries(read_second, n_second);
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_read_keeps_data_after_reclaim() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    assert(append_entries(LOG_SEGMENT_ENTRIES) >= 0);
+    int cursor = log_cursor_open(&entry_log, 0);
+    struct queue_entry entry;
+
+    // act
+    assert(log_read(&entry_log, cursor, &entry, 1, SIZE_MAX, NULL) == 1);
+    log_cursor_close(&entry_log, cursor);
+    assert(append_entries(1) >= 0);
+
+    // assert: the reader's reference outlives the segment
+    assert(entry_log.start == LOG_SEGMENT_ENTRIES);
+    assert(memcmp(entry.data, "Hello", 5) == 0);
+
+    // teardown
+    free_entries(&entry, 1);
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_read_throws_when_nothing_to_read() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    int cursor = log_cursor_open(&entry_log, 0);
+    struct queue_entry entry;
+
+    // act & assert
+    assert(log_read(&entry_log, cursor, &entry, 1, SIZE_MAX, NULL) < 0);
+    assert(errno == ENODATA);
+
+    assert(append_entries(1) >= 0);
+    assert(log_read(&entry_log, cursor, &entry, 1, 4, NULL) < 0);
+    assert(errno == EMSGSIZE);
+    assert(entry_log.cursors[cursor].offset == 0);
+
+    assert(log_read(&entry_log, -1, &entry, 1, SIZE_MAX, NULL) < 0);
+    assert(errno == EINVAL);
+
+    assert(log_read(&entry_log, cursor + 1, &entry, 1, SIZE_MAX, NULL) < 0);
+    assert(errno == EINVAL);
+
+    // teardown
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_read_stops_at_max_bytes() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    assert(append_entries(3) >= 0);
+    int cursor = log_cursor_open(&entry_log, 0);
+    struct queue_entry entries[3];
+    uint64_t offset;
+
+    // act & assert
+    int n = log_read(&entry_log, cursor, entries, 3, 12, &offset);
+    assert(n == 2);
+    assert(offset == 0);
+    free_entries(entries, n);
+
+    n = log_read(&entry_log, cursor, entries, 3, 12, &offset);
+    assert(n == 1);
+    assert(offset == 2);
+    assert(entries[0].id == 2);
+    free_entries(entries, n);
+
+    // teardown
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_cursor_open_throws_when_out_of_range() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    assert(append_entries(LOG_SEGMENT_ENTRIES + 1) >= 0);
+
+    // act & assert: the first segment was read by every cursor, none
+    assert(log_cursor_open(&entry_log, 0) < 0);
+    assert(errno == ERANGE);
+
+    assert(log_cursor_open(&entry_log, LOG_SEGMENT_ENTRIES + 2) < 0);
+    assert(errno == ERANGE);
+
+    for (int i = 0; i < LOG_MAX_CURSORS; i++) {
+        assert(log_cursor_open(&entry_log, LOG_SEGMENT_ENTRIES + 1) == i);
+    }
+    assert(log_cursor_open(&entry_log, LOG_SEGMENT_ENTRIES) < 0);
+    assert(errno == EMFILE);
+
+    // teardown
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_cursor_seek_replays_entries() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    assert(append_entries(3) >= 0);
+    int cursor = log_cursor_open(&entry_log, 0);
+    struct queue_entry entries[3];
+
+    // act
+    int n = log_read(&entry_log, cursor, entries, 3, SIZE_MAX, NULL);
+    free_entries(entries, n);
+    assert(log_cursor_seek(&entry_log, cursor, 1) >= 0);
+    n = log_read(&entry_log, cursor, entries, 3, SIZE_MAX, NULL);
+
+    // assert
+    assert(n == 2);
+    assert(entries[0].id == 1);
+    assert(entries[1].id == 2);
+
+    assert(log_cursor_seek(&entry_log, cursor, 4) < 0);
+    assert(errno == ERANGE);
+
+    assert(log_cursor_seek(&entry_log, cursor + 1, 0) < 0);
+    assert(errno == EINVAL);
+
+    // teardown
+    free_entries(entries, n);
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_reclaim_waits_for_every_cursor() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    int slow = log_cursor_open(&entry_log, 0);
+    int fast = log_cursor_open(&entry_log, 0);
+    assert(append_entries(2 * LOG_SEGMENT_ENTRIES) >= 0);
+    struct queue_entry *entries =
+        malloc(2 * LOG_SEGMENT_ENTRIES * sizeof *entries);
+
+    // act & assert
+    int n = log_read(&entry_log, fast, entries, 2 * LOG_SEGMENT_ENTRIES,
+                     SIZE_MAX, NULL);
+    free_entries(entries, n);
+    assert(log_reclaim(&entry_log) == 0);
+    assert(entry_log.start == 0);
+
+    n = log_read(&entry_log, slow, entries, LOG_SEGMENT_ENTRIES, SIZE_MAX,
+                 NULL);
+    free_entries(entries, n);
+    assert(log_reclaim(&entry_log) == LOG_SEGMENT_ENTRIES);
+    assert(entry_log.start == LOG_SEGMENT_ENTRIES);
+    assert(entry_log.bytes == LOG_SEGMENT_ENTRIES * 5);
+
+    // closed cursors hold nothing back
+    log_cursor_close(&entry_log, slow);
+    assert(log_reclaim(&entry_log) == LOG_SEGMENT_ENTRIES);
+    assert(entry_log.start == 2 * LOG_SEGMENT_ENTRIES);
+    assert(!entry_log.bytes);
+
+    // teardown
+    free(entries);
+    log_destroy(&entry_log);
+    return 0;
+}
+
+int test_log_reclaim_keeps_retention() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, SIZE_MAX, LOG_SEGMENT_ENTRIES);
+
+    // act
+    assert(append_entries(3 * LOG_SEGMENT_ENTRIES + 1) >= 0);
+
+    // assert: the newest full segment stays for replay
+    assert(entry_log.start == 2 * LOG_SEGMENT_ENTRIES);
+    assert(log_cursor_open(&entry_log, 2 * LOG_SEGMENT_ENTRIES) >= 0);
+    assert(log_reclaim(&entry_log) == 0);
+
+    // teardown
+    log_destroy(&entry_log);
+
+    // arrange
+    log_init(&entry_log, 2 * LOG_SEGMENT_ENTRIES * 5, UINT64_MAX);
+
+    // act
+    assert(append_entries(4 * LOG_SEGMENT_ENTRIES) >= 0);
+    log_reclaim(&entry_log);
+
+    // assert
+    assert(entry_log.start == 2 * LOG_SEGMENT_ENTRIES);
+    assert(!errno);
+
+    // teardown
+    log_destroy(&entry_log);
+    return 0;
+}
+
+static void *append_thread(void *arg) {
+    (void)arg;
+    for (unsigned int id = 0; id < TEST_ENTRIES; id++) {
+        struct queue_entry entry = {.id = id, .data = "Hello", .size = 5};
+        while (log_append(&entry_log, &entry, NULL) < 0) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *read_thread(void *arg) {
+    int cursor = *(int *)arg;
+    struct queue_entry entries[64];
+    unsigned int id = 0;
+    while (id < TEST_ENTRIES) {
+        int n = log_read(&entry_log, cursor, entries, 64, SIZE_MAX, NULL);
+        if (n < 0) {
+            sched_yield();
+            continue;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (entries[i].id != id++ ||
+                memcmp(entries[i].data, "Hello", 5) != 0) {
+                *(int *)arg = -1;
+            }
+        }
+        free_entries(entries, n);
+    }
+    return NULL;
+}
+
+int test_log_read_concurrently_with_append() {
+    // arrange
+    errno = 0;
+    log_init(&entry_log, 0, 0);
+    pthread_t appender;
+    pthread_t readers[TEST_THREADS];
+    int cursors[TEST_THREADS];
+
+    // act
+    for (int i = 0; i < TEST_THREADS; i++) {
+        cursors[i] = log_cursor_open(&entry_log, 0);
+        pthread_create(&readers[i], NULL, read_thread, &cursors[i]);
+    }
+    pthread_create(&appender, NULL, append_thread, NULL);
+    pthread_join(appender, NULL);
+    for (int i = 0; i < TEST_THREADS; i++) {
+        pthread_join(readers[i], NULL);
+    }
+    log_reclaim(&entry_log);
+
+    // assert: every reader saw every entry in order, and segments were
+    // reclaimed behind them
+    for (int i = 0; i < TEST_THREADS; i++) {
+        assert(cursors[i] >= 0);
+        assert(entry_log.cursors[cursors[i]].offset == TEST_ENTRIES);
+    }
+    assert(entry_log.start ==
+           (TEST_ENTRIES - 1) / LOG_SEGMENT_ENTRIES * LOG_SEGMENT_ENTRIES);
+
+    // teardown
+    log_destroy(&entry_log);
+    return 0;
+}
+
+struct test_case tests[] = {
+    {"test_log_init_throws_when_invalid_args", NULL, NULL,
+     test_log_init_throws_when_invalid_args},
+    {"test_log_append_throws_when_invalid_args", NULL, NULL,
+     test_log_append_throws_when_invalid_args},
+    {"test_log_append_success_at_consecutive_offsets", NULL, NULL,
+     test_log_append_success_at_consecutive_offsets},
+    {"test_log_append_batch_success_across_segments", NULL, NULL,
+     test_log_append_batch_success_across_segments},
+    {"test_log_read_success_from_every_cursor", NULL, NULL,
+     test_log_read_success_from_every_cursor},
+    {"test_log_read_keeps_data_after_reclaim", NULL, NULL,
+     test_log_read_keeps_data_after_reclaim},
+    {"test_log_read_throws_when_nothing_to_read", NULL, NULL,
+     test_log_read_throws_when_nothing_to_read},
+    {"test_log_read_stops_at_max_bytes", NULL, NULL,
+     test_log_read_stops_at_max_bytes},
+    {"test_log_cursor_open_throws_when_out_of_range", NULL, NULL,
+     test_log_cursor_open_throws_when_out_of_range},
+    {"test_log_cursor_seek_replays_entries", NULL, NULL,
+     test_log_cursor_seek_replays_entries},
+    {"test_log_reclaim_waits_for_every_cursor", NULL, NULL,
+     test_log_reclaim_waits_for_every_cursor},
+    {"test_log_reclaim_keeps_retention", NULL, NULL,
+     test_log_reclaim_keeps_retention},
+    {"test_log_read_concurrently_with_append", NULL, NULL,
+     test_log_read_concurrently_with_append}};
+
+struct test_suite suite = {.name = "test_log", .setup = NULL, .teardown = NULL};
+
+int main() { run_suite(); }
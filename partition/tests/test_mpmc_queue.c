@@ -0,0 +1,356 @@
+#include "mpmc_queue.h"
+
+#include <messageq/buffer_pool.h>
+#include <messageq/test.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_THREADS 4
+#define TEST_ENTRIES 100000 // per producer
+
+int test_mpmc_queue_init_throws_error_when_invalid_args() {
+    // arrange
+    errno = 0;
+
+    // act & assert
+    assert(mpmc_queue_init(NULL) < 0);
+    assert(errno == EINVAL);
+    return 0;
+}
+
+int test_mpmc_queue_init_success() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+
+    // act
+    int ret = mpmc_queue_init(&queue);
+
+    // assert
+    assert(ret >= 0);
+    assert(queue.head == queue.tail);
+    assert(!queue.head->next);
+    assert(!queue.length);
+    assert(!queue.bytes);
+    assert(!errno);
+
+    // teardown
+    mpmc_queue_destroy(&queue);
+    return 0;
+}
+
+int test_mpmc_queue_push_throws_error_when_invalid_args() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+    mpmc_queue_init(&queue);
+    struct queue_entry entry = {.id = 1, .data = "Hello", .size = 5};
+    struct queue_entry empty = {.id = 1, .data = "Hello", .size = 0};
+
+    // act & assert
+    assert(mpmc_queue_push(NULL, &entry) < 0);
+    assert(errno == EINVAL);
+
+    assert(mpmc_queue_push(&queue, NULL) < 0);
+    assert(errno == EINVAL);
+
+    assert(mpmc_queue_push(&queue, &empty) < 0);
+    assert(errno == EINVAL);
+
+    assert(mpmc_queue_push_leased(&queue, &empty) < 0);
+    assert(errno == EINVAL);
+
+    assert(mpmc_queue_push_batch(&queue, &entry, 0) < 0);
+    assert(errno == EINVAL);
+
+    assert(!queue.length);
+
+    // teardown
+    mpmc_queue_destroy(&queue);
+    return 0;
+}
+
+int test_mpmc_queue_pop_throws_error_when_empty() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+    mpmc_queue_init(&queue);
+    struct queue_entry popped;
+
+    // act & assert
+    assert(mpmc_queue_pop(&queue, &popped, 1024) < 0);
+    assert(errno == ENODATA);
+
+    assert(mpmc_queue_pop(&queue, NULL, 1024) < 0);
+    assert(errno == EINVAL);
+
+    assert(mpmc_queue_peek_id(&queue) < 0);
+    assert(errno == ENODATA);
+
+    // teardown
+    mpmc_queue_destroy(&queue);
+    return 0;
+}
+
+int test_mpmc_queue_pop_success() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+    mpmc_queue_init(&queue);
+    char data[] = "Hello";
+    struct queue_entry first = {.id = 1, .data = data, .size = 5};
+    struct queue_entry second = {.id = 2, .data = "World!", .size = 6};
+    struct queue_entry popped;
+
+    // act
+    assert(mpmc_queue_push(&queue, &first) >= 0);
+    assert(mpmc_queue_push(&queue, &second) >= 0);
+    data[0] = 'J'; // pushed entries are copies
+
+    // assert
+    assert(queue.length == 2);
+    assert(queue.bytes == 11);
+    assert(mpmc_queue_peek_id(&queue) == 1);
+
+    assert(mpmc_queue_pop(&queue, &popped, 1024) >= 0);
+    assert(popped.id == 1);
+    assert(popped.size == 5);
+    assert(memcmp(popped.data, "Hello", 5) == 0);
+    buffer_pool_free(popped.data);
+
+    assert(mpmc_queue_peek_id(&queue) == 2);
+    assert(mpmc_queue_pop(&queue, &popped, 1024) >= 0);
+    assert(popped.id == 2);
+    assert(memcmp(popped.data, "World!", 6) == 0);
+    buffer_pool_free(popped.data);
+
+    assert(mpmc_queue_pop(&queue, &popped, 1024) < 0);
+    assert(errno == ENODATA);
+    assert(!queue.length);
+    assert(!queue.bytes);
+
+    // teardown
+    mpmc_queue_destroy(&queue);
+    return 0;
+}
+
+int test_mpmc_queue_pop_throws_error_when_head_too_large() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+    mpmc_queue_init(&queue);
+    struct queue_entry entry = {.id = 1, .data = "Hello", .size = 5};
+    struct queue_entry popped;
+    mpmc_queue_push(&queue, &entry);
+
+    // act & assert
+    assert(mpmc_queue_pop(&queue, &popped, 4) < 0);
+    assert(errno == EMSGSIZE);
+    assert(queue.length == 1);
+    assert(mpmc_queue_peek_id(&queue) == 1);
+
+    assert(mpmc_queue_pop(&queue, &popped, 5) >= 0);
+    assert(popped.id == 1);
+    buffer_pool_free(popped.data);
+
+    // teardown
+    mpmc_queue_destroy(&queue);
+    return 0;
+}
+
+int test_mpmc_queue_push_leased_success() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+    mpmc_queue_init(&queue);
+    char *data = buffer_pool_alloc(1024);
+    memset(data, 'a', 1024);
+    struct queue_entry entry = {.id = 7, .data = data, .size = 1024};
+    struct queue_entry popped;
+
+    // act
+    int ret = mpmc_queue_push_leased(&queue, &entry);
+
+    // assert
+    assert(ret >= 0);
+    assert(mpmc_queue_pop(&queue, &popped, 1024) >= 0);
+    assert(popped.id == 7);
+    assert(popped.data == data); // handed over, not copied
+    assert(popped.size == 1024);
+    assert(!errno);
+
+    // teardown
+    buffer_pool_free(popped.data);
+    mpmc_queue_destroy(&queue);
+    return 0;
+}
+
+int test_mpmc_queue_push_batch_success() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+    mpmc_queue_init(&queue);
+    struct queue_entry head = {.id = 1, .data = "a", .size = 1};
+    struct queue_entry batch[] = {
+        {.id = 2, .data = "bb", .size = 2},
+        {.id = 3, .data = "ccc", .size = 3},
+        {.id = 4, .data = "dddd", .size = 4},
+    };
+    struct queue_entry bad[] = {
+        {.id = 5, .data = "e", .size = 1},
+        {.id = 6, .data = "f", .size = 0},
+    };
+    struct queue_entry popped;
+    mpmc_queue_push(&queue, &head);
+
+    // act
+    assert(mpmc_queue_push_batch(&queue, batch, 3) >= 0);
+    assert(mpmc_queue_push_batch(&queue, bad, 2) < 0);
+
+    // assert
+    assert(errno == EINVAL);
+    assert(queue.length == 4);
+    assert(queue.bytes == 10);
+    for (unsigned int id = 1; id <= 4; id++) {
+        assert(mpmc_queue_pop(&queue, &popped, 1024) >= 0);
+        assert(popped.id == id);
+        assert(popped.size == id);
+        buffer_pool_free(popped.data);
+    }
+    assert(mpmc_queue_pop(&queue, &popped, 1024) < 0);
+
+    // teardown
+    mpmc_queue_destroy(&queue);
+    return 0;
+}
+
+int test_mpmc_queue_destroy_frees_entries() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+    mpmc_queue_init(&queue);
+    char *data = buffer_pool_alloc(512);
+    struct queue_entry leased = {.id = 1, .data = data, .size = 512};
+    struct queue_entry entry = {.id = 2, .data = "Hello", .size = 5};
+    mpmc_queue_push_leased(&queue, &leased);
+    mpmc_queue_push(&queue, &entry);
+
+    // act
+    mpmc_queue_destroy(&queue);
+
+    // assert
+    assert(!queue.head);
+    assert(!queue.tail);
+    assert(!queue.length);
+    assert(!errno);
+    return 0;
+}
+
+struct mpmc_thread {
+    pthread_t tid;
+    struct mpmc_queue *queue;
+    unsigned int first_id;
+    unsigned char *seen; // entries popped, indexed by ID
+    int corrupted;       // popped data did not match its ID
+};
+
+static void *produce(void *arg) {
+    struct mpmc_thread *thread = arg;
+    for (unsigned int i = 0; i < TEST_ENTRIES; i++) {
+        unsigned int id = thread->first_id + i;
+        struct queue_entry entry = {.id = id, .data = &id, .size = sizeof id};
+        if (i % 8) {
+            mpmc_queue_push(thread->queue, &entry);
+        } else {
+            mpmc_queue_push_batch(thread->queue, &entry, 1);
+        }
+    }
+    return NULL;
+}
+
+static void *consume(void *arg) {
+    struct mpmc_thread *thread = arg;
+    struct queue_entry entry;
+    for (unsigned int i = 0; i < TEST_ENTRIES; i++) {
+        while (mpmc_queue_pop(thread->queue, &entry, sizeof(unsigned int)) <
+               0) {
+            mpmc_queue_peek_id(thread->queue);
+        }
+
+        unsigned int id;
+        memcpy(&id, entry.data, sizeof id);
+        if (id != entry.id) {
+            thread->corrupted = 1;
+        }
+        __atomic_add_fetch(&thread->seen[entry.id], 1, __ATOMIC_RELAXED);
+        buffer_pool_free(entry.data);
+    }
+    return NULL;
+}
+
+int test_mpmc_queue_hands_every_entry_to_one_consumer() {
+    // arrange
+    errno = 0;
+    struct mpmc_queue queue;
+    mpmc_queue_init(&queue);
+    unsigned char *seen = calloc(TEST_THREADS * TEST_ENTRIES, 1);
+    struct mpmc_thread producers[TEST_THREADS];
+    struct mpmc_thread consumers[TEST_THREADS];
+
+    // act
+    for (int i = 0; i < TEST_THREADS; i++) {
+        producers[i] = (struct mpmc_thread){
+            .queue = &queue, .first_id = i * TEST_ENTRIES, .seen = seen};
+        consumers[i] = (struct mpmc_thread){.queue = &queue, .seen = seen};
+        pthread_create(&producers[i].tid, NULL, produce, &producers[i]);
+        pthread_create(&consumers[i].tid, NULL, consume, &consumers[i]);
+    }
+    for (int i = 0; i < TEST_THREADS; i++) {
+        pthread_join(producers[i].tid, NULL);
+        pthread_join(consumers[i].tid, NULL);
+    }
+
+    // assert
+    for (unsigned int id = 0; id < TEST_THREADS * TEST_ENTRIES; id++) {
+        assert(seen[id] == 1);
+    }
+    for (int i = 0; i < TEST_THREADS; i++) {
+        assert(!consumers[i].corrupted);
+    }
+    assert(queue.head == queue.tail);
+    assert(!queue.length);
+    assert(!queue.bytes);
+
+    // teardown
+    free(seen);
+    mpmc_queue_destroy(&queue);
+    return 0;
+}
+
+struct test_case tests[] = {
+    {"test_mpmc_queue_init_throws_error_when_invalid_args", NULL, NULL,
+     test_mpmc_queue_init_throws_error_when_invalid_args},
+    {"test_mpmc_queue_init_success", NULL, NULL, test_mpmc_queue_init_success},
+    {"test_mpmc_queue_push_throws_error_when_invalid_args", NULL, NULL,
+     test_mpmc_queue_push_throws_error_when_invalid_args},
+    {"test_mpmc_queue_pop_throws_error_when_empty", NULL, NULL,
+     test_mpmc_queue_pop_throws_error_when_empty},
+    {"test_mpmc_queue_pop_success", NULL, NULL, test_mpmc_queue_pop_success},
+    {"test_mpmc_queue_pop_throws_error_when_head_too_large", NULL, NULL,
+     test_mpmc_queue_pop_throws_error_when_head_too_large},
+    {"test_mpmc_queue_push_leased_success", NULL, NULL,
+     test_mpmc_queue_push_leased_success},
+    {"test_mpmc_queue_push_batch_success", NULL, NULL,
+     test_mpmc_queue_push_batch_success},
+    {"test_mpmc_queue_destroy_frees_entries", NULL, NULL,
+     test_mpmc_queue_destroy_frees_entries},
+    {"test_mpmc_queue_hands_every_entry_to_one_consumer", NULL, NULL,
+     test_mpmc_queue_hands_every_entry_to_one_consumer}};
+
+struct test_suite suite = {
+    .name = "test_mpmc_queue", .setup = NULL, .teardown = NULL};
+
+int main() { run_suite(); }
@@ -1,5 +1,6 @@
 #include "queue.h"
 
+#include <messageq/buffer_pool.h>
 #include <messageq/test.h>
 
 #include <errno.h>
@@ -7,6 +8,33 @@
 #include <stdlib.h>
 #include <string.h>
 
+/**
+ * Gets the `i`-th entry from the head of a queue, in place.
+ */
+static struct queue_entry entry_at(struct queue *queue, unsigned int i) {
+    struct queue_chunk *chunk = queue->pop_chunk;
+    size_t offset = queue->pop_offset;
+    for (;;) {
+        if (offset == chunk->end) {
+            chunk = chunk->next;
+            offset = 0;
+            continue;
+        }
+
+        struct queue_record *record = (void *)(chunk->data + offset);
+        if (!i--) {
+            void *data = record->size > QUEUE_INLINE_MAX
+                             ? *(void **)(record + 1)
+                             : (void *)(record + 1);
+            return (struct queue_entry){
+                .data = data, .id = record->id, .size = record->size};
+        }
+        offset += sizeof *record + (record->size > QUEUE_INLINE_MAX
+                                        ? sizeof(void *)
+                                        : (record->size + 7) & ~7u);
+    }
+}
+
 int test_queue_init_success() {
     // arrange
     errno = 0;
@@ -18,6 +46,8 @@ int test_queue_init_success() {
     // assert
     assert(!queue.head);
     assert(!queue.tail);
+    assert(!queue.length);
+    assert(!queue.bytes);
 
     // teardown
     queue_destroy(&queue);
@@ -114,9 +144,10 @@ int test_queue_push_success_when_empty() {
     assert(queue_push(&queue, &entry) >= 0);
     assert(!errno);
     assert(queue.head == queue.tail);
-    assert(queue.head->entry.id == entry.id);
-    assert(memcmp(queue.head->entry.data, entry.data, entry.size) == 0);
-    assert(queue.head->entry.size == entry.size);
+    assert(queue.length == 1);
+    assert(entry_at(&queue, 0).id == entry.id);
+    assert(memcmp(entry_at(&queue, 0).data, entry.data, entry.size) == 0);
+    assert(entry_at(&queue, 0).size == entry.size);
     assert(!queue.head->next);
 
     // teardown
@@ -145,15 +176,15 @@ int test_queue_push_success_when_size_is_one() {
     // act & assert
     assert(queue_push(&queue, &entry2) >= 0);
     assert(!errno);
-    assert(queue.head != queue.tail);
-    assert(queue.head->entry.id == entry1.id);
-    assert(memcmp(queue.head->entry.data, entry1.data, entry1.size) == 0);
-    assert(queue.head->entry.size == entry1.size);
-    assert(queue.tail == queue.head->next);
-
-    assert(queue.tail->entry.id == entry2.id);
-    assert(memcmp(queue.tail->entry.data, entry2.data, entry2.size) == 0);
-    assert(queue.tail->entry.size == entry2.size);
+    assert(queue.head == queue.tail);
+    assert(queue.length == 2);
+    assert(entry_at(&queue, 0).id == entry1.id);
+    assert(memcmp(entry_at(&queue, 0).data, entry1.data, entry1.size) == 0);
+    assert(entry_at(&queue, 0).size == entry1.size);
+
+    assert(entry_at(&queue, 1).id == entry2.id);
+    assert(memcmp(entry_at(&queue, 1).data, entry2.data, entry2.size) == 0);
+    assert(entry_at(&queue, 1).size == entry2.size);
     assert(!queue.tail->next);
 
     // teardown
@@ -194,32 +225,94 @@ int test_queue_push_success_when_size_is_greater_than_one() {
     assert(queue_push(&queue, &entry4) >= 0);
     assert(!errno);
 
-    struct queue_node *node1 = queue.head;
-    struct queue_node *node2 = node1->next;
-    struct queue_node *node3 = node2->next;
-    struct queue_node *node4 = node3->next;
+    struct queue_entry slot1 = entry_at(&queue, 0);
+    struct queue_entry slot2 = entry_at(&queue, 1);
+    struct queue_entry slot3 = entry_at(&queue, 2);
+    struct queue_entry slot4 = entry_at(&queue, 3);
 
-    assert(queue.head != queue.tail);
-    assert(queue.tail->entry.id == entry4.id);
-    assert(memcmp(queue.tail->entry.data, entry4.data, entry4.size) == 0);
-    assert(queue.tail->entry.size == entry4.size);
+    assert(queue.head == queue.tail);
+    assert(queue.length == 4);
+    assert(queue.tail->end == 4 * (sizeof(struct queue_record) + 8));
     assert(!queue.tail->next);
 
-    assert(node1->entry.id == entry1.id);
-    assert(memcmp(node1->entry.data, entry1.data, entry1.size) == 0);
-    assert(node1->entry.size == entry1.size);
+    assert(slot1.id == entry1.id);
+    assert(memcmp(slot1.data, entry1.data, entry1.size) == 0);
+    assert(slot1.size == entry1.size);
 
-    assert(node2->entry.id == entry2.id);
-    assert(memcmp(node2->entry.data, entry2.data, entry2.size) == 0);
-    assert(node2->entry.size == entry2.size);
+    assert(slot2.id == entry2.id);
+    assert(memcmp(slot2.data, entry2.data, entry2.size) == 0);
+    assert(slot2.size == entry2.size);
 
-    assert(node3->entry.id == entry3.id);
-    assert(memcmp(node3->entry.data, entry3.data, entry3.size) == 0);
-    assert(node3->entry.size == entry3.size);
+    assert(slot3.id == entry3.id);
+    assert(memcmp(slot3.data, entry3.data, entry3.size) == 0);
+    assert(slot3.size == entry3.size);
+
+    assert(slot4.id == entry4.id);
+    assert(memcmp(slot4.data, entry4.data, entry4.size) == 0);
+    assert(slot4.size == entry4.size);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_push_batch_throws_error_when_invalid_args() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
 
-    assert(node4->entry.id == entry4.id);
-    assert(memcmp(node4->entry.data, entry4.data, entry4.size) == 0);
-    assert(node4->entry.size == entry4.size);
+    struct queue_entry entries[2] = {{.id = 1, .data = "Hello", .size = 5},
+                                     {.id = 2, .data = "World", .size = 5}};
+
+    // act & assert
+    assert(queue_push_batch(NULL, entries, 2) < 0);
+    assert(errno == EINVAL);
+
+    assert(queue_push_batch(&queue, NULL, 2) < 0);
+    assert(errno == EINVAL);
+
+    assert(queue_push_batch(&queue, entries, 0) < 0);
+    assert(errno == EINVAL);
+
+    // arrange
+    entries[1].size = 0;
+
+    // act & assert
+    assert(queue_push_batch(&queue, entries, 2) < 0);
+    assert(errno == EINVAL);
+    assert(!queue.head);
+    assert(!queue.tail);
+    assert(!queue.length);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_push_batch_success() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+
+    struct queue_entry entry = {.id = 1, .data = "Hello", .size = 5};
+    queue_push(&queue, &entry);
+
+    struct queue_entry entries[3] = {{.id = 2, .data = ", ", .size = 2},
+                                     {.id = 3, .data = "World", .size = 5},
+                                     {.id = 4, .data = "!", .size = 1}};
+
+    // act
+    assert(queue_push_batch(&queue, entries, 3) >= 0);
+
+    // assert
+    assert(!errno);
+    assert(queue.length == 4);
+    for (unsigned int id = 1; id <= 4; id++) {
+        assert(entry_at(&queue, id - 1).id == id);
+    }
+    assert(memcmp(entry_at(&queue, 3).data, "!", 1) == 0);
 
     // teardown
     queue_destroy(&queue);
@@ -230,8 +323,15 @@ int test_queue_pop_throws_error_when_invalid_args() {
     // arrange
     errno = 0;
 
+    struct queue queue;
+    queue_init(&queue);
+    struct queue_entry popped;
+
     // act & assert
-    assert(!queue_pop(NULL));
+    assert(queue_pop(NULL, &popped) < 0);
+    assert(errno == EINVAL);
+
+    assert(queue_pop(&queue, NULL) < 0);
     assert(errno == EINVAL);
     return 0;
 }
@@ -242,8 +342,10 @@ int test_queue_pop_throws_error_when_empty() {
     struct queue queue;
     queue_init(&queue);
 
+    struct queue_entry popped;
+
     // act & assert
-    assert(!queue_pop(&queue));
+    assert(queue_pop(&queue, &popped) < 0);
     assert(errno == ENODATA);
 
     // teardown
@@ -263,21 +365,20 @@ int test_queue_pop_success_when_size_is_one() {
     entry.size = strlen(entry.data);
     queue_push(&queue, &entry);
 
+    struct queue_entry popped;
+
     // act
-    struct queue_entry *popped = queue_pop(&queue);
+    assert(queue_pop(&queue, &popped) >= 0);
 
     // assert
-    assert(popped);
     assert(!errno);
-    assert(!queue.head);
-    assert(!queue.tail);
-    assert(popped->id == 1);
-    assert(memcmp(popped->data, "Hello, World!", 13) == 0);
-    assert(popped->size == 13);
+    assert(!queue.length);
+    assert(queue_peek_id(&queue) < 0);
+    assert(popped.id == 1);
+    assert(memcmp(popped.data, "Hello, World!", 13) == 0);
+    assert(popped.size == 13);
 
     // teardown
-    free(popped->data);
-    free(popped);
     queue_destroy(&queue);
     return 0;
 }
@@ -310,36 +411,437 @@ int test_queue_pop_success_when_size_is_greater_than_one() {
     entry.size = strlen(entry.data);
     queue_push(&queue, &entry);
 
+    struct queue_entry popped;
+
     // act
-    struct queue_entry *popped = queue_pop(&queue);
+    assert(queue_pop(&queue, &popped) >= 0);
+
+    // assert
+    assert(!errno);
+
+    struct queue_entry slot1 = entry_at(&queue, 0);
+    struct queue_entry slot2 = entry_at(&queue, 1);
+    struct queue_entry slot3 = entry_at(&queue, 2);
+
+    assert(popped.id == 1);
+    assert(memcmp(popped.data, "Hello", 5) == 0);
+    assert(popped.size == 5);
+
+    assert(slot1.id == 2);
+    assert(memcmp(slot1.data, ", ", 2) == 0);
+    assert(slot1.size == 2);
+
+    assert(slot2.id == 3);
+    assert(memcmp(slot2.data, "World", 5) == 0);
+    assert(slot2.size == 5);
+
+    assert(slot3.id == 4);
+    assert(memcmp(slot3.data, "!", 1) == 0);
+    assert(slot3.size == 1);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_pop_batch_throws_error_when_invalid_args() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+    struct queue_entry popped[4];
+
+    // act & assert
+    assert(queue_pop_batch(NULL, popped, 4, 100) < 0);
+    assert(errno == EINVAL);
+
+    assert(queue_pop_batch(&queue, NULL, 4, 100) < 0);
+    assert(errno == EINVAL);
+
+    assert(queue_pop_batch(&queue, popped, 0, 100) < 0);
+    assert(errno == EINVAL);
+
+    assert(queue_pop_batch(&queue, popped, 4, 100) < 0);
+    assert(errno == ENODATA);
+
+    // arrange
+    struct queue_entry entry = {.id = 1, .data = "Hello", .size = 5};
+    queue_push(&queue, &entry);
+
+    // act & assert
+    assert(queue_pop_batch(&queue, popped, 4, 4) < 0);
+    assert(errno == EMSGSIZE);
+    assert(queue.length == 1);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_pop_batch_success_when_limited_by_count() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+
+    struct queue_entry entries[3] = {{.id = 1, .data = "Hello", .size = 5},
+                                     {.id = 2, .data = ", ", .size = 2},
+                                     {.id = 3, .data = "World", .size = 5}};
+    queue_push_batch(&queue, entries, 3);
+    struct queue_entry popped[2];
+
+    // act
+    int n = queue_pop_batch(&queue, popped, 2, 100);
+
+    // assert
+    assert(n == 2);
+    assert(!errno);
+    assert(popped[0].id == 1);
+    assert(memcmp(popped[0].data, "Hello", 5) == 0);
+    assert(popped[1].id == 2);
+    assert(queue.length == 1);
+    assert(queue_peek_id(&queue) == 3);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_pop_batch_success_when_limited_by_bytes() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+
+    struct queue_entry entries[3] = {{.id = 1, .data = "Hello", .size = 5},
+                                     {.id = 2, .data = ", ", .size = 2},
+                                     {.id = 3, .data = "World", .size = 5}};
+    queue_push_batch(&queue, entries, 3);
+    struct queue_entry popped[4];
+
+    // act: the third entry would make 12 bytes
+    int n = queue_pop_batch(&queue, popped, 4, 11);
 
     // assert
-    assert(popped);
+    assert(n == 2);
     assert(!errno);
+    assert(popped[1].id == 2);
+    assert(queue_peek_id(&queue) == 3);
+
+    // act: drains the queue
+    n = queue_pop_batch(&queue, popped, 4, 11);
+
+    // assert
+    assert(n == 1);
+    assert(popped[0].id == 3);
+    assert(memcmp(popped[0].data, "World", 5) == 0);
+    assert(!queue.length);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_counts_length_and_bytes() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+
+    struct queue_entry entry = {.id = 1, .data = "Hello", .size = 5};
+    struct queue_entry entries[2] = {{.id = 2, .data = ", ", .size = 2},
+                                     {.id = 3, .data = "World", .size = 5}};
+    struct queue_entry head;
+    struct queue_entry popped[2];
+
+    // act & assert
+    assert(queue_push(&queue, &entry) >= 0);
+    assert(queue_push_batch(&queue, entries, 2) >= 0);
+    assert(queue.length == 3);
+    assert(queue.bytes == 12);
+
+    assert(queue_pop(&queue, &head) >= 0);
+    assert(queue.length == 2);
+    assert(queue.bytes == 7);
+
+    assert(queue_pop_batch(&queue, popped, 2, 100) == 2);
+    assert(!queue.length);
+    assert(!queue.bytes);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_stores_large_entries_out_of_line() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+
+    char small[QUEUE_INLINE_MAX];
+    char large[QUEUE_INLINE_MAX + 1];
+    memset(small, 's', sizeof small);
+    memset(large, 'l', sizeof large);
+    struct queue_entry entries[2] = {
+        {.id = 1, .data = small, .size = sizeof small},
+        {.id = 2, .data = large, .size = sizeof large}};
+    struct queue_entry popped[2];
+
+    // act
+    assert(queue_push_batch(&queue, entries, 2) >= 0);
+
+    // assert: the small entry is copied into the chunk, the large one is
+    // referenced from it
+    assert(queue.tail->end == 2 * sizeof(struct queue_record) +
+                                  QUEUE_INLINE_MAX + sizeof(void *));
+
+    // act
+    assert(queue_pop_batch(&queue, popped, 2, 2 * sizeof large) == 2);
+
+    // assert: popped entries stay valid until the queue is updated again
+    assert(popped[0].data == queue.head->data + sizeof(struct queue_record));
+    assert(memcmp(popped[0].data, small, sizeof small) == 0);
+    assert(popped[1].size == sizeof large);
+    assert(memcmp(popped[1].data, large, sizeof large) == 0);
+    assert(!errno);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_push_leased_moves_large_entries() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+
+    char *small = buffer_pool_alloc(5);
+    char *large = buffer_pool_alloc(QUEUE_INLINE_MAX + 1);
+    memcpy(small, "Hello", 5);
+    memset(large, 'l', QUEUE_INLINE_MAX + 1);
+    struct queue_entry entries[2] = {
+        {.id = 1, .data = small, .size = 5},
+        {.id = 2, .data = large, .size = QUEUE_INLINE_MAX + 1}};
+    struct queue_entry popped;
+
+    // act & assert: the small entry is copied inline and its lease released,
+    // the large one is kept as is
+    assert(queue_push_leased(&queue, &entries[0]) >= 0);
+    assert(queue_push_leased(&queue, &entries[1]) >= 0);
+    assert(entry_at(&queue, 1).data == large);
+
+    // act & assert: a held entry outlives the next update of the queue
+    assert(queue_pop(&queue, &popped) >= 0);
+    char *copy = queue_entry_hold(&popped);
+    assert(copy && copy != popped.data);
+    assert(queue_pop(&queue, &popped) >= 0);
+    assert(popped.data == large);
+    char *shared = queue_entry_hold(&popped);
+    assert(shared == large);
+
+    queue_destroy(&queue);
+    assert(memcmp(copy, "Hello", 5) == 0);
+    assert(shared[QUEUE_INLINE_MAX] == 'l');
+    assert(!errno);
+
+    // teardown
+    buffer_pool_free(copy);
+    buffer_pool_free(shared);
+    return 0;
+}
 
-    struct queue_node *node1 = queue.head;
-    struct queue_node *node2 = node1->next;
-    struct queue_node *node3 = node2->next;
+int test_queue_push_front_throws_error_when_invalid_args() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+    struct queue_entry entry = {.id = 1, .data = "Hello", .size = 5};
+    struct queue_entry empty = {.id = 1, .data = NULL, .size = 0};
 
-    assert(popped->id == 1);
-    assert(memcmp(popped->data, "Hello", 5) == 0);
-    assert(popped->size == 5);
+    // act & assert
+    assert(queue_push_front(NULL, &entry) < 0);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(queue_push_front(&queue, NULL) < 0);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(queue_push_front(&queue, &empty) < 0);
+    assert(errno == EINVAL);
+    errno = 0;
+    assert(queue_push_front_leased(&queue, &empty) < 0);
+    assert(errno == EINVAL);
+    assert(queue.length == 0);
 
-    assert(node1->entry.id == 2);
-    assert(memcmp(node1->entry.data, ", ", 2) == 0);
-    assert(node1->entry.size == 2);
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_push_front_success() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+    char id[16];
+    struct queue_entry popped;
+
+    for (unsigned int i = 3; i <= 5; i++) {
+        snprintf(id, sizeof id, "%u", i);
+        struct queue_entry entry = {.id = i, .data = id, .size = strlen(id)};
+        assert(queue_push(&queue, &entry) >= 0);
+    }
+
+    // act & assert: a popped entry goes back into the room it left
+    assert(queue_pop(&queue, &popped) >= 0);
+    assert(popped.id == 3);
+    struct queue_chunk *chunk = queue.head;
+    assert(queue_push_front(&queue, &popped) >= 0);
+    assert(queue.head == chunk);
+    assert(queue.length == 3);
+
+    // act & assert: with no room left, a chunk is linked in front
+    struct queue_entry two = {.id = 2, .data = "2", .size = 1};
+    assert(queue_push_front(&queue, &two) >= 0);
+    assert(queue.head != chunk && queue.head->next == chunk);
+    assert(queue.length == 4);
+
+    struct queue_entry one = {.id = 1, .data = "1", .size = 1};
+    assert(queue_push_front(&queue, &one) >= 0);
+
+    // assert: entries pushed at either end keep their order
+    struct queue_entry six = {.id = 6, .data = "6", .size = 1};
+    assert(queue_push(&queue, &six) >= 0);
+    for (unsigned int i = 1; i <= 6; i++) {
+        assert(queue_pop(&queue, &popped) >= 0);
+        snprintf(id, sizeof id, "%u", i);
+        assert(popped.id == i);
+        assert(popped.size == strlen(id));
+        assert(memcmp(popped.data, id, popped.size) == 0);
+    }
+    assert(queue_pop(&queue, &popped) < 0);
+    assert(errno == ENODATA);
+    errno = 0;
 
-    assert(node2->entry.id == 3);
-    assert(memcmp(node2->entry.data, "World", 5) == 0);
-    assert(node2->entry.size == 5);
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
 
-    assert(node3->entry.id == 4);
-    assert(memcmp(node3->entry.data, "!", 1) == 0);
-    assert(node3->entry.size == 1);
+int test_queue_push_front_keeps_entries_of_the_head_chunk() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+    char data[QUEUE_INLINE_MAX];
+    memset(data, 'd', sizeof data);
+    struct queue_entry entry = {.id = 2, .data = "s", .size = 1};
+    struct queue_entry popped;
+
+    // a small entry, popped, then more than a chunk of full inline ones
+    assert(queue_push(&queue, &entry) >= 0);
+    unsigned int n = QUEUE_CHUNK_SIZE / (sizeof(struct queue_record) +
+                                         QUEUE_INLINE_MAX) +
+                     2;
+    entry.data = data;
+    entry.size = sizeof data;
+    for (unsigned int i = 3; i < n; i++) {
+        entry.id = i;
+        assert(queue_push(&queue, &entry) >= 0);
+    }
+    assert(queue_pop(&queue, &popped) >= 0);
+    struct queue_chunk *chunk = queue.head;
+
+    // act: a full inline entry does not fit in the room the small one left
+    entry.id = 1;
+    int result = queue_push_front(&queue, &entry);
+
+    // assert
+    assert(result >= 0);
+    assert(queue.head != chunk && queue.head->next == chunk);
+
+    // act: a large entry fits before it
+    char *large = buffer_pool_alloc(QUEUE_INLINE_MAX + 1);
+    memset(large, 'l', QUEUE_INLINE_MAX + 1);
+    struct queue_entry front = {
+        .id = 0, .data = large, .size = QUEUE_INLINE_MAX + 1};
+    result = queue_push_front_leased(&queue, &front);
+
+    // assert
+    assert(result >= 0);
+    assert(entry_at(&queue, 0).data == large);
+    assert(queue.length == n - 1);
+    for (unsigned int i = 0; i < n; i++) {
+        if (i == 2) {
+            continue;
+        }
+        assert(queue_pop(&queue, &popped) >= 0);
+        assert(popped.id == i);
+        if (i) {
+            assert(popped.size == sizeof data);
+            assert(memcmp(popped.data, data, sizeof data) == 0);
+        }
+    }
+    assert(queue.length == 0);
+    assert(!errno);
+
+    // teardown
+    queue_destroy(&queue);
+    return 0;
+}
+
+int test_queue_recycles_chunks() {
+    // arrange
+    errno = 0;
+    struct queue queue;
+    queue_init(&queue);
+
+    // entries of 1 byte take a record of 16 bytes
+    unsigned int per_chunk = QUEUE_CHUNK_SIZE / 16;
+    unsigned int n = 3 * per_chunk + per_chunk / 2;
+    struct queue_entry *entries = malloc(n * sizeof *entries);
+    for (unsigned int i = 0; i < n; i++) {
+        entries[i] = (struct queue_entry){.id = i, .data = "!", .size = 1};
+    }
+
+    // act & assert: entries fill chunks in order, across pushes and batches
+    for (unsigned int i = 0; i < per_chunk / 2; i++) {
+        assert(queue_push(&queue, &entries[i]) >= 0);
+    }
+    assert(queue_push_batch(&queue, entries + per_chunk / 2,
+                            n - per_chunk / 2) >= 0);
+    assert(queue.length == n);
+    assert(queue.tail->end == per_chunk / 2 * 16);
+    assert(entry_at(&queue, per_chunk).id == per_chunk);
+
+    struct queue_chunk *second = queue.head->next;
+    struct queue_entry popped;
+    for (unsigned int i = 0; i < 2 * per_chunk; i++) {
+        assert(queue_pop(&queue, &popped) >= 0);
+        assert(popped.id == i);
+    }
+    assert(queue_peek_id(&queue) == (int)(2 * per_chunk));
+
+    // act & assert: the next push recycles the chunks popped empty, and takes
+    // spare chunks before allocating new ones
+    assert(queue_push_batch(&queue, entries, per_chunk) >= 0);
+    assert(queue.spares_count == 1);
+    assert(queue.tail == second);
+    assert(!errno);
+
+    // act & assert: a drained queue keeps its head chunk
+    while (queue.length) {
+        assert(queue_pop(&queue, &popped) >= 0);
+    }
+    assert(queue_pop(&queue, &popped) < 0);
+    assert(errno == ENODATA);
+    assert(queue.head == queue.tail);
+    assert(!queue.tail->end);
+    assert(queue.spares_count <= QUEUE_SPARE_CHUNKS);
 
     // teardown
-    free(popped->data);
-    free(popped);
+    free(entries);
     queue_destroy(&queue);
     return 0;
 }
@@ -414,6 +916,10 @@ struct test_case tests[] = {
      test_queue_push_success_when_size_is_one},
     {"test_queue_push_success_when_size_is_greater_than_one", NULL, NULL,
      test_queue_push_success_when_size_is_greater_than_one},
+    {"test_queue_push_batch_throws_error_when_invalid_args", NULL, NULL,
+     test_queue_push_batch_throws_error_when_invalid_args},
+    {"test_queue_push_batch_success", NULL, NULL,
+     test_queue_push_batch_success},
     {"test_queue_pop_throws_error_when_invalid_args", NULL, NULL,
      test_queue_pop_throws_error_when_invalid_args},
     {"test_queue_pop_throws_error_when_empty", NULL, NULL,
@@ -422,6 +928,25 @@ struct test_case tests[] = {
      test_queue_pop_success_when_size_is_one},
     {"test_queue_pop_success_when_size_is_greater_than_one", NULL, NULL,
      test_queue_pop_success_when_size_is_greater_than_one},
+    {"test_queue_pop_batch_throws_error_when_invalid_args", NULL, NULL,
+     test_queue_pop_batch_throws_error_when_invalid_args},
+    {"test_queue_pop_batch_success_when_limited_by_count", NULL, NULL,
+     test_queue_pop_batch_success_when_limited_by_count},
+    {"test_queue_pop_batch_success_when_limited_by_bytes", NULL, NULL,
+     test_queue_pop_batch_success_when_limited_by_bytes},
+    {"test_queue_counts_length_and_bytes", NULL, NULL,
+     test_queue_counts_length_and_bytes},
+    {"test_queue_stores_large_entries_out_of_line", NULL, NULL,
+     test_queue_stores_large_entries_out_of_line},
+    {"test_queue_push_leased_moves_large_entries", NULL, NULL,
+     test_queue_push_leased_moves_large_entries},
+    {"test_queue_push_front_throws_error_when_invalid_args", NULL, NULL,
+     test_queue_push_front_throws_error_when_invalid_args},
+    {"test_queue_push_front_success", NULL, NULL,
+     test_queue_push_front_success},
+    {"test_queue_push_front_keeps_entries_of_the_head_chunk", NULL, NULL,
+     test_queue_push_front_keeps_entries_of_the_head_chunk},
+    {"test_queue_recycles_chunks", NULL, NULL, test_queue_recycles_chunks},
     {"test_queue_peek_id_throws_when_invalid_args", NULL, NULL,
      test_queue_peek_id_throws_when_invalid_args},
     {"test_queue_peek_id_throws_when_empty", NULL, NULL,